@@ -8,6 +8,7 @@
 #include <Protocol/LegacyBios.h>
 #include <Protocol/LegacyRegion.h>
 #include <Protocol/LegacyRegion2.h>
+#include <Library/BaseLib.h>
 #include <Library/PcdLib.h>
 #include <Library/UefiLib.h>
 #include <Library/DebugLib.h>
@@ -705,6 +706,30 @@ SetHighestAvailableTextMode(
 	return Status;
 }
 
+// Locates the driver protocol, and checks that its revision is the one the loader was built with
+STATIC
+EFI_STATUS
+EFIAPI
+LocateEfiGuardDriverProtocol(
+	OUT EFIGUARD_DRIVER_PROTOCOL** EfiGuardDriverProtocol
+	)
+{
+	CONST EFI_STATUS Status = gBS->LocateProtocol(&gEfiGuardDriverProtocolGuid,
+												NULL,
+												(VOID**)EfiGuardDriverProtocol);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	if ((*EfiGuardDriverProtocol)->Revision != EFIGUARD_DRIVER_PROTOCOL_REVISION)
+	{
+		Print(L"[LOADER] The loaded driver has protocol revision %u, but this loader requires revision %u.\r\n",
+			(*EfiGuardDriverProtocol)->Revision, EFIGUARD_DRIVER_PROTOCOL_REVISION);
+		*EfiGuardDriverProtocol = NULL;
+		return EFI_INCOMPATIBLE_VERSION;
+	}
+	return EFI_SUCCESS;
+}
+
 STATIC
 EFI_STATUS
 EFIAPI
@@ -718,10 +743,10 @@ StartEfiGuard(
 	// 
 	// Check if the driver is loaded 
 	// 
-	EFI_STATUS Status = gBS->LocateProtocol(&gEfiGuardDriverProtocolGuid,
-											NULL,
-											(VOID**)&EfiGuardDriverProtocol);
-	ASSERT((!EFI_ERROR(Status) || Status == EFI_NOT_FOUND));
+	EFI_STATUS Status = LocateEfiGuardDriverProtocol(&EfiGuardDriverProtocol);
+	ASSERT((!EFI_ERROR(Status) || Status == EFI_NOT_FOUND || Status == EFI_INCOMPATIBLE_VERSION));
+	if (Status == EFI_INCOMPATIBLE_VERSION)
+		goto Exit;
 	if (Status == EFI_NOT_FOUND)
 	{
 		Print(L"[LOADER] Locating and loading driver file %S...\r\n", EFIGUARD_DRIVER_FILENAME);
@@ -763,9 +788,7 @@ StartEfiGuard(
 		Print(L"[LOADER] The driver is already loaded.\r\n");
 	}
 
-	Status = gBS->LocateProtocol(&gEfiGuardDriverProtocolGuid,
-								NULL,
-								(VOID**)&EfiGuardDriverProtocol);
+	Status = LocateEfiGuardDriverProtocol(&EfiGuardDriverProtocol);
 	if (EFI_ERROR(Status))
 	{
 		Print(L"[LOADER] LocateProtocol failed: %llx (%r).\r\n", Status, Status);
@@ -791,6 +814,13 @@ StartEfiGuard(
 														sizeof(NoYes) / sizeof(UINT16),
 														L'1');
 
+		Print(L"How much should the driver print while booting?\r\n"
+			L"    [1] Everything (default)\r\n    [2] Only a summary of each patch stage\r\n    [3] Nothing, unless there is an error\r\n    ");
+		CONST UINT16 AcceptedVerbosities[] = { L'1', L'2', L'3' };
+		CONST UINT16 SelectedVerbosity = PromptInput(AcceptedVerbosities,
+													sizeof(AcceptedVerbosities) / sizeof(UINT16),
+													L'1');
+
 		EFIGUARD_CONFIGURATION_DATA ConfigData;
 		switch (SelectedDseBypass)
 		{
@@ -806,6 +836,45 @@ StartEfiGuard(
 			break;
 		}
 		ConfigData.WaitForKeyPress = (BOOLEAN)(SelectedWaitForKeyPress == L'2');
+		switch (SelectedVerbosity)
+		{
+		case L'1':
+		default:
+			ConfigData.Verbosity = VERBOSITY_VERBOSE;
+			break;
+		case L'2':
+			ConfigData.Verbosity = VERBOSITY_SUMMARY;
+			break;
+		case L'3':
+			ConfigData.Verbosity = VERBOSITY_QUIET;
+			break;
+		}
+
+		//
+		// Remember the verbosity, so that it is also used for the initialization output and on non-interactive boots.
+		// Like the driver's own NV variables, it is only written if it changed
+		//
+		CONST UINT32 Verbosity = (UINT32)ConfigData.Verbosity;
+		UINT32 StoredVerbosity = 0, StoredAttributes = 0;
+		UINTN StoredSize = sizeof(StoredVerbosity);
+		Status = gRT->GetVariable(EFIGUARD_VERBOSITY_VARIABLE_NAME,
+								EFIGUARD_VERBOSITY_VARIABLE_GUID,
+								&StoredAttributes,
+								&StoredSize,
+								&StoredVerbosity);
+		if (EFI_ERROR(Status) ||
+			StoredAttributes != EFIGUARD_VERBOSITY_VARIABLE_ATTRIBUTES ||
+			StoredSize != sizeof(StoredVerbosity) ||
+			StoredVerbosity != Verbosity)
+		{
+			Status = gRT->SetVariable(EFIGUARD_VERBOSITY_VARIABLE_NAME,
+									EFIGUARD_VERBOSITY_VARIABLE_GUID,
+									EFIGUARD_VERBOSITY_VARIABLE_ATTRIBUTES,
+									sizeof(Verbosity),
+									(VOID*)&Verbosity);
+			if (EFI_ERROR(Status))
+				Print(L"[LOADER] Failed to store the verbosity setting: %llx (%r).\r\n", Status, Status);
+		}
 
 		//
 		// Send the configuration data to the driver
@@ -823,6 +892,47 @@ Exit:
 	return Status;
 }
 
+//
+// Queries the driver for its boot timing and scan statistics, and prints the stages that have run so far
+//
+STATIC
+VOID
+EFIAPI
+PrintEfiGuardStatistics(
+	VOID
+	)
+{
+	EFIGUARD_DRIVER_PROTOCOL* EfiGuardDriverProtocol;
+	EFI_STATUS Status = LocateEfiGuardDriverProtocol(&EfiGuardDriverProtocol);
+	if (EFI_ERROR(Status))
+		return;
+
+	EFIGUARD_STATISTICS Statistics;
+	Status = EfiGuardDriverProtocol->QueryStatistics(&Statistics);
+	if (EFI_ERROR(Status))
+	{
+		Print(L"[LOADER] Driver QueryStatistics() returned error %llx (%r).\r\n", Status, Status);
+		return;
+	}
+
+	STATIC CONST CHAR16* CONST StageNames[EFIGUARD_STAGE_MAX] = EFIGUARD_STAGE_NAMES;
+	Print(L"\r\n%-38S %5S %12S %12S %10S %8S\r\n", L"Stage", L"Runs", L"Time", L"Bytes", L"Decoded", L"Resyncs");
+	for (UINT32 i = 0; i < EFIGUARD_STAGE_MAX; ++i)
+	{
+		CONST EFIGUARD_STAGE_STATISTICS* Stage = &Statistics.Stages[i];
+		if (Stage->Count == 0)
+			continue;
+
+		// Show microseconds if the driver was able to measure the TSC frequency, and raw ticks otherwise
+		CONST UINT64 Time = Statistics.TscFrequency != 0
+			? DivU64x64Remainder(MultU64x32(Stage->Ticks, 1000000), Statistics.TscFrequency, NULL)
+			: Stage->Ticks;
+		Print(L"%-38S %5u %12lu %12lu %10lu %8lu\r\n",
+			StageNames[i], Stage->Count, Time, Stage->BytesScanned, Stage->InstructionsDecoded, Stage->ResyncEvents);
+	}
+	Print(L"Times are in %S.\r\n\r\n", Statistics.TscFrequency != 0 ? L"us" : L"TSC ticks");
+}
+
 //
 // Attempt to boot each Windows boot option in the BootOptions array.
 // This function is a combined and simplified version of BootBootOptions (BdsDxe) and EfiBootManagerBoot (UefiBootManagerLib),
@@ -1265,6 +1375,8 @@ UefiMain(
 		return EFI_SUCCESS;
 
 	// We should never reach this unless something is seriously wrong (no boot device / partition table corrupted / catastrophic boot manager failure...)
+	// Show how far the driver got before the boot failed
+	PrintEfiGuardStatistics();
 	Print(L"Failed to boot anything. This is super bad!\r\n"
 		L"Press any key to return to the firmware or shell,\r\nwhich will surely fix this and not make things worse.\r\n");
 	WaitForKey();
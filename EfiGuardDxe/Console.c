@@ -0,0 +1,74 @@
+#include "EfiGuardDxe.h"
+
+#include <Library/BaseMemoryLib.h>
+#include <Library/PrintLib.h>
+
+// Size of the console output buffer in characters. Console output is very slow on serial-redirected and GOP text consoles,
+// and most of this cost is per OutputString() call rather than per character, so messages are written in chunks of up to this size
+#define CONSOLE_BUFFER_SIZE			4096
+
+// Maximum length of a single formatted message, including the terminator
+#define CONSOLE_MESSAGE_MAX_LENGTH	512
+
+STATIC CHAR16 mConsoleBuffer[CONSOLE_BUFFER_SIZE];
+STATIC UINTN mConsoleBufferLength = 0;
+
+
+VOID
+EFIAPI
+ConsoleFlush(
+	VOID
+	)
+{
+	if (mConsoleBufferLength == 0)
+		return;
+
+	mConsoleBuffer[mConsoleBufferLength] = L'\0';
+	mConsoleBufferLength = 0;
+	if (gST->ConOut != NULL)
+		gST->ConOut->OutputString(gST->ConOut, mConsoleBuffer);
+}
+
+VOID
+EFIAPI
+ConsoleWrite(
+	IN CONST CHAR16 *String
+	)
+{
+	CONST UINTN Length = StrLen(String);
+	if (Length >= CONSOLE_BUFFER_SIZE)
+	{
+		// Too large to buffer. Write it as is, after anything that is still in the buffer
+		ConsoleFlush();
+		if (gST->ConOut != NULL)
+			gST->ConOut->OutputString(gST->ConOut, (CHAR16*)String);
+		return;
+	}
+
+	// Leave room for the terminator added by ConsoleFlush()
+	if (mConsoleBufferLength + Length >= CONSOLE_BUFFER_SIZE)
+		ConsoleFlush();
+
+	CopyMem(mConsoleBuffer + mConsoleBufferLength, String, Length * sizeof(CHAR16));
+	mConsoleBufferLength += Length;
+}
+
+VOID
+EFIAPI
+ConsolePrint(
+	IN EFIGUARD_VERBOSITY Level,
+	IN CONST CHAR16 *Format,
+	...
+	)
+{
+	if (Level > gDriverConfig.Verbosity)
+		return;
+
+	CHAR16 Message[CONSOLE_MESSAGE_MAX_LENGTH];
+	VA_LIST VaList;
+	VA_START(VaList, Format);
+	UnicodeVSPrint(Message, sizeof(Message), Format, VaList);
+	VA_END(VaList);
+
+	ConsoleWrite(Message);
+}
@@ -33,17 +33,33 @@ DriverConfigure(
 	IN CONST EFIGUARD_CONFIGURATION_DATA* ConfigurationData
 	);
 
+EFI_STATUS
+EFIAPI
+DriverQueryStatistics(
+	OUT EFIGUARD_STATISTICS* Statistics
+	);
+
 EFIGUARD_DRIVER_PROTOCOL gEfiGuardDriverProtocol =
 {
-	DriverConfigure
+	EFIGUARD_DRIVER_PROTOCOL_REVISION,
+	DriverConfigure,
+	DriverQueryStatistics
 };
 
+//
+// Build-time default verbosity, used if EFIGUARD_VERBOSITY_VARIABLE_NAME is not set
+//
+#ifndef EFIGUARD_DEFAULT_VERBOSITY
+#define EFIGUARD_DEFAULT_VERBOSITY		VERBOSITY_VERBOSE
+#endif
+
 //
 // Default driver configuration used if Configure() is not called
 //
 EFIGUARD_CONFIGURATION_DATA gDriverConfig = {
 	DSE_DISABLE_SETVARIABLE_HOOK,	// DseBypassMethod
-	FALSE							// WaitForKeyPress
+	FALSE,							// WaitForKeyPress
+	EFIGUARD_DEFAULT_VERBOSITY		// Verbosity
 };
 
 //
@@ -125,6 +141,51 @@ SetServicePointer(
 	return OriginalFunction;
 }
 
+//
+// Returns TRUE if the final file name in a device path is bootmgfw.efi or bootx64.efi. The device path nodes are compared
+// directly, because this runs for every image loaded during BDS and converting the device path to text requires an allocation.
+//
+STATIC
+BOOLEAN
+EFIAPI
+IsBootmgfwDevicePath(
+	IN CONST EFI_DEVICE_PATH_PROTOCOL *DevicePath OPTIONAL
+	)
+{
+	if (DevicePath == NULL)
+		return FALSE;
+
+	// The path may be split over several file path nodes, in which case the file name is in the last one
+	CONST FILEPATH_DEVICE_PATH* FilePath = NULL;
+	for (CONST EFI_DEVICE_PATH_PROTOCOL* Node = DevicePath; !IsDevicePathEnd(Node); Node = NextDevicePathNode(Node))
+	{
+		if (DevicePathNodeLength(Node) < sizeof(EFI_DEVICE_PATH_PROTOCOL))
+			return FALSE;
+		if (DevicePathType(Node) == MEDIA_DEVICE_PATH && DevicePathSubType(Node) == MEDIA_FILEPATH_DP)
+			FilePath = (CONST FILEPATH_DEVICE_PATH*)Node;
+	}
+	if (FilePath == NULL)
+		return FALSE;
+
+	// Strip the terminator(s), and find the start of the file name
+	CONST CHAR16* PathName = FilePath->PathName;
+	UINTN Length = (DevicePathNodeLength(FilePath) - SIZE_OF_FILEPATH_DEVICE_PATH) / sizeof(CHAR16);
+	while (Length > 0 && PathName[Length - 1] == L'\0')
+		Length--;
+	UINTN Start = Length;
+	while (Start > 0 && PathName[Start - 1] != L'\\' && PathName[Start - 1] != L'/')
+		Start--;
+
+	STATIC CONST CHAR16* CONST FileNames[] = { L"bootmgfw.efi", L"bootx64.efi" };
+	for (UINT32 i = 0; i < ARRAY_SIZE(FileNames); ++i)
+	{
+		CONST UINTN FileNameLength = StrLen(FileNames[i]);
+		if (Length - Start == FileNameLength && StrniCmp(PathName + Start, FileNames[i], FileNameLength) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
 //
 // Boot Services LoadImage hook
 //
@@ -139,34 +200,42 @@ HookedLoadImage(
 	OUT EFI_HANDLE *ImageHandle
 	)
 {
-	// Try to get a readable file path from the EFI shell protocol if it's available
-	EFI_SHELL_PROTOCOL* EfiShellProtocol = NULL;
-	CONST EFI_STATUS EfiShellStatus = gBS->LocateProtocol(&gEfiShellProtocolGuid,
-															NULL,
-															(VOID**)&EfiShellProtocol);
-	CHAR16* ImagePath = NULL;
-	if (!EFI_ERROR(EfiShellStatus))
-	{
-		ImagePath = EfiShellProtocol->GetFilePathFromDevicePath(DevicePath);
-	}
-	if (ImagePath == NULL)
-	{
-		ImagePath = ConvertDevicePathToText(DevicePath, TRUE, TRUE);
-	}
+	STAGE_TIMER Timer;
+	BeginStage(&Timer, EFIGUARD_STAGE_LOAD_IMAGE);
 
 	// We only have a filename to go on at this point. We will determine the final 'is this bootmgfw.efi?' status after the image has been loaded
-	CONST BOOLEAN MaybeBootmgfw = ImagePath != NULL
-		? StriStr(ImagePath, L"bootmgfw.efi") != NULL || StriStr(ImagePath, L"bootx64.efi") != NULL
-		: FALSE;
+	CONST BOOLEAN MaybeBootmgfw = IsBootmgfwDevicePath(DevicePath);
 	CONST BOOLEAN IsBoot = (MaybeBootmgfw || (BootPolicy == TRUE && SourceBuffer == NULL));
 
-	// Print what's being loaded or booted
-	CONST INT32 OriginalAttribute = SetConsoleTextColour(EFI_GREEN, FALSE);
-	Print(L"[HookedLoadImage] %S %S\r\n    (ParentImageHandle = %llx)\r\n",
-		(IsBoot ? L"Booting" : L"Loading"), ImagePath, (UINTN)ParentImageHandle);
-	if (ImagePath != NULL)
-		FreePool(ImagePath);
-	//RtlSleep(500);
+	// Print what's being booted. Other images (drivers, option ROMs, shell applications) are loaded silently, to avoid slowing down BDS
+	INT32 OriginalAttribute = 0;
+	if (IsBoot)
+	{
+		OriginalAttribute = SetConsoleTextColour(EFI_GREEN, FALSE);
+	}
+	if (IsBoot && gDriverConfig.Verbosity >= VERBOSITY_VERBOSE)
+	{
+		// Try to get a readable file path from the EFI shell protocol if it's available.
+		// This is not cached, because the protocol is uninstalled when the shell exits
+		EFI_SHELL_PROTOCOL* EfiShellProtocol = NULL;
+		CONST EFI_STATUS EfiShellStatus = gBS->LocateProtocol(&gEfiShellProtocolGuid,
+																NULL,
+																(VOID**)&EfiShellProtocol);
+		CHAR16* ImagePath = NULL;
+		if (!EFI_ERROR(EfiShellStatus) && DevicePath != NULL)
+		{
+			ImagePath = EfiShellProtocol->GetFilePathFromDevicePath(DevicePath);
+		}
+		if (ImagePath == NULL)
+		{
+			ImagePath = ConvertDevicePathToText(DevicePath, TRUE, TRUE);
+		}
+
+		ConsolePrint(VERBOSITY_VERBOSE, L"[HookedLoadImage] Booting %S\r\n    (ParentImageHandle = %llx)\r\n",
+			ImagePath, (UINTN)ParentImageHandle);
+		if (ImagePath != NULL)
+			FreePool(ImagePath);
+	}
 
 	// Q: If we loaded bootmgfw.efi manually, is there any benefit to flipping BootPolicy to TRUE
 	// to make it look like the load request came straight from the boot manager?
@@ -197,7 +266,7 @@ HookedLoadImage(
 															EFI_OPEN_PROTOCOL_GET_PROTOCOL);
 		if (EFI_ERROR(ImageInfoStatus))
 		{
-			Print(L"\r\nHookedLoadImage: failed to get loaded image info. Status: %llx (%r)\r\n",
+			ConsolePrint(VERBOSITY_QUIET, L"\r\nHookedLoadImage: failed to get loaded image info. Status: %llx (%r)\r\n",
 				ImageInfoStatus, ImageInfoStatus);
 		}
 		else
@@ -216,15 +285,34 @@ HookedLoadImage(
 				PrintLoadedImageInfo(LoadedImage);
 
 				// Nuke it dot it
-				PatchBootManager(FileType,
-								LoadedImage->ImageBase,
-								LoadedImage->ImageSize);
+				CONST PEFI_IMAGE_NT_HEADERS NtHeaders = RtlpImageNtHeaderEx(LoadedImage->ImageBase, LoadedImage->ImageSize);
+				PE_IMAGE_VIEW Image;
+				if (NtHeaders != NULL && !EFI_ERROR(InitializePeImageView(LoadedImage->ImageBase, NtHeaders, &Image)))
+				{
+					PatchBootManager(FileType,
+									&Image);
+				}
+				else
+				{
+					ConsolePrint(VERBOSITY_QUIET, L"\r\nHookedLoadImage: bootmgfw.efi PE image at 0x%p with size 0x%llx is invalid!\r\nPress any key to continue anyway, or press ESC to reboot.\r\n",
+						LoadedImage->ImageBase, LoadedImage->ImageSize);
+					if (!WaitForKey())
+					{
+						gRT->ResetSystem(EfiResetCold, EFI_SUCCESS, 0, NULL);
+					}
+				}
 			}
 		}
 	}
 
-	gST->ConOut->SetAttribute(gST->ConOut, OriginalAttribute);
-	gST->ConOut->EnableCursor(gST->ConOut, FALSE);
+	if (IsBoot)
+	{
+		ConsoleFlush();
+		gST->ConOut->SetAttribute(gST->ConOut, OriginalAttribute);
+		gST->ConOut->EnableCursor(gST->ConOut, FALSE);
+	}
+
+	EndStage(&Timer);
 
 	return Status;
 }
@@ -344,8 +432,8 @@ ExitBootServicesEvent(
 	gBS->CloseEvent(gEfiExitBootServicesEvent);
 	gEfiExitBootServicesEvent = NULL;
 
-	// The message buffer may be empty if the patch process was aborted in one of the earlier stages
-	if (gKernelPatchInfo.Buffer[0] != CHAR_NULL)
+	// The message log may be empty if the patch process was aborted in one of the earlier stages
+	if (gKernelPatchInfo.NumMessages != 0)
 	{
 		CONST EFI_STATUS Status = gKernelPatchInfo.Status;
 		CONST INT32 OriginalAttribute = gST->ConOut->Mode->Attribute;
@@ -354,13 +442,18 @@ ExitBootServicesEvent(
 		CONST BOOLEAN ShowErrorMessage = gKernelPatchInfo.KernelBuildNumber == 0 || gKernelPatchInfo.KernelBuildNumber >= 6001 || Status != EFI_UNSUPPORTED;
 		if (Status == EFI_SUCCESS)
 		{
-			SetConsoleTextColour(EFI_GREEN, TRUE);
-			PrintKernelPatchInfo();
-			Print(L"\r\nSuccessfully patched ntoskrnl.exe.\r\n");
+			// In quiet mode, leave the screen alone
+			if (gDriverConfig.Verbosity >= VERBOSITY_SUMMARY)
+				SetConsoleTextColour(EFI_GREEN, gDriverConfig.Verbosity >= VERBOSITY_VERBOSE);
+			if (gDriverConfig.Verbosity >= VERBOSITY_VERBOSE)
+				PrintKernelPatchInfo();
+			ConsolePrint(VERBOSITY_SUMMARY, L"\r\nSuccessfully patched ntoskrnl.exe.\r\n");
+			if (gDriverConfig.Verbosity >= VERBOSITY_VERBOSE)
+				PrintBootStatistics();
 
 			if (gDriverConfig.WaitForKeyPress)
 			{
-				Print(L"\r\nPress any key to continue.\r\n");
+				ConsolePrint(VERBOSITY_QUIET, L"\r\nPress any key to continue.\r\n");
 				WaitForKey();
 			}
 		}
@@ -369,26 +462,30 @@ ExitBootServicesEvent(
 			// Patch failed. Most important stuff first: make a fake BSOD, because... reasons
 			// TODO if really bored: use GOP to set the BG colour on the whole screen.
 			// Could add one of those obnoxious Win 10 :( smileys and a QR code
+			ConsoleFlush();
 			gST->ConOut->SetAttribute(gST->ConOut, EFI_WHITE | EFI_BACKGROUND_BLUE);
 			gST->ConOut->ClearScreen(gST->ConOut);
 
-			Print(L"A problem has been detected and Windows has been paused to prevent damage\r\nto your botnets.\r\n\r\n"
+			ConsolePrint(VERBOSITY_QUIET, L"A problem has been detected and Windows has been paused to prevent damage\r\nto your botnets.\r\n\r\n"
 				L"BOOTKIT_KERNEL_PATCH_FAILED\r\n\r\n"
 				L"Technical information:\r\n\r\n*** STOP: 0X%llX (%r, 0x%p)\r\n\r\n",
 				Status, Status, gKernelPatchInfo.KernelBase);
 			PrintKernelPatchInfo();
+			PrintBootStatistics();
+			ConsoleFlush();
 
 			// Give time for user to register their loss and allow for the grieving process to set in
 			RtlStall(2000);
 
 			// Prompt user to ask what they want to do
-			Print(L"\r\nPress any key to continue anyway, or press ESC to reboot.\r\n");
+			ConsolePrint(VERBOSITY_QUIET, L"\r\nPress any key to continue anyway, or press ESC to reboot.\r\n");
 			if (!WaitForKey())
 			{
 				gRT->ResetSystem(EfiResetCold, EFI_SUCCESS, 0, NULL);
 			}
 		}
 
+		ConsoleFlush();
 		gST->ConOut->SetAttribute(gST->ConOut, OriginalAttribute);
 		if (Status != EFI_SUCCESS && ShowErrorMessage)
 			gST->ConOut->ClearScreen(gST->ConOut);
@@ -464,12 +561,26 @@ DriverConfigure(
 	if (gEfiAtRuntime || gBootmgfwHandle != NULL)
 		return EFI_ACCESS_DENIED;
 
-	if (ConfigurationData == NULL)
+	if (ConfigurationData == NULL || ConfigurationData->Verbosity > VERBOSITY_VERBOSE)
 		return EFI_INVALID_PARAMETER;
 
 	gDriverConfig = *ConfigurationData;
 
-	Print(L"Configuration data accepted.\r\n\r\n");
+	ConsolePrint(VERBOSITY_VERBOSE, L"Configuration data accepted.\r\n\r\n");
+
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+DriverQueryStatistics(
+	OUT EFIGUARD_STATISTICS* Statistics
+	)
+{
+	if (Statistics == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	CopyMem(Statistics, &gBootStatistics, sizeof(*Statistics));
 
 	return EFI_SUCCESS;
 }
@@ -530,6 +641,27 @@ EfiGuardUnload(
 	return EFI_SUCCESS;
 }
 
+// Reads the default verbosity from EFIGUARD_VERBOSITY_VARIABLE_NAME, if it is set to a valid value
+STATIC
+VOID
+LoadDefaultVerbosity(
+	VOID
+	)
+{
+	UINT32 Verbosity;
+	UINT32 Attributes;
+	UINTN Size = sizeof(Verbosity);
+	CONST EFI_STATUS Status = gRT->GetVariable(EFIGUARD_VERBOSITY_VARIABLE_NAME,
+												EFIGUARD_VERBOSITY_VARIABLE_GUID,
+												&Attributes,
+												&Size,
+												&Verbosity);
+	if (EFI_ERROR(Status) || Size != sizeof(Verbosity) || Verbosity > VERBOSITY_VERBOSE)
+		return;
+
+	gDriverConfig.Verbosity = (EFIGUARD_VERBOSITY)Verbosity;
+}
+
 // 
 // Main entry point
 // 
@@ -542,6 +674,8 @@ EfiGuardInitialize(
 {
 	ASSERT(ImageHandle == gImageHandle);
 
+	LoadDefaultVerbosity();
+
 	// Check if we're not already loaded.
 	EFIGUARD_DRIVER_PROTOCOL* EfiGuardDriverProtocol;
 	EFI_STATUS Status = gBS->LocateProtocol(&gEfiGuardDriverProtocolGuid,
@@ -549,7 +683,7 @@ EfiGuardInitialize(
 											(VOID**)&EfiGuardDriverProtocol);
 	if (Status != EFI_NOT_FOUND)
 	{
-		Print(L"An instance of the driver is already loaded.\r\n");
+		ConsolePrint(VERBOSITY_VERBOSE, L"An instance of the driver is already loaded.\r\n");
 		return EFI_ALREADY_STARTED;
 	}
 
@@ -562,7 +696,7 @@ EfiGuardInitialize(
 													NULL);
 	if (EFI_ERROR(Status))
 	{
-		Print(L"Failed to install EFI Driver Supported Version protocol. Error: %llx (%r)\r\n", Status, Status);
+		ConsolePrint(VERBOSITY_QUIET, L"Failed to install EFI Driver Supported Version protocol. Error: %llx (%r)\r\n", Status, Status);
 		return Status;
 	}
 
@@ -585,9 +719,10 @@ EfiGuardInitialize(
 	// Clear screen and print header
 	//
 	CONST INT32 OriginalAttribute = SetConsoleTextColour(EFI_GREEN, TRUE);
-	Print(L"\r\n\r\n");
-	Print(L"%S", EFIGUARD_TITLE1);
-	Print(L"%S", EFIGUARD_TITLE2);
+	ConsolePrint(VERBOSITY_VERBOSE, L"\r\n\r\n");
+	ConsolePrint(VERBOSITY_VERBOSE, L"%S", EFIGUARD_TITLE1);
+	ConsolePrint(VERBOSITY_VERBOSE, L"%S", EFIGUARD_TITLE2);
+	ConsoleFlush();
 	gST->ConOut->SetAttribute(gST->ConOut, OriginalAttribute);
 
 	EFI_LOADED_IMAGE_PROTOCOL *LocalImageInfo;
@@ -606,13 +741,13 @@ EfiGuardInitialize(
 	// Hook gBS->LoadImage
 	//
 	mOriginalLoadImage = (EFI_IMAGE_LOAD)SetServicePointer(&gBS->Hdr, (VOID**)&gBS->LoadImage, (VOID*)&HookedLoadImage);
-	Print(L"Hooked gBS->LoadImage: 0x%p -> 0x%p\r\n", (VOID*)mOriginalLoadImage, (VOID*)&HookedLoadImage);
+	ConsolePrint(VERBOSITY_VERBOSE, L"Hooked gBS->LoadImage: 0x%p -> 0x%p\r\n", (VOID*)mOriginalLoadImage, (VOID*)&HookedLoadImage);
 
 	//
 	// Hook gRT->SetVariable
 	//
 	mOriginalSetVariable = (EFI_SET_VARIABLE)SetServicePointer(&gRT->Hdr, (VOID**)&gRT->SetVariable, (VOID*)&HookedSetVariable);
-	Print(L"Hooked gRT->SetVariable: 0x%p -> 0x%p\r\n", (VOID*)mOriginalSetVariable, (VOID*)&HookedSetVariable);
+	ConsolePrint(VERBOSITY_VERBOSE, L"Hooked gRT->SetVariable: 0x%p -> 0x%p\r\n", (VOID*)mOriginalSetVariable, (VOID*)&HookedSetVariable);
 
 	// Register notification callback for ExitBootServices()
 	Status = gBS->CreateEventEx(EVT_NOTIFY_SIGNAL,
@@ -636,12 +771,17 @@ EfiGuardInitialize(
 
 	// Initialize the global kernel patch info struct.
 	gKernelPatchInfo.Status = EFI_SUCCESS;
-	gKernelPatchInfo.BufferSize = 0;
-	SetMem64(gKernelPatchInfo.Buffer, sizeof(gKernelPatchInfo.Buffer), 0ULL);
+	gKernelPatchInfo.NumMessages = 0;
 	gKernelPatchInfo.WinloadBuildNumber = 0;
 	gKernelPatchInfo.KernelBuildNumber = 0;
 	gKernelPatchInfo.KernelBase = NULL;
 
+	// Calibrate the TSC and clear the boot statistics
+	InitializeBootStatistics();
+
+	// Load the patch locations found on previous boots
+	PatchCacheLoad();
+
 	// The ASCII banner is very pretty - ensure the user has enough time to admire it
 	// how about no
 	//RtlSleep(1500);
@@ -649,11 +789,12 @@ EfiGuardInitialize(
 Exit:
 	if (EFI_ERROR(Status))
 	{
-		Print(L"\r\nEfiGuardDxe initialization failed with status %llx (%r)\r\n", Status, Status);
+		ConsolePrint(VERBOSITY_QUIET, L"\r\nEfiGuardDxe initialization failed with status %llx (%r)\r\n", Status, Status);
 
 		// Because we do not use the driver binding protocol, recovering from a failed load is simple.
 		// We can just call the unload function, which will only unload that which was actually installed.
 		EfiGuardUnload(gImageHandle);
 	}
+	ConsoleFlush();
 	return Status;
 }
@@ -93,14 +93,14 @@ extern UINT8 gBootmgrImgArchStartBootApplicationBackup[sizeof(gHookTemplate)];
 
 
 //
-// Patches the Windows Boot Manager: either bootmgfw.efi or bootmgr.efi; normally the former unless booting a WIM file
+// Patches the Windows Boot Manager: either bootmgfw.efi or bootmgr.efi; normally the former unless booting a WIM file.
+// The patchers take a PE_IMAGE_VIEW of the image, which is parsed once by the caller and shared by all locators that run on it.
 // 
 EFI_STATUS
 EFIAPI
 PatchBootManager(
 	IN INPUT_FILETYPE FileType,
-	IN VOID* ImageBase,
-	IN UINTN ImageSize
+	IN CONST PE_IMAGE_VIEW* Image
 	);
 
 
@@ -130,8 +130,7 @@ HookedOslFwpKernelSetupPhase1(
 EFI_STATUS
 EFIAPI
 PatchWinload(
-	IN VOID* ImageBase,
-	IN PEFI_IMAGE_NT_HEADERS NtHeaders
+	IN CONST PE_IMAGE_VIEW* Image
 	);
 
 //
@@ -143,8 +142,7 @@ EFI_STATUS
 EFIAPI
 PatchImgpValidateImageHash(
 	IN INPUT_FILETYPE FileType,
-	IN UINT8* ImageBase,
-	IN PEFI_IMAGE_NT_HEADERS NtHeaders
+	IN CONST PE_IMAGE_VIEW* Image
 	);
 
 //
@@ -156,8 +154,8 @@ EFI_STATUS
 EFIAPI
 PatchImgpFilterValidationFailure(
 	IN INPUT_FILETYPE FileType,
-	IN UINT8* ImageBase,
-	IN PEFI_IMAGE_NT_HEADERS NtHeaders
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN CONST XREF_INDEX* XrefIndex OPTIONAL
 	);
 
 //
@@ -188,26 +186,175 @@ BlStatusPrintNoop(
 EFI_STATUS
 EFIAPI
 PatchNtoskrnl(
-	IN VOID* ImageBase,
+	IN CONST PE_IMAGE_VIEW* Image
+	);
+
+
+//
+// Buffered console output. Messages are collected in a buffer and written to gST->ConOut in large chunks, because every
+// OutputString() call is expensive on serial-redirected and GOP text consoles. Any buffered output is written by ConsoleFlush(),
+// which must be called before changing console attributes, before waiting for input, and before control leaves the driver.
+// WaitForKey() and SetConsoleTextColour() flush the buffer themselves.
+//
+
+//
+// Formats and buffers a message if Level does not exceed the configured verbosity. Use VERBOSITY_QUIET for errors and prompts.
+//
+VOID
+EFIAPI
+ConsolePrint(
+	IN EFIGUARD_VERBOSITY Level,
+	IN CONST CHAR16 *Format,
+	...
+	);
+
+//
+// Buffers a string regardless of the configured verbosity.
+//
+VOID
+EFIAPI
+ConsoleWrite(
+	IN CONST CHAR16 *String
+	);
+
+//
+// Writes any buffered output to the console.
+//
+VOID
+EFIAPI
+ConsoleFlush(
+	VOID
+	);
+
+
+//
+// Patch sites whose locations are stored in the patch cache
+//
+typedef enum _PATCH_SITE
+{
+	// Boot manager
+	PatchSiteImgArchStartBootApplication,
+
+	// Boot manager and winload.efi
+	PatchSiteImgpValidateImageHash,
+	PatchSiteImgpFilterValidationFailure,
+
+	// winload.efi
+	PatchSiteOslFwpKernelSetupPhase1,
+
+	// ntoskrnl.exe
+	PatchSiteKeInitAmd64SpecificState,
+	PatchSiteCcInitializeBcbProfiler,
+	PatchSiteExpLicenseWatchInitWorker,
+	PatchSiteKiVerifyScopesExecute,
+	PatchSiteKiMcaDeferredRecoveryServiceCaller0,
+	PatchSiteKiMcaDeferredRecoveryServiceCaller1,
+	PatchSiteGlobalPgContext,
+	PatchSiteKiSwInterrupt,
+	PatchSiteSepInitializeCodeIntegrity,
+	PatchSiteSeValidateImageDataMovEax,
+	PatchSiteSeValidateImageDataJz,
+	PatchSiteSeCodeIntegrityQueryInformation,
+
+	PatchSiteMax
+} PATCH_SITE;
+
+//
+// Binds a patch site to the variable that holds its address. A NULL address means the site does not exist in the image.
+//
+typedef struct _PATCH_CACHE_BINDING
+{
+	PATCH_SITE Site;
+	UINT8** Address;
+} PATCH_CACHE_BINDING;
+
+//
+// Loads the patch cache from NVRAM. Must be called while boot services are available.
+//
+VOID
+EFIAPI
+PatchCacheLoad(
+	VOID
+	);
+
+//
+// Writes the patch cache to NVRAM if it has changed. Must be called while boot services are available, and not from the ExitBootServices()
+// callback, because variable writes may allocate memory. ntoskrnl.exe is patched after ExitBootServices(), so its entry is never written:
+// it is kept for the current boot only, and filled from the known builds table or by the locators on every boot.
+//
+EFI_STATUS
+EFIAPI
+PatchCacheFlush(
+	VOID
+	);
+
+//
+// Selects the image to use for cache lookups of the specified file type. The cache entry for the file type is keyed by TimeDateStamp,
+// SizeOfImage, CheckSum and a hash of the headers and .pdata. Returns TRUE if the entry matches this image; otherwise the entry is reset,
+// and filled from the built-in table of known builds (KnownBuilds.h) if the image is listed there, in which case TRUE is also returned.
+//
+BOOLEAN
+EFIAPI
+PatchCacheOpenImage(
+	IN INPUT_FILETYPE FileType,
+	IN CONST UINT8* ImageBase,
 	IN PEFI_IMAGE_NT_HEADERS NtHeaders
 	);
 
+//
+// Looks up the addresses of the bound patch sites. Returns TRUE only if all of the sites are cached and the original bytes
+// at each of them match. On success the addresses are stored in the bound variables; on failure they are not modified.
+// Only ntoskrnl.exe sites can be found as NULL; a cached NULL for any other site is treated as a miss.
+//
+BOOLEAN
+EFIAPI
+PatchCacheLookupSites(
+	IN INPUT_FILETYPE FileType,
+	IN CONST PATCH_CACHE_BINDING* Bindings,
+	IN UINT32 NumBindings
+	);
+
+//
+// Records the addresses of the bound patch sites, along with their original bytes. This must be done before the sites are patched.
+//
+VOID
+EFIAPI
+PatchCacheRecordSites(
+	IN INPUT_FILETYPE FileType,
+	IN CONST PATCH_CACHE_BINDING* Bindings,
+	IN UINT32 NumBindings
+	);
+
 
 //
 // The kernel patch result. This is used to hold data generated during
 // HookedOslFwpKernelSetupPhase1 and PatchNtoskrnl until we can safely access
 // boot services to print the output. This is done during the ExitBootServices() callback.
 //
-// Status holds the final patch status. If this is not EFI_SUCCESS, the buffer holds an
+// Status holds the final patch status. If this is not EFI_SUCCESS, the log ends with an
 // error message, and the user will be prompted to reboot or continue.
-// If Status is EFI_SUCCESS, the buffer holds concatenated patch information similar to what
+// If Status is EFI_SUCCESS, the log holds patch information similar to what
 // is printed during the patching of bootmgfw.efi/bootmgr.efi/winload.efi.
 //
+// Messages are not formatted until they are printed. Each message is stored as a binary record holding its format
+// string and raw arguments, so that logging one from the kernel setup phase costs little more than a few stores.
+// The log is a ring: if more than KERNEL_PATCH_MAX_MESSAGES messages are appended, the oldest ones are overwritten.
+//
+#define KERNEL_PATCH_MAX_MESSAGES				256
+#define KERNEL_PATCH_MESSAGE_MAX_ARGUMENTS		4
+
+typedef struct _KERNEL_PATCH_MESSAGE
+{
+	CONST CHAR16* Format;		// Also identifies the message. Must be a string literal, as must any %s/%S arguments
+	UINT64 Tsc;
+	UINT64 Arguments[KERNEL_PATCH_MESSAGE_MAX_ARGUMENTS];
+} KERNEL_PATCH_MESSAGE;
+
 typedef struct _KERNEL_PATCH_INFORMATION
 {
 	EFI_STATUS Status;
-	UINTN BufferSize;			// In bytes, excluding null terminator. This may be 0. The maximum buffer size is simply sizeof(Buffer).
-	CHAR16 Buffer[8192];		// 8K ought to be enough for everyone
+	UINT32 NumMessages;			// Total number of messages appended. The next record is Messages[NumMessages % KERNEL_PATCH_MAX_MESSAGES]
+	KERNEL_PATCH_MESSAGE Messages[KERNEL_PATCH_MAX_MESSAGES];
 	UINT32 WinloadBuildNumber;	// Used to determine whether the loader block provided by winload.efi will be for Vista (or older) kernels
 	UINT32 KernelBuildNumber;	// Used to determine whether an error message should be shown
 	VOID* KernelBase;
@@ -215,9 +362,26 @@ typedef struct _KERNEL_PATCH_INFORMATION
 
 extern KERNEL_PATCH_INFORMATION gKernelPatchInfo;
 
+//
+// Arena for the index structures built by PatchNtoskrnl. Like gKernelPatchInfo, it is backed by a static buffer,
+// so that it can be used in both winload contexts. It is reset at the start of each PatchNtoskrnl call.
+//
+extern ARENA gKernelArena;
+
+
+//
+// Boot timing and scan statistics, returned by QueryStatistics() and printed in the ExitBootServices() callback.
+// Like gKernelPatchInfo, this is a static struct so that it can also be updated from winload's application context.
+// The host tools run the locators on several threads at once, and define BOOT_STATISTICS_STORAGE as _Thread_local.
+//
+#ifndef BOOT_STATISTICS_STORAGE
+#define BOOT_STATISTICS_STORAGE
+#endif
+extern BOOT_STATISTICS_STORAGE EFIGUARD_STATISTICS gBootStatistics;
+
 
 //
-// Appends a kernel patch status info or error message to the buffer for delayed printing,
+// Appends a kernel patch status info or error message to the log for delayed printing,
 // and prints it to a boot debugger immediately if one is connected.
 //
 #define PRINT_KERNEL_PATCH_MSG(Fmt, ...) \
@@ -0,0 +1,14 @@
+//
+// THIS FILE WAS GENERATED BY "KnownBuilds.py". DO NOT EDIT MANUALLY.
+//
+#ifndef __KNOWN_BUILDS_H
+#define __KNOWN_BUILDS_H
+
+// Sorted by (TimeDateStamp, SizeOfImage, FileType). The last entry is a terminator that is not part of the table
+STATIC CONST KNOWN_BUILD mKnownBuilds[] = {
+	{ 0 }
+};
+
+#define NUM_KNOWN_BUILDS		(ARRAY_SIZE(mKnownBuilds) - 1)
+
+#endif
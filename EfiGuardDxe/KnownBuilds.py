@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+#
+# Regenerates KnownBuilds.h, the built-in table of patch sites for known boot manager, winload.efi and ntoskrnl.exe builds.
+#
+# The sites themselves are found by the driver's locators. Boot each build once with EfiGuardDxe loaded, then save the
+# EfiGuardPatchCache variable from the UEFI shell (it has no runtime access, so the OS cannot read it):
+#     dmpstore EfiGuardPatchCache -guid 7a88ad09-ce58-4765-98de-87fe12a6d5a8 -s cache.bin
+# and copy the file into a directory together with the images. Every cache entry whose image is found in the directory is added
+# to the table. Images that have no cache entry are listed on stderr. The cache only holds boot manager and winload.efi sites.
+#
+# Alternatively, the directory may contain JSON output from Tools/EfiGuardLocate, which runs the same locators on Linux.
+# Every image that was located successfully is added to the table, without needing a copy of the image itself.
+#
+# Usage: KnownBuilds.py <directory> [output file]
+#
+
+import json
+import os
+import struct
+import sys
+
+# Must match PATCH_SITE in EfiGuardDxe.h
+PATCH_SITES = [
+	"PatchSiteImgArchStartBootApplication",
+	"PatchSiteImgpValidateImageHash",
+	"PatchSiteImgpFilterValidationFailure",
+	"PatchSiteOslFwpKernelSetupPhase1",
+	"PatchSiteKeInitAmd64SpecificState",
+	"PatchSiteCcInitializeBcbProfiler",
+	"PatchSiteExpLicenseWatchInitWorker",
+	"PatchSiteKiVerifyScopesExecute",
+	"PatchSiteKiMcaDeferredRecoveryServiceCaller0",
+	"PatchSiteKiMcaDeferredRecoveryServiceCaller1",
+	"PatchSiteGlobalPgContext",
+	"PatchSiteKiSwInterrupt",
+	"PatchSiteSepInitializeCodeIntegrity",
+	"PatchSiteSeValidateImageDataMovEax",
+	"PatchSiteSeValidateImageDataJz",
+	"PatchSiteSeCodeIntegrityQueryInformation",
+]
+
+# Must match INPUT_FILETYPE in pe.h, starting at BootmgfwEfi. These are also the patch cache slots
+FILE_TYPES = ["BootmgfwEfi", "BootmgrEfi", "WinloadEfi", "Ntoskrnl"]
+
+# Must match PatchCache.c. The Ntoskrnl slot is not persisted
+PATCH_CACHE_VERSION = 2
+PATCH_CACHE_NUM_PERSISTENT_SLOTS = len(FILE_TYPES) - 1
+PATCH_CACHE_SITE_BYTES = 8
+KEY = struct.Struct("<4I")
+SITE = struct.Struct("<I%ds" % PATCH_CACHE_SITE_BYTES)
+ENTRY_SIZE = KEY.size + 4 + len(PATCH_SITES) * SITE.size
+CACHE_SIZE = 8 + PATCH_CACHE_NUM_PERSISTENT_SLOTS * ENTRY_SIZE
+
+PATCH_CACHE_VARIABLE_NAME = "EfiGuardPatchCache"
+
+
+def read_pe_identity(data):
+	"""Returns (TimeDateStamp, SizeOfImage, CheckSum) of a PE32+ image, or None if this is not one."""
+	if len(data) < 0x40 or data[:2] != b"MZ":
+		return None
+	nt = struct.unpack_from("<I", data, 0x3C)[0]
+	if nt + 0x60 > len(data) or data[nt:nt + 4] != b"PE\0\0":
+		return None
+	time_date_stamp = struct.unpack_from("<I", data, nt + 8)[0]
+	optional = nt + 24
+	if struct.unpack_from("<H", data, optional)[0] != 0x20B:
+		return None
+	size_of_image, = struct.unpack_from("<I", data, optional + 56)
+	check_sum, = struct.unpack_from("<I", data, optional + 64)
+	return time_date_stamp, size_of_image, check_sum
+
+
+def read_dmpstore_variable(data, name):
+	"""Returns the data of the named variable in a file saved by 'dmpstore -s', or None if there is none."""
+	# Each variable is saved as: UINT32 NameSize, UINT32 DataSize, CHAR16 Name[], EFI_GUID, UINT32 Attributes, UINT8 Data[], UINT32 Crc32
+	offset = 0
+	while offset + 8 <= len(data):
+		name_size, data_size = struct.unpack_from("<2I", data, offset)
+		data_offset = offset + 8 + name_size + 16 + 4
+		if data_offset + data_size + 4 > len(data):
+			return None
+		if data[offset + 8:offset + 8 + name_size].decode("utf-16-le", "replace").rstrip("\0") == name:
+			return data[data_offset:data_offset + data_size]
+		offset = data_offset + data_size + 4
+	return None
+
+
+def read_patch_cache(data):
+	"""Returns the entries of an EfiGuardPatchCache variable dump as (slot, key, site mask, sites)."""
+	if len(data) != CACHE_SIZE:
+		data = read_dmpstore_variable(data, PATCH_CACHE_VARIABLE_NAME)
+	if data is None or len(data) != CACHE_SIZE:
+		return None
+	version, size = struct.unpack_from("<2I", data, 0)
+	if version != PATCH_CACHE_VERSION or size != CACHE_SIZE:
+		return None
+
+	entries = []
+	for slot in range(PATCH_CACHE_NUM_PERSISTENT_SLOTS):
+		offset = 8 + slot * ENTRY_SIZE
+		key = KEY.unpack_from(data, offset)
+		site_mask, = struct.unpack_from("<I", data, offset + KEY.size)
+		sites = [SITE.unpack_from(data, offset + KEY.size + 4 + i * SITE.size) for i in range(len(PATCH_SITES))]
+		if site_mask != 0:
+			entries.append((slot, key, site_mask, sites))
+	return entries
+
+
+def read_locate_output(data):
+	"""Returns the successfully located images in EfiGuardLocate output as (file name, (slot, key, site mask, sites))."""
+	try:
+		results = json.loads(data)
+	except ValueError:
+		return None
+	if not isinstance(results, list):
+		return None
+
+	entries = []
+	for result in results:
+		if result.get("status") != "ok" or result.get("type") not in FILE_TYPES:
+			continue
+		key = (result["timeDateStamp"], result["sizeOfImage"], result["checkSum"], 0)
+		site_mask = 0
+		sites = [(0, bytes(PATCH_CACHE_SITE_BYTES))] * len(PATCH_SITES)
+		for name, site in result["sites"].items():
+			i = PATCH_SITES.index(name)
+			site_mask |= 1 << i
+			sites[i] = (site["rva"], bytes.fromhex(site["bytes"]).ljust(PATCH_CACHE_SITE_BYTES, b"\0"))
+		entries.append((os.path.basename(result["file"]), (FILE_TYPES.index(result["type"]), key, site_mask, sites)))
+	return entries
+
+
+def format_entry(name, slot, key, site_mask, sites):
+	lines = ["\t// %s" % name,
+		"\t{",
+		"\t\t0x%08X, 0x%08X, %s, 0x%08X," % (key[0], key[1], FILE_TYPES[slot], site_mask),
+		"\t\t{"]
+	for i, (rva, site_bytes) in enumerate(sites):
+		if site_mask & (1 << i):
+			lines.append("\t\t\t[%s] = { 0x%08X, { %s } }," % (PATCH_SITES[i], rva, ", ".join("0x%02X" % b for b in site_bytes)))
+	lines += ["\t\t}", "\t},"]
+	return "\n".join(lines)
+
+
+def main():
+	if len(sys.argv) < 2:
+		sys.exit("Usage: %s <directory> [output file]" % os.path.basename(sys.argv[0]))
+	directory = sys.argv[1]
+	if not os.path.isdir(directory):
+		sys.exit("%s: not a directory" % directory)
+	output = sys.argv[2] if len(sys.argv) > 2 else os.path.join(os.path.dirname(os.path.abspath(__file__)), "KnownBuilds.h")
+
+	images = {}		# (TimeDateStamp, SizeOfImage, CheckSum) -> file name
+	entries = {}	# (TimeDateStamp, SizeOfImage) -> {slot: (slot, key, site mask, sites)}
+	located = {}	# (TimeDateStamp, SizeOfImage, CheckSum, slot) -> (file name, (slot, key, site mask, sites)) from EfiGuardLocate
+	for root, _, files in os.walk(directory):
+		for file_name in sorted(files):
+			with open(os.path.join(root, file_name), "rb") as f:
+				data = f.read()
+			identity = read_pe_identity(data)
+			if identity is not None:
+				images[identity] = file_name
+				continue
+			if file_name.endswith(".json"):
+				for name, entry in read_locate_output(data) or []:
+					located[tuple(entry[1][:3]) + (entry[0],)] = (name, entry)
+				continue
+			for entry in read_patch_cache(data) or []:
+				entries.setdefault((entry[1][0], entry[1][1]), {})[entry[0]] = entry
+
+	# One table entry per (TimeDateStamp, SizeOfImage, slot), since bootmgfw.efi and bootmgr.efi are often the same image.
+	# The slot order matches INPUT_FILETYPE, so this is also the order FindKnownBuild() in PatchCache.c searches in
+	table = {}
+	for identity, file_name in sorted(images.items()):
+		matches = [entry for entry in entries.get(identity[:2], {}).values() if entry[1][2] == identity[2]]
+		if not matches:
+			if not any(key[:3] == identity for key in located):
+				sys.stderr.write("%s: no patch cache entry found, skipping\n" % file_name)
+			continue
+		for entry in matches:
+			table[identity[:2] + (entry[0],)] = format_entry(file_name, *entry)
+	for identity, (file_name, entry) in located.items():
+		key = identity[:2] + (entry[0],)
+		if key not in table:
+			table[key] = format_entry(file_name, *entry)
+	table = [table[key] for key in sorted(table)]
+
+	with open(output, "w", newline="\n") as f:
+		f.write("//\n")
+		f.write("// THIS FILE WAS GENERATED BY \"%s\". DO NOT EDIT MANUALLY.\n" % os.path.basename(sys.argv[0]))
+		f.write("//\n")
+		f.write("#ifndef __KNOWN_BUILDS_H\n")
+		f.write("#define __KNOWN_BUILDS_H\n")
+		f.write("\n")
+		f.write("// Sorted by (TimeDateStamp, SizeOfImage, FileType). The last entry is a terminator that is not part of the table\n")
+		f.write("STATIC CONST KNOWN_BUILD mKnownBuilds[] = {\n")
+		for entry in table:
+			f.write(entry + "\n")
+		f.write("\t{ 0 }\n")
+		f.write("};\n")
+		f.write("\n")
+		f.write("#define NUM_KNOWN_BUILDS\t\t(ARRAY_SIZE(mKnownBuilds) - 1)\n")
+		f.write("\n")
+		f.write("#endif\n")
+	print("%s: %u known builds" % (output, len(table)))
+
+
+if __name__ == "__main__":
+	main()
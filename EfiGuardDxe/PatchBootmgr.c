@@ -8,6 +8,9 @@ UINT8 gBootmgfwImgArchStartBootApplicationBackup[sizeof(gHookTemplate)] = { 0 };
 VOID* /*t_ImgArchStartBootApplication_XX*/ gOriginalBootmgrImgArchStartBootApplication = NULL;
 UINT8 gBootmgrImgArchStartBootApplicationBackup[sizeof(gHookTemplate)] = { 0 };
 
+// Patch plan for the ImgArchStartBootApplication hook
+STATIC PATCH_PLAN mHookPatchPlan;
+
 
 //
 // Universal template bytes for a "faux call" inline hook
@@ -35,6 +38,7 @@ CONST UINTN gHookTemplateAddressOffset = 1;
 STATIC CONST UINT8 SigImgArchStartBootApplication[] = {
 	0x41, 0xB8, 0x09, 0x00, 0x00, 0xD0				// mov r8d, 0D0000009h
 };
+STATIC BYTE_PATTERN SigImgArchStartBootApplicationPattern = BYTE_PATTERN_INIT(SigImgArchStartBootApplication, "xxxxxx");
 
 
 //
@@ -56,15 +60,16 @@ HookedBootManagerImgArchStartBootApplication(
 	// Restore the original function bytes that we replaced with our hook
 	CopyWpMem(OriginalFunction, OriginalFunctionBytes, sizeof(gHookTemplate));
 
-	// Clear the screen and paint it, paint it bl... green
-	CONST INT32 OriginalAttribute = SetConsoleTextColour(EFI_GREEN, TRUE);
+	// Clear the screen and paint it, paint it bl... green. Only clear it if there is going to be something to read
+	CONST INT32 OriginalAttribute = SetConsoleTextColour(EFI_GREEN, gDriverConfig.Verbosity >= VERBOSITY_VERBOSE);
 
-	// Get the PE headers
+	// Get the PE headers, and parse them for the patchers
 	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = RtlpImageNtHeaderEx(ImageBase, ImageSize);
 	INPUT_FILETYPE FileType = Unknown;
-	if (NtHeaders == NULL)
+	PE_IMAGE_VIEW Image;
+	if (NtHeaders == NULL || EFI_ERROR(InitializePeImageView(ImageBase, NtHeaders, &Image)))
 	{
-		Print(L"\r\nHookedBootmanagerImgArchStartBootApplication: PE image at 0x%p with size 0x%lx is invalid!\r\nPress any key to continue anyway, or press ESC to reboot.\r\n",
+		ConsolePrint(VERBOSITY_QUIET, L"\r\nHookedBootmanagerImgArchStartBootApplication: PE image at 0x%p with size 0x%lx is invalid!\r\nPress any key to continue anyway, or press ESC to reboot.\r\n",
 			ImageBase, ImageSize);
 		if (!WaitForKey())
 		{
@@ -84,50 +89,49 @@ HookedBootManagerImgArchStartBootApplication(
 	}
 
 	// Print info
-	Print(L"[ %S!ImgArchStartBootApplication ]\r\n", (OriginalFunctionBytes == gBootmgrImgArchStartBootApplicationBackup ? L"bootmgr" : L"bootmgfw"));
-	Print(L"ImageBase: 0x%p\r\n", ImageBase);
-	Print(L"ImageSize: %lx\r\n", ImageSize);
-	Print(L"File type: %S\r\n", FileTypeToString(FileType));
-	Print(L"EntryPoint: 0x%p\r\n", ((UINT8*)ImageBase + HEADER_FIELD(NtHeaders, AddressOfEntryPoint)));
-	Print(L"AppEntry:\r\n");
-	Print(L"  Signature: %a\r\n", AppEntry->Signature);
-	Print(L"  Flags: %lx\r\n", AppEntry->Flags);
-	Print(L"  GUID: %08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x\r\n",
+	ConsolePrint(VERBOSITY_VERBOSE, L"[ %S!ImgArchStartBootApplication ]\r\n", (OriginalFunctionBytes == gBootmgrImgArchStartBootApplicationBackup ? L"bootmgr" : L"bootmgfw"));
+	ConsolePrint(VERBOSITY_VERBOSE, L"ImageBase: 0x%p\r\n", ImageBase);
+	ConsolePrint(VERBOSITY_VERBOSE, L"ImageSize: %lx\r\n", ImageSize);
+	ConsolePrint(VERBOSITY_VERBOSE, L"File type: %S\r\n", FileTypeToString(FileType));
+	ConsolePrint(VERBOSITY_VERBOSE, L"EntryPoint: 0x%p\r\n", ((UINT8*)ImageBase + HEADER_FIELD(NtHeaders, AddressOfEntryPoint)));
+	ConsolePrint(VERBOSITY_VERBOSE, L"AppEntry:\r\n");
+	ConsolePrint(VERBOSITY_VERBOSE, L"  Signature: %a\r\n", AppEntry->Signature);
+	ConsolePrint(VERBOSITY_VERBOSE, L"  Flags: %lx\r\n", AppEntry->Flags);
+	ConsolePrint(VERBOSITY_VERBOSE, L"  GUID: %08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x\r\n",
 		AppEntry->Guid.Data1, AppEntry->Guid.Data2, AppEntry->Guid.Data3,
 		AppEntry->Guid.Data4[0], AppEntry->Guid.Data4[1], AppEntry->Guid.Data4[2], AppEntry->Guid.Data4[3],
 		AppEntry->Guid.Data4[4], AppEntry->Guid.Data4[5], AppEntry->Guid.Data4[6], AppEntry->Guid.Data4[7]);
 #ifdef EFI_DEBUG
 	// Stuff likely no one cares about
-	Print(L"  Unknown: %lx %lx %lx %lx\r\n", AppEntry->Unknown[0], AppEntry->Unknown[1], AppEntry->Unknown[2], AppEntry->Unknown[3]);
-	Print(L"  BcdData:\r\n");
-	Print(L"    Type: %lx\r\n", AppEntry->BcdData.Type);
-	Print(L"    DataOffset: %lx\r\n", AppEntry->BcdData.DataOffset);
-	Print(L"    DataSize: %lx\r\n", AppEntry->BcdData.DataSize);
-	Print(L"    ListOffset: %lx\r\n", AppEntry->BcdData.ListOffset);
-	Print(L"    NextEntryOffset: %lx\r\n", AppEntry->BcdData.NextEntryOffset);
-	Print(L"    Empty: %lx\r\n", AppEntry->BcdData.Empty);
+	ConsolePrint(VERBOSITY_VERBOSE, L"  Unknown: %lx %lx %lx %lx\r\n", AppEntry->Unknown[0], AppEntry->Unknown[1], AppEntry->Unknown[2], AppEntry->Unknown[3]);
+	ConsolePrint(VERBOSITY_VERBOSE, L"  BcdData:\r\n");
+	ConsolePrint(VERBOSITY_VERBOSE, L"    Type: %lx\r\n", AppEntry->BcdData.Type);
+	ConsolePrint(VERBOSITY_VERBOSE, L"    DataOffset: %lx\r\n", AppEntry->BcdData.DataOffset);
+	ConsolePrint(VERBOSITY_VERBOSE, L"    DataSize: %lx\r\n", AppEntry->BcdData.DataSize);
+	ConsolePrint(VERBOSITY_VERBOSE, L"    ListOffset: %lx\r\n", AppEntry->BcdData.ListOffset);
+	ConsolePrint(VERBOSITY_VERBOSE, L"    NextEntryOffset: %lx\r\n", AppEntry->BcdData.NextEntryOffset);
+	ConsolePrint(VERBOSITY_VERBOSE, L"    Empty: %lx\r\n", AppEntry->BcdData.Empty);
 #endif
 
 	if (FileType == WinloadEfi)
 	{
 		// Patch winload.efi
-		PatchWinload(ImageBase,
-					NtHeaders);
+		PatchWinload(&Image);
 	}
 	else if (FileType == BootmgrEfi)
 	{
 		// Call PatchBootManager a second time; this time to patch bootmgr.efi
 		PatchBootManager(FileType,
-						ImageBase,
-						ImageSize);
+						&Image);
 	}
 
 CallOriginal:
+	ConsoleFlush();
 	if (FileType == WinloadEfi || FileType == BootmgrEfi)
 	{
 		// Clear screen
 		gST->ConOut->EnableCursor(gST->ConOut, FALSE);
-		SetConsoleTextColour((UINTN)((OriginalAttribute >> 4) & 0x7), TRUE);
+		SetConsoleTextColour((UINTN)((OriginalAttribute >> 4) & 0x7), gDriverConfig.Verbosity >= VERBOSITY_VERBOSE);
 	}
 
 	// Call the original function to transfer execution to the boot application entry point; normally winload.efi!OslMain or bootmgr.efi!BmMain.
@@ -232,6 +236,42 @@ HookedBootmgrImgArchStartBootApplication_Eight(
 														gBootmgrImgArchStartBootApplicationBackup);
 }
 
+//
+// Finds [bootmgfw|bootmgr]!ImgArch[Efi]StartBootApplication
+//
+STATIC
+EFI_STATUS
+EFIAPI
+FindImgArchStartBootApplication(
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN CONST CHAR16* ShortFileName,
+	IN CONST CHAR16* FunctionName,
+	OUT UINT8** ImgArchStartBootApplicationAddress
+	)
+{
+	CONST PEFI_IMAGE_SECTION_HEADER CodeSection = &Image->Sections[0];
+	UINT8* Found = NULL;
+	CONST EFI_STATUS Status = FindPattern(&SigImgArchStartBootApplicationPattern,
+										Image->ImageBase + CodeSection->VirtualAddress,
+										CodeSection->SizeOfRawData,
+										(VOID**)&Found);
+	if (EFI_ERROR(Status))
+	{
+		ConsolePrint(VERBOSITY_QUIET, L"\r\nPatchBootManager: failed to find %S!%S signature. Status: %llx\r\n", ShortFileName, FunctionName, Status);
+		return Status;
+	}
+
+	// Found signature; backtrack to function start
+	*ImgArchStartBootApplicationAddress = BacktrackToFunctionStart(Image->ImageBase, Image->NtHeaders, Found);
+	if (*ImgArchStartBootApplicationAddress == NULL)
+	{
+		ConsolePrint(VERBOSITY_QUIET, L"\r\nPatchBootManager: failed to find %S!%S function start [signature at 0x%p].\r\n", ShortFileName, FunctionName, (VOID*)Found);
+		return EFI_NOT_FOUND;
+	}
+
+	return EFI_SUCCESS;
+}
+
 //
 // Patches the Windows Boot Manager (either bootmgfw.efi or bootmgr.efi; normally the former unless booting a WIM file)
 // 
@@ -239,8 +279,7 @@ EFI_STATUS
 EFIAPI
 PatchBootManager(
 	IN INPUT_FILETYPE FileType,
-	IN VOID* ImageBase,
-	IN UINTN ImageSize
+	IN CONST PE_IMAGE_VIEW* Image
 	)
 {
 	if (gBootmgfwHandle == NULL)
@@ -248,37 +287,28 @@ PatchBootManager(
 
 	ASSERT(FileType == BootmgfwEfi || FileType == BootmgrEfi);
 
-	// Get PE headers
+	STAGE_TIMER Timer;
+	BeginStage(&Timer, EFIGUARD_STAGE_PATCH_BOOT_MANAGER);
+
+	UINT8* ImageBase = Image->ImageBase;
+	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = Image->NtHeaders;
 	CONST BOOLEAN PatchingBootmgrEfi = FileType == BootmgrEfi;
 	CONST CHAR16* ShortFileName = PatchingBootmgrEfi ? L"bootmgr" : L"bootmgfw";
-	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = RtlpImageNtHeaderEx(ImageBase, ImageSize);
-	EFI_STATUS Status;
-	if (NtHeaders == NULL)
-	{
-		Status = EFI_LOAD_ERROR;
-		Print(L"\r\nPatchBootManager: %S.efi PE image at 0x%p with size 0x%llx is invalid!\r\nPress any key to continue anyway, or press ESC to reboot.\r\n",
-			ShortFileName, ImageBase, ImageSize);
-		if (!WaitForKey())
-		{
-			gRT->ResetSystem(EfiResetCold, EFI_SUCCESS, 0, NULL);
-		}
-		goto Exit;
-	}
 
 	// Print file and version info
 	UINT16 MajorVersion = 0, MinorVersion = 0, BuildNumber = 0, Revision = 0;
-	Status = GetPeFileVersionInfo(ImageBase, &MajorVersion, &MinorVersion, &BuildNumber, &Revision, NULL);
+	EFI_STATUS Status = GetPeFileVersionInfo(ImageBase, &MajorVersion, &MinorVersion, &BuildNumber, &Revision, NULL);
 	if (EFI_ERROR(Status))
-		Print(L"\r\nPatchBootManager: WARNING: failed to obtain %S.efi version info. Status: %llx\r\n", ShortFileName, Status);
+		ConsolePrint(VERBOSITY_SUMMARY, L"\r\nPatchBootManager: WARNING: failed to obtain %S.efi version info. Status: %llx\r\n", ShortFileName, Status);
 	else
 	{
-		Print(L"\r\nPatching %S.efi v%u.%u.%u.%u...\r\n", ShortFileName, MajorVersion, MinorVersion, BuildNumber, Revision);
+		ConsolePrint(VERBOSITY_VERBOSE, L"\r\nPatching %S.efi v%u.%u.%u.%u...\r\n", ShortFileName, MajorVersion, MinorVersion, BuildNumber, Revision);
 
 		// Check if this is a supported boot manager version. All patches should work on all versions since Vista SP1,
 		// except for the ImgpFilterValidationFailure patch because this function only exists on Windows 7 and higher.
 		if (BuildNumber < 6001)
 		{
-			Print(L"\r\nPatchBootManager: ERROR: Unsupported %S.efi image version.\r\n"
+			ConsolePrint(VERBOSITY_QUIET, L"\r\nPatchBootManager: ERROR: Unsupported %S.efi image version.\r\n"
 				L"The minimum supported boot manager version is Windows Vista SP1.\r\n"
 				L"It is recommended to use the Windows 10 boot manager even when running an older OS.\r\n", ShortFileName);
 			Status = EFI_UNSUPPORTED;
@@ -286,33 +316,25 @@ PatchBootManager(
 		}
 	}
 
-	// Find [bootmgfw|bootmgr]!ImgArch[Efi]StartBootApplication
+	// Find [bootmgfw|bootmgr]!ImgArch[Efi]StartBootApplication. If this boot manager was patched before, try the patch cache first
 	CONST CHAR16* FunctionName = BuildNumber >= 17134 ? L"ImgArchStartBootApplication" : L"ImgArchEfiStartBootApplication";
-	CONST PEFI_IMAGE_SECTION_HEADER CodeSection = IMAGE_FIRST_SECTION(NtHeaders);
-	UINT8* Found = NULL;
-	Status = FindPattern(SigImgArchStartBootApplication,
-							0xCC,
-							sizeof(SigImgArchStartBootApplication),
-							(UINT8*)ImageBase + CodeSection->VirtualAddress,
-							CodeSection->SizeOfRawData,
-							(VOID**)&Found);
-	if (EFI_ERROR(Status))
+	UINT8* ImgArchStartBootApplication = NULL;
+	CONST PATCH_CACHE_BINDING CacheBinding = { PatchSiteImgArchStartBootApplication, &ImgArchStartBootApplication };
+	if (!PatchCacheOpenImage(FileType, ImageBase, NtHeaders) || !PatchCacheLookupSites(FileType, &CacheBinding, 1))
 	{
-		Print(L"\r\nPatchBootManager: failed to find %S!%S signature. Status: %llx\r\n", ShortFileName, FunctionName, Status);
-		goto Exit;
+		Status = FindImgArchStartBootApplication(Image,
+												ShortFileName,
+												FunctionName,
+												&ImgArchStartBootApplication);
+		if (EFI_ERROR(Status))
+			goto Exit;
+		PatchCacheRecordSites(FileType, &CacheBinding, 1);
 	}
 
-	// Found signature; backtrack to function start
 	// Note: pOriginalAddress is a pointer to a (function) pointer, because the original address depends on the type of boot manager we are patching.
 	VOID **pOriginalAddress = PatchingBootmgrEfi ? &gOriginalBootmgrImgArchStartBootApplication : &gOriginalBootmgfwImgArchStartBootApplication;
-	*pOriginalAddress = (VOID*)BacktrackToFunctionStart(ImageBase, NtHeaders, Found);
+	*pOriginalAddress = (VOID*)ImgArchStartBootApplication;
 	CONST VOID* OriginalAddress = *pOriginalAddress;
-	if (OriginalAddress == NULL)
-	{
-		Print(L"\r\nPatchBootManager: failed to find %S!%S function start [signature at 0x%p].\r\n", ShortFileName, FunctionName, (VOID*)Found);
-		Status = EFI_NOT_FOUND;
-		goto Exit;
-	}
 
 	// Found
 	VOID* HookAddress;
@@ -321,40 +343,57 @@ PatchBootManager(
 	else
 		HookAddress = PatchingBootmgrEfi ? (VOID*)&HookedBootmgrImgArchStartBootApplication_Eight : (VOID*)&HookedBootmgfwImgArchStartBootApplication_Eight;
 	UINT8* BackupAddress = PatchingBootmgrEfi ? gBootmgrImgArchStartBootApplicationBackup : gBootmgfwImgArchStartBootApplicationBackup;
-	Print(L"\r\nFound %S!%S at 0x%p.\r\n", ShortFileName, FunctionName, (VOID*)OriginalAddress);
-	Print(L"Hooked%S%S at 0x%p.\r\n", (PatchingBootmgrEfi ? L"Bootmgr" : L"Bootmgfw"), FunctionName, HookAddress);
+	ConsolePrint(VERBOSITY_VERBOSE, L"\r\nFound %S!%S at 0x%p.\r\n", ShortFileName, FunctionName, (VOID*)OriginalAddress);
+	ConsolePrint(VERBOSITY_VERBOSE, L"Hooked%S%S at 0x%p.\r\n", (PatchingBootmgrEfi ? L"Bootmgr" : L"Bootmgfw"), FunctionName, HookAddress);
+
+	// Place faux call (push addr, ret) at the start of the function to transfer execution to our hook.
+	// The hook is written as a single patch, so that write protection only needs to be disabled once
+	UINT8 HookBytes[sizeof(gHookTemplate)];
+	CopyMem(HookBytes, gHookTemplate, sizeof(gHookTemplate));
+	CopyMem(HookBytes + gHookTemplateAddressOffset, (UINTN*)&HookAddress, sizeof(UINTN));
+	InitializePatchPlan(&mHookPatchPlan);
+	AddPatchPlanEntry(&mHookPatchPlan, (VOID*)OriginalAddress, NULL, HookBytes, sizeof(HookBytes));
 
 	CONST EFI_TPL Tpl = gBS->RaiseTPL(TPL_HIGH_LEVEL); // Note: implies cli
 
 	// Backup original function prologue
 	CopyMem(BackupAddress, (VOID*)OriginalAddress, sizeof(gHookTemplate));
 
-	// Place faux call (push addr, ret) at the start of the function to transfer execution to our hook
-	CopyWpMem((VOID*)OriginalAddress, gHookTemplate, sizeof(gHookTemplate));
-	CopyWpMem((UINT8*)OriginalAddress + gHookTemplateAddressOffset, (UINTN*)&HookAddress, sizeof(UINTN));
+	Status = ApplyPatchPlan(&mHookPatchPlan);
 
 	gBS->RestoreTPL(Tpl);
 
+	if (EFI_ERROR(Status))
+	{
+		ConsolePrint(VERBOSITY_QUIET, L"\r\nPatchBootManager: failed to hook %S!%S. Status: %llx\r\n", ShortFileName, FunctionName, Status);
+		goto Exit;
+	}
+
 	// Patch ImgpValidateImageHash to allow custom boot loaders. This is completely
 	// optional (unless booting a custom winload.efi), and failures are ignored
 	PatchImgpValidateImageHash(FileType,
-								ImageBase,
-								NtHeaders);
+								Image);
 
 	if (BuildNumber >= 7600)
 	{
 		// Patch ImgpFilterValidationFailure so it doesn't silently
 		// rat out every violation to a TPM or SI log. Also optional
 		PatchImgpFilterValidationFailure(FileType,
-										ImageBase,
-										NtHeaders);
+										Image,
+										NULL);
 	}
 
+	// Save the locations found above for the next boot
+	PatchCacheFlush();
+
 Exit:
+	// Stop the clock before waiting for user input
+	EndStage(&Timer);
+
 	if (EFI_ERROR(Status))
 	{
 		// Patch failed. Prompt user to ask what they want to do
-		Print(L"\r\nPress any key to continue anyway, or press ESC to reboot.\r\n");
+		ConsolePrint(VERBOSITY_QUIET, L"\r\nPress any key to continue anyway, or press ESC to reboot.\r\n");
 		if (!WaitForKey())
 		{
 			gRT->ResetSystem(EfiResetCold, EFI_SUCCESS, 0, NULL);
@@ -362,15 +401,16 @@ Exit:
 	}
 	else
 	{
-		Print(L"Successfully patched %S!%S.\r\n", ShortFileName, FunctionName);
+		ConsolePrint(VERBOSITY_SUMMARY, L"Successfully patched %S!%S.\r\n", ShortFileName, FunctionName);
 		//RtlSleep(2000);
 
 		if (gDriverConfig.WaitForKeyPress)
 		{
-			Print(L"\r\nPress any key to continue.\r\n");
+			ConsolePrint(VERBOSITY_QUIET, L"\r\nPress any key to continue.\r\n");
 			WaitForKey();
 		}
 	}
+	ConsoleFlush();
 
 	// Return success, because even if the patch failed, the user chose not to reboot above
 	return EFI_SUCCESS;
@@ -0,0 +1,328 @@
+#include "EfiGuardDxe.h"
+
+#include <Library/BaseMemoryLib.h>
+
+#define PATCH_CACHE_VARIABLE_NAME			L"EfiGuardPatchCache"
+// Not accessible at runtime, so that the OS cannot point the patches at locations of its choosing
+#define PATCH_CACHE_VARIABLE_ATTRIBUTES		(EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS)
+#define PATCH_CACHE_VERSION					2
+
+// Number of original bytes stored for each site. These are compared on lookup to catch stale entries
+#define PATCH_CACHE_SITE_BYTES				8
+
+// One slot per supported image type, starting at BootmgfwEfi. The ntoskrnl.exe slot is last, and is not persisted:
+// the kernel is patched after ExitBootServices(), when the BS-only variable can no longer be written
+#define PATCH_CACHE_SLOT(FileType)			((UINTN)(FileType) - BootmgfwEfi)
+#define PATCH_CACHE_NUM_SLOTS				(Ntoskrnl - BootmgfwEfi + 1)
+#define PATCH_CACHE_NUM_PERSISTENT_SLOTS	(PATCH_CACHE_NUM_SLOTS - 1)
+#define PATCH_CACHE_HAS_SLOT(FileType)		((FileType) >= BootmgfwEfi && (FileType) <= Ntoskrnl)
+
+// Only the ntoskrnl.exe sites may be missing from an image, depending on its build. All other sites must have an address
+#define PATCH_SITE_IS_OPTIONAL(Site)		((Site) >= PatchSiteKeInitAmd64SpecificState)
+
+typedef struct _PATCH_CACHE_KEY
+{
+	UINT32 TimeDateStamp;
+	UINT32 SizeOfImage;
+	UINT32 CheckSum;
+	UINT32 Hash;			// FNV-1a of the file header, the section headers and .pdata
+} PATCH_CACHE_KEY;
+
+typedef struct _PATCH_CACHE_SITE
+{
+	UINT32 Rva;				// 0 if the site does not exist in this image
+	UINT8 Bytes[PATCH_CACHE_SITE_BYTES];
+} PATCH_CACHE_SITE;
+
+typedef struct _PATCH_CACHE_ENTRY
+{
+	PATCH_CACHE_KEY Key;
+	UINT32 SiteMask;		// Bit N is set if site N has been recorded
+	PATCH_CACHE_SITE Sites[PatchSiteMax];
+} PATCH_CACHE_ENTRY;
+
+typedef struct _PATCH_CACHE
+{
+	UINT32 Version;
+	UINT32 Size;
+	PATCH_CACHE_ENTRY Entries[PATCH_CACHE_NUM_PERSISTENT_SLOTS];
+} PATCH_CACHE;
+
+// Patch sites of an image in the built-in table of known builds
+typedef struct _KNOWN_BUILD
+{
+	UINT32 TimeDateStamp;
+	UINT32 SizeOfImage;
+	INPUT_FILETYPE FileType;
+	UINT32 SiteMask;
+	PATCH_CACHE_SITE Sites[PatchSiteMax];
+} KNOWN_BUILD;
+
+#include "KnownBuilds.h"
+
+// Not pool allocated, since ntoskrnl.exe sites are looked up and recorded in winload's application context
+STATIC PATCH_CACHE mPatchCache;
+STATIC PATCH_CACHE_ENTRY mKernelEntry;
+STATIC_ASSERT(sizeof(PATCH_CACHE) <= VARIABLE_STATE_MAX_SIZE, "The patch cache must fit in the SetVariableIfChanged() buffer, or it is written on every boot");
+STATIC CONST UINT8* mImageBases[PATCH_CACHE_NUM_SLOTS];
+STATIC PEFI_IMAGE_NT_HEADERS mNtHeaders[PATCH_CACHE_NUM_SLOTS];
+STATIC BOOLEAN mPatchCacheDirty = FALSE;
+
+// Returns the cache entry for a file type. The ntoskrnl.exe entry only lives for the current boot
+STATIC
+PATCH_CACHE_ENTRY*
+GetPatchCacheEntry(
+	IN INPUT_FILETYPE FileType
+	)
+{
+	return FileType == Ntoskrnl ? &mKernelEntry : &mPatchCache.Entries[PATCH_CACHE_SLOT(FileType)];
+}
+
+// Returns TRUE if a cached site lies entirely within a section of the kind its locator searches: writable data for g_PgContext,
+// and code for all other sites. This rejects entries that were corrupted, or that point outside of the image's code
+STATIC
+BOOLEAN
+IsValidSiteRva(
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN PATCH_SITE Site,
+	IN UINT32 Rva
+	)
+{
+	CONST UINT32 Required = Site == PatchSiteGlobalPgContext ? EFI_IMAGE_SCN_MEM_WRITE : EFI_IMAGE_SCN_MEM_EXECUTE;
+	CONST UINT32 Forbidden = Site == PatchSiteGlobalPgContext ? EFI_IMAGE_SCN_MEM_EXECUTE : 0;
+
+	CONST PEFI_IMAGE_SECTION_HEADER Sections = IMAGE_FIRST_SECTION(NtHeaders);
+	for (UINT16 i = 0; i < NtHeaders->FileHeader.NumberOfSections; ++i)
+	{
+		CONST PEFI_IMAGE_SECTION_HEADER Section = &Sections[i];
+		if (Rva < Section->VirtualAddress || (UINT64)Rva + PATCH_CACHE_SITE_BYTES > (UINT64)Section->VirtualAddress + Section->Misc.VirtualSize)
+			continue;
+
+		return (Section->Characteristics & Required) == Required && (Section->Characteristics & Forbidden) == 0;
+	}
+	return FALSE;
+}
+
+// FNV-1a
+STATIC
+UINT32
+HashBytes(
+	IN UINT32 Hash,
+	IN CONST UINT8* Data,
+	IN UINTN Size
+	)
+{
+	for (UINTN i = 0; i < Size; ++i)
+	{
+		Hash ^= Data[i];
+		Hash *= 16777619U;
+	}
+	return Hash;
+}
+
+// Computes the cache key of an image. Only parts of the image that the loader does not modify are hashed
+STATIC
+VOID
+ComputePatchCacheKey(
+	IN CONST UINT8* ImageBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	OUT PATCH_CACHE_KEY* Key
+	)
+{
+	Key->TimeDateStamp = NtHeaders->FileHeader.TimeDateStamp;
+	Key->SizeOfImage = HEADER_FIELD(NtHeaders, SizeOfImage);
+	Key->CheckSum = HEADER_FIELD(NtHeaders, CheckSum);
+
+	UINT32 Hash = HashBytes(2166136261U, (CONST UINT8*)&NtHeaders->FileHeader, sizeof(NtHeaders->FileHeader));
+	Hash = HashBytes(Hash, (CONST UINT8*)IMAGE_FIRST_SECTION(NtHeaders), NtHeaders->FileHeader.NumberOfSections * sizeof(EFI_IMAGE_SECTION_HEADER));
+	if (NtHeaders->OptionalHeader.NumberOfRvaAndSizes > EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION)
+	{
+		CONST EFI_IMAGE_DATA_DIRECTORY* Pdata = &NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+		if (Pdata->VirtualAddress != 0 && Pdata->Size != 0 && (UINT64)Pdata->VirtualAddress + Pdata->Size <= Key->SizeOfImage)
+			Hash = HashBytes(Hash, ImageBase + Pdata->VirtualAddress, Pdata->Size);
+	}
+	Key->Hash = Hash;
+}
+
+// Binary search of the known builds table by (TimeDateStamp, SizeOfImage, FileType). The file type is part of the key because
+// bootmgfw.efi and bootmgr.efi are often the same image, which then has an entry for each
+STATIC
+CONST KNOWN_BUILD*
+FindKnownBuild(
+	IN INPUT_FILETYPE FileType,
+	IN CONST PATCH_CACHE_KEY* Key
+	)
+{
+	UINTN Low = 0, High = NUM_KNOWN_BUILDS;
+	while (Low < High)
+	{
+		CONST UINTN Mid = Low + (High - Low) / 2;
+		CONST KNOWN_BUILD* Build = &mKnownBuilds[Mid];
+		if (Build->TimeDateStamp < Key->TimeDateStamp ||
+			(Build->TimeDateStamp == Key->TimeDateStamp && Build->SizeOfImage < Key->SizeOfImage) ||
+			(Build->TimeDateStamp == Key->TimeDateStamp && Build->SizeOfImage == Key->SizeOfImage && Build->FileType < FileType))
+			Low = Mid + 1;
+		else
+			High = Mid;
+	}
+
+	// Low may be the index of the terminator, which never matches as its file type is Unknown
+	if (mKnownBuilds[Low].TimeDateStamp == Key->TimeDateStamp &&
+		mKnownBuilds[Low].SizeOfImage == Key->SizeOfImage &&
+		mKnownBuilds[Low].FileType == FileType)
+		return &mKnownBuilds[Low];
+	return NULL;
+}
+
+VOID
+EFIAPI
+PatchCacheLoad(
+	VOID
+	)
+{
+	UINT32 Attributes = 0;
+	UINTN Size = sizeof(mPatchCache);
+	CONST EFI_STATUS Status = gRT->GetVariable(PATCH_CACHE_VARIABLE_NAME,
+												&gEfiGuardDriverProtocolGuid,
+												&Attributes,
+												&Size,
+												&mPatchCache);
+	if (EFI_ERROR(Status) || Size != sizeof(mPatchCache) || Attributes != PATCH_CACHE_VARIABLE_ATTRIBUTES ||
+		mPatchCache.Version != PATCH_CACHE_VERSION || mPatchCache.Size != sizeof(mPatchCache))
+	{
+		// Missing, written by a different version of the driver, or created by someone else with runtime access. Start over
+		ZeroMem(&mPatchCache, sizeof(mPatchCache));
+		mPatchCache.Version = PATCH_CACHE_VERSION;
+		mPatchCache.Size = sizeof(mPatchCache);
+	}
+	ZeroMem(&mKernelEntry, sizeof(mKernelEntry));
+	mPatchCacheDirty = FALSE;
+}
+
+EFI_STATUS
+EFIAPI
+PatchCacheFlush(
+	VOID
+	)
+{
+	if (!mPatchCacheDirty)
+		return EFI_SUCCESS;
+
+	// The dirty flag is also set when an entry is replaced by one with the same contents, e.g. when alternating between
+	// two boot entries of the same build. The variable layer catches that case, so the flash is only written on an actual change
+	CONST EFI_STATUS Status = SetVariableIfChanged(PATCH_CACHE_VARIABLE_NAME,
+													&gEfiGuardDriverProtocolGuid,
+													PATCH_CACHE_VARIABLE_ATTRIBUTES,
+													sizeof(mPatchCache),
+													&mPatchCache);
+	if (!EFI_ERROR(Status))
+		mPatchCacheDirty = FALSE;
+	return Status;
+}
+
+BOOLEAN
+EFIAPI
+PatchCacheOpenImage(
+	IN INPUT_FILETYPE FileType,
+	IN CONST UINT8* ImageBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders
+	)
+{
+	if (!PATCH_CACHE_HAS_SLOT(FileType))
+		return FALSE;
+
+	PATCH_CACHE_KEY Key;
+	ComputePatchCacheKey(ImageBase, NtHeaders, &Key);
+
+	PATCH_CACHE_ENTRY* Entry = GetPatchCacheEntry(FileType);
+	mImageBases[PATCH_CACHE_SLOT(FileType)] = ImageBase;
+	mNtHeaders[PATCH_CACHE_SLOT(FileType)] = NtHeaders;
+	if (CompareMem(&Entry->Key, &Key, sizeof(Key)) == 0)
+		return TRUE;
+
+	// Different image. Replace the entry for the previous one
+	ZeroMem(Entry, sizeof(*Entry));
+	Entry->Key = Key;
+	if (FileType != Ntoskrnl)
+		mPatchCacheDirty = TRUE;
+
+	// If this is a known build, start from its patch sites. These are verified on lookup like any other cache entry,
+	// so a mismatch in the table only results in the sites being searched for
+	CONST KNOWN_BUILD* Build = FindKnownBuild(FileType, &Key);
+	if (Build == NULL)
+		return FALSE;
+
+	Entry->SiteMask = Build->SiteMask;
+	CopyMem(Entry->Sites, Build->Sites, sizeof(Entry->Sites));
+	return TRUE;
+}
+
+BOOLEAN
+EFIAPI
+PatchCacheLookupSites(
+	IN INPUT_FILETYPE FileType,
+	IN CONST PATCH_CACHE_BINDING* Bindings,
+	IN UINT32 NumBindings
+	)
+{
+	if (!PATCH_CACHE_HAS_SLOT(FileType))
+		return FALSE;
+
+	CONST PATCH_CACHE_ENTRY* Entry = GetPatchCacheEntry(FileType);
+	CONST UINT8* ImageBase = mImageBases[PATCH_CACHE_SLOT(FileType)];
+	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = mNtHeaders[PATCH_CACHE_SLOT(FileType)];
+	if (ImageBase == NULL)
+		return FALSE;
+
+	// Verify all sites before storing any of them, so that the caller's addresses are left untouched on a miss
+	for (UINT32 i = 0; i < NumBindings; ++i)
+	{
+		CONST PATCH_CACHE_SITE* Site = &Entry->Sites[Bindings[i].Site];
+		if ((Entry->SiteMask & (1U << Bindings[i].Site)) == 0 ||
+			(Site->Rva == 0 && !PATCH_SITE_IS_OPTIONAL(Bindings[i].Site)) ||
+			(Site->Rva != 0 && (!IsValidSiteRva(NtHeaders, Bindings[i].Site, Site->Rva) ||
+				CompareMem(ImageBase + Site->Rva, Site->Bytes, PATCH_CACHE_SITE_BYTES) != 0)))
+			return FALSE;
+	}
+
+	for (UINT32 i = 0; i < NumBindings; ++i)
+	{
+		CONST PATCH_CACHE_SITE* Site = &Entry->Sites[Bindings[i].Site];
+		*Bindings[i].Address = Site->Rva != 0 ? (UINT8*)ImageBase + Site->Rva : NULL;
+	}
+	return TRUE;
+}
+
+VOID
+EFIAPI
+PatchCacheRecordSites(
+	IN INPUT_FILETYPE FileType,
+	IN CONST PATCH_CACHE_BINDING* Bindings,
+	IN UINT32 NumBindings
+	)
+{
+	if (!PATCH_CACHE_HAS_SLOT(FileType))
+		return;
+
+	PATCH_CACHE_ENTRY* Entry = GetPatchCacheEntry(FileType);
+	CONST UINT8* ImageBase = mImageBases[PATCH_CACHE_SLOT(FileType)];
+	if (ImageBase == NULL)
+		return;
+
+	for (UINT32 i = 0; i < NumBindings; ++i)
+	{
+		CONST UINT8* Address = *Bindings[i].Address;
+		if (Address != NULL && (Address < ImageBase || Address - ImageBase > Entry->Key.SizeOfImage - PATCH_CACHE_SITE_BYTES))
+			continue; // Not cacheable
+
+		PATCH_CACHE_SITE* Site = &Entry->Sites[Bindings[i].Site];
+		Site->Rva = Address != NULL ? (UINT32)(Address - ImageBase) : 0;
+		if (Address != NULL)
+			CopyMem(Site->Bytes, Address, PATCH_CACHE_SITE_BYTES);
+		else
+			ZeroMem(Site->Bytes, PATCH_CACHE_SITE_BYTES);
+		Entry->SiteMask |= 1U << Bindings[i].Site;
+	}
+	if (FileType != Ntoskrnl)
+		mPatchCacheDirty = TRUE;
+}
@@ -13,6 +13,18 @@
 // because it allows the buffer to be accessed from both contexts at all stages of driver execution.
 KERNEL_PATCH_INFORMATION gKernelPatchInfo;
 
+// Import index capacity for ntoskrnl.exe (64KB). If it overflows, imports are looked up by walking the import directory
+#define KERNEL_IMPORT_INDEX_CAPACITY	4096
+
+// The import index is the only thing allocated from the kernel arena. The buffer is part of the runtime driver image and stays resident
+// for the whole OS session, so it only has a little headroom for alignment
+#define KERNEL_ARENA_SIZE				(KERNEL_IMPORT_INDEX_CAPACITY * sizeof(IMPORT_INDEX_ENTRY) + 4 * 1024)
+STATIC UINT64 mKernelArenaBuffer[KERNEL_ARENA_SIZE / sizeof(UINT64)];
+ARENA gKernelArena = { (UINT8*)mKernelArenaBuffer, sizeof(mKernelArenaBuffer), 0 };
+
+// Patch plan for the PatchGuard and DSE patches, which are each applied with write protection disabled only once
+STATIC PATCH_PLAN mKernelPatchPlan;
+
 
 // Signature for nt!KeInitAmd64SpecificState
 // This function is present in all x64 kernels since Vista. It generates a #DE due to 32 bit idiv quotient overflow.
@@ -26,14 +38,16 @@ STATIC CONST UINT8 SigKeInitAmd64SpecificState[] = {
 	0x99,						// cdq
 	0x41, 0xF7, 0xF8			// idiv r8d
 };
+STATIC BYTE_PATTERN SigKeInitAmd64SpecificStatePattern = BYTE_PATTERN_INIT(SigKeInitAmd64SpecificState, "xxxxxxxxxxxxxxxxxxxxx");
 
 // Signature for nt!KiVerifyScopesExecute
 // This function is present since Windows 8.1 and is responsible for executing all functions in the KiVerifyXcptRoutines array.
 // One of these functions, KiVerifyXcpt15, will indirectly initialize a PatchGuard context from its exception handler.
 STATIC CONST UINT8 SigKiVerifyScopesExecute[] = {
-	0x83, 0xCC, 0xCC, 0x00,										// and d/qword ptr [REG+XX], 0
+	0x83, 0x00, 0x00, 0x00,										// and d/qword ptr [REG+XX], 0
 	0x48, 0xB8, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFE	// mov rax, 0FEFFFFFFFFFFFFFFh
 };
+STATIC BYTE_PATTERN SigKiVerifyScopesExecutePattern = BYTE_PATTERN_INIT(SigKiVerifyScopesExecute, "x??xxxxxxxxxxx");
 
 // Signature for nt!KiMcaDeferredRecoveryService
 // This function is present since Windows 8.1 and bugchecks the system with bugcode 0x109 after zeroing registers.
@@ -45,6 +59,7 @@ STATIC CONST UINT8 SigKiMcaDeferredRecoveryService[] = {
 	0x8B, 0xE8,												// mov ebp, eax
 	0x4C, 0x8B, 0xD0										// mov r10, rax
 };
+STATIC BYTE_PATTERN SigKiMcaDeferredRecoveryServicePattern = BYTE_PATTERN_INIT(SigKiMcaDeferredRecoveryService, "xxxxxxxxxxx");
 
 // Signature for nt!KiSwInterrupt
 // This function is present since Windows 10 and is the interrupt handler for int 20h.
@@ -52,10 +67,11 @@ STATIC CONST UINT8 SigKiMcaDeferredRecoveryService[] = {
 // If int 20h is issued from kernel mode, the PatchGuard verification routine KiSwInterruptDispatch is called.
 STATIC CONST UINT8 SigKiSwInterrupt[] = {
 	0xFB,													// sti
-	0x48, 0x8D, 0xCC, 0xCC,									// lea REG, [REG-XX]
-	0xE8, 0xCC, 0xCC, 0xCC, 0xCC,							// call KiSwInterruptDispatch
+	0x48, 0x8D, 0x00, 0x00,									// lea REG, [REG-XX]
+	0xE8, 0x00, 0x00, 0x00, 0x00,							// call KiSwInterruptDispatch
 	0xFA													// cli
 };
+STATIC BYTE_PATTERN SigKiSwInterruptPattern = BYTE_PATTERN_INIT(SigKiSwInterrupt, "xxx??x????x");
 STATIC CONST UINTN SigKiSwInterruptCallOffset = 5, SigKiSwInterruptCliOffset = 10;
 
 // Signature for nt!SeCodeIntegrityQueryInformation, called through NtQuerySystemInformation(SystemCodeIntegrityInformation).
@@ -63,11 +79,12 @@ STATIC CONST UINTN SigKiSwInterruptCallOffset = 5, SigKiSwInterruptCliOffset = 1
 // This signature is only for the Windows 10 RS3+ version. I could add more signatures but this is a pretty superficial patch anyway.
 STATIC CONST UINT8 SigSeCodeIntegrityQueryInformation[] = {
 	0x48, 0x83, 0xEC,										// sub rsp, XX
-	0xCC, 0x48, 0x83, 0x3D, 0xCC, 0xCC, 0xCC, 0xCC, 0x00,	// cmp ds:qword_xxxx, 0
+	0x00, 0x48, 0x83, 0x3D, 0x00, 0x00, 0x00, 0x00, 0x00,	// cmp ds:qword_xxxx, 0
 	0x4D, 0x8B, 0xC8,										// mov r9, r8
 	0x4C, 0x8B, 0xD1,										// mov r10, rcx
-	0x74, 0xCC												// jz XX
+	0x74, 0x00												// jz XX
 };
+STATIC BYTE_PATTERN SigSeCodeIntegrityQueryInformationPattern = BYTE_PATTERN_INIT(SigSeCodeIntegrityQueryInformation, "xxx?xxx????xxxxxxxx?");
 
 // Patched SeCodeIntegrityQueryInformation which reports that DSE is enabled
 STATIC CONST UINT8 SeCodeIntegrityQueryInformationPatch[] = {
@@ -77,38 +94,381 @@ STATIC CONST UINT8 SeCodeIntegrityQueryInformationPatch[] = {
 	0xC3													// ret
 };
 
+//
+// Instruction matchers used with DisassembleRange() by the locators below
+//
+
+// Prefilters. These only look at the mnemonic, so the operands need not be decoded for the large majority of instructions
+STATIC
+BOOLEAN
+EFIAPI
+IsMovInstruction(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	return Context->Instruction.mnemonic == ZYDIS_MNEMONIC_MOV;
+}
+
+STATIC
+BOOLEAN
+EFIAPI
+IsCmpInstruction(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	return Context->Instruction.mnemonic == ZYDIS_MNEMONIC_CMP;
+}
+
+STATIC
+BOOLEAN
+EFIAPI
+IsMovCallOrJmpInstruction(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	return Context->Instruction.mnemonic == ZYDIS_MNEMONIC_MOV ||
+		Context->Instruction.mnemonic == ZYDIS_MNEMONIC_CALL ||
+		Context->Instruction.mnemonic == ZYDIS_MNEMONIC_JMP;
+}
+
+// Matches 'mov [al|rax], 0x0FFFFF780000002D4' ; SharedUserData->KdDebuggerEnabled
+STATIC
+BOOLEAN
+EFIAPI
+IsMovKdDebuggerEnabled(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	return (Context->Instruction.operand_count == 2 && Context->Instruction.mnemonic == ZYDIS_MNEMONIC_MOV && Context->Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER) &&
+		((Context->Operands[0].reg.value == ZYDIS_REGISTER_AL && Context->Operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY &&
+			(UINT64)(Context->Operands[1].mem.disp.value) == 0x0FFFFF780000002D4ULL) ||
+		(Context->Operands[0].reg.value == ZYDIS_REGISTER_RAX && Context->Operands[1].type == ZYDIS_OPERAND_TYPE_IMMEDIATE &&
+			Context->Operands[1].imm.value.u == 0x0FFFFF780000002D4ULL));
+}
+
+// Matches 'mov al, ds:[0x0FFFFF780000002D4]' ; SharedUserData->KdDebuggerEnabled
+// PredicateContext points to the CcInitializeBcbProfiler matcher, whose match must be excluded
+STATIC
+BOOLEAN
+EFIAPI
+IsExpLicenseWatchInitWorkerMovAl(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	CONST INSTRUCTION_MATCHER* CcInitializeBcbProfilerMatcher = (CONST INSTRUCTION_MATCHER*)PredicateContext;
+	return (UINT8*)Context->InstructionAddress != CcInitializeBcbProfilerMatcher->Found &&
+		Context->Instruction.operand_count == 2 && Context->Instruction.mnemonic == ZYDIS_MNEMONIC_MOV &&
+		Context->Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER && Context->Operands[0].reg.value == ZYDIS_REGISTER_AL &&
+		Context->Operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY && Context->Operands[1].mem.segment == ZYDIS_REGISTER_DS &&
+		Context->Operands[1].mem.disp.value == 0x0FFFFF780000002D4LL;
+}
+
+// Matches 'mov REG, ds:[RIP-relative]' (global variable load)
+STATIC
+BOOLEAN
+EFIAPI
+IsMovRegFromGlobal(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	return Context->Instruction.operand_count == 2 &&
+		Context->Instruction.mnemonic == ZYDIS_MNEMONIC_MOV &&
+		(Context->Instruction.attributes & ZYDIS_ATTRIB_ACCEPTS_SEGMENT) != 0 &&
+		Context->Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER &&
+		Context->Operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY && Context->Operands[1].mem.base == ZYDIS_REGISTER_RIP &&
+		(Context->Operands[1].mem.segment == ZYDIS_REGISTER_CS || Context->Operands[1].mem.segment == ZYDIS_REGISTER_DS);
+}
+
+// Matches 'mov ds:[RIP-relative], REG' (global variable store)
+STATIC
+BOOLEAN
+EFIAPI
+IsMovGlobalFromReg(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	return Context->Instruction.operand_count == 2 &&
+		Context->Instruction.mnemonic == ZYDIS_MNEMONIC_MOV &&
+		Context->Operands[0].type == ZYDIS_OPERAND_TYPE_MEMORY && Context->Operands[0].mem.base == ZYDIS_REGISTER_RIP &&
+		Context->Operands[1].type == ZYDIS_OPERAND_TYPE_REGISTER;
+}
+
+// Computes the address of the RIP-relative memory operand of the instruction, and stores it in the ZyanU64 in CallbackContext
+STATIC
+BOOLEAN
+EFIAPI
+StoreRipRelativeAddress(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* CallbackContext
+	)
+{
+	for (UINT8 i = 0; i < Context->Instruction.operand_count; ++i)
+	{
+		if (Context->Operands[i].type == ZYDIS_OPERAND_TYPE_MEMORY && Context->Operands[i].mem.base == ZYDIS_REGISTER_RIP)
+		{
+			if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context->Instruction, &Context->Operands[i], Context->InstructionAddress, (ZyanU64*)CallbackContext)))
+				return FALSE;
+			break;
+		}
+	}
+	return TRUE;
+}
 
 //
-// Defuses PatchGuard initialization routines before execution is transferred to the kernel.
-// All code accessed here is located in the INIT and .text sections.
+// State for the SepInitializeCodeIntegrity matcher
 //
+typedef struct _SEP_INITIALIZE_CODE_INTEGRITY_MATCH
+{
+	UINTN CiInitialize;		// IAT address of CiInitialize, or on Windows Vista/7 the address of the import thunk
+	UINT16 BuildNumber;
+	UINT8* LastMovIntoEcx;	// Keep track of 'mov ecx, xxx' - the last one before call/jmp cs:__imp_CiInitialize is the one we want to patch
+	UINT8* MovIntoEcx;
+} SEP_INITIALIZE_CODE_INTEGRITY_MATCH;
+
+// Matches a 2-byte 'mov ecx, <anything>', as well as the call/jmp to CiInitialize that follows it
+STATIC
+BOOLEAN
+EFIAPI
+IsSepInitializeCodeIntegrityInstruction(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	CONST SEP_INITIALIZE_CODE_INTEGRITY_MATCH* Match = (CONST SEP_INITIALIZE_CODE_INTEGRITY_MATCH*)PredicateContext;
+
+	// Check if this is a 2-byte (size of our patch) 'mov ecx, <anything>'
+	if (Context->Instruction.operand_count == 2 && Context->Instruction.length == 2 && Context->Instruction.mnemonic == ZYDIS_MNEMONIC_MOV &&
+		Context->Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER && Context->Operands[0].reg.value == ZYDIS_REGISTER_ECX)
+	{
+		return TRUE;
+	}
+
+	if ((Match->BuildNumber >= 9200 &&
+			((Context->Instruction.operand_count == 2 || Context->Instruction.operand_count == 4) &&
+			(Context->Operands[0].type == ZYDIS_OPERAND_TYPE_MEMORY && Context->Operands[0].mem.base == ZYDIS_REGISTER_RIP) &&
+			((Context->Instruction.mnemonic == ZYDIS_MNEMONIC_JMP && Context->Instruction.operand_count == 2) ||
+			(Context->Instruction.mnemonic == ZYDIS_MNEMONIC_CALL && Context->Instruction.operand_count == 4))))
+		||
+		(Match->BuildNumber < 9200 &&
+			(Context->Instruction.operand_count == 4 &&
+			Context->Operands[0].type == ZYDIS_OPERAND_TYPE_IMMEDIATE && Context->Operands[0].imm.is_relative == ZYAN_TRUE &&
+			Context->Instruction.mnemonic == ZYDIS_MNEMONIC_CALL)))
+	{
+		// Check if this is
+		// 'call IMM:CiInitialize thunk'				// E8 ?? ?? ?? ??			// Windows Vista/7
+		// or
+		// 'jmp qword ptr ds:[CiInitialize IAT RVA]'	// 48 FF 25 ?? ?? ?? ??		// Windows 8 through 10.0.15063.0
+		// or
+		// 'call qword ptr ds:[CiInitialize IAT RVA]'	// FF 15 ?? ?? ?? ??		// Windows 10.0.16299.0+
+		ZyanU64 OperandAddress = 0;
+		return ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context->Instruction, &Context->Operands[0], Context->InstructionAddress, &OperandAddress)) &&
+			OperandAddress == Match->CiInitialize;
+	}
+
+	return FALSE;
+}
+
+STATIC
+BOOLEAN
+EFIAPI
+StoreSepInitializeCodeIntegrityInstruction(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* CallbackContext
+	)
+{
+	SEP_INITIALIZE_CODE_INTEGRITY_MATCH* Match = (SEP_INITIALIZE_CODE_INTEGRITY_MATCH*)CallbackContext;
+	if (Context->Instruction.mnemonic == ZYDIS_MNEMONIC_MOV)
+	{
+		Match->LastMovIntoEcx = (UINT8*)Context->InstructionAddress;
+		return TRUE;
+	}
+
+	Match->MovIntoEcx = Match->LastMovIntoEcx; // The last 'mov ecx, xxx' before the call/jmp is the instruction we want
+	return FALSE;
+}
+
+// Matches 'mov eax, 0xC0000428' (STATUS_INVALID_IMAGE_HASH) in SeValidateImageData on Windows >= 8.
+// PredicateContext holds the build number
+STATIC
+BOOLEAN
+EFIAPI
+IsSeValidateImageDataMovEax(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	if ((Context->Instruction.operand_count == 2 && Context->Instruction.mnemonic == ZYDIS_MNEMONIC_MOV) &&
+		(Context->Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER && Context->Operands[0].reg.value == ZYDIS_REGISTER_EAX) &&
+		Context->Operands[1].type == ZYDIS_OPERAND_TYPE_IMMEDIATE && (Context->Operands[1].imm.value.s & 0xFFFFFFFFLL) == 0xc0000428LL)
+	{
+		// Exclude false positives: next instruction must be jmp rel32 (Win 8), jmp rel8 (Win 8.1/10) or ret
+		CONST UINT8* Address = (UINT8*)Context->InstructionAddress;
+		CONST UINT8 JmpOpcode = (UINTN)PredicateContext >= 9600 ? 0xEB : 0xE9;
+		return *(Address + Context->Instruction.length) == JmpOpcode || *(Address + Context->Instruction.length) == 0xC3;
+	}
+	return FALSE;
+}
+
+// Matches 'cmp g_CiEnabled, al' followed by jz in SeValidateImageData on Windows Vista/7.
+// PredicateContext holds the address of g_CiEnabled
+STATIC
+BOOLEAN
+EFIAPI
+IsSeValidateImageDataCmpCiEnabled(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	if ((Context->Instruction.operand_count == 3 && Context->Instruction.mnemonic == ZYDIS_MNEMONIC_CMP) &&
+		(Context->Operands[0].type == ZYDIS_OPERAND_TYPE_MEMORY && Context->Operands[0].mem.base == ZYDIS_REGISTER_RIP) &&
+		(Context->Operands[1].type == ZYDIS_OPERAND_TYPE_REGISTER && Context->Operands[1].reg.value == ZYDIS_REGISTER_AL))
+	{
+		ZyanU64 OperandAddress = 0;
+		return ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context->Instruction, &Context->Operands[0], Context->InstructionAddress, &OperandAddress)) &&
+			OperandAddress == (UINTN)PredicateContext &&
+			*((UINT8*)Context->InstructionAddress + Context->Instruction.length) == 0x74; // Verify the next instruction is jz
+	}
+	return FALSE;
+}
+
+// Stores the address of the instruction following the matched one in the UINT8* in CallbackContext
+STATIC
+BOOLEAN
+EFIAPI
+StoreNextInstructionAddress(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* CallbackContext
+	)
+{
+	*(UINT8**)CallbackContext = (UINT8*)Context->InstructionAddress + Context->Instruction.length;
+	return FALSE;
+}
+
+// Disassembles the functions in a section that have a function table entry. Any matchers that are still active afterwards
+// get a linear sweep of the whole section, since the instruction they are looking for may be in a leaf function
 STATIC
 EFI_STATUS
 EFIAPI
-DisablePatchGuard(
-	IN UINT8* ImageBase,
+DisassembleSection(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST UINT8* ImageBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN CONST EFI_IMAGE_SECTION_HEADER* Section,
+	IN OUT PINSTRUCTION_MATCHER Matchers,
+	IN UINT32 NumMatchers
+	)
+{
+	CONST FUNCTION_FILTER Filter = { Section->VirtualAddress, Section->VirtualAddress + Section->SizeOfRawData, 0, 0, 0, 0 };
+	FUNCTION_ITERATOR Iterator;
+	if (!EFI_ERROR(InitializeFunctionIterator(ImageBase, NtHeaders, &Filter, &Iterator)) &&
+		!EFI_ERROR(DisassembleFunctions(Context, &Iterator, Matchers, NumMatchers)))
+		return EFI_SUCCESS;
+
+	return DisassembleRange(Context, ImageBase + Section->VirtualAddress, Section->SizeOfRawData, Matchers, NumMatchers);
+}
+
+// Finds the first call/jmp to Target in [Start, Start + Length) with FindBranchesTo(). TypeMask is a combination of XREF_TYPE_MASK() values.
+// Returns NULL if there is no such call/jmp
+STATIC
+UINT8*
+EFIAPI
+FindFirstBranchTo(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST UINT8* ImageBase,
 	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN CONST VOID* Target,
+	IN UINT8 TypeMask,
+	IN CONST UINT8* Start,
+	IN UINTN Length
+	)
+{
+	UINT8* Site = NULL;
+	UINT32 NumSites;
+	FindBranchesTo(Context, ImageBase, NtHeaders, Start, Length, Target, TypeMask, &Site, 1, &NumSites);
+	return Site;
+}
+
+
+//
+// Addresses patched by DisablePatchGuard(). Members for functions that do not exist in the kernel being patched are NULL
+//
+typedef struct _PATCHGUARD_SITES
+{
+	UINT8* KeInitAmd64SpecificState;
+	UINT8* CcInitializeBcbProfiler;
+	UINT8* ExpLicenseWatchInitWorker;
+	UINT8* KiVerifyScopesExecute;
+	UINT8* KiMcaDeferredRecoveryServiceCallers[2];
+	UINT8* GlobalPgContext;
+	UINT8* KiSwInterrupt;
+} PATCHGUARD_SITES;
+
+//
+// Addresses patched by DisableDSE(). Members that are not needed for the kernel version and DSE bypass method are NULL
+//
+typedef struct _DSE_SITES
+{
+	UINT8* SepInitializeCodeIntegrityMovEcx;
+	UINT8* SeValidateImageDataMovEax;
+	UINT8* SeValidateImageDataJz;
+	UINT8* SeCodeIntegrityQueryInformation;
+} DSE_SITES;
+
+//
+// Finds the PatchGuard initialization routines to be defused by DisablePatchGuard().
+// All code accessed here is located in the INIT and .text sections.
+// Each locator is timed as a separate stage using Timer. The caller must call EndStage() on it after this function returns.
+//
+STATIC
+EFI_STATUS
+EFIAPI
+FindPatchGuardSites(
+	IN CONST PE_IMAGE_VIEW* Image,
 	IN PEFI_IMAGE_SECTION_HEADER InitSection,
 	IN PEFI_IMAGE_SECTION_HEADER TextSection,
-	IN UINT16 BuildNumber
+	IN UINT16 BuildNumber,
+	OUT PSTAGE_TIMER Timer,
+	OUT PATCHGUARD_SITES* Sites
 	)
 {
+	BeginStage(Timer, EFIGUARD_STAGE_FIND_KE_INIT_AMD64_SPECIFIC_STATE);
+
+	UINT8* ImageBase = Image->ImageBase;
+	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = Image->NtHeaders;
+
+	// Resolve the exports needed below in a single walk over the export name table. These must be sorted by name
+	EXPORT_LOOKUP Exports[] = {
+		{ "ExAllocatePool2", NULL },
+		{ "RtlPcToFileHeader", NULL }
+	};
+	GetProcedureAddresses((UINTN)ImageBase, NtHeaders, Exports, ARRAY_SIZE(Exports));
+
 	UINT32 StartRva = InitSection->VirtualAddress;
 	UINT32 SizeOfRawData = InitSection->SizeOfRawData;
 	UINT8* StartVa = ImageBase + StartRva;
 
-	// Search for KeInitAmd64SpecificState
-	PRINT_KERNEL_PATCH_MSG(L"\r\n== Searching for nt!KeInitAmd64SpecificState pattern in INIT ==\r\n");
-	UINT8* KeInitAmd64SpecificStatePatternAddress = NULL;
-	for (UINT8* Address = StartVa; Address < StartVa + SizeOfRawData - sizeof(SigKeInitAmd64SpecificState); ++Address)
-	{
-		if (CompareMem(Address, SigKeInitAmd64SpecificState, sizeof(SigKeInitAmd64SpecificState)) == 0)
-		{
-			KeInitAmd64SpecificStatePatternAddress = Address;
-			PRINT_KERNEL_PATCH_MSG(L"    Found KeInitAmd64SpecificState pattern at 0x%llX.\r\n", (UINTN)KeInitAmd64SpecificStatePatternAddress);
-			break;
-		}
-	}
+	// Search for KeInitAmd64SpecificState and KiVerifyScopesExecute (only exists on Windows >= 8.1). Both are in INIT, so do this in a single pass
+	PATTERN_SEARCH_ENTRY InitPatterns[] = {
+		{ &SigKeInitAmd64SpecificStatePattern, NULL },
+		{ &SigKiVerifyScopesExecutePattern, NULL }
+	};
+	PRINT_KERNEL_PATCH_MSG(L"\r\n== Searching for nt!KeInitAmd64SpecificState%S pattern%S in INIT ==\r\n",
+		(BuildNumber >= 9600 ? L" and nt!KiVerifyScopesExecute" : L""), (BuildNumber >= 9600 ? L"s" : L""));
+	FindPatterns(InitPatterns,
+				BuildNumber >= 9600 ? 2 : 1,
+				StartVa,
+				SizeOfRawData);
+
+	UINT8* KeInitAmd64SpecificStatePatternAddress = (UINT8*)InitPatterns[0].Found;
+	if (KeInitAmd64SpecificStatePatternAddress != NULL)
+		PRINT_KERNEL_PATCH_MSG(L"    Found KeInitAmd64SpecificState pattern at 0x%llX.\r\n", (UINTN)KeInitAmd64SpecificStatePatternAddress);
 
 	// Backtrack to function start
 	UINT8* KeInitAmd64SpecificState = BacktrackToFunctionStart(ImageBase, NtHeaders, KeInitAmd64SpecificStatePatternAddress);
@@ -119,18 +479,21 @@ DisablePatchGuard(
 		return EFI_NOT_FOUND;
 	}
 
-	// Search for CcInitializeBcbProfiler (Win 8+) / <HUGEFUNC> (Win Vista/7)
+	EndStage(Timer);
+	BeginStage(Timer, EFIGUARD_STAGE_FIND_CC_INITIALIZE_BCB_PROFILER);
+
+	// Search for CcInitializeBcbProfiler (Win 8+) / <HUGEFUNC> (Win Vista/7) and ExpLicenseWatchInitWorker (only exists on Windows >= 8).
 	// Most variables below use the 'CcInitializeBcbProfiler' name, which is not really accurate for Windows Vista/7 but close enough.
 	// For debug prints, call the function "<HUGEFUNC>" instead if we're on Windows Vista/7. (seriously, it's fucking huge)
 	CONST CHAR16* FuncName = BuildNumber >= 9200 ? L"CcInitializeBcbProfiler" : L"<HUGEFUNC>";
-	PRINT_KERNEL_PATCH_MSG(L"== Disassembling INIT to find nt!%S ==\r\n", FuncName);
-	UINT8* CcInitializeBcbProfilerPatternAddress = NULL;
+	PRINT_KERNEL_PATCH_MSG(L"== Disassembling INIT to find nt!%S%S ==\r\n",
+		FuncName, (BuildNumber >= 9200 ? L" and nt!ExpLicenseWatchInitWorker" : L""));
 
 	// On Windows Vista/7 we need to find the address of RtlPcToFileHeader, which will help identify HUGEFUNC as no other function calls this
 	UINTN RtlPcToFileHeader = 0;
 	if (BuildNumber < 9200)
 	{
-		RtlPcToFileHeader = (UINTN)GetProcedureAddress((UINTN)ImageBase, NtHeaders, "RtlPcToFileHeader");
+		RtlPcToFileHeader = (UINTN)Exports[1].Address;
 		if (RtlPcToFileHeader == 0)
 		{
 			PRINT_KERNEL_PATCH_MSG(L"Failed to find RtlPcToFileHeader export.\r\n");
@@ -147,57 +510,29 @@ DisablePatchGuard(
 		return EFI_LOAD_ERROR;
 	}
 
-	Context.Length = SizeOfRawData;
-	Context.Offset = 0;
+	// Windows Vista/7: look for 'call RtlPcToFileHeader'. Windows 8+: look for 'mov [al|rax], 0x0FFFFF780000002D4' for CcInitializeBcbProfiler,
+	// and for 'mov al, ds:[0x0FFFFF780000002D4]' for ExpLicenseWatchInitWorker. The latter must obviously not be the CcInitializeBcbProfiler one.
+	// The call is found with a branch lookup, so INIT only needs to be disassembled on Windows 8+
+	INSTRUCTION_MATCHER InitMatchers[2];
+	ZeroMem(InitMatchers, sizeof(InitMatchers));
+	InitMatchers[0].Prefilter = IsMovInstruction;
+	InitMatchers[0].Predicate = IsMovKdDebuggerEnabled;
+	InitMatchers[0].Active = BuildNumber >= 9200;
+	InitMatchers[1].Prefilter = IsMovInstruction;
+	InitMatchers[1].Predicate = IsExpLicenseWatchInitWorkerMovAl;
+	InitMatchers[1].PredicateContext = &InitMatchers[0];
+	InitMatchers[1].Active = BuildNumber >= 9200;
+	if (BuildNumber < 9200)
+		InitMatchers[0].Found = FindFirstBranchTo(&Context, ImageBase, NtHeaders, (VOID*)RtlPcToFileHeader, XREF_TYPE_MASK(XREF_CALL_REL32), StartVa, SizeOfRawData);
+	DisassembleSection(&Context, ImageBase, NtHeaders, InitSection, InitMatchers, ARRAY_SIZE(InitMatchers));
 
-	// Start decode loop
-	while ((Context.InstructionAddress = (ZyanU64)(StartVa + Context.Offset),
-			Status = ZydisDecoderDecodeFull(&Context.Decoder,
-											(VOID*)Context.InstructionAddress,
-											Context.Length - Context.Offset,
-											&Context.Instruction,
-											Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
+	UINT8* CcInitializeBcbProfilerPatternAddress = InitMatchers[0].Found;
+	if (CcInitializeBcbProfilerPatternAddress != NULL)
 	{
-		if (!ZYAN_SUCCESS(Status))
-		{
-			Context.Offset++;
-			continue;
-		}
-
 		if (BuildNumber < 9200)
-		{
-			// Windows Vista/7: check if this is 'call IMM'
-			if (Context.Instruction.operand_count == 4 &&
-				Context.Operands[0].type == ZYDIS_OPERAND_TYPE_IMMEDIATE && Context.Operands[0].imm.is_relative == ZYAN_TRUE &&
-				Context.Instruction.mnemonic == ZYDIS_MNEMONIC_CALL)
-			{
-				// Check if this is 'call RtlPcToFileHeader'
-				ZyanU64 OperandAddress = 0;
-				if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context.Instruction, &Context.Operands[0], Context.InstructionAddress, &OperandAddress)) &&
-					OperandAddress == RtlPcToFileHeader)
-				{
-					CcInitializeBcbProfilerPatternAddress = (UINT8*)Context.InstructionAddress;
-					PRINT_KERNEL_PATCH_MSG(L"    Found 'call RtlPcToFileHeader' at 0x%llX.\r\n", (UINTN)CcInitializeBcbProfilerPatternAddress);
-					break;
-				}
-			}
-		}
+			PRINT_KERNEL_PATCH_MSG(L"    Found 'call RtlPcToFileHeader' at 0x%llX.\r\n", (UINTN)CcInitializeBcbProfilerPatternAddress);
 		else
-		{
-			// Windows 8+: check if this is 'mov [al|rax], 0x0FFFFF780000002D4' ; SharedUserData->KdDebuggerEnabled
-			if ((Context.Instruction.operand_count == 2 && Context.Instruction.mnemonic == ZYDIS_MNEMONIC_MOV && Context.Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER) &&
-				((Context.Operands[0].reg.value == ZYDIS_REGISTER_AL && Context.Operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY &&
-					(UINT64)(Context.Operands[1].mem.disp.value) == 0x0FFFFF780000002D4ULL) ||
-				(Context.Operands[0].reg.value == ZYDIS_REGISTER_RAX && Context.Operands[1].type == ZYDIS_OPERAND_TYPE_IMMEDIATE &&
-					Context.Operands[1].imm.value.u == 0x0FFFFF780000002D4ULL)))
-			{
-				CcInitializeBcbProfilerPatternAddress = (UINT8*)Context.InstructionAddress;
-				PRINT_KERNEL_PATCH_MSG(L"    Found CcInitializeBcbProfiler pattern at 0x%llX.\r\n", (UINTN)CcInitializeBcbProfilerPatternAddress);
-				break;
-			}
-		}
-
-		Context.Offset += Context.Instruction.length;
+			PRINT_KERNEL_PATCH_MSG(L"    Found CcInitializeBcbProfiler pattern at 0x%llX.\r\n", (UINTN)CcInitializeBcbProfilerPatternAddress);
 	}
 
 	// Backtrack to function start
@@ -209,43 +544,13 @@ DisablePatchGuard(
 		return EFI_NOT_FOUND;
 	}
 
-	// Search for ExpLicenseWatchInitWorker (only exists on Windows >= 8)
+	// Check the result of the ExpLicenseWatchInitWorker search (only exists on Windows >= 8)
 	UINT8* ExpLicenseWatchInitWorker = NULL;
 	if (BuildNumber >= 9200)
 	{
-		PRINT_KERNEL_PATCH_MSG(L"== Disassembling INIT to find nt!ExpLicenseWatchInitWorker ==\r\n");
-		UINT8* ExpLicenseWatchInitWorkerPatternAddress = NULL;
-
-		// Start decode loop
-		Context.Offset = 0;
-		while ((Context.InstructionAddress = (ZyanU64)(StartVa + Context.Offset),
-				Status = ZydisDecoderDecodeFull(&Context.Decoder,
-												(VOID*)Context.InstructionAddress,
-												Context.Length - Context.Offset,
-												&Context.Instruction,
-												Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
-		{
-			if (!ZYAN_SUCCESS(Status))
-			{
-				Context.Offset++;
-				continue;
-			}
-
-			// Check if this is 'mov al, ds:[0x0FFFFF780000002D4]' ; SharedUserData->KdDebuggerEnabled
-			// The address must also obviously not be the CcInitializeBcbProfiler one we just found
-			if ((UINT8*)Context.InstructionAddress != CcInitializeBcbProfilerPatternAddress &&
-				Context.Instruction.operand_count == 2 && Context.Instruction.mnemonic == ZYDIS_MNEMONIC_MOV &&
-				Context.Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER && Context.Operands[0].reg.value == ZYDIS_REGISTER_AL &&
-				Context.Operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY && Context.Operands[1].mem.segment == ZYDIS_REGISTER_DS &&
-				Context.Operands[1].mem.disp.value == 0x0FFFFF780000002D4LL)
-			{
-				ExpLicenseWatchInitWorkerPatternAddress = (UINT8*)Context.InstructionAddress;
-				PRINT_KERNEL_PATCH_MSG(L"    Found ExpLicenseWatchInitWorker pattern at 0x%llX.\r\n", (UINTN)ExpLicenseWatchInitWorkerPatternAddress);
-				break;
-			}
-
-			Context.Offset += Context.Instruction.length;
-		}
+		UINT8* ExpLicenseWatchInitWorkerPatternAddress = InitMatchers[1].Found;
+		if (ExpLicenseWatchInitWorkerPatternAddress != NULL)
+			PRINT_KERNEL_PATCH_MSG(L"    Found ExpLicenseWatchInitWorker pattern at 0x%llX.\r\n", (UINTN)ExpLicenseWatchInitWorkerPatternAddress);
 
 		// Backtrack to function start
 		ExpLicenseWatchInitWorker = BacktrackToFunctionStart(ImageBase, NtHeaders, ExpLicenseWatchInitWorkerPatternAddress);
@@ -257,19 +562,12 @@ DisablePatchGuard(
 		}
 	}
 
-	// Search for KiVerifyScopesExecute (only exists on Windows >= 8.1)
+	// Check the result of the KiVerifyScopesExecute search (only exists on Windows >= 8.1)
 	UINT8* KiVerifyScopesExecute = NULL;
 	if (BuildNumber >= 9600)
 	{
-		PRINT_KERNEL_PATCH_MSG(L"== Searching for nt!KiVerifyScopesExecute pattern in INIT ==\r\n");
-		UINT8* KiVerifyScopesExecutePatternAddress = NULL;
-		CONST EFI_STATUS FindKiVerifyScopesExecuteStatus = FindPattern(SigKiVerifyScopesExecute,
-																	0xCC,
-																	sizeof(SigKiVerifyScopesExecute),
-																	StartVa,
-																	SizeOfRawData,
-																	(VOID**)&KiVerifyScopesExecutePatternAddress);
-		if (EFI_ERROR(FindKiVerifyScopesExecuteStatus))
+		UINT8* KiVerifyScopesExecutePatternAddress = (UINT8*)InitPatterns[1].Found;
+		if (KiVerifyScopesExecutePatternAddress == NULL)
 		{
 			PRINT_KERNEL_PATCH_MSG(L"    Failed to find KiVerifyScopesExecute pattern.\r\n");
 			return EFI_NOT_FOUND;
@@ -285,69 +583,46 @@ DisablePatchGuard(
 		}
 	}
 
-	// Search for callers of KiMcaDeferredRecoveryService (only exists on Windows >= 8.1)
-	UINT8* KiMcaDeferredRecoveryServiceCallers[2];
-	ZeroMem(KiMcaDeferredRecoveryServiceCallers, sizeof(KiMcaDeferredRecoveryServiceCallers));
+	EndStage(Timer);
+	BeginStage(Timer, EFIGUARD_STAGE_FIND_KI_MCA_DEFERRED_RECOVERY_SERVICE);
+
+	// Search for KiMcaDeferredRecoveryService (only exists on Windows >= 8.1) and KiSwInterrupt (only exists on Windows >= 10).
+	// Both are in .text, so do this in a single pass
+	PATTERN_SEARCH_ENTRY TextPatterns[] = {
+		{ &SigKiMcaDeferredRecoveryServicePattern, NULL },
+		{ &SigKiSwInterruptPattern, NULL }
+	};
 	if (BuildNumber >= 9600)
 	{
 		StartRva = TextSection->VirtualAddress;
 		SizeOfRawData = TextSection->SizeOfRawData;
 		StartVa = ImageBase + StartRva;
 
-		// Search for KiMcaDeferredRecoveryService
-		PRINT_KERNEL_PATCH_MSG(L"== Searching for nt!KiMcaDeferredRecoveryService pattern in .text ==\r\n");
-		UINT8* KiMcaDeferredRecoveryService = NULL;
-		for (UINT8* Address = StartVa; Address < StartVa + SizeOfRawData - sizeof(SigKiMcaDeferredRecoveryService); ++Address)
-		{
-			if (CompareMem(Address, SigKiMcaDeferredRecoveryService, sizeof(SigKiMcaDeferredRecoveryService)) == 0)
-			{
-				KiMcaDeferredRecoveryService = Address;
-				PRINT_KERNEL_PATCH_MSG(L"    Found KiMcaDeferredRecoveryService pattern at 0x%llX.\r\n", (UINTN)KiMcaDeferredRecoveryService);
-				break;
-			}
-		}
+		PRINT_KERNEL_PATCH_MSG(L"== Searching for nt!KiMcaDeferredRecoveryService%S pattern%S in .text ==\r\n",
+			(BuildNumber >= 10240 ? L" and nt!KiSwInterrupt" : L""), (BuildNumber >= 10240 ? L"s" : L""));
+		FindPatterns(TextPatterns,
+					BuildNumber >= 10240 ? 2 : 1,
+					StartVa,
+					SizeOfRawData);
+	}
 
+	// Search for callers of KiMcaDeferredRecoveryService (only exists on Windows >= 8.1)
+	UINT8* KiMcaDeferredRecoveryServiceCallers[2];
+	ZeroMem(KiMcaDeferredRecoveryServiceCallers, sizeof(KiMcaDeferredRecoveryServiceCallers));
+	if (BuildNumber >= 9600)
+	{
+		UINT8* KiMcaDeferredRecoveryService = (UINT8*)TextPatterns[0].Found;
 		if (KiMcaDeferredRecoveryService == NULL)
 		{
 			PRINT_KERNEL_PATCH_MSG(L"    Failed to find KiMcaDeferredRecoveryService.\r\n");
 			return EFI_NOT_FOUND;
 		}
+		PRINT_KERNEL_PATCH_MSG(L"    Found KiMcaDeferredRecoveryService pattern at 0x%llX.\r\n", (UINTN)KiMcaDeferredRecoveryService);
 
-		// Start decode loop
-		Context.Length = SizeOfRawData;
-		Context.Offset = 0;
-		while ((Context.InstructionAddress = (ZyanU64)(StartVa + Context.Offset),
-				Status = ZydisDecoderDecodeFull(&Context.Decoder,
-												(VOID*)Context.InstructionAddress,
-												Context.Length - Context.Offset,
-												&Context.Instruction,
-												Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
-		{
-			if (!ZYAN_SUCCESS(Status))
-			{
-				Context.Offset++;
-				continue;
-			}
-
-			// Check if this is 'call KiMcaDeferredRecoveryService'
-			ZyanU64 OperandAddress = 0;	
-			if (Context.Instruction.mnemonic == ZYDIS_MNEMONIC_CALL &&
-				ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context.Instruction, &Context.Operands[0], Context.InstructionAddress, &OperandAddress)) &&
-				OperandAddress == (UINTN)KiMcaDeferredRecoveryService)
-			{
-				if (KiMcaDeferredRecoveryServiceCallers[0] == NULL)
-				{
-					KiMcaDeferredRecoveryServiceCallers[0] = (UINT8*)Context.InstructionAddress;
-				}
-				else if (KiMcaDeferredRecoveryServiceCallers[1] == NULL)
-				{
-					KiMcaDeferredRecoveryServiceCallers[1] = (UINT8*)Context.InstructionAddress;
-					break;
-				}
-			}
-
-			Context.Offset += Context.Instruction.length;
-		}
+		// Find the two callers of KiMcaDeferredRecoveryService
+		UINT32 NumCallers;
+		FindBranchesTo(&Context, ImageBase, NtHeaders, StartVa, SizeOfRawData, KiMcaDeferredRecoveryService,
+			XREF_TYPE_MASK(XREF_CALL_REL32), KiMcaDeferredRecoveryServiceCallers, ARRAY_SIZE(KiMcaDeferredRecoveryServiceCallers), &NumCallers);
 
 		// Backtrack to function start
 		KiMcaDeferredRecoveryServiceCallers[0] = BacktrackToFunctionStart(ImageBase, NtHeaders, KiMcaDeferredRecoveryServiceCallers[0]);
@@ -359,27 +634,20 @@ DisablePatchGuard(
 		}
 	}
 
+	EndStage(Timer);
+	BeginStage(Timer, EFIGUARD_STAGE_FIND_GLOBAL_PG_CONTEXT);
+
 	// We need KiSwInterruptDispatch to call ExAllocatePool2 for our preferred method to work, because we rely on it to
 	// return null for zero pool tags. Windows 10 20H1 does export ExAllocatePool2, but without using it where we need it.
-	CONST BOOLEAN FindGlobalPgContext = BuildNumber >= 20348 && GetProcedureAddress((UINTN)ImageBase, NtHeaders, "ExAllocatePool2") != NULL;
+	CONST BOOLEAN FindGlobalPgContext = BuildNumber >= 20348 && Exports[0].Address != NULL;
 
 	// Search for KiSwInterrupt[Dispatch] and optionally its global PatchGuard context (named g_PgContext here). Both of these only exist on Windows >= 10
 	UINT8* KiSwInterruptPatternAddress = NULL, *gPgContext = NULL;
 	if (BuildNumber >= 10240)
 	{
-		StartRva = TextSection->VirtualAddress;
-		SizeOfRawData = TextSection->SizeOfRawData;
-		StartVa = ImageBase + StartRva;
-
-		PRINT_KERNEL_PATCH_MSG(L"== Searching for nt!KiSwInterrupt pattern in .text ==\r\n");
 		UINT8* KiSwInterruptDispatchAddress = NULL;
-		CONST EFI_STATUS FindKiSwInterruptStatus = FindPattern(SigKiSwInterrupt,
-																0xCC,
-																sizeof(SigKiSwInterrupt),
-																StartVa,
-																SizeOfRawData,
-																(VOID**)&KiSwInterruptPatternAddress);
-		if (EFI_ERROR(FindKiSwInterruptStatus))
+		KiSwInterruptPatternAddress = (UINT8*)TextPatterns[1].Found;
+		if (KiSwInterruptPatternAddress == NULL)
 		{
 			// This is not a fatal error as the system can still boot without patching g_PgContext or KiSwInterrupt.
 			// However note that in this case, any attempt to issue int 20h from kernel mode later will result in a bugcheck.
@@ -396,64 +664,80 @@ DisablePatchGuard(
 
 		if (KiSwInterruptDispatchAddress != NULL && FindGlobalPgContext)
 		{
-			// Start decode loop
-			Context.Length = 128;
-			Context.Offset = 0;
-			while ((Context.InstructionAddress = (ZyanU64)(KiSwInterruptDispatchAddress + Context.Offset),
-					Status = ZydisDecoderDecodeFull(&Context.Decoder,
-													(VOID*)Context.InstructionAddress,
-													Context.Length - Context.Offset,
-													&Context.Instruction,
-													Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
-			{
-				if (!ZYAN_SUCCESS(Status))
-				{
-					Context.Offset++;
-					continue;
-				}
-
-				// Check if this is 'mov REG, ds:g_PgContext'
-				if (Context.Instruction.operand_count == 2 &&
-					Context.Instruction.mnemonic == ZYDIS_MNEMONIC_MOV &&
-					(Context.Instruction.attributes & ZYDIS_ATTRIB_ACCEPTS_SEGMENT) != 0 &&
-					Context.Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER &&
-					Context.Operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY && Context.Operands[1].mem.base == ZYDIS_REGISTER_RIP &&
-					(Context.Operands[1].mem.segment == ZYDIS_REGISTER_CS || Context.Operands[1].mem.segment == ZYDIS_REGISTER_DS))
-				{
-					if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context.Instruction, &Context.Operands[1], Context.InstructionAddress, (ZyanU64*)&gPgContext)))
-					{
-						PRINT_KERNEL_PATCH_MSG(L"    Found g_PgContext at 0x%llX.\r\n", (UINTN)gPgContext);
-						break;
-					}
-				}
-
-				Context.Offset += Context.Instruction.length;
-			}
+			// Look for 'mov REG, ds:g_PgContext'
+			INSTRUCTION_MATCHER PgContextMatcher = {
+				IsMovInstruction, IsMovRegFromGlobal, NULL, StoreRipRelativeAddress, &gPgContext, TRUE, NULL
+			};
+			if (!EFI_ERROR(DisassembleRange(&Context, KiSwInterruptDispatchAddress, 128, &PgContextMatcher, 1)))
+				PRINT_KERNEL_PATCH_MSG(L"    Found g_PgContext at 0x%llX.\r\n", (UINTN)gPgContext);
 		}
 	}
 
+	Sites->KeInitAmd64SpecificState = KeInitAmd64SpecificState;
+	Sites->CcInitializeBcbProfiler = CcInitializeBcbProfiler;
+	Sites->ExpLicenseWatchInitWorker = ExpLicenseWatchInitWorker;
+	Sites->KiVerifyScopesExecute = KiVerifyScopesExecute;
+	Sites->KiMcaDeferredRecoveryServiceCallers[0] = KiMcaDeferredRecoveryServiceCallers[0];
+	Sites->KiMcaDeferredRecoveryServiceCallers[1] = KiMcaDeferredRecoveryServiceCallers[1];
+	Sites->GlobalPgContext = gPgContext;
+	Sites->KiSwInterrupt = KiSwInterruptPatternAddress;
+
+	return EFI_SUCCESS;
+}
+
+//
+// Defuses PatchGuard initialization routines before execution is transferred to the kernel.
+// All patches are applied as one patch plan, so either all of them or none are applied.
+//
+STATIC
+EFI_STATUS
+EFIAPI
+DisablePatchGuard(
+	IN UINT8* ImageBase,
+	IN PEFI_IMAGE_SECTION_HEADER InitSection,
+	IN CONST PATCHGUARD_SITES* Sites,
+	IN UINT16 BuildNumber
+	)
+{
+	CONST CHAR16* FuncName = BuildNumber >= 9200 ? L"CcInitializeBcbProfiler" : L"<HUGEFUNC>";
+	UINT8* KeInitAmd64SpecificState = Sites->KeInitAmd64SpecificState;
+	UINT8* CcInitializeBcbProfiler = Sites->CcInitializeBcbProfiler;
+	UINT8* ExpLicenseWatchInitWorker = Sites->ExpLicenseWatchInitWorker;
+	UINT8* KiVerifyScopesExecute = Sites->KiVerifyScopesExecute;
+	UINT8* CONST* KiMcaDeferredRecoveryServiceCallers = Sites->KiMcaDeferredRecoveryServiceCallers;
+	UINT8* gPgContext = Sites->GlobalPgContext;
+	UINT8* KiSwInterruptPatternAddress = Sites->KiSwInterrupt;
+
 	// We have all the addresses we need; now do the actual patching.
 	CONST UINT32 Yes = 0xC301B0;	// mov al, 1, ret
 	CONST UINT32 No = 0xC3C033;		// xor eax, eax, ret
-	CopyWpMem(KeInitAmd64SpecificState, &No, sizeof(No));
-	CopyWpMem(CcInitializeBcbProfiler, &Yes, sizeof(Yes));
+	InitializePatchPlan(&mKernelPatchPlan);
+	AddPatchPlanEntry(&mKernelPatchPlan, KeInitAmd64SpecificState, NULL, &No, sizeof(No));
+	AddPatchPlanEntry(&mKernelPatchPlan, CcInitializeBcbProfiler, NULL, &Yes, sizeof(Yes));
 	if (ExpLicenseWatchInitWorker != NULL)
-		CopyWpMem(ExpLicenseWatchInitWorker, &No, sizeof(No));
+		AddPatchPlanEntry(&mKernelPatchPlan, ExpLicenseWatchInitWorker, NULL, &No, sizeof(No));
 	if (KiVerifyScopesExecute != NULL)
-		CopyWpMem(KiVerifyScopesExecute, &No, sizeof(No));
+		AddPatchPlanEntry(&mKernelPatchPlan, KiVerifyScopesExecute, NULL, &No, sizeof(No));
 	if (KiMcaDeferredRecoveryServiceCallers[0] != NULL && KiMcaDeferredRecoveryServiceCallers[1] != NULL)
 	{
-		CopyWpMem(KiMcaDeferredRecoveryServiceCallers[0], &No, sizeof(No));
-		CopyWpMem(KiMcaDeferredRecoveryServiceCallers[1], &No, sizeof(No));
+		AddPatchPlanEntry(&mKernelPatchPlan, KiMcaDeferredRecoveryServiceCallers[0], NULL, &No, sizeof(No));
+		AddPatchPlanEntry(&mKernelPatchPlan, KiMcaDeferredRecoveryServiceCallers[1], NULL, &No, sizeof(No));
 	}
 	if (gPgContext != NULL)
 	{
 		CONST UINT64 NewPgContextAddress = (UINT64)ImageBase + InitSection->VirtualAddress; // Address in discardable section
-		CopyWpMem(gPgContext, &NewPgContextAddress, sizeof(NewPgContextAddress));
+		AddPatchPlanEntry(&mKernelPatchPlan, gPgContext, NULL, &NewPgContextAddress, sizeof(NewPgContextAddress));
 	}
 	else if (KiSwInterruptPatternAddress != NULL)
 	{
-		SetWpMem(KiSwInterruptPatternAddress, sizeof(SigKiSwInterrupt), 0x90); // 11 x nop
+		AddPatchPlanFill(&mKernelPatchPlan, KiSwInterruptPatternAddress, sizeof(SigKiSwInterrupt), 0x90); // 11 x nop
+	}
+
+	CONST EFI_STATUS Status = ApplyPatchPlan(&mKernelPatchPlan);
+	if (EFI_ERROR(Status))
+	{
+		PRINT_KERNEL_PATCH_MSG(L"\r\nFailed to apply PatchGuard patches. Status: %llx\r\n", Status);
+		return Status;
 	}
 
 	// Print info
@@ -492,43 +776,67 @@ DisablePatchGuard(
 }
 
 //
-// Disables DSE for the duration of the boot by preventing it from initializing.
-// This function is only called if DseBypassMethod is DSE_DISABLE_AT_BOOT, or if the Windows version is Vista or 7
-// and DseBypassMethod is DSE_DISABLE_SETVARIABLE_HOOK. In the latter case, only one byte is patched to make
-// the SetVariable backdoor safe to use more than once. DSE will still be fully initialized in this case.
+// Copies Image to DseImage, and attaches an index of the kernel imports for the IAT lookups of FindDseSites().
+// Buckets is a caller-provided buffer of KERNEL_IMPORT_INDEX_CAPACITY entries. If it is NULL, Image already has an index or the index
+// cannot be built, DseImage is a plain copy and the imports are looked up by walking the import directory instead.
+//
+STATIC
+VOID
+EFIAPI
+AttachKernelImportIndex(
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN PIMPORT_INDEX_ENTRY Buckets OPTIONAL,
+	OUT PIMPORT_INDEX ImportIndex,
+	OUT PPE_IMAGE_VIEW DseImage
+	)
+{
+	*DseImage = *Image;
+	ImportIndex->ImageBase = NULL;
+	ImportIndex->Buckets = Buckets;
+	ImportIndex->NumBuckets = KERNEL_IMPORT_INDEX_CAPACITY;
+	ImportIndex->Count = 0;
+	if (Image->ImportIndex == NULL && Buckets != NULL && !EFI_ERROR(BuildImportIndex(Image->ImageBase, Image->NtHeaders, ImportIndex)))
+		DseImage->ImportIndex = ImportIndex;
+}
+
+//
+// Finds the code to be patched by DisableDSE().
 // All code accessed here is located in the PAGE section.
+// Each locator is timed as a separate stage using Timer. The caller must call EndStage() on it after this function returns.
 //
 STATIC
 EFI_STATUS
 EFIAPI
-DisableDSE(
-	IN UINT8* ImageBase,
-	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+FindDseSites(
+	IN CONST PE_IMAGE_VIEW* Image,
 	IN PEFI_IMAGE_SECTION_HEADER PageSection,
 	IN EFIGUARD_DSE_BYPASS_TYPE BypassType,
-	IN UINT16 BuildNumber
+	IN UINT16 BuildNumber,
+	OUT PSTAGE_TIMER Timer,
+	OUT DSE_SITES* Sites
 	)
 {
+	BeginStage(Timer, EFIGUARD_STAGE_FIND_CI_INITIALIZE);
+
 	if (BypassType == DSE_DISABLE_NONE)
 		return EFI_INVALID_PARAMETER;
 
+	UINT8* ImageBase = Image->ImageBase;
+	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = Image->NtHeaders;
 	CONST UINT32 PageSizeOfRawData = PageSection->SizeOfRawData;
 	CONST UINT8* PageStartVa = ImageBase + PageSection->VirtualAddress;
 
-	// Find the ntoskrnl.exe IAT address for CI.dll!CiInitialize
+	// Find the ntoskrnl.exe IAT address for CI.dll!CiInitialize. This uses the import index of the image view if the caller built one
 	VOID* CiInitialize;
-	CONST EFI_STATUS IatStatus = FindIATAddressForImport(ImageBase,
-														NtHeaders,
-														"CI.dll",
-														"CiInitialize",
-														&CiInitialize);
+	CONST EFI_STATUS IatStatus = PeImageFindIATAddress(Image, "CI.dll", "CiInitialize", &CiInitialize);
 	if (EFI_ERROR(IatStatus))
 	{
 		PRINT_KERNEL_PATCH_MSG(L"Failed to find IAT address of CI.dll!CiInitialize.\r\n");
 		return IatStatus;
 	}
 
-	PRINT_KERNEL_PATCH_MSG(L"\r\n== Disassembling PAGE to find nt!SepInitializeCodeIntegrity 'mov ecx, xxx' ==\r\n");
+	PRINT_KERNEL_PATCH_MSG(L"\r\n== Disassembling PAGE to find nt!SepInitializeCodeIntegrity 'mov ecx, xxx'%S ==\r\n",
+		(BuildNumber >= 9200 ? L" and nt!SeValidateImageData 'mov eax, 0xC0000428'" : L""));
 
 	// Initialize Zydis
 	ZYDIS_CONTEXT Context;
@@ -539,48 +847,13 @@ DisableDSE(
 		return EFI_LOAD_ERROR;
 	}
 
-	UINT8* SepInitializeCodeIntegrityMovEcxAddress = NULL;
-
 	if (BuildNumber < 9200)
 	{
 		// On Windows Vista/7 we have an enormously annoying import thunk in .text to find. All it does is 'jmp __imp_CiInitialize'.
 		// SepInitializeCodeIntegrity will then call this thunk. What a waste
-		CONST PEFI_IMAGE_SECTION_HEADER TextSection = IMAGE_FIRST_SECTION(NtHeaders);
-		VOID* JmpCiInitializeAddress = NULL;
-		Context.Length = TextSection->SizeOfRawData;
-		Context.Offset = 0;
-
-		// Start decode loop
-		while ((Context.InstructionAddress = (ZyanU64)(ImageBase + TextSection->VirtualAddress + Context.Offset),
-				Status = ZydisDecoderDecodeFull(&Context.Decoder,
-												(VOID*)Context.InstructionAddress,
-												Context.Length - Context.Offset,
-												&Context.Instruction,
-												Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
-		{
-			if (!ZYAN_SUCCESS(Status))
-			{
-				Context.Offset++;
-				continue;
-			}
-
-			if ((Context.Instruction.operand_count == 2 &&
-				Context.Operands[0].type == ZYDIS_OPERAND_TYPE_MEMORY && Context.Operands[0].mem.base == ZYDIS_REGISTER_RIP) &&
-				Context.Instruction.mnemonic == ZYDIS_MNEMONIC_JMP)
-			{
-				// Check if this is 'jmp qword ptr ds:[CiInitialize IAT RVA]'
-				ZyanU64 OperandAddress = 0;
-				if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context.Instruction, &Context.Operands[0], Context.InstructionAddress, &OperandAddress)) &&
-					OperandAddress == (UINTN)CiInitialize)
-				{
-					JmpCiInitializeAddress = (VOID*)Context.InstructionAddress;
-					break;
-				}
-			}
-
-			Context.Offset += Context.Instruction.length;
-		}
-
+		CONST PEFI_IMAGE_SECTION_HEADER TextSection = &Image->Sections[0];
+		UINT8* JmpCiInitializeAddress = FindFirstBranchTo(&Context, ImageBase, NtHeaders, CiInitialize, XREF_TYPE_MASK(XREF_JMP_INDIRECT),
+			ImageBase + TextSection->VirtualAddress, TextSection->SizeOfRawData);
 		if (JmpCiInitializeAddress == NULL)
 		{
 			PRINT_KERNEL_PATCH_MSG(L"    Failed to find 'jmp __imp_CiInitialize' import thunk.\r\n");
@@ -591,170 +864,90 @@ DisableDSE(
 		CiInitialize = JmpCiInitializeAddress;
 	}
 
-	UINT8* LastMovIntoEcx = NULL; // Keep track of 'mov ecx, xxx' - the last one before call/jmp cs:__imp_CiInitialize is the one we want to patch
-	Context.Length = PageSizeOfRawData;
-	Context.Offset = 0;
+	EndStage(Timer);
+	BeginStage(Timer, EFIGUARD_STAGE_FIND_SEP_INITIALIZE_CODE_INTEGRITY);
 
-	// Start decode loop
-	while ((Context.InstructionAddress = (ZyanU64)(PageStartVa + Context.Offset),
-			Status = ZydisDecoderDecodeFull(&Context.Decoder,
-											(VOID*)Context.InstructionAddress,
-											Context.Length - Context.Offset,
-											&Context.Instruction,
-											Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
-	{
-		if (!ZYAN_SUCCESS(Status))
-		{
-			Context.Offset++;
-			continue;
-		}
+	// On Windows >= 8, SeValidateImageData is found in the same pass over PAGE as SepInitializeCodeIntegrity.
+	// On Windows Vista/7 this requires the address of g_CiEnabled, which is found via SepInitializeCodeIntegrity, so a second pass is needed
+	SEP_INITIALIZE_CODE_INTEGRITY_MATCH SepInitializeCodeIntegrityMatch = { (UINTN)CiInitialize, BuildNumber, NULL, NULL };
+	INSTRUCTION_MATCHER PageMatchers[2] = {
+		{ IsMovCallOrJmpInstruction, IsSepInitializeCodeIntegrityInstruction, &SepInitializeCodeIntegrityMatch,
+			StoreSepInitializeCodeIntegrityInstruction, &SepInitializeCodeIntegrityMatch, TRUE, NULL },
+		{ IsMovInstruction, IsSeValidateImageDataMovEax, (VOID*)(UINTN)BuildNumber, NULL, NULL, BuildNumber >= 9200, NULL }
+	};
 
-		// Check if this is a 2-byte (size of our patch) 'mov ecx, <anything>' and store the instruction address if so
-		if (Context.Instruction.operand_count == 2 && Context.Instruction.length == 2 && Context.Instruction.mnemonic == ZYDIS_MNEMONIC_MOV &&
-			Context.Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER && Context.Operands[0].reg.value == ZYDIS_REGISTER_ECX)
-		{
-			LastMovIntoEcx = (UINT8*)Context.InstructionAddress;
-		}
-		else if ((BuildNumber >= 9200 &&
-				((Context.Instruction.operand_count == 2 || Context.Instruction.operand_count == 4) &&
-				(Context.Operands[0].type == ZYDIS_OPERAND_TYPE_MEMORY && Context.Operands[0].mem.base == ZYDIS_REGISTER_RIP) &&
-				((Context.Instruction.mnemonic == ZYDIS_MNEMONIC_JMP && Context.Instruction.operand_count == 2) ||
-				(Context.Instruction.mnemonic == ZYDIS_MNEMONIC_CALL && Context.Instruction.operand_count == 4))))
-			||
-			(BuildNumber < 9200 &&
-				(Context.Instruction.operand_count == 4 &&
-				Context.Operands[0].type == ZYDIS_OPERAND_TYPE_IMMEDIATE && Context.Operands[0].imm.is_relative == ZYAN_TRUE &&
-				Context.Instruction.mnemonic == ZYDIS_MNEMONIC_CALL)))
-		{
-			// Check if this is
-			// 'call IMM:CiInitialize thunk'				// E8 ?? ?? ?? ??			// Windows Vista/7
-			// or
-			// 'jmp qword ptr ds:[CiInitialize IAT RVA]'	// 48 FF 25 ?? ?? ?? ??		// Windows 8 through 10.0.15063.0
-			// or
-			// 'call qword ptr ds:[CiInitialize IAT RVA]'	// FF 15 ?? ?? ?? ??		// Windows 10.0.16299.0+
-			ZyanU64 OperandAddress = 0;
-			if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context.Instruction, &Context.Operands[0], Context.InstructionAddress, &OperandAddress)) &&
-				OperandAddress == (UINTN)CiInitialize)
-			{
-				SepInitializeCodeIntegrityMovEcxAddress = LastMovIntoEcx; // The last 'mov ecx, xxx' before the call/jmp is the instruction we want
-				PRINT_KERNEL_PATCH_MSG(L"    Found 'mov ecx, xxx' in SepInitializeCodeIntegrity [RVA: 0x%X].\r\n",
-					(UINT32)(SepInitializeCodeIntegrityMovEcxAddress - ImageBase));
-				break;
-			}
-		}
+	// Look up the call/jmp to CiInitialize first, so that only SepInitializeCodeIntegrity itself needs to be disassembled
+	UINT8* CallCiInitializeAddress;
+	if (BuildNumber < 9200)
+		CallCiInitializeAddress = FindFirstBranchTo(&Context, ImageBase, NtHeaders, CiInitialize, XREF_TYPE_MASK(XREF_CALL_REL32), PageStartVa, PageSizeOfRawData);
+	else
+	{
+		// Windows 8 through 10.0.15063.0 use a jmp, later versions a call. Take whichever comes first
+		CallCiInitializeAddress = FindFirstBranchTo(&Context, ImageBase, NtHeaders, CiInitialize,
+			XREF_TYPE_MASK(XREF_JMP_INDIRECT) | XREF_TYPE_MASK(XREF_CALL_INDIRECT), PageStartVa, PageSizeOfRawData);
+	}
 
-		Context.Offset += Context.Instruction.length;
+	// The call may be in a chained function fragment, whose primary entry is not guaranteed to precede it. In that case the range below
+	// would underflow, so skip straight to the pass over PAGE
+	CONST UINT8* SepInitializeCodeIntegrity = BacktrackToFunctionStart(ImageBase, NtHeaders, CallCiInitializeAddress);
+	if (SepInitializeCodeIntegrity != NULL && SepInitializeCodeIntegrity <= CallCiInitializeAddress)
+	{
+		// If this fails, the matcher remains active and SepInitializeCodeIntegrity is searched for in the pass over PAGE below
+		DisassembleRange(&Context,
+						SepInitializeCodeIntegrity,
+						(UINTN)(CallCiInitializeAddress - SepInitializeCodeIntegrity) + ZYDIS_MAX_INSTRUCTION_LENGTH,
+						&PageMatchers[0],
+						1);
+		SepInitializeCodeIntegrityMatch.LastMovIntoEcx = NULL;
 	}
+	DisassembleSection(&Context, ImageBase, NtHeaders, PageSection, PageMatchers, ARRAY_SIZE(PageMatchers));
 
+	UINT8* SepInitializeCodeIntegrityMovEcxAddress = SepInitializeCodeIntegrityMatch.MovIntoEcx;
 	if (SepInitializeCodeIntegrityMovEcxAddress == NULL)
 	{
 		PRINT_KERNEL_PATCH_MSG(L"    Failed to find SepInitializeCodeIntegrity 'mov ecx, xxx' pattern.\r\n");
 		return EFI_NOT_FOUND;
 	}
+	PRINT_KERNEL_PATCH_MSG(L"    Found 'mov ecx, xxx' in SepInitializeCodeIntegrity [RVA: 0x%X].\r\n",
+		(UINT32)(SepInitializeCodeIntegrityMovEcxAddress - ImageBase));
 
-	ZyanU64 gCiEnabled = 0;
+	EndStage(Timer);
+	BeginStage(Timer, EFIGUARD_STAGE_FIND_SE_VALIDATE_IMAGE_DATA);
+
+	UINT8 *SeValidateImageDataMovEaxAddress = PageMatchers[1].Found, *SeValidateImageDataJzAddress = NULL;
 	if (BuildNumber < 9200)
 	{
-		// On Windows Vista/7, find g_CiEnabled now because it's a few bytes away and we'll it need later
-		Context.Length = 32;
-		Context.Offset = 0;
-
-		while ((Context.InstructionAddress = (ZyanU64)(SepInitializeCodeIntegrityMovEcxAddress + Context.Offset),
-				Status = ZydisDecoderDecodeFull(&Context.Decoder,
-												(VOID*)Context.InstructionAddress,
-												Context.Length - Context.Offset,
-												&Context.Instruction,
-												Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
-		{
-			if (!ZYAN_SUCCESS(Status))
-			{
-				Context.Offset++;
-				continue;
-			}
-
-			// Check if this is 'mov g_CiEnabled, REG8'
-			if (Context.Instruction.operand_count == 2 &&
-				Context.Instruction.mnemonic == ZYDIS_MNEMONIC_MOV &&
-				Context.Operands[0].type == ZYDIS_OPERAND_TYPE_MEMORY && Context.Operands[0].mem.base == ZYDIS_REGISTER_RIP &&
-				Context.Operands[1].type == ZYDIS_OPERAND_TYPE_REGISTER)
-			{
-				if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context.Instruction, &Context.Operands[0], Context.InstructionAddress, &gCiEnabled)))
-				{
-					PRINT_KERNEL_PATCH_MSG(L"    Found g_CiEnabled at 0x%llX.\r\n", gCiEnabled);
-					break;
-				}
-			}
-
-			Context.Offset += Context.Instruction.length;
-		}
+		// On Windows Vista/7, find g_CiEnabled now because it's a few bytes away. Look for 'mov g_CiEnabled, REG8'
+		ZyanU64 gCiEnabled = 0;
+		INSTRUCTION_MATCHER CiEnabledMatcher = {
+			IsMovInstruction, IsMovGlobalFromReg, NULL, StoreRipRelativeAddress, &gCiEnabled, TRUE, NULL
+		};
+		DisassembleRange(&Context, SepInitializeCodeIntegrityMovEcxAddress, 32, &CiEnabledMatcher, 1);
 
 		if (gCiEnabled == 0)
 		{
 			PRINT_KERNEL_PATCH_MSG(L"    Failed to find g_CiEnabled.\r\n");
 			return EFI_NOT_FOUND;
 		}
-	}
+		PRINT_KERNEL_PATCH_MSG(L"    Found g_CiEnabled at 0x%llX.\r\n", gCiEnabled);
 
-	PRINT_KERNEL_PATCH_MSG(L"== Disassembling PAGE to find nt!SeValidateImageData '%S' ==\r\n",
-		(BuildNumber >= 9200 ? L"mov eax, 0xC0000428" : L"cmp g_CiEnabled, al"));
-	UINT8 *SeValidateImageDataMovEaxAddress = NULL, *SeValidateImageDataJzAddress = NULL;
+		PRINT_KERNEL_PATCH_MSG(L"== Disassembling PAGE to find nt!SeValidateImageData 'cmp g_CiEnabled, al' ==\r\n");
 
-	// Start decode loop
-	Context.Length = PageSizeOfRawData;
-	Context.Offset = 0;
-	while ((Context.InstructionAddress = (ZyanU64)(PageStartVa + Context.Offset),
-			Status = ZydisDecoderDecodeFull(&Context.Decoder,
-											(VOID*)Context.InstructionAddress,
-											Context.Length - Context.Offset,
-											&Context.Instruction,
-											Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
-	{
-		if (!ZYAN_SUCCESS(Status))
-		{
-			Context.Offset++;
-			continue;
-		}
+		// Store the address of the jz following the cmp instead of the cmp itself, as we will be patching the jz
+		INSTRUCTION_MATCHER CmpCiEnabledMatcher = {
+			IsCmpInstruction, IsSeValidateImageDataCmpCiEnabled, (VOID*)(UINTN)gCiEnabled, StoreNextInstructionAddress, &SeValidateImageDataJzAddress, TRUE, NULL
+		};
 
-		// On Windows >= 8, check if this is 'mov eax, 0xC0000428' (STATUS_INVALID_IMAGE_HASH) in SeValidateImageData
-		if ((BuildNumber >= 9200 &&
-			(Context.Instruction.operand_count == 2 && Context.Instruction.mnemonic == ZYDIS_MNEMONIC_MOV) &&
-			(Context.Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER && Context.Operands[0].reg.value == ZYDIS_REGISTER_EAX) &&
-			Context.Operands[1].type == ZYDIS_OPERAND_TYPE_IMMEDIATE && (Context.Operands[1].imm.value.s & 0xFFFFFFFFLL) == 0xc0000428LL))
-		{
-			// Exclude false positives: next instruction must be jmp rel32 (Win 8), jmp rel8 (Win 8.1/10) or ret
-			CONST UINT8* Address = (UINT8*)Context.InstructionAddress;
-			CONST UINT8 JmpOpcode = BuildNumber >= 9600 ? 0xEB : 0xE9;
-			if (*(Address + Context.Instruction.length) == JmpOpcode || *(Address + Context.Instruction.length) == 0xC3)
-			{
-				SeValidateImageDataMovEaxAddress = (UINT8*)Address;
-				PRINT_KERNEL_PATCH_MSG(L"    Found 'mov eax, 0xC0000428' in SeValidateImageData [RVA: 0x%X].\r\n",
-					(UINT32)(SeValidateImageDataMovEaxAddress - ImageBase));
-				break;
-			}
-		}
-		// On Windows Vista/7, check if this is 'cmp g_CiEnabled, al' in SeValidateImageData
-		else if (BuildNumber < 9200 &&
-			(Context.Instruction.operand_count == 3 && Context.Instruction.mnemonic == ZYDIS_MNEMONIC_CMP) &&
-			(Context.Operands[0].type == ZYDIS_OPERAND_TYPE_MEMORY && Context.Operands[0].mem.base == ZYDIS_REGISTER_RIP) &&
-			(Context.Operands[1].type == ZYDIS_OPERAND_TYPE_REGISTER && Context.Operands[1].reg.value == ZYDIS_REGISTER_AL))
-		{
-			ZyanU64 OperandAddress = 0;
-			if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context.Instruction, &Context.Operands[0], Context.InstructionAddress, &OperandAddress)) &&
-				OperandAddress == gCiEnabled)
-			{
-				// Verify the next instruction is jz, and store its address instead of the cmp, as we will be patching the jz
-				CONST UINT8* Address = (UINT8*)Context.InstructionAddress;
-				if (*(Address + Context.Instruction.length) == 0x74)
-				{
-					SeValidateImageDataJzAddress = (UINT8*)(Address + Context.Instruction.length);
-					PRINT_KERNEL_PATCH_MSG(L"    Found 'cmp g_CiEnabled, al' in SeValidateImageData [RVA: 0x%X].\r\n",
-						(UINT32)(Address - ImageBase));
-					break;
-				}
-			}
-		}
+		DisassembleSection(&Context, ImageBase, NtHeaders, PageSection, &CmpCiEnabledMatcher, 1);
 
-		Context.Offset += Context.Instruction.length;
+		if (SeValidateImageDataJzAddress != NULL)
+			PRINT_KERNEL_PATCH_MSG(L"    Found 'cmp g_CiEnabled, al' in SeValidateImageData [RVA: 0x%X].\r\n",
+				(UINT32)(CmpCiEnabledMatcher.Found - ImageBase));
+	}
+	else if (SeValidateImageDataMovEaxAddress != NULL)
+	{
+		PRINT_KERNEL_PATCH_MSG(L"    Found 'mov eax, 0xC0000428' in SeValidateImageData [RVA: 0x%X].\r\n",
+			(UINT32)(SeValidateImageDataMovEaxAddress - ImageBase));
 	}
 
 	if (SeValidateImageDataMovEaxAddress == NULL && SeValidateImageDataJzAddress == NULL)
@@ -764,43 +957,93 @@ DisableDSE(
 		return EFI_NOT_FOUND;
 	}
 
+	EndStage(Timer);
+	BeginStage(Timer, EFIGUARD_STAGE_FIND_SE_CODE_INTEGRITY_QUERY_INFORMATION);
+
+	// On RS3 or higher, also look for SeCodeIntegrityQueryInformation. This is not required as DSE will be disabled regardless
+	UINT8* SeCodeIntegrityQueryInformation = NULL;
+	if (BuildNumber >= 16299 && BypassType == DSE_DISABLE_AT_BOOT)
+	{
+		FindPattern(&SigSeCodeIntegrityQueryInformationPattern,
+					(VOID*)PageStartVa, // SeCodeIntegrityQueryInformation is in PAGE, so start there
+					PageSizeOfRawData,
+					(VOID**)&SeCodeIntegrityQueryInformation);
+	}
+
+	Sites->SepInitializeCodeIntegrityMovEcx = SepInitializeCodeIntegrityMovEcxAddress;
+	Sites->SeValidateImageDataMovEax = SeValidateImageDataMovEaxAddress;
+	Sites->SeValidateImageDataJz = SeValidateImageDataJzAddress;
+	Sites->SeCodeIntegrityQueryInformation = SeCodeIntegrityQueryInformation;
+
+	return EFI_SUCCESS;
+}
+
+//
+// Disables DSE for the duration of the boot by preventing it from initializing.
+// This function is only called if DseBypassMethod is DSE_DISABLE_AT_BOOT, or if the Windows version is Vista or 7
+// and DseBypassMethod is DSE_DISABLE_SETVARIABLE_HOOK. In the latter case, only one byte is patched to make
+// the SetVariable backdoor safe to use more than once. DSE will still be fully initialized in this case.
+//
+STATIC
+EFI_STATUS
+EFIAPI
+DisableDSE(
+	IN UINT8* ImageBase,
+	IN CONST DSE_SITES* Sites,
+	IN EFIGUARD_DSE_BYPASS_TYPE BypassType,
+	IN UINT16 BuildNumber
+	)
+{
 	// We have all the addresses we need; now do the actual patching.
 	// SepInitializeCodeIntegrity is only patched when using the 'nuke option' DSE_DISABLE_AT_BOOT.
+	InitializePatchPlan(&mKernelPatchPlan);
 	if (BypassType == DSE_DISABLE_AT_BOOT)
 	{
 		CONST UINT16 ZeroEcx = 0xC931;
-		CopyWpMem(SepInitializeCodeIntegrityMovEcxAddress, &ZeroEcx, sizeof(ZeroEcx));					// xor ecx, ecx
+		AddPatchPlanEntry(&mKernelPatchPlan, Sites->SepInitializeCodeIntegrityMovEcx, NULL, &ZeroEcx, sizeof(ZeroEcx));	// xor ecx, ecx
 	}
 
 	// SeValidateImageData *must* be patched on Windows Vista and 7 regardless of the DSE bypass method.
 	// On Windows >= 8, again require DSE_DISABLE_AT_BOOT to do anything as it is otherwise harmless.
 	if (BuildNumber < 9200)
-		SetWpMem(SeValidateImageDataJzAddress, sizeof(UINT8), 0xEB);									// jmp
+	{
+		CONST UINT8 Jz = 0x74, Jmp = 0xEB;
+		AddPatchPlanEntry(&mKernelPatchPlan, Sites->SeValidateImageDataJz, &Jz, &Jmp, sizeof(Jmp));						// jmp
+	}
 	else if (BypassType == DSE_DISABLE_AT_BOOT)
 	{
-		CONST UINT32 Zero = 0;
-		CopyWpMem(SeValidateImageDataMovEaxAddress + 1 /*skip existing mov*/, &Zero, sizeof(Zero));		// mov eax, 0
+		CONST UINT32 InvalidImageHash = 0xC0000428, Zero = 0;
+		AddPatchPlanEntry(&mKernelPatchPlan, Sites->SeValidateImageDataMovEax + 1 /*skip existing mov*/,
+			&InvalidImageHash, &Zero, sizeof(Zero));																		// mov eax, 0
+	}
+
+	// If we are on RS3 or higher and found SeCodeIntegrityQueryInformation, patch it too.
+	// This is optional, as DSE will be disabled regardless.
+	CONST BOOLEAN PatchSeCodeIntegrityQueryInformation = BuildNumber >= 16299 && BypassType == DSE_DISABLE_AT_BOOT &&
+		Sites->SeCodeIntegrityQueryInformation != NULL;
+	if (PatchSeCodeIntegrityQueryInformation)
+	{
+		AddPatchPlanEntry(&mKernelPatchPlan, Sites->SeCodeIntegrityQueryInformation, NULL,
+			SeCodeIntegrityQueryInformationPatch, sizeof(SeCodeIntegrityQueryInformationPatch));
+	}
+
+	CONST EFI_STATUS Status = ApplyPatchPlan(&mKernelPatchPlan);
+	if (EFI_ERROR(Status))
+	{
+		PRINT_KERNEL_PATCH_MSG(L"\r\nFailed to apply DSE patches. Status: %llx\r\n", Status);
+		return Status;
 	}
 
 	if (BuildNumber >= 16299 && BypassType == DSE_DISABLE_AT_BOOT)
 	{
-		// We are on RS3 or higher. If we can find and patch SeCodeIntegrityQueryInformation, great.
-		// But DSE has been disabled at this point, so success will be returned regardless.
-		UINT8* Found = NULL;
-		CONST EFI_STATUS CiStatus = FindPattern(SigSeCodeIntegrityQueryInformation,
-												0xCC,
-												sizeof(SigSeCodeIntegrityQueryInformation),
-												(VOID*)PageStartVa, // SeCodeIntegrityQueryInformation is in PAGE, so start there
-												PageSizeOfRawData,
-												(VOID**)&Found);
-		if (EFI_ERROR(CiStatus))
+		if (PatchSeCodeIntegrityQueryInformation)
 		{
-			PRINT_KERNEL_PATCH_MSG(L"\r\nFailed to find SeCodeIntegrityQueryInformation. Skipping patch.\r\n");
+			PRINT_KERNEL_PATCH_MSG(L"\r\nPatched SeCodeIntegrityQueryInformation [RVA: 0x%X].\r\n",
+				(UINT32)(Sites->SeCodeIntegrityQueryInformation - ImageBase));
 		}
 		else
 		{
-			CopyMem(Found, SeCodeIntegrityQueryInformationPatch, sizeof(SeCodeIntegrityQueryInformationPatch));
-			PRINT_KERNEL_PATCH_MSG(L"\r\nPatched SeCodeIntegrityQueryInformation [RVA: 0x%X].\r\n", (UINT32)(Found - ImageBase));
+			PRINT_KERNEL_PATCH_MSG(L"\r\nFailed to find SeCodeIntegrityQueryInformation. Skipping patch.\r\n");
 		}
 	}
 
@@ -813,11 +1056,16 @@ DisableDSE(
 EFI_STATUS
 EFIAPI
 PatchNtoskrnl(
-	IN VOID* ImageBase,
-	IN PEFI_IMAGE_NT_HEADERS NtHeaders
+	IN CONST PE_IMAGE_VIEW* Image
 	)
 {
-	PRINT_KERNEL_PATCH_MSG(L"[PatchNtoskrnl] ntoskrnl.exe at 0x%llX, size 0x%llX\r\n", (UINTN)ImageBase, (UINTN)NtHeaders->OptionalHeader.SizeOfImage);
+	UINT8* ImageBase = Image->ImageBase;
+	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = Image->NtHeaders;
+
+	PRINT_KERNEL_PATCH_MSG(L"[PatchNtoskrnl] ntoskrnl.exe at 0x%llX, size 0x%llX\r\n", (UINTN)ImageBase, (UINTN)Image->SizeOfImage);
+
+	// Discard anything that was allocated for a previous image
+	ResetArena(&gKernelArena);
 
 	// Print file and version info
 	UINT16 MajorVersion = 0, MinorVersion = 0, BuildNumber = 0, Revision = 0;
@@ -850,52 +1098,108 @@ PatchNtoskrnl(
 		}
 	}
 
-	// Find the INIT and PAGE sections
-	PEFI_IMAGE_SECTION_HEADER InitSection = NULL, TextSection = NULL, PageSection = NULL;
-	PEFI_IMAGE_SECTION_HEADER Section = IMAGE_FIRST_SECTION(NtHeaders);
-	for (UINT16 i = 0; i < NtHeaders->FileHeader.NumberOfSections; ++i)
+	// Find the INIT, .text and PAGE sections
+	CONST PEFI_IMAGE_SECTION_HEADER InitSection = PeImageFindSection(Image, "INIT");
+	CONST PEFI_IMAGE_SECTION_HEADER TextSection = PeImageFindSection(Image, ".text");
+	CONST PEFI_IMAGE_SECTION_HEADER PageSection = PeImageFindSection(Image, "PAGE");
+	if (InitSection == NULL || TextSection == NULL || PageSection == NULL)
 	{
-		CHAR8 SectionName[EFI_IMAGE_SIZEOF_SHORT_NAME + 1];
-		CopyMem(SectionName, Section->Name, EFI_IMAGE_SIZEOF_SHORT_NAME);
-		SectionName[EFI_IMAGE_SIZEOF_SHORT_NAME] = '\0';
-
-		if (AsciiStrCmp(SectionName, "INIT") == 0)
-			InitSection = Section;
-		else if (AsciiStrCmp(SectionName, ".text") == 0)
-			TextSection = Section;
-		else if (AsciiStrCmp(SectionName, "PAGE") == 0)
-			PageSection = Section;
-
-		Section++;
+		PRINT_KERNEL_PATCH_MSG(L"[PatchNtoskrnl] ERROR: failed to find the INIT, .text and PAGE sections.\r\n");
+		return EFI_NOT_FOUND;
 	}
 
-	ASSERT(InitSection != NULL && TextSection != NULL && PageSection != NULL);
+	// Look up the patch sites in the patch cache first
+	CONST BOOLEAN PatchDse = gDriverConfig.DseBypassMethod == DSE_DISABLE_AT_BOOT ||
+		(BuildNumber < 9200 && gDriverConfig.DseBypassMethod != DSE_DISABLE_NONE);
+	PATCHGUARD_SITES PgSites;
+	DSE_SITES DseSites;
+	ZeroMem(&PgSites, sizeof(PgSites));
+	ZeroMem(&DseSites, sizeof(DseSites));
+	CONST PATCH_CACHE_BINDING PgCacheBindings[] = {
+		{ PatchSiteKeInitAmd64SpecificState, &PgSites.KeInitAmd64SpecificState },
+		{ PatchSiteCcInitializeBcbProfiler, &PgSites.CcInitializeBcbProfiler },
+		{ PatchSiteExpLicenseWatchInitWorker, &PgSites.ExpLicenseWatchInitWorker },
+		{ PatchSiteKiVerifyScopesExecute, &PgSites.KiVerifyScopesExecute },
+		{ PatchSiteKiMcaDeferredRecoveryServiceCaller0, &PgSites.KiMcaDeferredRecoveryServiceCallers[0] },
+		{ PatchSiteKiMcaDeferredRecoveryServiceCaller1, &PgSites.KiMcaDeferredRecoveryServiceCallers[1] },
+		{ PatchSiteGlobalPgContext, &PgSites.GlobalPgContext },
+		{ PatchSiteKiSwInterrupt, &PgSites.KiSwInterrupt }
+	};
+	CONST PATCH_CACHE_BINDING DseCacheBindings[] = {
+		{ PatchSiteSepInitializeCodeIntegrity, &DseSites.SepInitializeCodeIntegrityMovEcx },
+		{ PatchSiteSeValidateImageDataMovEax, &DseSites.SeValidateImageDataMovEax },
+		{ PatchSiteSeValidateImageDataJz, &DseSites.SeValidateImageDataJz },
+		{ PatchSiteSeCodeIntegrityQueryInformation, &DseSites.SeCodeIntegrityQueryInformation }	// Only searched for by FindDseSites() on RS3+ with DSE_DISABLE_AT_BOOT
+	};
+	CONST UINT32 NumDseCacheBindings = BuildNumber >= 16299 && gDriverConfig.DseBypassMethod == DSE_DISABLE_AT_BOOT
+		? ARRAY_SIZE(DseCacheBindings)
+		: ARRAY_SIZE(DseCacheBindings) - 1;
+	CONST BOOLEAN CacheOpened = PatchCacheOpenImage(Ntoskrnl, ImageBase, NtHeaders);
+	CONST BOOLEAN HavePgSites = CacheOpened && PatchCacheLookupSites(Ntoskrnl, PgCacheBindings, ARRAY_SIZE(PgCacheBindings));
+	CONST BOOLEAN HaveDseSites = !PatchDse || (CacheOpened && PatchCacheLookupSites(Ntoskrnl, DseCacheBindings, NumDseCacheBindings));
+
+	STAGE_TIMER Timer;
 
 	// Patch INIT and .text sections to disable PatchGuard
 	PRINT_KERNEL_PATCH_MSG(L"[PatchNtoskrnl] Disabling PatchGuard... [INIT RVA: 0x%X - 0x%X]\r\n",
 		InitSection->VirtualAddress, InitSection->VirtualAddress + InitSection->SizeOfRawData);
-	Status = DisablePatchGuard(ImageBase,
-								NtHeaders,
-								InitSection,
-								TextSection,
-								BuildNumber);
+	if (HavePgSites)
+		PRINT_KERNEL_PATCH_MSG(L"    Using cached PatchGuard patch locations.\r\n");
+	else
+	{
+		Status = FindPatchGuardSites(Image,
+									InitSection,
+									TextSection,
+									BuildNumber,
+									&Timer,
+									&PgSites);
+		EndStage(&Timer);
+		if (EFI_ERROR(Status))
+			return Status;
+
+		PatchCacheRecordSites(Ntoskrnl, PgCacheBindings, ARRAY_SIZE(PgCacheBindings));
+	}
+	BeginStage(&Timer, EFIGUARD_STAGE_DISABLE_PATCHGUARD);
+	Status = DisablePatchGuard(ImageBase, InitSection, &PgSites, BuildNumber);
+	EndStage(&Timer);
 	if (EFI_ERROR(Status))
 		return Status;
 
 	PRINT_KERNEL_PATCH_MSG(L"\r\n[PatchNtoskrnl] Successfully disabled PatchGuard.\r\n");
 
-	if (gDriverConfig.DseBypassMethod == DSE_DISABLE_AT_BOOT ||
-		(BuildNumber < 9200 && gDriverConfig.DseBypassMethod != DSE_DISABLE_NONE))
+	if (PatchDse)
 	{
 		// Patch PAGE section to disable DSE at boot, or (on Windows Vista/7) to allow the SetVariable hook to be safely used more than once
 		PRINT_KERNEL_PATCH_MSG(L"[PatchNtoskrnl] %S... [PAGE RVA: 0x%X - 0x%X]\r\n",
 			gDriverConfig.DseBypassMethod == DSE_DISABLE_AT_BOOT ? L"Disabling DSE" : L"Ensuring safe DSE bypass",
 			PageSection->VirtualAddress, PageSection->VirtualAddress + PageSection->SizeOfRawData);
-		Status = DisableDSE(ImageBase,
-							NtHeaders,
-							PageSection,
-							gDriverConfig.DseBypassMethod,
-							BuildNumber);
+		if (HaveDseSites)
+			PRINT_KERNEL_PATCH_MSG(L"    Using cached DSE patch locations.\r\n");
+		else
+		{
+			// Index the kernel imports for the IAT lookups of the DSE locators
+			PIMPORT_INDEX_ENTRY ImportBuckets = Image->ImportIndex == NULL
+				? ArenaAllocate(&gKernelArena, KERNEL_IMPORT_INDEX_CAPACITY * sizeof(IMPORT_INDEX_ENTRY), sizeof(UINT32))
+				: NULL;
+			PE_IMAGE_VIEW DseImage;
+			IMPORT_INDEX ImportIndex;
+			AttachKernelImportIndex(Image, ImportBuckets, &ImportIndex, &DseImage);
+
+			Status = FindDseSites(&DseImage,
+								PageSection,
+								gDriverConfig.DseBypassMethod,
+								BuildNumber,
+								&Timer,
+								&DseSites);
+			EndStage(&Timer);
+			if (EFI_ERROR(Status))
+				return Status;
+
+			PatchCacheRecordSites(Ntoskrnl, DseCacheBindings, NumDseCacheBindings);
+		}
+		BeginStage(&Timer, EFIGUARD_STAGE_DISABLE_DSE);
+		Status = DisableDSE(ImageBase, &DseSites, gDriverConfig.DseBypassMethod, BuildNumber);
+		EndStage(&Timer);
 		if (EFI_ERROR(Status))
 			return Status;
 
@@ -6,14 +6,18 @@
 t_OslFwpKernelSetupPhase1 gOriginalOslFwpKernelSetupPhase1 = NULL;
 UINT8 gOslFwpKernelSetupPhase1Backup[sizeof(gHookTemplate)] = { 0 };
 
+// Patch plan for the OslFwpKernelSetupPhase1 hook
+STATIC PATCH_PLAN mHookPatchPlan;
+
 
 // Signature for winload!OslFwpKernelSetupPhase1+XX, where the value of XX needs to be determined by backtracking.
 // Windows 10 RS4 and later only. On older OSes, and on Windows 10 as fallback, OslFwpKernelSetupPhase1 is found via xrefs to EfipGetRsdt
 STATIC CONST UINT8 SigOslFwpKernelSetupPhase1[] = {
-	0x89, 0xCC, 0x24, 0x01, 0x00, 0x00,				// mov [REG+124h], r32
-	0xE8, 0xCC, 0xCC, 0xCC, 0xCC,					// call BlBdStop
-	0xCC, 0x8B, 0xCC								// mov r32, r/m32
+	0x89, 0x00, 0x24, 0x01, 0x00, 0x00,				// mov [REG+124h], r32
+	0xE8, 0x00, 0x00, 0x00, 0x00,					// call BlBdStop
+	0x00, 0x8B, 0x00								// mov r32, r/m32
 };
+STATIC BYTE_PATTERN SigOslFwpKernelSetupPhase1Pattern = BYTE_PATTERN_INIT(SigOslFwpKernelSetupPhase1, "x?xxxxx?????x?");
 
 STATIC UNICODE_STRING ImgpFilterValidationFailureMessage = RTL_CONSTANT_STRING(L"*** Windows is unable to verify the signature of"); // newline, etc etc...
 
@@ -27,10 +31,11 @@ STATIC CONST UINT8 SigBlStatusPrint[] = {
 	0x4C, 0x89, 0x48, 0x20,							// mov [rax+20h], r9
 	0x53,											// push rbx
 	0x48, 0x83, 0xEC, 0x40,							// sub rsp, 40h
-	0xE8, 0xCC, 0xCC, 0xCC, 0xCC,					// call BlBdDebuggerEnabled
+	0xE8, 0x00, 0x00, 0x00, 0x00,					// call BlBdDebuggerEnabled
 	0x84, 0xC0,										// test al, al
-	0x74, 0xCC										// jz XX
+	0x74, 0x00										// jz XX
 };
+STATIC BYTE_PATTERN SigBlStatusPrintPattern = BYTE_PATTERN_INIT(SigBlStatusPrint, "xxxxxxxxxxxxxxxxxxxxxxxxx????xxx?");
 
 // EFI vendor GUID used by Microsoft
 STATIC CONST EFI_GUID MicrosoftVendorGuid = {
@@ -89,32 +94,14 @@ DisableVbs(
 	)
 {
 	CONST BOOLEAN Disabled = TRUE;
-	UINT32 Attributes;
-	UINTN Size = 0;
-
-	// Clear VbsPolicyDisabled variable if needed
-	EFI_STATUS Status = gRT->GetVariable((CHAR16*)VbsPolicyDisabledVariableName,
-										(EFI_GUID*)&MicrosoftVendorGuid,
-										&Attributes,
-										&Size,
-										NULL);
-	if (Status != EFI_NOT_FOUND &&
-		(Attributes != (EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS) || Size != sizeof(Disabled)))
-	{
-		gRT->SetVariable((CHAR16*)VbsPolicyDisabledVariableName,
-						(EFI_GUID*)&MicrosoftVendorGuid,
-						0,
-						0,
-						NULL);
-	}
 
-	// Write the new value
-	Status = gRT->SetVariable((CHAR16*)VbsPolicyDisabledVariableName,
-							(EFI_GUID*)&MicrosoftVendorGuid,
-							EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
-							sizeof(Disabled),
-							(BOOLEAN*)&Disabled);
-	return Status;
+	// winload.efi deletes the variable after reading it, so this writes it on every boot. SetVariableIfChanged() is still used because
+	// it recreates a leftover variable that has the wrong attributes or size, which SetVariable() would refuse to overwrite
+	return SetVariableIfChanged(VbsPolicyDisabledVariableName,
+								&MicrosoftVendorGuid,
+								EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+								sizeof(Disabled),
+								&Disabled);
 }
 
 //
@@ -126,6 +113,9 @@ HookedOslFwpKernelSetupPhase1(
 	IN PLOADER_PARAMETER_BLOCK LoaderBlock
 	)
 {
+	STAGE_TIMER Timer;
+	BeginStage(&Timer, EFIGUARD_STAGE_OSL_FWP_KERNEL_SETUP_PHASE1);
+
 	// Restore the original function bytes that we replaced with our hook
 	CopyWpMem((VOID*)gOriginalOslFwpKernelSetupPhase1, gOslFwpKernelSetupPhase1Backup, sizeof(gHookTemplate));
 
@@ -158,40 +148,127 @@ HookedOslFwpKernelSetupPhase1(
 		goto CallOriginal;
 	}
 
+	PE_IMAGE_VIEW KernelImage;
+	if (NtHeaders == NULL || EFI_ERROR(InitializePeImageView(KernelBase, NtHeaders, &KernelImage)))
+	{
+		gKernelPatchInfo.Status = EFI_LOAD_ERROR;
+		PRINT_KERNEL_PATCH_MSG(L"[HookedOslFwpKernelSetupPhase1] Failed to parse the headers of the kernel image at 0x%p!\r\n", KernelBase);
+		goto CallOriginal;
+	}
+
 	// Patch the kernel
+	STAGE_TIMER PatchTimer;
+	BeginStage(&PatchTimer, EFIGUARD_STAGE_PATCH_NTOSKRNL);
 	gKernelPatchInfo.KernelBase = KernelBase;
-	gKernelPatchInfo.Status = PatchNtoskrnl(KernelBase,
-											NtHeaders);
+	gKernelPatchInfo.Status = PatchNtoskrnl(&KernelImage);
+	EndStage(&PatchTimer);
 
 CallOriginal:
 	// No error handling here (not a lot of options). This is done in the ExitBootServices() callback which reads the patch status
+	EndStage(&Timer);
 
 	// Call the original function to transfer execution back to winload!OslFwpKernelSetupPhase1
 	return gOriginalOslFwpKernelSetupPhase1(LoaderBlock);
 }
 
 //
-// Patches ImgpValidateImageHash in bootmgfw.efi, bootmgr.efi, and winload.[efi|exe] to allow loading modified kernels and boot loaders.
-// Failures are ignored because this patch is not needed for the bootkit to work
+// Instruction matchers used with DisassembleRange() by the locators below
 //
-EFI_STATUS
+
+// Prefilter for IsAndMinusFortyOne
+STATIC
+BOOLEAN
 EFIAPI
-PatchImgpValidateImageHash(
-	IN INPUT_FILETYPE FileType,
-	IN UINT8* ImageBase,
-	IN PEFI_IMAGE_NT_HEADERS NtHeaders
+IsShortAndInstruction(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
 	)
 {
-	// This works on pretty much anything really
-	ASSERT(FileType == WinloadExe || FileType == BootmgfwEfi || FileType == BootmgrEfi || FileType == WinloadEfi);
-	CONST CHAR16* ShortName = FileType == BootmgfwEfi ? L"bootmgfw" : (FileType == BootmgrEfi ? L"bootmgr" : L"winload");
+	return Context->Instruction.mnemonic == ZYDIS_MNEMONIC_AND &&
+		(Context->Instruction.length == 3 || Context->Instruction.length == 4);
+}
 
-	CONST PEFI_IMAGE_SECTION_HEADER CodeSection = IMAGE_FIRST_SECTION(NtHeaders);
+// Matches 'and REG32, 0FFFFFFD7h' (only esi and r8d are used here really)
+STATIC
+BOOLEAN
+EFIAPI
+IsAndMinusFortyOne(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	return Context->Instruction.operand_count == 3 &&
+		Context->Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER &&
+		Context->Operands[1].type == ZYDIS_OPERAND_TYPE_IMMEDIATE &&
+		Context->Operands[1].imm.is_signed == ZYAN_TRUE &&
+		Context->Operands[1].imm.value.s == (ZyanI64)((ZyanI32)0xFFFFFFD7); // Sign extend to 64 bits
+}
+
+// Prefilter for IsLeaRipRelative and IsEfipGetRsdtLeaRcx
+STATIC
+BOOLEAN
+EFIAPI
+IsLeaInstruction(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	return Context->Instruction.mnemonic == ZYDIS_MNEMONIC_LEA;
+}
+
+// Matches 'lea REG, ds:[rip + offset]' where the effective address is the one in PredicateContext
+STATIC
+BOOLEAN
+EFIAPI
+IsLeaRipRelative(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	ZyanU64 OperandAddress = 0;
+	return Context->Instruction.operand_count == 2 &&
+		Context->Operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY &&
+		Context->Operands[1].mem.base == ZYDIS_REGISTER_RIP &&
+		ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context->Instruction, &Context->Operands[1], Context->InstructionAddress, &OperandAddress)) &&
+		OperandAddress == (UINTN)PredicateContext;
+}
+
+// Matches 'lea rcx, ds:[rip + offset_to_acpi20_guid]' in EfipGetRsdt. PredicateContext holds the address of the GUID
+STATIC
+BOOLEAN
+EFIAPI
+IsEfipGetRsdtLeaRcx(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	if (Context->Operands[0].type != ZYDIS_OPERAND_TYPE_REGISTER || Context->Operands[0].reg.value != ZYDIS_REGISTER_RCX ||
+		!IsLeaRipRelative(Context, PredicateContext))
+		return FALSE;
+
+	// Check for false positives (BlFwGetSystemTable)
+	CONST UINT8* Check = (UINT8*)Context->InstructionAddress - 4; // 4 = length of 'lea rdx, [r11+18h]' which precedes this instruction in EfipGetRsdt
+	return Check[0] == 0x49 && Check[1] == 0x8D && Check[2] == 0x53; // If no match, this is not EfipGetRsdt
+}
+
+// Finds ImgpValidateImageHash in bootmgfw.efi, bootmgr.efi, and winload.[efi|exe]
+STATIC
+EFI_STATUS
+EFIAPI
+FindImgpValidateImageHash(
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN CONST CHAR16* ShortName,
+	OUT UINT8** ImgpValidateImageHashAddress
+	)
+{
+	UINT8* ImageBase = Image->ImageBase;
+	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = Image->NtHeaders;
+	CONST PEFI_IMAGE_SECTION_HEADER CodeSection = &Image->Sections[0];
 
 	CONST UINT32 CodeSizeOfRawData = CodeSection->SizeOfRawData;
 	CONST UINT8* CodeStartVa = ImageBase + CodeSection->VirtualAddress;
 
-	Print(L"== Disassembling .text to find %S!ImgpValidateImageHash ==\r\n", ShortName);
+	ConsolePrint(VERBOSITY_VERBOSE, L"== Disassembling .text to find %S!ImgpValidateImageHash ==\r\n", ShortName);
 	UINT8* AndMinusFortyOneAddress = NULL;
 
 	// Initialize Zydis
@@ -199,97 +276,94 @@ PatchImgpValidateImageHash(
 	ZyanStatus Status = ZydisInit(NtHeaders, &Context);
 	if (!ZYAN_SUCCESS(Status))
 	{
-		Print(L"Failed to initialize disassembler engine.\r\n");
+		ConsolePrint(VERBOSITY_VERBOSE, L"Failed to initialize disassembler engine.\r\n");
 		return EFI_LOAD_ERROR;
 	}
 
-	Context.Length = CodeSizeOfRawData;
-	Context.Offset = 0;
-
-	// Start decode loop
-	while ((Context.InstructionAddress = (ZyanU64)(CodeStartVa + Context.Offset),
-			Status = ZydisDecoderDecodeFull(&Context.Decoder,
-											(VOID*)Context.InstructionAddress,
-											Context.Length - Context.Offset,
-											&Context.Instruction,
-											Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
-	{
-		if (!ZYAN_SUCCESS(Status))
-		{
-			Context.Offset++;
-			continue;
-		}
-
-		// Check if this is 'and REG32, 0FFFFFFD7h' (only esi and r8d are used here really)
-		if (Context.Instruction.operand_count == 3 &&
-			(Context.Instruction.length == 3 || Context.Instruction.length == 4) &&
-			Context.Instruction.mnemonic == ZYDIS_MNEMONIC_AND &&
-			Context.Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER &&
-			Context.Operands[1].type == ZYDIS_OPERAND_TYPE_IMMEDIATE &&
-			Context.Operands[1].imm.is_signed == ZYAN_TRUE &&
-			Context.Operands[1].imm.value.s == (ZyanI64)((ZyanI32)0xFFFFFFD7)) // Sign extend to 64 bits
-		{
-			AndMinusFortyOneAddress = (UINT8*)Context.InstructionAddress;
-			break;
-		}
-
-		Context.Offset += Context.Instruction.length;
-	}
+	INSTRUCTION_MATCHER AndMatcher = { IsShortAndInstruction, IsAndMinusFortyOne, NULL, NULL, NULL, TRUE, NULL };
+	if (!EFI_ERROR(DisassembleRange(&Context, CodeStartVa, CodeSizeOfRawData, &AndMatcher, 1)))
+		AndMinusFortyOneAddress = AndMatcher.Found;
 
 	// Backtrack to function start
-	UINT8* ImgpValidateImageHash = BacktrackToFunctionStart(ImageBase, NtHeaders, AndMinusFortyOneAddress);
-	if (ImgpValidateImageHash == NULL)
+	*ImgpValidateImageHashAddress = BacktrackToFunctionStart(ImageBase, NtHeaders, AndMinusFortyOneAddress);
+	if (*ImgpValidateImageHashAddress == NULL)
 	{
-		Print(L"    Failed to find %S!ImgpValidateImageHash%S.\r\n",
+		ConsolePrint(VERBOSITY_VERBOSE, L"    Failed to find %S!ImgpValidateImageHash%S.\r\n",
 			ShortName, (AndMinusFortyOneAddress == NULL ? L" 'and xxx, 0FFFFFFD7h' instruction" : L""));
 		return EFI_NOT_FOUND;
 	}
 
-	// Apply the patch
-	CONST UINT32 Ok = 0xC3C033; // xor eax, eax, ret
-	CopyWpMem(ImgpValidateImageHash, &Ok, sizeof(Ok));
-
-	// Print info
-	Print(L"    Patched %S!ImgpValidateImageHash [RVA: 0x%X].\r\n",
-		ShortName, (UINT32)(ImgpValidateImageHash - ImageBase));
-
 	return EFI_SUCCESS;
 }
 
 //
-// Patches ImgpFilterValidationFailure in bootmgfw.efi, bootmgr.efi, and winload.[efi|exe]
+// Patches ImgpValidateImageHash in bootmgfw.efi, bootmgr.efi, and winload.[efi|exe] to allow loading modified kernels and boot loaders.
 // Failures are ignored because this patch is not needed for the bootkit to work
 //
 EFI_STATUS
 EFIAPI
-PatchImgpFilterValidationFailure(
+PatchImgpValidateImageHash(
 	IN INPUT_FILETYPE FileType,
-	IN UINT8* ImageBase,
-	IN PEFI_IMAGE_NT_HEADERS NtHeaders
+	IN CONST PE_IMAGE_VIEW* Image
 	)
 {
 	// This works on pretty much anything really
 	ASSERT(FileType == WinloadExe || FileType == BootmgfwEfi || FileType == BootmgrEfi || FileType == WinloadEfi);
 	CONST CHAR16* ShortName = FileType == BootmgfwEfi ? L"bootmgfw" : (FileType == BootmgrEfi ? L"bootmgr" : L"winload");
 
-	// Find .text and/or .rdata sections
-	PEFI_IMAGE_SECTION_HEADER PatternSection = NULL, CodeSection = NULL;
-	PEFI_IMAGE_SECTION_HEADER Section = IMAGE_FIRST_SECTION(NtHeaders);
-	for (UINT16 i = 0; i < NtHeaders->FileHeader.NumberOfSections; ++i)
+	STAGE_TIMER Timer;
+	BeginStage(&Timer, EFIGUARD_STAGE_PATCH_IMGP_VALIDATE_IMAGE_HASH);
+
+	// Try the patch cache first
+	UINT8* ImgpValidateImageHash = NULL;
+	CONST PATCH_CACHE_BINDING CacheBinding = { PatchSiteImgpValidateImageHash, &ImgpValidateImageHash };
+	if (!PatchCacheLookupSites(FileType, &CacheBinding, 1))
 	{
-		if (CompareMem(Section->Name, ".text", sizeof(".text") - 1) == 0)
-			CodeSection = Section;
-		if (((FileType == BootmgfwEfi || FileType == BootmgrEfi) &&
-			CompareMem(Section->Name, ".text", sizeof(".text") - 1) == 0) // [bootmgfw|bootmgr].efi (usually) has no .rdata section, and starting at .text is always fine
-			||
-			((FileType == WinloadExe || FileType == WinloadEfi) &&
-			CompareMem(Section->Name, ".rdata", sizeof(".rdata") - 1) == 0)) // For winload.[exe|efi] the string is in .rdata
-			PatternSection = Section;
-		Section++;
+		CONST EFI_STATUS Status = FindImgpValidateImageHash(Image, ShortName, &ImgpValidateImageHash);
+		if (EFI_ERROR(Status))
+		{
+			EndStage(&Timer);
+			return Status;
+		}
+		PatchCacheRecordSites(FileType, &CacheBinding, 1);
 	}
 
-	ASSERT(PatternSection != NULL);
-	ASSERT(CodeSection != NULL);
+	// Apply the patch
+	CONST UINT32 Ok = 0xC3C033; // xor eax, eax, ret
+	CopyWpMem(ImgpValidateImageHash, &Ok, sizeof(Ok));
+
+	// Print info
+	ConsolePrint(VERBOSITY_VERBOSE, L"    Patched %S!ImgpValidateImageHash [RVA: 0x%X].\r\n",
+		ShortName, (UINT32)(ImgpValidateImageHash - Image->ImageBase));
+
+	EndStage(&Timer);
+
+	return EFI_SUCCESS;
+}
+
+// Finds ImgpFilterValidationFailure in bootmgfw.efi, bootmgr.efi, and winload.[efi|exe]
+STATIC
+EFI_STATUS
+EFIAPI
+FindImgpFilterValidationFailure(
+	IN INPUT_FILETYPE FileType,
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN CONST XREF_INDEX* XrefIndex OPTIONAL,
+	IN CONST CHAR16* ShortName,
+	OUT UINT8** ImgpFilterValidationFailureAddress
+	)
+{
+	UINT8* ImageBase = Image->ImageBase;
+	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = Image->NtHeaders;
+
+	// Find .text and/or .rdata sections. [bootmgfw|bootmgr].efi (usually) has no .rdata section, and starting at .text is always fine.
+	// For winload.[exe|efi] the string is in .rdata
+	CONST PEFI_IMAGE_SECTION_HEADER CodeSection = PeImageFindSection(Image, ".text");
+	CONST PEFI_IMAGE_SECTION_HEADER PatternSection = FileType == WinloadExe || FileType == WinloadEfi
+		? PeImageFindSection(Image, ".rdata")
+		: CodeSection;
+	if (CodeSection == NULL || PatternSection == NULL)
+		return EFI_NOT_FOUND;
 
 	CONST UINT32 PatternStartRva = PatternSection->VirtualAddress;
 	CONST UINT32 PatternSizeOfRawData = PatternSection->SizeOfRawData;
@@ -298,28 +372,23 @@ PatchImgpFilterValidationFailure(
 	CHAR8 SectionName[EFI_IMAGE_SIZEOF_SHORT_NAME + 1];
 	CopyMem(SectionName, PatternSection->Name, EFI_IMAGE_SIZEOF_SHORT_NAME);
 	SectionName[EFI_IMAGE_SIZEOF_SHORT_NAME] = '\0';
-	Print(L"\r\n== Searching for load failure string in %a [RVA: 0x%X - 0x%X] ==\r\n",
+	ConsolePrint(VERBOSITY_VERBOSE, L"\r\n== Searching for load failure string in %a [RVA: 0x%X - 0x%X] ==\r\n",
 		SectionName, PatternStartRva, PatternStartRva + PatternSizeOfRawData);
 
 	// Search for the black screen of death string "Windows is unable to verify the integrity of the file [...]"
 	UINT8* IntegrityFailureStringAddress = NULL;
-	for (UINT8* Address = (UINT8*)PatternStartVa;
-		Address < ImageBase + NtHeaders->OptionalHeader.SizeOfImage - ImgpFilterValidationFailureMessage.MaximumLength;
-		++Address)
-	{
-		if (CompareMem(Address, ImgpFilterValidationFailureMessage.Buffer, ImgpFilterValidationFailureMessage.Length) == 0)
-		{
-			IntegrityFailureStringAddress = Address;
-			Print(L"    Found load failure string at 0x%llx.\r\n", (UINTN)IntegrityFailureStringAddress);
-			break;
-		}
-	}
-
-	if (IntegrityFailureStringAddress == NULL)
+	CONST EFI_STATUS FindStringStatus = FindBytes(ImgpFilterValidationFailureMessage.Buffer,
+												ImgpFilterValidationFailureMessage.Length,
+												1,
+												PatternStartVa,
+												(UINT32)(ImageBase + Image->SizeOfImage - PatternStartVa),
+												(VOID**)&IntegrityFailureStringAddress);
+	if (EFI_ERROR(FindStringStatus))
 	{
-		Print(L"    Failed to find load failure string.\r\n");
+		ConsolePrint(VERBOSITY_VERBOSE, L"    Failed to find load failure string.\r\n");
 		return EFI_NOT_FOUND;
 	}
+	ConsolePrint(VERBOSITY_VERBOSE, L"    Found load failure string at 0x%llx.\r\n", (UINTN)IntegrityFailureStringAddress);
 
 	CONST UINT32 CodeStartRva = CodeSection->VirtualAddress;
 	CONST UINT32 CodeSizeOfRawData = CodeSection->SizeOfRawData;
@@ -327,7 +396,7 @@ PatchImgpFilterValidationFailure(
 
 	ZeroMem(SectionName, sizeof(SectionName));
 	CopyMem(SectionName, CodeSection->Name, EFI_IMAGE_SIZEOF_SHORT_NAME);
-	Print(L"== Disassembling %a to find %S!ImgpFilterValidationFailure ==\r\n", SectionName, ShortName);
+	ConsolePrint(VERBOSITY_VERBOSE, L"== Disassembling %a to find %S!ImgpFilterValidationFailure ==\r\n", SectionName, ShortName);
 	UINT8* LeaIntegrityFailureAddress = NULL;
 
 	// Initialize Zydis
@@ -335,61 +404,74 @@ PatchImgpFilterValidationFailure(
 	ZyanStatus Status = ZydisInit(NtHeaders, &Context);
 	if (!ZYAN_SUCCESS(Status))
 	{
-		Print(L"Failed to initialize disassembler engine.\r\n");
+		ConsolePrint(VERBOSITY_VERBOSE, L"Failed to initialize disassembler engine.\r\n");
 		return EFI_LOAD_ERROR;
 	}
 
-	Context.Length = CodeSizeOfRawData;
-	Context.Offset = 0;
-
-	// Start decode loop
-	while ((Context.InstructionAddress = (ZyanU64)(CodeStartVa + Context.Offset),
-			Status = ZydisDecoderDecodeFull(&Context.Decoder,
-											(VOID*)Context.InstructionAddress,
-											Context.Length - Context.Offset,
-											&Context.Instruction,
-											Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
+	// Look for 'lea REG, ds:[rip + offset_to_bsod_string]'
+	INSTRUCTION_MATCHER LeaMatcher = { IsLeaInstruction, IsLeaRipRelative, IntegrityFailureStringAddress, NULL, NULL, TRUE, NULL };
+	if ((XrefIndex != NULL &&
+		!EFI_ERROR(MatchXrefsTo(&Context, XrefIndex, IntegrityFailureStringAddress, XREF_TYPE_MASK(XREF_DATA_LEA), CodeStartVa, CodeSizeOfRawData, &LeaMatcher))) ||
+		!EFI_ERROR(DisassembleRange(&Context, CodeStartVa, CodeSizeOfRawData, &LeaMatcher, 1)))
 	{
-		if (!ZYAN_SUCCESS(Status))
-		{
-			Context.Offset++;
-			continue;
-		}
-
-		// Check if this is "lea REG, ds:[rip + offset_to_bsod_string]"
-		if (Context.Instruction.operand_count == 2 && Context.Instruction.mnemonic == ZYDIS_MNEMONIC_LEA &&
-			Context.Operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY &&
-			Context.Operands[1].mem.base == ZYDIS_REGISTER_RIP)
-		{
-			ZyanU64 OperandAddress = 0;
-			if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context.Instruction, &Context.Operands[1], Context.InstructionAddress, &OperandAddress)) &&
-				OperandAddress == (UINTN)IntegrityFailureStringAddress)
-			{
-				LeaIntegrityFailureAddress = (UINT8*)Context.InstructionAddress;
-				Print(L"    Found load instruction for load failure string at 0x%llx.\r\n", (UINTN)LeaIntegrityFailureAddress);
-				break;
-			}
-		}
-
-		Context.Offset += Context.Instruction.length;
+		LeaIntegrityFailureAddress = LeaMatcher.Found;
+		ConsolePrint(VERBOSITY_VERBOSE, L"    Found load instruction for load failure string at 0x%llx.\r\n", (UINTN)LeaIntegrityFailureAddress);
 	}
 
 	// Backtrack to function start
-	UINT8* ImgpFilterValidationFailure = BacktrackToFunctionStart(ImageBase, NtHeaders, LeaIntegrityFailureAddress);
-	if (ImgpFilterValidationFailure == NULL)
+	*ImgpFilterValidationFailureAddress = BacktrackToFunctionStart(ImageBase, NtHeaders, LeaIntegrityFailureAddress);
+	if (*ImgpFilterValidationFailureAddress == NULL)
 	{
-		Print(L"    Failed to find %S!ImgpFilterValidationFailure%S.\r\n",
+		ConsolePrint(VERBOSITY_VERBOSE, L"    Failed to find %S!ImgpFilterValidationFailure%S.\r\n",
 			ShortName, (LeaIntegrityFailureAddress == NULL ? L" load failure string load instruction" : L""));
 		return EFI_NOT_FOUND;
 	}
 
+	return EFI_SUCCESS;
+}
+
+//
+// Patches ImgpFilterValidationFailure in bootmgfw.efi, bootmgr.efi, and winload.[efi|exe]
+// Failures are ignored because this patch is not needed for the bootkit to work
+//
+EFI_STATUS
+EFIAPI
+PatchImgpFilterValidationFailure(
+	IN INPUT_FILETYPE FileType,
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN CONST XREF_INDEX* XrefIndex OPTIONAL
+	)
+{
+	// This works on pretty much anything really
+	ASSERT(FileType == WinloadExe || FileType == BootmgfwEfi || FileType == BootmgrEfi || FileType == WinloadEfi);
+	CONST CHAR16* ShortName = FileType == BootmgfwEfi ? L"bootmgfw" : (FileType == BootmgrEfi ? L"bootmgr" : L"winload");
+
+	STAGE_TIMER Timer;
+	BeginStage(&Timer, EFIGUARD_STAGE_PATCH_IMGP_FILTER_VALIDATION_FAILURE);
+
+	// Try the patch cache first
+	UINT8* ImgpFilterValidationFailure = NULL;
+	CONST PATCH_CACHE_BINDING CacheBinding = { PatchSiteImgpFilterValidationFailure, &ImgpFilterValidationFailure };
+	if (!PatchCacheLookupSites(FileType, &CacheBinding, 1))
+	{
+		CONST EFI_STATUS Status = FindImgpFilterValidationFailure(FileType, Image, XrefIndex, ShortName, &ImgpFilterValidationFailure);
+		if (EFI_ERROR(Status))
+		{
+			EndStage(&Timer);
+			return Status;
+		}
+		PatchCacheRecordSites(FileType, &CacheBinding, 1);
+	}
+
 	// Apply the patch
 	CONST UINT32 Ok = 0xC3C033; // xor eax, eax, ret
 	CopyWpMem(ImgpFilterValidationFailure, &Ok, sizeof(Ok));
 
 	// Print info
-	Print(L"    Patched %S!ImgpFilterValidationFailure [RVA: 0x%X].\r\n\r\n",
-		ShortName, (UINT32)(ImgpFilterValidationFailure - ImageBase));
+	ConsolePrint(VERBOSITY_VERBOSE, L"    Patched %S!ImgpFilterValidationFailure [RVA: 0x%X].\r\n\r\n",
+		ShortName, (UINT32)(ImgpFilterValidationFailure - Image->ImageBase));
+
+	EndStage(&Timer);
 
 	return EFI_SUCCESS;
 }
@@ -400,16 +482,18 @@ PatchImgpFilterValidationFailure(
 EFI_STATUS
 EFIAPI
 FindOslFwpKernelSetupPhase1(
-	IN CONST UINT8* ImageBase,
-	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN CONST PE_IMAGE_VIEW* Image,
 	IN PEFI_IMAGE_SECTION_HEADER CodeSection,
 	IN PEFI_IMAGE_SECTION_HEADER PatternSection,
+	IN CONST XREF_INDEX* XrefIndex OPTIONAL,
 	IN UINT16 BuildNumber,
 	OUT UINT8** OslFwpKernelSetupPhase1Address
 	)
 {
 	*OslFwpKernelSetupPhase1Address = NULL;
 
+	CONST UINT8* ImageBase = Image->ImageBase;
+	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = Image->NtHeaders;
 	CONST UINT8* CodeStartVa = ImageBase + CodeSection->VirtualAddress;
 	CONST UINT32 CodeSizeOfRawData = CodeSection->SizeOfRawData;
 	CONST UINT8* PatternStartVa = ImageBase + PatternSection->VirtualAddress;
@@ -418,9 +502,7 @@ FindOslFwpKernelSetupPhase1(
 	{
 		// On Windows 10 RS4 and later, try simple pattern matching first since it will most likely work
 		UINT8* Found = NULL;
-		CONST EFI_STATUS Status = FindPattern(SigOslFwpKernelSetupPhase1,
-											0xCC,
-											sizeof(SigOslFwpKernelSetupPhase1),
+		CONST EFI_STATUS Status = FindPattern(&SigOslFwpKernelSetupPhase1Pattern,
 											(VOID*)CodeStartVa,
 											CodeSizeOfRawData,
 											(VOID**)&Found);
@@ -430,64 +512,43 @@ FindOslFwpKernelSetupPhase1(
 			*OslFwpKernelSetupPhase1Address = BacktrackToFunctionStart(ImageBase, NtHeaders, Found);
 			if (*OslFwpKernelSetupPhase1Address != NULL)
 			{
-				Print(L"\r\nFound OslFwpKernelSetupPhase1 at 0x%llX.\r\n", (UINTN)(*OslFwpKernelSetupPhase1Address));
+				ConsolePrint(VERBOSITY_VERBOSE, L"\r\nFound OslFwpKernelSetupPhase1 at 0x%llX.\r\n", (UINTN)(*OslFwpKernelSetupPhase1Address));
 				return EFI_SUCCESS; // Found; early out
 			}
 		}
 	}
 
 	// Initialize Zydis
-	Print(L"\r\n== Disassembling .text to find OslFwpKernelSetupPhase1 ==\r\n");
+	ConsolePrint(VERBOSITY_VERBOSE, L"\r\n== Disassembling .text to find OslFwpKernelSetupPhase1 ==\r\n");
 	ZYDIS_CONTEXT Context;
 	ZyanStatus Status = ZydisInit(NtHeaders, &Context);
 	if (!ZYAN_SUCCESS(Status))
 	{
-		Print(L"Failed to initialize disassembler engine.\r\n");
+		ConsolePrint(VERBOSITY_VERBOSE, L"Failed to initialize disassembler engine.\r\n");
 		return EFI_LOAD_ERROR;
 	}
 
-	CONST VOID* BlBdStop = GetProcedureAddress((UINTN)ImageBase, NtHeaders, "BlBdStop");
-	if (BuildNumber >= 17134 && BlBdStop != NULL)
+	// Only a few calls are needed from .text, so these are found with a raw byte scan instead of by disassembling all of it
+	UINT8* CallSites[32];
+	UINT32 NumCallSites;
+	CONST VOID* BlBdStop = PeImageGetProcedureAddress(Image, "BlBdStop");
+	if (BuildNumber >= 17134 && BlBdStop != NULL &&
+		!EFI_ERROR(FindBranchesTo(&Context, ImageBase, NtHeaders, CodeStartVa + 6, CodeSizeOfRawData - 6, BlBdStop,
+									XREF_TYPE_MASK(XREF_CALL_REL32), CallSites, ARRAY_SIZE(CallSites), &NumCallSites)))
 	{
-		Context.Length = CodeSizeOfRawData;
-		Context.Offset = 6;
-
-		// Start decode loop
-		while ((Context.InstructionAddress = (ZyanU64)(CodeStartVa + Context.Offset),
-				Status = ZydisDecoderDecodeFull(&Context.Decoder,
-												(VOID*)Context.InstructionAddress,
-												Context.Length - Context.Offset,
-												&Context.Instruction,
-												Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
+		for (UINT32 i = 0; i < NumCallSites; ++i)
 		{
-			if (!ZYAN_SUCCESS(Status))
-			{
-				Context.Offset++;
-				continue;
-			}
-
 			// Check if this is 'call BlBdStop'
-			if (Context.Instruction.operand_count == 4 &&
-				Context.Operands[0].type == ZYDIS_OPERAND_TYPE_IMMEDIATE && Context.Operands[0].imm.is_relative == ZYAN_TRUE &&
-				Context.Instruction.mnemonic == ZYDIS_MNEMONIC_CALL)
+			CONST UINT8* CallBlBdStopAddress = CallSites[i];
+
+			// Check if the preceding instruction is 'mov [REG+124h], r32'
+			if ((CallBlBdStopAddress[-6] == 0x89 || CallBlBdStopAddress[-6] == 0x8B) &&
+				*(UINT32*)(&CallBlBdStopAddress[-4]) == 0x124 &&
+				(*OslFwpKernelSetupPhase1Address = BacktrackToFunctionStart(ImageBase, NtHeaders, CallBlBdStopAddress)) != NULL)
 			{
-				ZyanU64 OperandAddress = 0;
-				if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context.Instruction, &Context.Operands[0], Context.InstructionAddress, &OperandAddress)) &&
-					OperandAddress == (UINTN)BlBdStop)
-				{
-					// Check if the preceding instruction is 'mov [REG+124h], r32'
-					CONST UINT8* CallBlBdStopAddress = (UINT8*)Context.InstructionAddress;
-					if ((CallBlBdStopAddress[-6] == 0x89 || CallBlBdStopAddress[-6] == 0x8B) &&
-						*(UINT32*)(&CallBlBdStopAddress[-4]) == 0x124 &&
-						(*OslFwpKernelSetupPhase1Address = BacktrackToFunctionStart(ImageBase, NtHeaders, CallBlBdStopAddress)) != NULL)
-					{
-						Print(L"    Found OslFwpKernelSetupPhase1 at 0x%llX.\r\n\r\n", (UINTN)(*OslFwpKernelSetupPhase1Address));
-						return EFI_SUCCESS;
-					}
-				}
+				ConsolePrint(VERBOSITY_VERBOSE, L"    Found OslFwpKernelSetupPhase1 at 0x%llX.\r\n\r\n", (UINTN)(*OslFwpKernelSetupPhase1Address));
+				return EFI_SUCCESS;
 			}
-
-			Context.Offset += Context.Instruction.length;
 		}
 	}
 
@@ -498,159 +559,142 @@ FindOslFwpKernelSetupPhase1(
 	// This of course implies finding EfipGetRsdt first. After that, find all calls to this function, and for each, calculate
 	// the distance from the start of the function to the call. OslFwpKernelSetupPhase1 is reliably (Vista through 10)
 	// the function that has the smallest value for this distance, i.e. the call happens very early in the function.
-	Print(L"\r\n== Searching for EfipGetRsdt pattern in .text ==\r\n");
+	ConsolePrint(VERBOSITY_VERBOSE, L"\r\n== Searching for EfipGetRsdt pattern in .text ==\r\n");
 
 	// Search for EFI ACPI 2.0 table GUID: { 8868e871-e4f1-11d3-bc22-0080c73c8881 }
 	UINT8* PatternAddress = NULL;
-	for (UINT8* Address = (UINT8*)PatternStartVa;
-		Address < ImageBase + NtHeaders->OptionalHeader.SizeOfImage - sizeof(gEfiAcpi20TableGuid);
-		++Address)
+	CONST EFI_STATUS FindGuidStatus = FindBytes(&gEfiAcpi20TableGuid,
+												sizeof(gEfiAcpi20TableGuid),
+												1,
+												PatternStartVa,
+												(UINT32)(ImageBase + Image->SizeOfImage - PatternStartVa),
+												(VOID**)&PatternAddress);
+	if (EFI_ERROR(FindGuidStatus))
 	{
-		if (CompareGuid((CONST GUID*)Address, &gEfiAcpi20TableGuid))
-		{
-			PatternAddress = Address;
-			Print(L"    Found EFI ACPI 2.0 GUID at 0x%llX.\r\n", (UINTN)PatternAddress);
-			break;
-		}
-	}
-
-	if (PatternAddress == NULL)
-	{
-		Print(L"    Failed to find EFI ACPI 2.0 GUID.\r\n");
+		ConsolePrint(VERBOSITY_VERBOSE, L"    Failed to find EFI ACPI 2.0 GUID.\r\n");
 		return EFI_NOT_FOUND;
 	}
+	ConsolePrint(VERBOSITY_VERBOSE, L"    Found EFI ACPI 2.0 GUID at 0x%llX.\r\n", (UINTN)PatternAddress);
 
-	Print(L"\r\n== Disassembling .text to find EfipGetRsdt ==\r\n");
+	ConsolePrint(VERBOSITY_VERBOSE, L"\r\n== Disassembling .text to find EfipGetRsdt ==\r\n");
 	UINT8* LeaEfiAcpiTableGuidAddress = NULL;
-	Context.Length = CodeSizeOfRawData;
-	Context.Offset = 0;
-
-	// Start decode loop
-	while ((Context.InstructionAddress = (ZyanU64)(CodeStartVa + Context.Offset),
-			Status = ZydisDecoderDecodeFull(&Context.Decoder,
-											(VOID*)Context.InstructionAddress,
-											Context.Length - Context.Offset,
-											&Context.Instruction,
-											Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
+	INSTRUCTION_MATCHER LeaMatcher = { IsLeaInstruction, IsEfipGetRsdtLeaRcx, PatternAddress, NULL, NULL, TRUE, NULL };
+	if ((XrefIndex != NULL &&
+		!EFI_ERROR(MatchXrefsTo(&Context, XrefIndex, PatternAddress, XREF_TYPE_MASK(XREF_DATA_LEA), CodeStartVa, CodeSizeOfRawData, &LeaMatcher))) ||
+		!EFI_ERROR(DisassembleRange(&Context, CodeStartVa, CodeSizeOfRawData, &LeaMatcher, 1)))
 	{
-		if (!ZYAN_SUCCESS(Status))
-		{
-			Context.Offset++;
-			continue;
-		}
-
-		// Check if this is "lea rcx, ds:[rip + offset_to_acpi20_guid]"
-		if (Context.Instruction.operand_count == 2 && Context.Instruction.mnemonic == ZYDIS_MNEMONIC_LEA &&
-			Context.Operands[0].type == ZYDIS_OPERAND_TYPE_REGISTER &&
-			Context.Operands[0].reg.value == ZYDIS_REGISTER_RCX &&
-			Context.Operands[1].type == ZYDIS_OPERAND_TYPE_MEMORY &&
-			Context.Operands[1].mem.base == ZYDIS_REGISTER_RIP)
-		{
-			ZyanU64 OperandAddress = 0;
-			if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context.Instruction, &Context.Operands[1], Context.InstructionAddress, &OperandAddress)) &&
-				OperandAddress == (UINTN)PatternAddress)
-			{
-				// Check for false positives (BlFwGetSystemTable)
-				CONST UINT8* Check = (UINT8*)(CodeStartVa + Context.Offset - 4); // 4 = length of 'lea rdx, [r11+18h]' which precedes this instruction in EfipGetRsdt
-				if (Check[0] == 0x49 && Check[1] == 0x8D && Check[2] == 0x53) // If no match, this is not EfipGetRsdt
-				{
-					LeaEfiAcpiTableGuidAddress = (UINT8*)Context.InstructionAddress;
-					Print(L"    Found load instruction for EFI ACPI 2.0 GUID at 0x%llX.\r\n", (UINTN)LeaEfiAcpiTableGuidAddress);
-					break;
-				}
-			}
-		}
-
-		Context.Offset += Context.Instruction.length;
+		LeaEfiAcpiTableGuidAddress = LeaMatcher.Found;
+		ConsolePrint(VERBOSITY_VERBOSE, L"    Found load instruction for EFI ACPI 2.0 GUID at 0x%llX.\r\n", (UINTN)LeaEfiAcpiTableGuidAddress);
 	}
 
 	if (LeaEfiAcpiTableGuidAddress == NULL)
 	{
-		Print(L"    Failed to find load instruction for EFI ACPI 2.0 GUID.\r\n");
+		ConsolePrint(VERBOSITY_VERBOSE, L"    Failed to find load instruction for EFI ACPI 2.0 GUID.\r\n");
 		return EFI_NOT_FOUND;
 	}
 
 	CONST UINT8* EfipGetRsdt = BacktrackToFunctionStart(ImageBase, NtHeaders, LeaEfiAcpiTableGuidAddress);
 	if (EfipGetRsdt == NULL)
 	{
-		Print(L"    Failed to find EfipGetRsdt.\r\n");
+		ConsolePrint(VERBOSITY_VERBOSE, L"    Failed to find EfipGetRsdt.\r\n");
 		return EFI_NOT_FOUND;
 	}
 
-	Print(L"    Found EfipGetRsdt at 0x%llX.\r\n", (UINTN)EfipGetRsdt);
+	ConsolePrint(VERBOSITY_VERBOSE, L"    Found EfipGetRsdt at 0x%llX.\r\n", (UINTN)EfipGetRsdt);
 	UINT8* CallEfipGetRsdtAddress = NULL;
-
-	// Start decode loop
-	Context.Offset = 0;
 	UINTN ShortestDistanceToCall = MAX_UINTN;
-	while ((Context.InstructionAddress = (ZyanU64)(CodeStartVa + Context.Offset),
-			Status = ZydisDecoderDecodeFull(&Context.Decoder,
-											(VOID*)Context.InstructionAddress,
-											Context.Length - Context.Offset,
-											&Context.Instruction,
-											Context.Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
-	{
-		if (!ZYAN_SUCCESS(Status))
-		{
-			Context.Offset++;
-			continue;
-		}
 
-		// Check if this is 'call IMM'
-		if (Context.Instruction.operand_count == 4 &&
-			Context.Operands[0].type == ZYDIS_OPERAND_TYPE_IMMEDIATE && Context.Operands[0].imm.is_relative == ZYAN_TRUE &&
-			Context.Instruction.mnemonic == ZYDIS_MNEMONIC_CALL)
+	// Find all 'call EfipGetRsdt' instructions
+	if (!EFI_ERROR(FindBranchesTo(&Context, ImageBase, NtHeaders, CodeStartVa, CodeSizeOfRawData, EfipGetRsdt,
+									XREF_TYPE_MASK(XREF_CALL_REL32), CallSites, ARRAY_SIZE(CallSites), &NumCallSites)))
+	{
+		for (UINT32 i = 0; i < NumCallSites; ++i)
 		{
-			// Check if this is 'call EfipGetRsdt'
-			ZyanU64 OperandAddress = 0;
-			if (ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context.Instruction, &Context.Operands[0], Context.InstructionAddress, &OperandAddress)) &&
-				OperandAddress == (UINTN)EfipGetRsdt)
+			// Calculate the distance from the start of the function to the instruction. OslFwpKernelSetupPhase1 will always have the shortest distance
+			UINT8* CallAddress = CallSites[i];
+			CONST UINTN StartOfFunction = (UINTN)BacktrackToFunctionStart(ImageBase, NtHeaders, CallAddress);
+			CONST UINTN Distance = (UINTN)CallAddress - StartOfFunction;
+			if (Distance < ShortestDistanceToCall)
 			{
-				// Calculate the distance from the start of the function to the instruction. OslFwpKernelSetupPhase1 will always have the shortest distance
-				CONST UINTN StartOfFunction = (UINTN)BacktrackToFunctionStart(ImageBase, NtHeaders, (UINT8*)Context.InstructionAddress);
-				CONST UINTN Distance = Context.InstructionAddress - StartOfFunction;
-				if (Distance < ShortestDistanceToCall)
-				{
-					CallEfipGetRsdtAddress = (UINT8*)Context.InstructionAddress;
-					ShortestDistanceToCall = Distance;
-				}
+				CallEfipGetRsdtAddress = CallAddress;
+				ShortestDistanceToCall = Distance;
 			}
 		}
-
-		Context.Offset += Context.Instruction.length;
 	}
 
 	if (CallEfipGetRsdtAddress == NULL)
 	{
-		Print(L"    Failed to find a single 'call EfipGetRsdt' instruction.\r\n");
+		ConsolePrint(VERBOSITY_VERBOSE, L"    Failed to find a single 'call EfipGetRsdt' instruction.\r\n");
 		return EFI_NOT_FOUND;
 	}
 
 	// Found
 	*OslFwpKernelSetupPhase1Address = CallEfipGetRsdtAddress - ShortestDistanceToCall;
-	Print(L"    Found OslFwpKernelSetupPhase1 at 0x%llX.\r\n\r\n", (UINTN)(*OslFwpKernelSetupPhase1Address));
+	ConsolePrint(VERBOSITY_VERBOSE, L"    Found OslFwpKernelSetupPhase1 at 0x%llX.\r\n\r\n", (UINTN)(*OslFwpKernelSetupPhase1Address));
 
 	return EFI_SUCCESS;
 }
 
+// Before RS4, OslFwpKernelSetupPhase1 is found through the EfipGetRsdt fallback, which needs the xref to the ACPI 2.0 GUID in .text.
+// On Windows 7 and later, ImgpFilterValidationFailure also needs the xref to the load failure string. Only when both are needed is
+// it worth indexing all RIP-relative data references in .text once, instead of disassembling it twice; a single xref is cheaper to
+// find with one disassembly pass
+#define WINLOAD_NEEDS_DATA_XREF_INDEX(BuildNumber)		((BuildNumber) >= 7600 && (BuildNumber) < 17134)
+
+// Number of entries for the data xref index of winload.efi's .text. No instruction with a [rip+disp32] operand is shorter than 6 bytes
+#define WINLOAD_DATA_XREF_INDEX_CAPACITY(CodeSection)	((CodeSection)->SizeOfRawData / 6)
+
+// Indexes the RIP-relative data references in winload.efi's .text. Entries is a caller-provided buffer of WINLOAD_DATA_XREF_INDEX_CAPACITY() entries.
+// If this fails, the locators fall back to disassembly
+STATIC
+EFI_STATUS
+EFIAPI
+BuildWinloadDataXrefIndex(
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN PEFI_IMAGE_SECTION_HEADER CodeSection,
+	IN PXREF_ENTRY Entries,
+	OUT PXREF_INDEX XrefIndex
+	)
+{
+	XrefIndex->ImageBase = Image->ImageBase;
+	XrefIndex->Entries = Entries;
+	XrefIndex->Capacity = WINLOAD_DATA_XREF_INDEX_CAPACITY(CodeSection);
+	XrefIndex->Count = 0;
+	if (Entries == NULL)
+		return EFI_OUT_OF_RESOURCES;
+
+	ZYDIS_CONTEXT Context;
+	if (!ZYAN_SUCCESS(ZydisInit(Image->NtHeaders, &Context)))
+		return EFI_LOAD_ERROR;
+
+	return BuildXrefIndex(&Context, Image->ImageBase, &CodeSection, 1, XREF_TYPE_MASK_DATA, XrefIndex);
+}
+
 //
 // Patches winload.efi
 // 
 EFI_STATUS
 EFIAPI
 PatchWinload(
-	IN VOID* ImageBase,
-	IN PEFI_IMAGE_NT_HEADERS NtHeaders
+	IN CONST PE_IMAGE_VIEW* Image
 	)
 {
+	UINT8* ImageBase = Image->ImageBase;
+	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = Image->NtHeaders;
+
+	STAGE_TIMER Timer;
+	BeginStage(&Timer, EFIGUARD_STAGE_PATCH_WINLOAD);
+
+	PXREF_ENTRY XrefEntries = NULL;
+
 	// Print file and version info
 	UINT16 MajorVersion = 0, MinorVersion = 0, BuildNumber = 0, Revision = 0;
 	EFI_STATUS Status = GetPeFileVersionInfo(ImageBase, &MajorVersion, &MinorVersion, &BuildNumber, &Revision, NULL);
 	if (EFI_ERROR(Status))
-		Print(L"\r\nPatchWinload: WARNING: failed to obtain winload.efi version info. Status: %llx\r\n", Status);
+		ConsolePrint(VERBOSITY_SUMMARY, L"\r\nPatchWinload: WARNING: failed to obtain winload.efi version info. Status: %llx\r\n", Status);
 	else
 	{
-		Print(L"\r\nPatching winload.efi v%u.%u.%u.%u...\r\n", MajorVersion, MinorVersion, BuildNumber, Revision);
+		ConsolePrint(VERBOSITY_VERBOSE, L"\r\nPatching winload.efi v%u.%u.%u.%u...\r\n", MajorVersion, MinorVersion, BuildNumber, Revision);
 
 		// Some... adjustments... need to be made later on in the case of pre-Windows 7 loader blocks, so store the build number
 		gKernelPatchInfo.WinloadBuildNumber = BuildNumber;
@@ -659,106 +703,140 @@ PatchWinload(
 		// except for the ImgpFilterValidationFailure patch because this function only exists on Windows 7 and higher.
 		if (BuildNumber < 6001)
 		{
-			Print(L"\r\nPatchWinload: ERROR: Unsupported winload.efi image version.\r\n");
+			ConsolePrint(VERBOSITY_QUIET, L"\r\nPatchWinload: ERROR: Unsupported winload.efi image version.\r\n");
 			Status = EFI_UNSUPPORTED;
 			goto Exit;
 		}
 	}
 
 	// Find the .text and .rdata sections
-	PEFI_IMAGE_SECTION_HEADER CodeSection = NULL, PatternSection = NULL;
-	PEFI_IMAGE_SECTION_HEADER Section = IMAGE_FIRST_SECTION(NtHeaders);
-	for (UINT16 i = 0; i < NtHeaders->FileHeader.NumberOfSections; ++i)
+	PEFI_IMAGE_SECTION_HEADER CodeSection = PeImageFindSection(Image, ".text");
+	CONST PEFI_IMAGE_SECTION_HEADER PatternSection = PeImageFindSection(Image, ".rdata");
+	if (CodeSection == NULL || PatternSection == NULL)
 	{
-		CHAR8 SectionName[EFI_IMAGE_SIZEOF_SHORT_NAME + 1];
-		CopyMem(SectionName, Section->Name, EFI_IMAGE_SIZEOF_SHORT_NAME);
-		SectionName[EFI_IMAGE_SIZEOF_SHORT_NAME] = '\0';
-
-		if (AsciiStrCmp(SectionName, ".text") == 0)
-			CodeSection = Section;
-		else if (AsciiStrCmp(SectionName, ".rdata") == 0)
-			PatternSection = Section;
-
-		Section++;
+		ConsolePrint(VERBOSITY_QUIET, L"\r\nPatchWinload: ERROR: failed to find the .text and .rdata sections of winload.efi.\r\n");
+		Status = EFI_NOT_FOUND;
+		goto Exit;
 	}
 
-	ASSERT(CodeSection != NULL);
-	ASSERT(PatternSection != NULL);
-
 	if (BuildNumber >= 10240)
 	{
 		// (Optional) find winload!BlStatusPrint
-		gBlStatusPrint = (t_BlStatusPrint)GetProcedureAddress((UINTN)ImageBase, NtHeaders, "BlStatusPrint");
+		gBlStatusPrint = (t_BlStatusPrint)PeImageGetProcedureAddress(Image, "BlStatusPrint");
 		if (gBlStatusPrint == NULL)
 		{
 			// Not exported (RS4 and earlier) - try to find by signature
-			FindPattern(SigBlStatusPrint,
-						0xCC,
-						sizeof(SigBlStatusPrint),
+			FindPattern(&SigBlStatusPrintPattern,
 						(UINT8*)ImageBase + CodeSection->VirtualAddress,
 						CodeSection->SizeOfRawData,
 						(VOID**)&gBlStatusPrint);
 			if (gBlStatusPrint == NULL)
 			{
 				gBlStatusPrint = BlStatusPrintNoop;
-				Print(L"\r\nWARNING: winload!BlStatusPrint not found. No boot debugger output will be available.\r\n");
+				ConsolePrint(VERBOSITY_SUMMARY, L"\r\nWARNING: winload!BlStatusPrint not found. No boot debugger output will be available.\r\n");
 			}
 		}
 
 		// Disable VBS for the duration of this boot
 		Status = DisableVbs();
 		if (EFI_ERROR(Status))
-			Print(L"\r\nWARNING: failed to set EFI runtime variable \"%ls\" in order to disable VBS.\r\n", VbsPolicyDisabledVariableName);
+			ConsolePrint(VERBOSITY_SUMMARY, L"\r\nWARNING: failed to set EFI runtime variable \"%ls\" in order to disable VBS.\r\n", VbsPolicyDisabledVariableName);
 	}
 
+	// Check the patch cache for the sites that are located through data xrefs. If this image has been seen before, the index below is not needed
+	UINT8* OslFwpKernelSetupPhase1 = NULL, *ImgpFilterValidationFailure = NULL;
+	CONST PATCH_CACHE_BINDING CacheBindings[] =
+	{
+		{ PatchSiteOslFwpKernelSetupPhase1, &OslFwpKernelSetupPhase1 },
+		{ PatchSiteImgpFilterValidationFailure, &ImgpFilterValidationFailure }
+	};
+	CONST BOOLEAN CacheHit = PatchCacheOpenImage(WinloadEfi, ImageBase, NtHeaders) &&
+		PatchCacheLookupSites(WinloadEfi, CacheBindings, BuildNumber >= 7600 ? 2 : 1);
+
+	// Index the data references in .text on the builds where two sites are found through them, unless both came from the cache
+	XREF_INDEX XrefIndex;
+	if (!CacheHit && WINLOAD_NEEDS_DATA_XREF_INDEX(BuildNumber))
+		XrefEntries = AllocatePool(WINLOAD_DATA_XREF_INDEX_CAPACITY(CodeSection) * sizeof(XREF_ENTRY));
+	CONST XREF_INDEX* DataXrefIndex = XrefEntries != NULL && !EFI_ERROR(BuildWinloadDataXrefIndex(Image, CodeSection, XrefEntries, &XrefIndex))
+		? &XrefIndex
+		: NULL;
+
 	// Find winload!OslFwpKernelSetupPhase1
-	Status = FindOslFwpKernelSetupPhase1(ImageBase,
-										NtHeaders,
-										CodeSection,
-										PatternSection,
-										BuildNumber,
-										(UINT8**)&gOriginalOslFwpKernelSetupPhase1);
-	if (EFI_ERROR(Status))
+	if (!CacheHit)
 	{
-		Print(L"\r\nPatchWinload: failed to find OslFwpKernelSetupPhase1. Status: %llx\r\n", Status);
-		goto Exit;
+		STAGE_TIMER LocatorTimer;
+		BeginStage(&LocatorTimer, EFIGUARD_STAGE_FIND_OSL_FWP_KERNEL_SETUP_PHASE1);
+		Status = FindOslFwpKernelSetupPhase1(Image,
+											CodeSection,
+											PatternSection,
+											DataXrefIndex,
+											BuildNumber,
+											&OslFwpKernelSetupPhase1);
+		EndStage(&LocatorTimer);
+		if (EFI_ERROR(Status))
+		{
+			ConsolePrint(VERBOSITY_QUIET, L"\r\nPatchWinload: failed to find OslFwpKernelSetupPhase1. Status: %llx\r\n", Status);
+			goto Exit;
+		}
+		PatchCacheRecordSites(WinloadEfi, &CacheBindings[0], 1);
 	}
+	gOriginalOslFwpKernelSetupPhase1 = (t_OslFwpKernelSetupPhase1)OslFwpKernelSetupPhase1;
 
 	CONST UINTN HookedOslFwpKernelSetupPhase1Address = (UINTN)&HookedOslFwpKernelSetupPhase1;
-	Print(L"HookedOslFwpKernelSetupPhase1 at 0x%p.\r\n", (VOID*)HookedOslFwpKernelSetupPhase1Address);
+	ConsolePrint(VERBOSITY_VERBOSE, L"HookedOslFwpKernelSetupPhase1 at 0x%p.\r\n", (VOID*)HookedOslFwpKernelSetupPhase1Address);
+
+	// Place faux call (push addr, ret) at the start of the function to transfer execution to our hook.
+	// The hook is written as a single patch, so that write protection only needs to be disabled once
+	UINT8 HookBytes[sizeof(gHookTemplate)];
+	CopyMem(HookBytes, gHookTemplate, sizeof(gHookTemplate));
+	CopyMem(HookBytes + gHookTemplateAddressOffset,
+		(UINTN*)&HookedOslFwpKernelSetupPhase1Address, sizeof(HookedOslFwpKernelSetupPhase1Address));
+	InitializePatchPlan(&mHookPatchPlan);
+	AddPatchPlanEntry(&mHookPatchPlan, (VOID*)gOriginalOslFwpKernelSetupPhase1, NULL, HookBytes, sizeof(HookBytes));
 
 	CONST EFI_TPL Tpl = gBS->RaiseTPL(TPL_HIGH_LEVEL); // Note: implies cli
 
 	// Backup original function prologue
 	CopyMem(gOslFwpKernelSetupPhase1Backup, (VOID*)gOriginalOslFwpKernelSetupPhase1, sizeof(gHookTemplate));
 
-	// Place faux call (push addr, ret) at the start of the function to transfer execution to our hook
-	CopyWpMem((VOID*)gOriginalOslFwpKernelSetupPhase1, gHookTemplate, sizeof(gHookTemplate));
-	CopyWpMem((UINT8*)gOriginalOslFwpKernelSetupPhase1 + gHookTemplateAddressOffset,
-		(UINTN*)&HookedOslFwpKernelSetupPhase1Address, sizeof(HookedOslFwpKernelSetupPhase1Address));
+	Status = ApplyPatchPlan(&mHookPatchPlan);
 
 	gBS->RestoreTPL(Tpl);
 
+	if (EFI_ERROR(Status))
+	{
+		ConsolePrint(VERBOSITY_QUIET, L"\r\nPatchWinload: failed to hook OslFwpKernelSetupPhase1. Status: %llx\r\n", Status);
+		goto Exit;
+	}
+
 	// Patch ImgpValidateImageHash to allow custom boot loaders. This is completely
 	// optional (unless booting a custom ntoskrnl.exe), and failures are ignored
 	PatchImgpValidateImageHash(WinloadEfi,
-								ImageBase,
-								NtHeaders);
+								Image);
 
 	if (BuildNumber >= 7600)
 	{
 		// Patch ImgpFilterValidationFailure so it doesn't silently
 		// rat out every violation to a TPM or SI log. Also optional
 		PatchImgpFilterValidationFailure(WinloadEfi,
-										ImageBase,
-										NtHeaders);
+										Image,
+										DataXrefIndex);
 	}
 
+	// Save the locations found above for the next boot
+	PatchCacheFlush();
+
 Exit:
+	if (XrefEntries != NULL)
+		FreePool(XrefEntries);
+
+	// Stop the clock before waiting for user input
+	EndStage(&Timer);
+
 	if (EFI_ERROR(Status))
 	{
 		// Patch failed. Prompt user to ask what they want to do
-		Print(L"\r\nPress any key to continue anyway, or press ESC to reboot.\r\n");
+		ConsolePrint(VERBOSITY_QUIET, L"\r\nPress any key to continue anyway, or press ESC to reboot.\r\n");
 		if (!WaitForKey())
 		{
 			gRT->ResetSystem(EfiResetCold, EFI_SUCCESS, 0, NULL);
@@ -766,15 +844,16 @@ Exit:
 	}
 	else
 	{
-		Print(L"Successfully patched winload!OslFwpKernelSetupPhase1.\r\n");
+		ConsolePrint(VERBOSITY_SUMMARY, L"Successfully patched winload!OslFwpKernelSetupPhase1.\r\n");
 		//RtlSleep(2000);
 
 		if (gDriverConfig.WaitForKeyPress)
 		{
-			Print(L"\r\nPress any key to continue.\r\n");
+			ConsolePrint(VERBOSITY_QUIET, L"\r\nPress any key to continue.\r\n");
 			WaitForKey();
 		}
 	}
+	ConsoleFlush();
 
 	// Return success, because even if the patch failed, the user chose not to reboot above
 	return EFI_SUCCESS;
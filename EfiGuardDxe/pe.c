@@ -60,6 +60,82 @@ RtlpImageNtHeaderEx(
 	return NtHeaders;
 }
 
+// Returns TRUE if any resource type or name in the resource directory is the specified string. Resource names are case-insensitive
+STATIC
+BOOLEAN
+HasNamedResource(
+	IN CONST UINT8* ResourceDirVa,
+	IN UINT32 ResourceDirSize,
+	IN CONST CHAR16* Name
+	)
+{
+	CONST UINTN NameLength = StrLen(Name);
+
+	// Check the named entries of the root (type) directory, and those of each type's name directory. Named entries come before ID entries
+	CONST EFI_IMAGE_RESOURCE_DIRECTORY* Directories[1 + 64];
+	UINT32 NumDirectories = 0;
+	Directories[NumDirectories++] = (CONST EFI_IMAGE_RESOURCE_DIRECTORY*)ResourceDirVa;
+	for (UINT32 d = 0; d < NumDirectories; ++d)
+	{
+		CONST EFI_IMAGE_RESOURCE_DIRECTORY* Directory = Directories[d];
+		CONST UINT32 NumEntries = (UINT32)Directory->NumberOfNamedEntries + Directory->NumberOfIdEntries;
+		if ((UINT32)((CONST UINT8*)Directory - ResourceDirVa) + sizeof(EFI_IMAGE_RESOURCE_DIRECTORY) +
+			NumEntries * sizeof(EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY) > ResourceDirSize)
+			return FALSE;
+
+		// The ID entries only need to be visited in the root directory, to find the name directories
+		CONST EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY* Entries = (CONST EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(Directory + 1);
+		CONST UINT32 NumEntriesToVisit = d == 0 ? NumEntries : Directory->NumberOfNamedEntries;
+		for (UINT32 i = 0; i < NumEntriesToVisit; ++i)
+		{
+			if (i < Directory->NumberOfNamedEntries && Entries[i].u1.s.NameIsString &&
+				Entries[i].u1.s.NameOffset + sizeof(UINT16) <= ResourceDirSize)
+			{
+				CONST EFI_IMAGE_RESOURCE_DIRECTORY_STRING* String = (CONST EFI_IMAGE_RESOURCE_DIRECTORY_STRING*)(ResourceDirVa + Entries[i].u1.s.NameOffset);
+				if (String->Length == NameLength &&
+					Entries[i].u1.s.NameOffset + sizeof(UINT16) + NameLength * sizeof(CHAR16) <= ResourceDirSize &&
+					StrniCmp(String->String, Name, NameLength) == 0)
+					return TRUE;
+			}
+
+			// Queue the name directories of the types
+			if (d == 0 && Entries[i].u2.s.DataIsDirectory && NumDirectories < ARRAY_SIZE(Directories) &&
+				Entries[i].u2.s.OffsetToDirectory + sizeof(EFI_IMAGE_RESOURCE_DIRECTORY) <= ResourceDirSize)
+				Directories[NumDirectories++] = (CONST EFI_IMAGE_RESOURCE_DIRECTORY*)(ResourceDirVa + Entries[i].u2.s.OffsetToDirectory);
+		}
+	}
+	return FALSE;
+}
+
+// Finds a literal byte sequence in the sections of an image that have file data. This includes code sections,
+// because [bootmgfw|bootmgr].efi usually has no .rdata section and keeps its constants in .text
+STATIC
+EFI_STATUS
+FindBytesInSections(
+	IN CONST UINT8* ImageBase,
+	IN UINTN ImageSize,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN CONST VOID* Bytes,
+	IN UINT32 Length,
+	IN UINT32 Alignment,
+	OUT VOID** Found
+	)
+{
+	CONST PEFI_IMAGE_SECTION_HEADER Sections = IMAGE_FIRST_SECTION(NtHeaders);
+	for (UINT16 i = 0; i < NtHeaders->FileHeader.NumberOfSections; ++i)
+	{
+		if (Sections[i].SizeOfRawData == 0 || Sections[i].VirtualAddress >= ImageSize)
+			continue;
+
+		CONST UINT32 Size = (UINT32)MIN((UINTN)MAX(Sections[i].Misc.VirtualSize, Sections[i].SizeOfRawData), ImageSize - Sections[i].VirtualAddress);
+		if (!EFI_ERROR(FindBytes(Bytes, Length, Alignment, ImageBase + Sections[i].VirtualAddress, Size, Found)))
+			return EFI_SUCCESS;
+	}
+
+	*Found = NULL;
+	return EFI_NOT_FOUND;
+}
+
 INPUT_FILETYPE
 EFIAPI
 GetInputFileType(
@@ -79,17 +155,36 @@ GetInputFileType(
 	if (Subsystem == EFI_IMAGE_SUBSYSTEM_NATIVE)
 		return Ntoskrnl;
 
+	// The boot manager and winload.efi carry their XSL display templates as named resources, which can be found without scanning
+	UINT32 Size = 0;
+	EFI_IMAGE_RESOURCE_DIRECTORY *ResourceDirTable =
+		RtlpImageDirectoryEntryToDataEx(ImageBase,
+										TRUE,
+										EFI_IMAGE_DIRECTORY_ENTRY_RESOURCE,
+										&Size);
+	if (ResourceDirTable != NULL && (UINT8*)ResourceDirTable + Size > ImageBase + ImageSize)
+		ResourceDirTable = NULL;
+
 	if (Subsystem == EFI_IMAGE_SUBSYSTEM_EFI_APPLICATION)
 	{
-		// Of the Windows loaders, only bootmgfw.efi has this subsystem type.
-		// Check for the BCD Bootmgr GUID, { 9DEA862C-5CDD-4E70-ACC1-F32B344D4795 }, which is present in bootmgfw/bootmgr (and on Win >= 8 also winload.[exe|efi])
+		// Of the Windows loaders, only bootmgfw.efi has this subsystem type
+		if (ResourceDirTable != NULL && Size >= sizeof(EFI_IMAGE_RESOURCE_DIRECTORY) &&
+			HasNamedResource((UINT8*)ResourceDirTable, Size, L"BOOTMGR.XSL"))
+			return BootmgfwEfi;
+
+		// Check for the BCD Bootmgr GUID, { 9DEA862C-5CDD-4E70-ACC1-F32B344D4795 }, which is present in bootmgfw/bootmgr (and on Win >= 8 also winload.[exe|efi]).
+		// This is a constant, but it may be in .text, so all sections with file data are searched
 		CONST EFI_GUID BcdWindowsBootmgrGuid = { 0x9dea862c, 0x5cdd, 0x4e70, { 0xac, 0xc1, 0xf3, 0x2b, 0x34, 0x4d, 0x47, 0x95 } };
-		for (UINT8* Address = (UINT8*)ImageBase; Address < ImageBase + ImageSize - sizeof(BcdWindowsBootmgrGuid); Address += sizeof(VOID*))
+		VOID* GuidAddress;
+		if (!EFI_ERROR(FindBytesInSections(ImageBase,
+											ImageSize,
+											NtHeaders,
+											&BcdWindowsBootmgrGuid,
+											sizeof(BcdWindowsBootmgrGuid),
+											sizeof(VOID*),
+											&GuidAddress)))
 		{
-			if (CompareGuid((CONST GUID*)Address, &BcdWindowsBootmgrGuid))
-			{
-				return BootmgfwEfi;
-			}
+			return BootmgfwEfi;
 		}
 
 		// Some other OS is being booted
@@ -103,27 +198,29 @@ GetInputFileType(
 		return Unknown;
 	}
 
-	// Brute force scan .rsrc to check if this is either winload.efi or bootmgr.efi.
+	// Check if this is either winload.efi or bootmgr.efi.
 	// We've already eliminated bootmgr and bootmgfw.efi as candidates, so there will be no false positives
-	UINT32 Size = 0;
-	EFI_IMAGE_RESOURCE_DIRECTORY *ResourceDirTable =
-		RtlpImageDirectoryEntryToDataEx(ImageBase,
-										TRUE,
-										EFI_IMAGE_DIRECTORY_ENTRY_RESOURCE,
-										&Size);
 	if (ResourceDirTable == NULL || Size == 0)
 		return Unknown;
 
-	for (UINT8* Address = (UINT8*)ResourceDirTable; Address < ImageBase + ImageSize - sizeof(L"OSLOADER.XSL"); Address += sizeof(CHAR16))
+	if (Size >= sizeof(EFI_IMAGE_RESOURCE_DIRECTORY))
 	{
-		if (CompareMem(Address, L"BOOTMGR.XSL", sizeof(L"BOOTMGR.XSL") - sizeof(CHAR16)) == 0)
-		{
+		if (HasNamedResource((UINT8*)ResourceDirTable, Size, L"BOOTMGR.XSL"))
 			return BootmgrEfi;
-		}
-		if (CompareMem(Address, L"OSLOADER.XSL", sizeof(L"OSLOADER.XSL") - sizeof(CHAR16)) == 0)
-		{
+		if (HasNamedResource((UINT8*)ResourceDirTable, Size, L"OSLOADER.XSL"))
 			return WinloadEfi;
-		}
+	}
+
+	// Fall back to a brute force scan of .rsrc, in case the templates are stored in some other way
+	CONST UINT32 ScanSize = (UINT32)(ImageBase + ImageSize - (UINT8*)ResourceDirTable);
+	VOID* NameAddress;
+	if (!EFI_ERROR(FindBytes(L"BOOTMGR.XSL", sizeof(L"BOOTMGR.XSL") - sizeof(CHAR16), sizeof(CHAR16), ResourceDirTable, ScanSize, &NameAddress)))
+	{
+		return BootmgrEfi;
+	}
+	if (!EFI_ERROR(FindBytes(L"OSLOADER.XSL", sizeof(L"OSLOADER.XSL") - sizeof(CHAR16), sizeof(CHAR16), ResourceDirTable, ScanSize, &NameAddress)))
+	{
+		return WinloadEfi;
 	}
 
 	// Any remaining images that could slip through here (SecConfig.efi, winresume.efi) are not relevant for us
@@ -156,6 +253,48 @@ FileTypeToString(
 	}
 }
 
+// Returns the export directory of an image, or NULL if it has none
+STATIC
+CONST EFI_IMAGE_EXPORT_DIRECTORY*
+GetExportDirectory(
+	IN UINTN DllBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	OUT UINT32* ExportDirRva,
+	OUT UINT32* ExportDirSize
+	)
+{
+	CONST PEFI_IMAGE_DATA_DIRECTORY ImageDirectories = NtHeaders->OptionalHeader.DataDirectory;
+	*ExportDirRva = ImageDirectories[EFI_IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress;
+	*ExportDirSize = ImageDirectories[EFI_IMAGE_DIRECTORY_ENTRY_EXPORT].Size;
+	if (*ExportDirRva == 0 || *ExportDirSize < sizeof(EFI_IMAGE_EXPORT_DIRECTORY))
+		return NULL;
+	return (CONST EFI_IMAGE_EXPORT_DIRECTORY*)(DllBase + *ExportDirRva);
+}
+
+// Returns the address of the export at the specified index in the name table, or NULL if it is a forwarder
+STATIC
+VOID*
+GetExportAddressByNameIndex(
+	IN UINTN DllBase,
+	IN CONST EFI_IMAGE_EXPORT_DIRECTORY* ExportDirectory,
+	IN UINT32 ExportDirRva,
+	IN UINT32 ExportDirSize,
+	IN UINT32 NameIndex
+	)
+{
+	CONST UINT32* AddressOfFunctions = (UINT32*)(DllBase + ExportDirectory->AddressOfFunctions);
+	CONST UINT16* AddressOfNameOrdinals = (UINT16*)(DllBase + ExportDirectory->AddressOfNameOrdinals);
+
+	CONST UINT16 Ordinal = AddressOfNameOrdinals[NameIndex];
+	if (Ordinal >= ExportDirectory->NumberOfFunctions)
+		return NULL;
+	CONST UINT32 FunctionRva = AddressOfFunctions[Ordinal];
+	if (FunctionRva >= ExportDirRva && FunctionRva < ExportDirRva + ExportDirSize)
+		return NULL; // Ignore forward exports
+
+	return (VOID*)(DllBase + FunctionRva);
+}
+
 VOID*
 EFIAPI
 GetProcedureAddress(
@@ -167,15 +306,11 @@ GetProcedureAddress(
 	if (DllBase == 0 || NtHeaders == NULL)
 		return NULL;
 
-	// Get the export directory RVA and size
-	CONST PEFI_IMAGE_DATA_DIRECTORY ImageDirectories = NtHeaders->OptionalHeader.DataDirectory;
-	CONST UINT32 ExportDirRva = ImageDirectories[EFI_IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress;
-	CONST UINT32 ExportDirSize = ImageDirectories[EFI_IMAGE_DIRECTORY_ENTRY_EXPORT].Size;
-
 	// Read the export directory
-	CONST PEFI_IMAGE_EXPORT_DIRECTORY ExportDirectory = (PEFI_IMAGE_EXPORT_DIRECTORY)(DllBase + ExportDirRva);
-	CONST UINT32* AddressOfFunctions = (UINT32*)(DllBase + ExportDirectory->AddressOfFunctions);
-	CONST UINT16* AddressOfNameOrdinals = (UINT16*)(DllBase + ExportDirectory->AddressOfNameOrdinals);
+	UINT32 ExportDirRva, ExportDirSize;
+	CONST EFI_IMAGE_EXPORT_DIRECTORY* ExportDirectory = GetExportDirectory(DllBase, NtHeaders, &ExportDirRva, &ExportDirSize);
+	if (ExportDirectory == NULL)
+		return NULL;
 	CONST UINT32* AddressOfNames = (UINT32*)(DllBase + ExportDirectory->AddressOfNames);
 
 	// Look up the import name in the name table using a binary search
@@ -198,13 +333,150 @@ GetProcedureAddress(
 
 	// If the high index is less than the low index, then a matching table entry
 	// was not found. Otherwise, get the ordinal number from the ordinal table
-	if (High < Low || Middle >= (INT32)ExportDirectory->NumberOfFunctions)
+	if (High < Low)
 		return NULL;
-	CONST UINT32 FunctionRva = AddressOfFunctions[AddressOfNameOrdinals[Middle]];
-	if (FunctionRva >= ExportDirRva && FunctionRva < ExportDirRva + ExportDirSize)
-		return NULL; // Ignore forward exports
 
-	return (VOID*)(DllBase + FunctionRva);
+	return GetExportAddressByNameIndex(DllBase, ExportDirectory, ExportDirRva, ExportDirSize, (UINT32)Middle);
+}
+
+// Resolves multiple exports in a single walk over the export name table. This is faster than calling GetProcedureAddress() for each name
+// if the lookups are sorted by name in AsciiStrCmp() order, which is also the order of the name table. Unsorted lookups still work, but
+// each out-of-order name restarts the walk. Returns EFI_NOT_FOUND if any of the names could not be resolved.
+EFI_STATUS
+EFIAPI
+GetProcedureAddresses(
+	IN UINTN DllBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN OUT PEXPORT_LOOKUP Lookups,
+	IN UINT32 NumLookups
+	)
+{
+	for (UINT32 i = 0; i < NumLookups; ++i)
+		Lookups[i].Address = NULL;
+
+	if (DllBase == 0 || NtHeaders == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	UINT32 ExportDirRva, ExportDirSize;
+	CONST EFI_IMAGE_EXPORT_DIRECTORY* ExportDirectory = GetExportDirectory(DllBase, NtHeaders, &ExportDirRva, &ExportDirSize);
+	if (ExportDirectory == NULL)
+		return EFI_NOT_FOUND;
+	CONST UINT32* AddressOfNames = (UINT32*)(DllBase + ExportDirectory->AddressOfNames);
+	CONST UINT32 NumberOfNames = ExportDirectory->NumberOfNames;
+
+	UINT32 NumFound = 0, Low = 0;
+	for (UINT32 i = 0; i < NumLookups; ++i)
+	{
+		CONST CHAR8* Name = Lookups[i].Name;
+		if (i > 0 && AsciiStrCmp(Name, Lookups[i - 1].Name) < 0)
+			Low = 0;
+
+		// All names before Low are less than Name. Gallop forward from there in steps of 1, 2, 4, ... until a name is not less than Name
+		UINT32 Bound = Low, Step = 1;
+		while (Bound < NumberOfNames && AsciiStrCmp(Name, (CHAR8*)(DllBase + AddressOfNames[Bound])) > 0)
+		{
+			Low = Bound + 1;
+			Bound = Low + Step - 1;
+			Step <<= 1;
+		}
+
+		// Binary search the bracket [Low, Bound] for the first name that is not less than Name
+		UINT32 High = MIN(Bound, NumberOfNames);
+		while (Low < High)
+		{
+			CONST UINT32 Middle = Low + ((High - Low) >> 1);
+			if (AsciiStrCmp(Name, (CHAR8*)(DllBase + AddressOfNames[Middle])) > 0)
+				Low = Middle + 1;
+			else
+				High = Middle;
+		}
+
+		if (Low < NumberOfNames && AsciiStrCmp(Name, (CHAR8*)(DllBase + AddressOfNames[Low])) == 0)
+		{
+			Lookups[i].Address = GetExportAddressByNameIndex(DllBase, ExportDirectory, ExportDirRva, ExportDirSize, Low);
+			if (Lookups[i].Address != NULL)
+				NumFound++;
+		}
+	}
+
+	return NumFound == NumLookups ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+// FNV-1a hash of an export name
+STATIC
+UINT32
+HashExportName(
+	IN CONST CHAR8* Name
+	)
+{
+	UINT32 Hash = 2166136261U;
+	while (*Name != '\0')
+	{
+		Hash ^= (UINT8)*Name++;
+		Hash *= 16777619U;
+	}
+	return Hash;
+}
+
+// Fills a hash table with the export names of an image. Returns EFI_BUFFER_TOO_SMALL if the table has too few buckets.
+EFI_STATUS
+EFIAPI
+BuildExportNameTable(
+	IN UINTN DllBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN OUT PEXPORT_NAME_TABLE Table
+	)
+{
+	if (DllBase == 0 || NtHeaders == NULL || Table->NumBuckets == 0 || (Table->NumBuckets & (Table->NumBuckets - 1)) != 0)
+		return EFI_INVALID_PARAMETER;
+
+	Table->DllBase = DllBase;
+	Table->ExportDirectory = GetExportDirectory(DllBase, NtHeaders, &Table->ExportDirRva, &Table->ExportDirSize);
+	ZeroMem(Table->Buckets, Table->NumBuckets * sizeof(*Table->Buckets));
+	if (Table->ExportDirectory == NULL)
+		return EFI_SUCCESS;
+
+	CONST UINT32* AddressOfNames = (UINT32*)(DllBase + Table->ExportDirectory->AddressOfNames);
+	CONST UINT32 NumberOfNames = Table->ExportDirectory->NumberOfNames;
+	if (NumberOfNames >= Table->NumBuckets)
+	{
+		Table->ExportDirectory = NULL;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	// Open addressing with linear probing
+	CONST UINT32 Mask = Table->NumBuckets - 1;
+	for (UINT32 i = 0; i < NumberOfNames; ++i)
+	{
+		UINT32 Bucket = HashExportName((CHAR8*)(DllBase + AddressOfNames[i])) & Mask;
+		while (Table->Buckets[Bucket] != 0)
+			Bucket = (Bucket + 1) & Mask;
+		Table->Buckets[Bucket] = i + 1;
+	}
+
+	return EFI_SUCCESS;
+}
+
+// Equivalent to GetProcedureAddress(), using a table filled by BuildExportNameTable()
+VOID*
+EFIAPI
+GetProcedureAddressFromTable(
+	IN CONST EXPORT_NAME_TABLE* Table,
+	IN CONST CHAR8* RoutineName
+	)
+{
+	if (Table->ExportDirectory == NULL)
+		return NULL;
+
+	CONST UINT32* AddressOfNames = (UINT32*)(Table->DllBase + Table->ExportDirectory->AddressOfNames);
+	CONST UINT32 Mask = Table->NumBuckets - 1;
+	for (UINT32 Bucket = HashExportName(RoutineName) & Mask; Table->Buckets[Bucket] != 0; Bucket = (Bucket + 1) & Mask)
+	{
+		CONST UINT32 NameIndex = Table->Buckets[Bucket] - 1;
+		if (AsciiStrCmp(RoutineName, (CHAR8*)(Table->DllBase + AddressOfNames[NameIndex])) == 0)
+			return GetExportAddressByNameIndex(Table->DllBase, Table->ExportDirectory, Table->ExportDirRva, Table->ExportDirSize, NameIndex);
+	}
+	return NULL;
 }
 
 EFI_STATUS
@@ -304,6 +576,148 @@ FindIATAddressForImport(
 	return EFI_NOT_FOUND;
 }
 
+// Continues a case-insensitive FNV-1a hash with a null-terminated string, including its terminator
+STATIC
+UINT32
+HashImportName(
+	IN UINT32 Hash,
+	IN CONST CHAR8* Name
+	)
+{
+	do
+	{
+		CONST CHAR8 Char = *Name;
+		Hash ^= (UINT8)(Char >= 'A' && Char <= 'Z' ? Char - 'A' + 'a' : Char);
+		Hash *= 16777619U;
+	} while (*Name++ != '\0');
+	return Hash;
+}
+
+// Fills an index with all imports by name of an image in a single walk over the import directory.
+// Returns EFI_BUFFER_TOO_SMALL if the index is full, in which case it must not be used.
+EFI_STATUS
+EFIAPI
+BuildImportIndex(
+	IN CONST VOID* ImageBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN OUT PIMPORT_INDEX Index
+	)
+{
+	if (Index->NumBuckets == 0 || (Index->NumBuckets & (Index->NumBuckets - 1)) != 0)
+		return EFI_INVALID_PARAMETER;
+
+	Index->ImageBase = (CONST UINT8*)ImageBase;
+	Index->Count = 0;
+	ZeroMem(Index->Buckets, Index->NumBuckets * sizeof(*Index->Buckets));
+
+	UINT32 ImportDirSize;
+	CONST IMAGE_IMPORT_DESCRIPTOR* Descriptor =
+		RtlpImageDirectoryEntryToDataEx(ImageBase,
+										TRUE,
+										EFI_IMAGE_DIRECTORY_ENTRY_IMPORT,
+										&ImportDirSize);
+	if (ImportDirSize == 0 || Descriptor == NULL)
+		return EFI_SUCCESS;
+
+	CONST UINT32 Mask = Index->NumBuckets - 1;
+	CONST BOOLEAN Is64Bit = IMAGE64(NtHeaders);
+	CONST UINT32 ThunkSize = Is64Bit ? sizeof(IMAGE_THUNK_DATA64) : sizeof(IMAGE_THUNK_DATA32);
+	CONST UINT32 NumDescriptors = ImportDirSize / sizeof(IMAGE_IMPORT_DESCRIPTOR);
+
+	for (UINT32 i = 0; i < NumDescriptors && (Descriptor->u.OriginalFirstThunk != 0 || Descriptor->FirstThunk != 0); ++i, ++Descriptor)
+	{
+		if (Descriptor->Name == 0)
+			continue;
+
+		CONST CHAR8* DllName = (CHAR8*)(Index->ImageBase + Descriptor->Name);
+		CONST UINT32 DllHash = HashImportName(2166136261U, DllName);
+
+		// Get the thunk data using the OFT if available, otherwise use the FT
+		CONST UINT8* ThunkData = Index->ImageBase +
+			(Descriptor->u.OriginalFirstThunk != 0
+				? Descriptor->u.OriginalFirstThunk
+				: Descriptor->FirstThunk);
+
+		for (UINT32 j = 0; ; ++j, ThunkData += ThunkSize)
+		{
+			CONST UINT64 AddressOfData = Is64Bit
+				? ((PIMAGE_THUNK_DATA64)ThunkData)->u1.AddressOfData
+				: ((PIMAGE_THUNK_DATA32)ThunkData)->u1.AddressOfData;
+			if (AddressOfData == 0)
+				break;
+			if ((AddressOfData & (Is64Bit ? IMAGE_ORDINAL_FLAG64 : IMAGE_ORDINAL_FLAG32)) != 0)
+				continue; // Ignore imports by ordinal
+
+			CONST PIMAGE_IMPORT_BY_NAME ImportByName = (PIMAGE_IMPORT_BY_NAME)(Index->ImageBase + (UINT32)AddressOfData);
+			if (ImportByName->Name[0] == '\0')
+				continue;
+
+			if (Index->Count + 1 >= Index->NumBuckets)
+				return EFI_BUFFER_TOO_SMALL;
+
+			// Open addressing with linear probing
+			CONST UINT32 Hash = HashImportName(DllHash, ImportByName->Name);
+			UINT32 Bucket = Hash & Mask;
+			while (Index->Buckets[Bucket].IatRva != 0)
+				Bucket = (Bucket + 1) & Mask;
+
+			Index->Buckets[Bucket].Hash = Hash;
+			Index->Buckets[Bucket].DllNameRva = Descriptor->Name;
+			Index->Buckets[Bucket].FunctionNameRva = (UINT32)((CONST UINT8*)ImportByName->Name - Index->ImageBase);
+			Index->Buckets[Bucket].IatRva = Descriptor->FirstThunk + j * ThunkSize;
+			Index->Count++;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+// Equivalent to FindIATAddressForImport(), using an index filled by BuildImportIndex()
+EFI_STATUS
+EFIAPI
+FindIATAddressInIndex(
+	IN CONST IMPORT_INDEX* Index,
+	IN CONST CHAR8* ImportDllName,
+	IN CONST CHAR8* FunctionName,
+	OUT VOID **FunctionIATAddress
+	)
+{
+	*FunctionIATAddress = NULL;
+
+	CONST UINT32 Hash = HashImportName(HashImportName(2166136261U, ImportDllName), FunctionName);
+	CONST UINT32 Mask = Index->NumBuckets - 1;
+	for (UINT32 Bucket = Hash & Mask; Index->Buckets[Bucket].IatRva != 0; Bucket = (Bucket + 1) & Mask)
+	{
+		CONST IMPORT_INDEX_ENTRY* Entry = &Index->Buckets[Bucket];
+		if (Entry->Hash == Hash &&
+			AsciiStriCmp((CHAR8*)(Index->ImageBase + Entry->FunctionNameRva), FunctionName) == 0 &&
+			AsciiStriCmp((CHAR8*)(Index->ImageBase + Entry->DllNameRva), ImportDllName) == 0)
+		{
+			*FunctionIATAddress = (VOID*)(Index->ImageBase + Entry->IatRva);
+			return EFI_SUCCESS;
+		}
+	}
+	return EFI_NOT_FOUND;
+}
+
+// Looks up multiple imports in an index filled by BuildImportIndex(). Returns EFI_NOT_FOUND if any of them could not be found
+EFI_STATUS
+EFIAPI
+FindIATAddressesInIndex(
+	IN CONST IMPORT_INDEX* Index,
+	IN OUT PIMPORT_LOOKUP Lookups,
+	IN UINT32 NumLookups
+	)
+{
+	EFI_STATUS Status = EFI_SUCCESS;
+	for (UINT32 i = 0; i < NumLookups; ++i)
+	{
+		if (EFI_ERROR(FindIATAddressInIndex(Index, Lookups[i].DllName, Lookups[i].FunctionName, &Lookups[i].IATAddress)))
+			Status = EFI_NOT_FOUND;
+	}
+	return Status;
+}
+
 
 UINT32
 EFIAPI
@@ -329,6 +743,163 @@ RvaToOffset(
 	return Result;
 }
 
+// Fills a data directory of a PE image view from the optional header, if the image has the directory
+STATIC
+VOID
+InitializePeImageDirectory(
+	IN CONST PE_IMAGE_VIEW* View,
+	IN UINT16 DirectoryEntry,
+	OUT PPE_IMAGE_DIRECTORY Directory
+	)
+{
+	Directory->Data = NULL;
+	Directory->Rva = 0;
+	Directory->Size = 0;
+
+	if (DirectoryEntry >= HEADER_FIELD(View->NtHeaders, NumberOfRvaAndSizes))
+		return;
+
+	CONST PEFI_IMAGE_DATA_DIRECTORY Directories = HEADER_FIELD(View->NtHeaders, DataDirectory);
+	CONST UINT32 Rva = Directories[DirectoryEntry].VirtualAddress;
+	CONST UINT32 Size = Directories[DirectoryEntry].Size;
+	if (Rva == 0 || Size == 0 || Rva >= View->SizeOfImage || Size > View->SizeOfImage - Rva)
+		return;
+
+	Directory->Data = View->ImageBase + Rva;
+	Directory->Rva = Rva;
+	Directory->Size = Size;
+}
+
+// Parses the section table and data directories of a mapped image once, so that the locators do not each have to walk them.
+// Returns EFI_UNSUPPORTED if the image has more than PE_IMAGE_VIEW_MAX_SECTIONS sections
+EFI_STATUS
+EFIAPI
+InitializePeImageView(
+	IN VOID* ImageBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	OUT PPE_IMAGE_VIEW View
+	)
+{
+	ZeroMem(View, sizeof(*View));
+
+	CONST UINT16 NumSections = NtHeaders->FileHeader.NumberOfSections;
+	if (NumSections > PE_IMAGE_VIEW_MAX_SECTIONS)
+		return EFI_UNSUPPORTED;
+
+	View->ImageBase = (UINT8*)ImageBase;
+	View->SizeOfImage = HEADER_FIELD(NtHeaders, SizeOfImage);
+	View->NtHeaders = NtHeaders;
+	View->Sections = IMAGE_FIRST_SECTION(NtHeaders);
+	View->NumSections = NumSections;
+
+	// The section table is normally already sorted by address, in which case this insertion sort is a single pass
+	for (UINT16 i = 0; i < NumSections; ++i)
+	{
+		UINT16 j = i;
+		while (j > 0 && View->Sections[View->SectionsByRva[j - 1]].VirtualAddress > View->Sections[i].VirtualAddress)
+		{
+			View->SectionsByRva[j] = View->SectionsByRva[j - 1];
+			j--;
+		}
+		View->SectionsByRva[j] = (UINT8)i;
+	}
+
+	InitializePeImageDirectory(View, EFI_IMAGE_DIRECTORY_ENTRY_EXPORT, &View->Exports);
+	InitializePeImageDirectory(View, EFI_IMAGE_DIRECTORY_ENTRY_IMPORT, &View->Imports);
+	InitializePeImageDirectory(View, EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION, &View->Exceptions);
+	InitializePeImageDirectory(View, EFI_IMAGE_DIRECTORY_ENTRY_RESOURCE, &View->Resources);
+
+	return EFI_SUCCESS;
+}
+
+// Returns the first section whose name is exactly Name, or NULL if there is none. Names longer than 8 characters never match
+PEFI_IMAGE_SECTION_HEADER
+EFIAPI
+PeImageFindSection(
+	IN CONST PE_IMAGE_VIEW* View,
+	IN CONST CHAR8* Name
+	)
+{
+	for (UINT16 i = 0; i < View->NumSections; ++i)
+	{
+		CONST UINT8* SectionName = View->Sections[i].Name;
+		UINTN j = 0;
+		while (j < EFI_IMAGE_SIZEOF_SHORT_NAME && Name[j] != '\0' && (CHAR8)SectionName[j] == Name[j])
+			j++;
+
+		if (j == EFI_IMAGE_SIZEOF_SHORT_NAME ? Name[j] == '\0' : (Name[j] == '\0' && SectionName[j] == '\0'))
+			return &View->Sections[i];
+	}
+	return NULL;
+}
+
+// Returns the section that contains Rva, or NULL if it is not inside any section
+PEFI_IMAGE_SECTION_HEADER
+EFIAPI
+PeImageSectionFromRva(
+	IN CONST PE_IMAGE_VIEW* View,
+	IN UINT32 Rva
+	)
+{
+	// Find the last section that starts at or below Rva
+	UINT32 Low = 0, High = View->NumSections;
+	while (Low < High)
+	{
+		CONST UINT32 Middle = (Low + High) / 2;
+		if (View->Sections[View->SectionsByRva[Middle]].VirtualAddress <= Rva)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+	if (Low == 0)
+		return NULL;
+
+	CONST PEFI_IMAGE_SECTION_HEADER Section = &View->Sections[View->SectionsByRva[Low - 1]];
+	return Rva - Section->VirtualAddress < Section->Misc.VirtualSize ? Section : NULL;
+}
+
+// Same as RvaToOffset(), using the sorted section table of the view
+UINT32
+EFIAPI
+PeImageRvaToOffset(
+	IN CONST PE_IMAGE_VIEW* View,
+	IN UINT32 Rva
+	)
+{
+	CONST PEFI_IMAGE_SECTION_HEADER Section = PeImageSectionFromRva(View, Rva);
+	return Section != NULL ? Rva - Section->VirtualAddress + Section->PointerToRawData : 0;
+}
+
+// Same as GetProcedureAddress(), but uses the export name table attached to the view if there is one
+VOID*
+EFIAPI
+PeImageGetProcedureAddress(
+	IN CONST PE_IMAGE_VIEW* View,
+	IN CONST CHAR8* RoutineName
+	)
+{
+	if (View->ExportNameTable != NULL)
+		return GetProcedureAddressFromTable(View->ExportNameTable, RoutineName);
+	return View->Exports.Data != NULL
+		? GetProcedureAddress((UINTN)View->ImageBase, View->NtHeaders, RoutineName)
+		: NULL;
+}
+
+// Same as FindIATAddressForImport(), but uses the import index attached to the view if there is one
+EFI_STATUS
+EFIAPI
+PeImageFindIATAddress(
+	IN CONST PE_IMAGE_VIEW* View,
+	IN CONST CHAR8* ImportDllName,
+	IN CONST CHAR8* FunctionName,
+	OUT VOID **FunctionIATAddress
+	)
+{
+	if (View->ImportIndex != NULL)
+		return FindIATAddressInIndex(View->ImportIndex, ImportDllName, FunctionName, FunctionIATAddress);
+	return FindIATAddressForImport(View->ImageBase, View->NtHeaders, ImportDllName, FunctionName, FunctionIATAddress);
+}
+
 // The kernel and ntdll divide this into [ RtlImageDirectoryEntryToData -> RtlpImageDirectoryEntryToData ->
 // { RtlpImageDirectoryEntryToData32 / RtlpImageDirectoryEntryToData64 } -> RtlpAddressInSectionTable ->
 // RtlpSectionTableFromVirtualAddress ], but with some macro help and RvaToOffset it can be limited to one function
@@ -370,6 +941,29 @@ RtlpImageDirectoryEntryToDataEx(
 	return (UINT8*)(Base) + RvaToOffset(NtHeaders, Rva);
 }
 
+// Returns the entry with the specified ID in a resource directory, or NULL if there is none. ID entries follow the named entries, sorted by ID
+STATIC
+CONST EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*
+FindResourceDirectoryEntryById(
+	IN CONST EFI_IMAGE_RESOURCE_DIRECTORY* Directory,
+	IN UINT16 Id
+	)
+{
+	CONST EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY* IdEntries = (CONST EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(Directory + 1) + Directory->NumberOfNamedEntries;
+	UINT32 Low = 0, High = Directory->NumberOfIdEntries;
+	while (Low < High)
+	{
+		CONST UINT32 Middle = (Low + High) / 2;
+		if (IdEntries[Middle].u1.Id < Id)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+	return Low < Directory->NumberOfIdEntries && IdEntries[Low].u1.Id == Id && !IdEntries[Low].u1.s.NameIsString
+		? &IdEntries[Low]
+		: NULL;
+}
+
 // Similar to LdrFindResource_U + LdrAccessResource combined, with some shortcuts for size optimization:
 // - Only IDs are supported for type/name/language, not strings. Named entries ("MUI", "RCDATA", ...) are ignored.
 // - Only images are supported, not mapped data files (e.g. LoadLibrary(..., LOAD_LIBRARY_AS_DATAFILE) data).
@@ -405,43 +999,25 @@ FindResourceDataById(
 	if (ResourceDirTable == NULL || Size == 0)
 		return EFI_NOT_FOUND;
 
+	// Type and name IDs are looked up with a binary search. If no language ID is given, the first language entry wins
 	CONST UINT8* ResourceDirVa = (UINT8*)ResourceDirTable;
-	EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY *DirEntry = NULL;
-	for (UINT16 i = ResourceDirTable->NumberOfNamedEntries; i < ResourceDirTable->NumberOfNamedEntries + ResourceDirTable->NumberOfIdEntries; ++i)
-	{
-		DirEntry = (EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)((UINT8*)ResourceDirTable + sizeof(EFI_IMAGE_RESOURCE_DIRECTORY) + (i * sizeof(EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY)));
-		if ((BOOLEAN)DirEntry->u1.s.NameIsString)
-			continue;
-		if (DirEntry->u1.Id == TypeId && DirEntry->u2.s.DataIsDirectory)
-			break;
-	}
-	if (DirEntry == NULL || DirEntry->u1.Id != TypeId)
+	CONST EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY *DirEntry = FindResourceDirectoryEntryById(ResourceDirTable, TypeId);
+	if (DirEntry == NULL || !DirEntry->u2.s.DataIsDirectory)
 		return EFI_NOT_FOUND;
 
 	ResourceDirTable = (EFI_IMAGE_RESOURCE_DIRECTORY*)(ResourceDirVa + DirEntry->u2.s.OffsetToDirectory);
-	DirEntry = NULL;
-	for (UINT16 i = ResourceDirTable->NumberOfNamedEntries; i < ResourceDirTable->NumberOfNamedEntries + ResourceDirTable->NumberOfIdEntries; ++i)
-	{
-		DirEntry = (EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)((UINT8*)ResourceDirTable + sizeof(EFI_IMAGE_RESOURCE_DIRECTORY) + (i * sizeof(EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY)));
-		if ((BOOLEAN)DirEntry->u1.s.NameIsString)
-			continue;
-		if (DirEntry->u1.Id == NameId && DirEntry->u2.s.DataIsDirectory)
-			break;
-	}
-	if (DirEntry == NULL || DirEntry->u1.Id != NameId)
+	DirEntry = FindResourceDirectoryEntryById(ResourceDirTable, NameId);
+	if (DirEntry == NULL || !DirEntry->u2.s.DataIsDirectory)
 		return EFI_NOT_FOUND;
 
 	ResourceDirTable = (EFI_IMAGE_RESOURCE_DIRECTORY*)(ResourceDirVa + DirEntry->u2.s.OffsetToDirectory);
-	DirEntry = NULL;
-	for (UINT16 i = ResourceDirTable->NumberOfNamedEntries; i < ResourceDirTable->NumberOfNamedEntries + ResourceDirTable->NumberOfIdEntries; ++i)
-	{
-		DirEntry = (EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)((UINT8*)ResourceDirTable + sizeof(EFI_IMAGE_RESOURCE_DIRECTORY) + (i * sizeof(EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY)));
-		if ((BOOLEAN)DirEntry->u1.s.NameIsString)
-			continue;
-		if ((LanguageId == 0 || DirEntry->u1.Id == LanguageId) && !DirEntry->u2.s.DataIsDirectory)
-			break;
-	}
-	if (DirEntry == NULL || (LanguageId != 0 && DirEntry->u1.Id != LanguageId))
+	if (LanguageId != 0)
+		DirEntry = FindResourceDirectoryEntryById(ResourceDirTable, LanguageId);
+	else
+		DirEntry = ResourceDirTable->NumberOfIdEntries > 0
+			? (CONST EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(ResourceDirTable + 1) + ResourceDirTable->NumberOfNamedEntries
+			: NULL;
+	if (DirEntry == NULL || DirEntry->u2.s.DataIsDirectory)
 		return EFI_INVALID_LANGUAGE;
 
 	EFI_IMAGE_RESOURCE_DATA_ENTRY *DataEntry = (EFI_IMAGE_RESOURCE_DATA_ENTRY*)(ResourceDirVa + DirEntry->u2.OffsetToData);
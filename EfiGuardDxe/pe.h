@@ -42,6 +42,11 @@ typedef EFI_IMAGE_EXPORT_DIRECTORY *PEFI_IMAGE_EXPORT_DIRECTORY;
 
 #define RUNTIME_FUNCTION_INDIRECT						0x1
 
+#define UNW_FLAG_NHANDLER								0x0
+#define UNW_FLAG_EHANDLER								0x1
+#define UNW_FLAG_UHANDLER								0x2
+#define UNW_FLAG_CHAININFO								0x4
+
 #define IMAGE32(NtHeaders) ((NtHeaders)->OptionalHeader.Magic == EFI_IMAGE_NT_OPTIONAL_HDR32_MAGIC)
 #define IMAGE64(NtHeaders) ((NtHeaders)->OptionalHeader.Magic == EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC)
 
@@ -188,6 +193,113 @@ typedef struct _IMAGE_RUNTIME_FUNCTION_ENTRY
 	} u;
 } IMAGE_RUNTIME_FUNCTION_ENTRY, *PIMAGE_RUNTIME_FUNCTION_ENTRY;
 
+//
+// Unwind info header. Only the fixed part is defined here; the unwind codes and optional handler/chained entry data follow it
+//
+typedef struct _UNWIND_INFO
+{
+	UINT8 Version : 3;
+	UINT8 Flags : 5;
+	UINT8 SizeOfProlog;
+	UINT8 CountOfCodes;
+	UINT8 FrameRegister : 4;
+	UINT8 FrameOffset : 4;
+} UNWIND_INFO, *PUNWIND_INFO;
+
+//
+// A name to resolve with GetProcedureAddresses(). Address receives the export address, or NULL if the name is not exported
+//
+typedef struct _EXPORT_LOOKUP
+{
+	CONST CHAR8* Name;
+	VOID* Address;
+} EXPORT_LOOKUP, *PEXPORT_LOOKUP;
+
+//
+// Hash table of the export names of an image, for images whose exports are looked up many times. Buckets is a caller-provided buffer
+// of NumBuckets entries. NumBuckets must be a power of 2 greater than the number of export names, and preferably at least twice that.
+//
+typedef struct _EXPORT_NAME_TABLE
+{
+	UINTN DllBase;
+	CONST EFI_IMAGE_EXPORT_DIRECTORY* ExportDirectory;	// NULL if the image has no exports
+	UINT32 ExportDirRva;
+	UINT32 ExportDirSize;
+	UINT32* Buckets;									// Index in the export name table + 1, or 0 if the bucket is empty
+	UINT32 NumBuckets;
+} EXPORT_NAME_TABLE, *PEXPORT_NAME_TABLE;
+
+//
+// An entry of an IMPORT_INDEX. The bucket is empty if IatRva is 0
+//
+typedef struct _IMPORT_INDEX_ENTRY
+{
+	UINT32 Hash;										// Case-insensitive hash of the DLL name and the function name
+	UINT32 DllNameRva;
+	UINT32 FunctionNameRva;
+	UINT32 IatRva;
+} IMPORT_INDEX_ENTRY, *PIMPORT_INDEX_ENTRY;
+
+//
+// Hash table of the imports by name of an image, which maps each DLL and function name pair to the IAT entry of the function. Buckets is a
+// caller-provided buffer of NumBuckets entries. NumBuckets must be a power of 2 greater than the number of imports, and preferably at least twice that.
+//
+typedef struct _IMPORT_INDEX
+{
+	CONST UINT8* ImageBase;
+	PIMPORT_INDEX_ENTRY Buckets;
+	UINT32 NumBuckets;
+	UINT32 Count;
+} IMPORT_INDEX, *PIMPORT_INDEX;
+
+//
+// A function to look up with FindIATAddressesInIndex(). IATAddress receives the address of the IAT entry, or NULL if the function is not imported
+//
+typedef struct _IMPORT_LOOKUP
+{
+	CONST CHAR8* DllName;
+	CONST CHAR8* FunctionName;
+	VOID* IATAddress;
+} IMPORT_LOOKUP, *PIMPORT_LOOKUP;
+
+//
+// Maximum number of sections supported by PE_IMAGE_VIEW. Kernel images have about 30
+//
+#define PE_IMAGE_VIEW_MAX_SECTIONS						96
+
+//
+// A data directory of a PE_IMAGE_VIEW. Data is NULL if the image does not have the directory
+//
+typedef struct _PE_IMAGE_DIRECTORY
+{
+	UINT8* Data;
+	UINT32 Rva;
+	UINT32 Size;
+} PE_IMAGE_DIRECTORY, *PPE_IMAGE_DIRECTORY;
+
+//
+// A parsed view of a mapped PE image, filled once by InitializePeImageView() and then passed to every locator that runs on the image.
+// SectionsByRva holds the indices of the sections in Sections, sorted by VirtualAddress for PeImageSectionFromRva().
+// ExportNameTable and ImportIndex are optional lookup tables that the owner of the view may build and attach; they are NULL by default.
+//
+typedef struct _PE_IMAGE_VIEW
+{
+	UINT8* ImageBase;
+	UINT32 SizeOfImage;
+	PEFI_IMAGE_NT_HEADERS NtHeaders;
+	PEFI_IMAGE_SECTION_HEADER Sections;
+	UINT16 NumSections;
+	UINT8 SectionsByRva[PE_IMAGE_VIEW_MAX_SECTIONS];
+
+	PE_IMAGE_DIRECTORY Exports;
+	PE_IMAGE_DIRECTORY Imports;
+	PE_IMAGE_DIRECTORY Exceptions;
+	PE_IMAGE_DIRECTORY Resources;
+
+	CONST EXPORT_NAME_TABLE* ExportNameTable;
+	CONST IMPORT_INDEX* ImportIndex;
+} PE_IMAGE_VIEW, *PPE_IMAGE_VIEW;
+
 
 //
 // Function declarations
@@ -220,6 +332,30 @@ GetProcedureAddress(
 	IN CONST CHAR8* RoutineName
 	);
 
+EFI_STATUS
+EFIAPI
+GetProcedureAddresses(
+	IN UINTN DllBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN OUT PEXPORT_LOOKUP Lookups,
+	IN UINT32 NumLookups
+	);
+
+EFI_STATUS
+EFIAPI
+BuildExportNameTable(
+	IN UINTN DllBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN OUT PEXPORT_NAME_TABLE Table
+	);
+
+VOID*
+EFIAPI
+GetProcedureAddressFromTable(
+	IN CONST EXPORT_NAME_TABLE* Table,
+	IN CONST CHAR8* RoutineName
+	);
+
 EFI_STATUS
 EFIAPI
 FindIATAddressForImport(
@@ -230,6 +366,31 @@ FindIATAddressForImport(
 	OUT VOID **FunctionIATAddress
 	);
 
+EFI_STATUS
+EFIAPI
+BuildImportIndex(
+	IN CONST VOID* ImageBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN OUT PIMPORT_INDEX Index
+	);
+
+EFI_STATUS
+EFIAPI
+FindIATAddressInIndex(
+	IN CONST IMPORT_INDEX* Index,
+	IN CONST CHAR8* ImportDllName,
+	IN CONST CHAR8* FunctionName,
+	OUT VOID **FunctionIATAddress
+	);
+
+EFI_STATUS
+EFIAPI
+FindIATAddressesInIndex(
+	IN CONST IMPORT_INDEX* Index,
+	IN OUT PIMPORT_LOOKUP Lookups,
+	IN UINT32 NumLookups
+	);
+
 UINT32
 EFIAPI
 RvaToOffset(
@@ -237,6 +398,51 @@ RvaToOffset(
 	IN UINT32 Rva
 	);
 
+EFI_STATUS
+EFIAPI
+InitializePeImageView(
+	IN VOID* ImageBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	OUT PPE_IMAGE_VIEW View
+	);
+
+PEFI_IMAGE_SECTION_HEADER
+EFIAPI
+PeImageFindSection(
+	IN CONST PE_IMAGE_VIEW* View,
+	IN CONST CHAR8* Name
+	);
+
+PEFI_IMAGE_SECTION_HEADER
+EFIAPI
+PeImageSectionFromRva(
+	IN CONST PE_IMAGE_VIEW* View,
+	IN UINT32 Rva
+	);
+
+UINT32
+EFIAPI
+PeImageRvaToOffset(
+	IN CONST PE_IMAGE_VIEW* View,
+	IN UINT32 Rva
+	);
+
+VOID*
+EFIAPI
+PeImageGetProcedureAddress(
+	IN CONST PE_IMAGE_VIEW* View,
+	IN CONST CHAR8* RoutineName
+	);
+
+EFI_STATUS
+EFIAPI
+PeImageFindIATAddress(
+	IN CONST PE_IMAGE_VIEW* View,
+	IN CONST CHAR8* ImportDllName,
+	IN CONST CHAR8* FunctionName,
+	OUT VOID **FunctionIATAddress
+	);
+
 VOID*
 EFIAPI
 RtlpImageDirectoryEntryToDataEx(
@@ -2,11 +2,16 @@
 #include "util.h"
 
 #include <Library/UefiLib.h>
+#include <Library/BaseLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/DevicePathLib.h>
 #include <Library/PrintLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 
+#if defined(MDE_CPU_X64)
+#include <emmintrin.h>
+#endif
+
 #ifndef ZYDIS_DISABLE_FORMATTER
 #include <Library/PrintLib.h>
 #include <Zycore/Format.h>
@@ -14,6 +19,10 @@
 STATIC ZydisFormatterFunc DefaultInstructionFormatter;
 #endif
 
+BOOT_STATISTICS_STORAGE EFIGUARD_STATISTICS gBootStatistics;
+
+STATIC CONST CHAR16* CONST StageNames[EFIGUARD_STAGE_MAX] = EFIGUARD_STAGE_NAMES;
+
 
 EFI_STATUS
 EFIAPI
@@ -59,13 +68,69 @@ PrintLoadedImageInfo(
 	)
 {
 	CHAR16* PathString = ConvertDevicePathToText(ImageInfo->FilePath, TRUE, TRUE);
-	Print(L"\r\n[+] %s\r\n", PathString);
-	Print(L"    -> ImageBase = %llx\r\n", ImageInfo->ImageBase);
-	Print(L"    -> ImageSize = %llx\r\n", ImageInfo->ImageSize);
+	ConsolePrint(VERBOSITY_VERBOSE, L"\r\n[+] %s\r\n", PathString);
+	ConsolePrint(VERBOSITY_VERBOSE, L"    -> ImageBase = %llx\r\n", ImageInfo->ImageBase);
+	ConsolePrint(VERBOSITY_VERBOSE, L"    -> ImageSize = %llx\r\n", ImageInfo->ImageSize);
 	if (PathString != NULL)
 		FreePool(PathString);
 }
 
+// Determines the sizes of the arguments consumed by a PrintLib format string. Integers without the 'l' prefix are read as UINT32,
+// and pointers, characters, statuses and '*' widths as UINTN. Returns the number of arguments, which may exceed the number of sizes stored
+STATIC
+UINT32
+GetFormatArgumentSizes(
+	IN CONST CHAR16 *Format,
+	OUT UINT8 ArgumentSizes[KERNEL_PATCH_MESSAGE_MAX_ARGUMENTS]
+	)
+{
+	UINT32 NumArguments = 0;
+	while (*Format != CHAR_NULL)
+	{
+		if (*Format++ != L'%')
+			continue;
+
+		UINT8 Size = sizeof(UINT32);
+		BOOLEAN Done = FALSE;
+		while (!Done && *Format != CHAR_NULL)
+		{
+			UINT8 ArgumentSize = 0;
+			switch (*Format++)
+			{
+				case L'-': case L'+': case L' ': case L',': case L'.':
+				case L'0': case L'1': case L'2': case L'3': case L'4':
+				case L'5': case L'6': case L'7': case L'8': case L'9':
+					break;
+				case L'l': case L'L':
+					Size = sizeof(UINT64);
+					break;
+				case L'*':
+					ArgumentSize = sizeof(UINTN);
+					break;
+				case L'd': case L'u': case L'x': case L'X':
+					ArgumentSize = Size;
+					Done = TRUE;
+					break;
+				case L'p': case L'c': case L'r': case L's': case L'S': case L'a': case L'g': case L't':
+					ArgumentSize = sizeof(UINTN);
+					Done = TRUE;
+					break;
+				default: // '%' or an unknown type, neither of which consumes an argument
+					Done = TRUE;
+					break;
+			}
+
+			if (ArgumentSize != 0)
+			{
+				if (NumArguments < KERNEL_PATCH_MESSAGE_MAX_ARGUMENTS)
+					ArgumentSizes[NumArguments] = ArgumentSize;
+				NumArguments++;
+			}
+		}
+	}
+	return NumArguments;
+}
+
 VOID
 EFIAPI
 AppendKernelPatchMessage(
@@ -73,50 +138,170 @@ AppendKernelPatchMessage(
 	...
 	)
 {
-	ASSERT(gKernelPatchInfo.BufferSize % sizeof(CHAR16) == 0);
-	ASSERT(gKernelPatchInfo.BufferSize < sizeof(gKernelPatchInfo.Buffer));
+	KERNEL_PATCH_MESSAGE* Message = &gKernelPatchInfo.Messages[gKernelPatchInfo.NumMessages % KERNEL_PATCH_MAX_MESSAGES];
+	gKernelPatchInfo.NumMessages++;
+
+	Message->Format = Format;
+	Message->Tsc = AsmReadTsc();
 
+	UINT8 ArgumentSizes[KERNEL_PATCH_MESSAGE_MAX_ARGUMENTS];
+	CONST UINT32 NumArguments = GetFormatArgumentSizes(Format, ArgumentSizes);
+	ASSERT(NumArguments <= KERNEL_PATCH_MESSAGE_MAX_ARGUMENTS);
+	if (NumArguments > KERNEL_PATCH_MESSAGE_MAX_ARGUMENTS)
+	{
+		// Print the format string itself rather than reading past the stored arguments later
+		Message->Format = L"%s";
+		Message->Arguments[0] = (UINTN)Format;
+		return;
+	}
+
+	// Only the raw arguments are stored. Formatting is deferred until PrintKernelPatchInfo() is called
 	VA_LIST VaList;
 	VA_START(VaList, Format);
-	CONST UINTN NumCharsPrinted = UnicodeVSPrint(gKernelPatchInfo.Buffer + (gKernelPatchInfo.BufferSize / sizeof(CHAR16)),
-												sizeof(gKernelPatchInfo.Buffer) - gKernelPatchInfo.BufferSize,
-												Format,
-												VaList);
+	for (UINT32 i = 0; i < NumArguments; ++i)
+	{
+		Message->Arguments[i] = ArgumentSizes[i] == sizeof(UINT64)
+			? VA_ARG(VaList, UINT64)
+			: VA_ARG(VaList, UINT32);
+	}
 	VA_END(VaList);
+}
+
+VOID
+EFIAPI
+PrintKernelPatchInfo(
+	VOID
+	)
+{
+	ASSERT(gST->ConOut != NULL);
+
+	UINT32 First = 0;
+	CONST UINT32 Count = gKernelPatchInfo.NumMessages;
+	if (Count > KERNEL_PATCH_MAX_MESSAGES)
+	{
+		First = Count - KERNEL_PATCH_MAX_MESSAGES;
+		ConsolePrint(VERBOSITY_QUIET, L"[!] %u earlier kernel patch message(s) were overwritten.\r\n", First);
+	}
+
+	// Each message is formatted separately. This is to prevent issues with platforms that have small Print() buffer limits
+	CHAR16 String[512];
+	for (UINT32 i = First; i < Count; ++i)
+	{
+		CONST KERNEL_PATCH_MESSAGE* Message = &gKernelPatchInfo.Messages[i % KERNEL_PATCH_MAX_MESSAGES];
 
-	ASSERT(gKernelPatchInfo.BufferSize + (NumCharsPrinted * sizeof(CHAR16)) < sizeof(gKernelPatchInfo.Buffer));
-	gKernelPatchInfo.BufferSize += (NumCharsPrinted * sizeof(CHAR16));
+		UINT8 ArgumentSizes[KERNEL_PATCH_MESSAGE_MAX_ARGUMENTS];
+		CONST UINT32 NumArguments = MIN(GetFormatArgumentSizes(Message->Format, ArgumentSizes), KERNEL_PATCH_MESSAGE_MAX_ARGUMENTS);
 
-	// Paranoid null terminator (UnicodeVSPrint should do this)
-	*(gKernelPatchInfo.Buffer + (gKernelPatchInfo.BufferSize / sizeof(CHAR16))) = CHAR_NULL;
+		UINT64 ArgumentList[KERNEL_PATCH_MESSAGE_MAX_ARGUMENTS];
+		BASE_LIST Marker = (BASE_LIST)ArgumentList;
+		for (UINT32 j = 0; j < NumArguments; ++j)
+		{
+			if (ArgumentSizes[j] == sizeof(UINT64))
+				BASE_ARG(Marker, UINT64) = Message->Arguments[j];
+			else
+				BASE_ARG(Marker, UINT32) = (UINT32)Message->Arguments[j];
+		}
 
-	// Separate the next message using the null terminator. This is because most Print() implementations crap out
-	// after ~4 lines (depending on PCDs), so we will print the final buffer using multiple calls to Print()
-	gKernelPatchInfo.BufferSize += sizeof(CHAR16);
+		UnicodeBSPrint(String, sizeof(String), Message->Format, (BASE_LIST)ArgumentList);
+		ConsoleWrite(String);
+	}
 }
 
 VOID
 EFIAPI
-PrintKernelPatchInfo(
+BeginStage(
+	OUT PSTAGE_TIMER Timer,
+	IN EFIGUARD_STAGE Stage
+	)
+{
+	ASSERT(Stage < EFIGUARD_STAGE_MAX);
+
+	Timer->Stage = Stage;
+	Timer->BytesScanned = gBootStatistics.BytesScanned;
+	Timer->InstructionsDecoded = gBootStatistics.InstructionsDecoded;
+	Timer->ResyncEvents = gBootStatistics.ResyncEvents;
+	Timer->StartTsc = AsmReadTsc();
+}
+
+VOID
+EFIAPI
+EndStage(
+	IN OUT PSTAGE_TIMER Timer
+	)
+{
+	CONST UINT64 EndTsc = AsmReadTsc();
+	if (Timer->Stage >= EFIGUARD_STAGE_MAX)
+		return;
+
+	EFIGUARD_STAGE_STATISTICS* Stage = &gBootStatistics.Stages[Timer->Stage];
+	if (Stage->Count++ == 0)
+		Stage->FirstTsc = Timer->StartTsc;
+	Stage->LastTsc = EndTsc;
+	Stage->Ticks += EndTsc - Timer->StartTsc;
+	Stage->BytesScanned += gBootStatistics.BytesScanned - Timer->BytesScanned;
+	Stage->InstructionsDecoded += gBootStatistics.InstructionsDecoded - Timer->InstructionsDecoded;
+	Stage->ResyncEvents += gBootStatistics.ResyncEvents - Timer->ResyncEvents;
+
+	Timer->Stage = EFIGUARD_STAGE_MAX;
+}
+
+VOID
+EFIAPI
+InitializeBootStatistics(
 	VOID
 	)
 {
-	ASSERT(gST->ConOut != NULL);
+	ZeroMem(&gBootStatistics, sizeof(gBootStatistics));
+
+	// Calibrate the TSC against the firmware's stall service. 1 ms is accurate enough to convert stage timings to microseconds
+	CONST UINT64 StartTsc = AsmReadTsc();
+	if (!EFI_ERROR(gBS->Stall(1000)))
+		gBootStatistics.TscFrequency = MultU64x32(AsmReadTsc() - StartTsc, 1000);
+}
 
-	UINTN NumChars = gKernelPatchInfo.BufferSize / sizeof(CHAR16);
-	if (NumChars * sizeof(CHAR16) >= sizeof(gKernelPatchInfo.Buffer) - sizeof(CHAR16))
-		NumChars = sizeof(gKernelPatchInfo.Buffer) - (2 * sizeof(CHAR16)); // Avoid buffer overrun
+// Converts TSC ticks to microseconds, or returns the ticks unchanged if the TSC frequency is unknown
+STATIC
+UINT64
+TicksToMicroseconds(
+	IN UINT64 Ticks
+	)
+{
+	if (gBootStatistics.TscFrequency == 0)
+		return Ticks;
+	return DivU64x64Remainder(MultU64x32(Ticks, 1000000), gBootStatistics.TscFrequency, NULL);
+}
 
-	CHAR16* String = gKernelPatchInfo.Buffer;
-	String[NumChars] = String[NumChars + 1] = CHAR_NULL; // Ensure we have a double null terminator at the end
-	UINTN Length;
+VOID
+EFIAPI
+PrintBootStatistics(
+	VOID
+	)
+{
+	// Stage start times are shown relative to the first stage that was run
+	UINT64 BaseTsc = MAX_UINT64;
+	for (UINT32 i = 0; i < EFIGUARD_STAGE_MAX; ++i)
+	{
+		if (gBootStatistics.Stages[i].Count != 0 && gBootStatistics.Stages[i].FirstTsc < BaseTsc)
+			BaseTsc = gBootStatistics.Stages[i].FirstTsc;
+	}
+	if (BaseTsc == MAX_UINT64)
+		return;
 
-	// A double null terminator marks the end. It's just like that lovely Win32 getenv API that makes me want to kill myself every time I see it
-	while ((Length = StrLen(String)) != 0)
+	CONST CHAR16* Unit = gBootStatistics.TscFrequency != 0 ? L"us" : L"ticks";
+	ConsolePrint(VERBOSITY_QUIET, L"\r\n%-38S %5S %12S %12S %12S %10S %8S\r\n", L"Stage", L"Runs", L"Start", L"Time", L"Bytes", L"Decoded", L"Resyncs");
+	for (UINT32 i = 0; i < EFIGUARD_STAGE_MAX; ++i)
 	{
-		gST->ConOut->OutputString(gST->ConOut, String);
-		String += Length + 1;
+		CONST EFIGUARD_STAGE_STATISTICS* Stage = &gBootStatistics.Stages[i];
+		if (Stage->Count == 0)
+			continue;
+
+		ConsolePrint(VERBOSITY_QUIET, L"%-38S %5u %12lu %12lu %12lu %10lu %8lu\r\n",
+			StageNames[i], Stage->Count, TicksToMicroseconds(Stage->FirstTsc - BaseTsc), TicksToMicroseconds(Stage->Ticks),
+			Stage->BytesScanned, Stage->InstructionsDecoded, Stage->ResyncEvents);
 	}
+	ConsolePrint(VERBOSITY_QUIET, L"%-38S %5S %12S %12S %12lu %10lu %8lu\r\n", L"Total", L"", L"", L"",
+		gBootStatistics.BytesScanned, gBootStatistics.InstructionsDecoded, gBootStatistics.ResyncEvents);
+	ConsolePrint(VERBOSITY_QUIET, L"Times are in %S. TSC frequency: %lu Hz\r\n", Unit, gBootStatistics.TscFrequency);
 }
 
 VOID
@@ -187,6 +372,220 @@ SetWpMem(
 	return Result;
 }
 
+VOID
+EFIAPI
+InitializePatchPlan(
+	OUT PATCH_PLAN *Plan
+	)
+{
+	Plan->Status = EFI_SUCCESS;
+	Plan->NumEntries = 0;
+}
+
+// Reserves the next entry of a patch plan, or records the failure in the plan
+STATIC
+PATCH_PLAN_ENTRY*
+AllocatePatchPlanEntry(
+	IN OUT PATCH_PLAN *Plan,
+	IN VOID *Destination,
+	IN UINTN Length
+	)
+{
+	if (Destination == NULL || Length == 0 || Length > PATCH_PLAN_MAX_PATCH_SIZE)
+	{
+		Plan->Status = EFI_INVALID_PARAMETER;
+		return NULL;
+	}
+	if (Plan->NumEntries >= PATCH_PLAN_MAX_ENTRIES)
+	{
+		Plan->Status = EFI_OUT_OF_RESOURCES;
+		return NULL;
+	}
+
+	PATCH_PLAN_ENTRY* Entry = &Plan->Entries[Plan->NumEntries++];
+	Entry->Address = (UINT8*)Destination;
+	Entry->Length = (UINT32)Length;
+	Entry->VerifyExpected = FALSE;
+	return Entry;
+}
+
+EFI_STATUS
+EFIAPI
+AddPatchPlanEntry(
+	IN OUT PATCH_PLAN *Plan,
+	IN VOID *Destination,
+	IN CONST VOID *Expected OPTIONAL,
+	IN CONST VOID *Patch,
+	IN UINTN Length
+	)
+{
+	PATCH_PLAN_ENTRY* Entry = AllocatePatchPlanEntry(Plan, Destination, Length);
+	if (Entry == NULL)
+		return Plan->Status;
+
+	if (Expected != NULL)
+	{
+		CopyMem(Entry->Expected, Expected, Length);
+		Entry->VerifyExpected = TRUE;
+	}
+	CopyMem(Entry->Patch, Patch, Length);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+AddPatchPlanFill(
+	IN OUT PATCH_PLAN *Plan,
+	IN VOID *Destination,
+	IN UINTN Length,
+	IN UINT8 Value
+	)
+{
+	PATCH_PLAN_ENTRY* Entry = AllocatePatchPlanEntry(Plan, Destination, Length);
+	if (Entry == NULL)
+		return Plan->Status;
+
+	SetMem(Entry->Patch, Length, Value);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+ApplyPatchPlan(
+	IN OUT PATCH_PLAN *Plan
+	)
+{
+	if (EFI_ERROR(Plan->Status))
+		return Plan->Status;
+
+	// Verify all entries before writing anything
+	for (UINT32 i = 0; i < Plan->NumEntries; ++i)
+	{
+		CONST PATCH_PLAN_ENTRY* Entry = &Plan->Entries[i];
+		if (Entry->VerifyExpected && CompareMem(Entry->Address, Entry->Expected, Entry->Length) != 0)
+			return EFI_COMPROMISED_DATA;
+	}
+
+	BOOLEAN WpEnabled, CetEnabled;
+	DisableWriteProtect(&WpEnabled, &CetEnabled);
+
+	EFI_STATUS Status = EFI_SUCCESS;
+	UINT32 NumApplied;
+	for (NumApplied = 0; NumApplied < Plan->NumEntries; ++NumApplied)
+	{
+		PATCH_PLAN_ENTRY* Entry = &Plan->Entries[NumApplied];
+		CopyMem(Entry->Original, Entry->Address, Entry->Length);
+		CopyMem(Entry->Address, Entry->Patch, Entry->Length);
+		if (CompareMem(Entry->Address, Entry->Patch, Entry->Length) != 0)
+		{
+			Status = EFI_DEVICE_ERROR;
+			++NumApplied; // Also roll back the partial write
+			break;
+		}
+	}
+
+	// Roll back in reverse order, so that overlapping patches are undone correctly
+	if (EFI_ERROR(Status))
+	{
+		while (NumApplied-- > 0)
+		{
+			CONST PATCH_PLAN_ENTRY* Entry = &Plan->Entries[NumApplied];
+			CopyMem(Entry->Address, Entry->Original, Entry->Length);
+		}
+	}
+
+	EnableWriteProtect(WpEnabled, CetEnabled);
+	return Status;
+}
+
+VOID
+EFIAPI
+InitializeArena(
+	OUT PARENA Arena,
+	IN VOID *Buffer,
+	IN UINTN Size
+	)
+{
+	Arena->Base = (UINT8*)Buffer;
+	Arena->Size = Size;
+	Arena->Used = 0;
+}
+
+VOID*
+EFIAPI
+ArenaAllocate(
+	IN OUT PARENA Arena,
+	IN UINTN Size,
+	IN UINTN Alignment
+	)
+{
+	ASSERT(Alignment != 0 && (Alignment & (Alignment - 1)) == 0);
+
+	CONST UINTN Start = ALIGN_VALUE((UINTN)Arena->Base + Arena->Used, Alignment) - (UINTN)Arena->Base;
+	if (Start > Arena->Size || Size > Arena->Size - Start)
+		return NULL;
+
+	Arena->Used = Start + Size;
+	return Arena->Base + Start;
+}
+
+VOID
+EFIAPI
+ResetArena(
+	IN OUT PARENA Arena
+	)
+{
+	Arena->Used = 0;
+}
+
+// Holds the current value of a variable for SetVariableIfChanged(). Static rather than on the stack, because the callers run from the
+// boot manager and winload.efi hooks on the boot application's stack, which is not ours to spend 2KB of
+STATIC UINT64 mVariableStateBuffer[VARIABLE_STATE_MAX_SIZE / sizeof(UINT64)];
+
+EFI_STATUS
+EFIAPI
+SetVariableIfChanged(
+	IN CONST CHAR16 *VariableName,
+	IN CONST EFI_GUID *VendorGuid,
+	IN UINT32 Attributes,
+	IN UINTN DataSize,
+	IN CONST VOID *Data
+	)
+{
+	UINT32 CurrentAttributes = 0;
+	UINTN CurrentSize = sizeof(mVariableStateBuffer);
+	CONST EFI_STATUS Status = gRT->GetVariable((CHAR16*)VariableName,
+												(EFI_GUID*)VendorGuid,
+												&CurrentAttributes,
+												&CurrentSize,
+												mVariableStateBuffer);
+	if (Status == EFI_SUCCESS &&
+		CurrentAttributes == Attributes &&
+		CurrentSize == DataSize &&
+		CompareMem(mVariableStateBuffer, Data, DataSize) == 0)
+	{
+		return EFI_SUCCESS;
+	}
+
+	// The attributes of an existing variable cannot be changed without deleting it first. Its size can, so a variable with the same attributes
+	// is simply overwritten. On EFI_BUFFER_TOO_SMALL, older firmwares do not return the attributes, in which case they will not match and the variable is also deleted
+	if ((Status == EFI_SUCCESS || Status == EFI_BUFFER_TOO_SMALL) &&
+		CurrentAttributes != Attributes)
+	{
+		gRT->SetVariable((CHAR16*)VariableName,
+						(EFI_GUID*)VendorGuid,
+						0,
+						0,
+						NULL);
+	}
+
+	return gRT->SetVariable((CHAR16*)VariableName,
+							(EFI_GUID*)VendorGuid,
+							Attributes,
+							DataSize,
+							(VOID*)Data);
+}
+
 BOOLEAN
 EFIAPI
 IsFiveLevelPagingEnabled(
@@ -268,6 +667,9 @@ WaitForKey(
 	VOID
 	)
 {
+	// Make sure the prompt is visible
+	ConsoleFlush();
+
 	// Hack: because we call this at TPL_NOTIFY in ExitBootServices, we cannot use WaitForEvent()
 	// in that scenario because it requires TPL <= TPL_APPLICATION. So check the TPL
 	CONST EFI_TPL Tpl = EfiGetCurrentTpl();
@@ -300,6 +702,9 @@ SetConsoleTextColour(
 	IN BOOLEAN ClearScreen
 	)
 {
+	// Anything that is still buffered was meant to be printed in the previous colour
+	ConsoleFlush();
+
 	CONST INT32 OriginalAttribute = gST->ConOut->Mode->Attribute;
 	CONST UINTN BackgroundColour = (UINTN)((OriginalAttribute >> 4) & 0x7);
 
@@ -310,128 +715,618 @@ SetConsoleTextColour(
 	return OriginalAttribute;
 }
 
-// TODO: #ifdef EFI_DEBUG, this should keep a match count and continue until the end of the buffer, then ASSERT(MatchCount == 1)
-EFI_STATUS
-EFIAPI
-FindPattern(
-	IN CONST UINT8* Pattern,
-	IN UINT8 Wildcard,
-	IN UINT32 PatternLength,
-	IN CONST VOID* Base,
-	IN UINT32 Size,
-	OUT VOID **Found
+// Byte values that are very common in x64 PE images (code as well as data), in roughly descending order of frequency.
+// Anything not in this list is considered rare, which makes it a good anchor byte for the pattern scanner
+STATIC CONST UINT8 CommonImageBytes[] = {
+	0x00, 0xFF, 0x48, 0x8B, 0xCC, 0x89, 0x0F, 0x24, 0x4C, 0x44, 0x01, 0x85, 0xC0, 0x83, 0xE8, 0x8D,
+	0x74, 0x45, 0x49, 0x41, 0x10, 0x08, 0x20, 0x33, 0x75, 0x28, 0x30, 0x40, 0x90, 0xC3, 0x02, 0x04
+};
+
+//
+// Two bytes of a pattern at fixed offsets that a position must match before the full pattern is compared there
+//
+typedef struct _PATTERN_ANCHORS
+{
+	UINT32 Offset0;
+	UINT32 Offset1;
+	UINT8 Byte0;
+	UINT8 Byte1;
+} PATTERN_ANCHORS;
+
+STATIC
+UINT32
+ByteCommonness(
+	IN UINT8 Value
 	)
 {
-	if (Found == NULL || Pattern == NULL || Base == NULL)
-		return EFI_INVALID_PARAMETER;
+	for (UINT32 i = 0; i < sizeof(CommonImageBytes); ++i)
+	{
+		if (CommonImageBytes[i] == Value)
+			return sizeof(CommonImageBytes) - i;
+	}
+	return 0;
+}
 
-	*Found = NULL;
+// Selects the two rarest fixed bytes of a pattern as its anchors. Mask may be NULL for a literal byte sequence.
+// Returns FALSE if the pattern consists of only wildcards
+STATIC
+BOOLEAN
+SelectPatternAnchors(
+	IN CONST UINT8* Bytes,
+	IN CONST CHAR8* Mask OPTIONAL,
+	IN UINT32 Length,
+	OUT PATTERN_ANCHORS* Anchors
+	)
+{
+	UINT32 Best = MAX_UINT32, SecondBest = MAX_UINT32;
+	UINT32 BestScore = MAX_UINT32, SecondBestScore = MAX_UINT32;
 
-	for (UINT8 *Address = (UINT8*)Base; Address < (UINT8*)((UINTN)Base + Size - PatternLength); ++Address)
+	for (UINT32 i = 0; i < Length; ++i)
 	{
-		UINT32 i;
-		for (i = 0; i < PatternLength; ++i)
+		if (Mask != NULL && Mask[i] != 'x')
+			continue;
+
+		CONST UINT32 Score = ByteCommonness(Bytes[i]);
+		if (Score < BestScore)
 		{
-			if (Pattern[i] != Wildcard && (*(Address + i) != Pattern[i]))
-				break;
+			SecondBest = Best;
+			SecondBestScore = BestScore;
+			Best = i;
+			BestScore = Score;
 		}
-
-		if (i == PatternLength)
+		else if (Score < SecondBestScore)
 		{
-			*Found = (VOID*)Address;
-			return EFI_SUCCESS;
+			SecondBest = i;
+			SecondBestScore = Score;
 		}
 	}
 
-	return EFI_NOT_FOUND;
+	if (Best == MAX_UINT32)
+		return FALSE;
+	if (SecondBest == MAX_UINT32)
+		SecondBest = Best; // Only one usable byte; the second compare is redundant but harmless
+
+	Anchors->Offset0 = Best;
+	Anchors->Offset1 = SecondBest;
+	Anchors->Byte0 = Bytes[Best];
+	Anchors->Byte1 = Bytes[SecondBest];
+	return TRUE;
+}
+
+// Returns the first offset in [Offset, LastOffset] at which both anchors match, or LastOffset + 1 if there is none.
+// On x64, 16 candidate positions are tested at a time using SSE2
+STATIC
+UINTN
+FindAnchorCandidate(
+	IN CONST PATTERN_ANCHORS* Anchors,
+	IN CONST UINT8* Start,
+	IN UINTN Offset,
+	IN UINTN LastOffset
+	)
+{
+#if defined(MDE_CPU_X64)
+	// Both loads stay in bounds: the highest byte read is Start + LastOffset + AnchorOffset, which lies within the last possible match
+	CONST __m128i Needle0 = _mm_set1_epi8((CHAR8)Anchors->Byte0);
+	CONST __m128i Needle1 = _mm_set1_epi8((CHAR8)Anchors->Byte1);
+	while (Offset + (sizeof(__m128i) - 1) <= LastOffset)
+	{
+		CONST __m128i Block0 = _mm_loadu_si128((CONST __m128i*)(Start + Offset + Anchors->Offset0));
+		CONST __m128i Block1 = _mm_loadu_si128((CONST __m128i*)(Start + Offset + Anchors->Offset1));
+		CONST UINT32 Mask = (UINT32)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(Block0, Needle0),
+																	_mm_cmpeq_epi8(Block1, Needle1)));
+		if (Mask != 0)
+			return Offset + (UINTN)LowBitSet32(Mask);
+
+		Offset += sizeof(__m128i);
+	}
+#endif
+
+	for (; Offset <= LastOffset; ++Offset)
+	{
+		if (Start[Offset + Anchors->Offset0] == Anchors->Byte0 &&
+			Start[Offset + Anchors->Offset1] == Anchors->Byte1)
+			break;
+	}
+	return Offset;
 }
 
-// For debugging non-working signatures. Not that I would ever need to do such a thing of course. Ha ha... ha
-// TODO: #ifdef EFI_DEBUG, this should keep a match count and continue until the end of the buffer, then ASSERT(MatchCount == 1)
 EFI_STATUS
 EFIAPI
-FindPatternVerbose(
-	IN CONST UINT8* Pattern,
-	IN UINT8 Wildcard,
-	IN UINT32 PatternLength,
-	IN CONST VOID* Base,
-	IN UINT32 Size,
-	OUT VOID **Found
+CompileBytePattern(
+	IN OUT PBYTE_PATTERN Pattern
 	)
 {
-	if (Found == NULL || Pattern == NULL || Base == NULL)
-		return EFI_INVALID_PARAMETER;
-
-	*Found = NULL;
+	if (Pattern->Compiled)
+		return EFI_SUCCESS;
 
-	CONST UINTN Start = (UINTN)Base;
-	CONST UINTN End = Start + Size - PatternLength;
-	EFI_STATUS Status = EFI_NOT_FOUND;
+	if (Pattern->Bytes == NULL || Pattern->Mask == NULL || Pattern->Length == 0 || Pattern->Length > MAX_BYTE_PATTERN_LENGTH)
+		return EFI_INVALID_PARAMETER;
 
-	UINT32 Max = 0;
-	UINT8 *AddrOfMax = NULL;
+	PATTERN_ANCHORS Anchors;
+	if (!SelectPatternAnchors(Pattern->Bytes, Pattern->Mask, Pattern->Length, &Anchors))
+		return EFI_INVALID_PARAMETER;
 
-	for (UINT8 *Address = (UINT8*)Start; Address < (UINT8*)End; ++Address)
+	UINT32 NumFixed = 0;
+	Pattern->FixedOffsets[NumFixed] = (UINT8)Anchors.Offset0;
+	Pattern->FixedValues[NumFixed++] = Anchors.Byte0;
+	if (Anchors.Offset1 != Anchors.Offset0)
 	{
-		UINT32 i;
-		for (i = 0; i < PatternLength; ++i)
-		{
-			if (Pattern[i] != Wildcard  && (*(Address + i) != Pattern[i]))
-				break;
-		}
-
-		if (i > Max)
-		{
-			Max = i;
-			AddrOfMax = Address;
-		}
+		Pattern->FixedOffsets[NumFixed] = (UINT8)Anchors.Offset1;
+		Pattern->FixedValues[NumFixed++] = Anchors.Byte1;
+	}
 
-		if (i == PatternLength)
+	for (UINT32 i = 0; i < Pattern->Length; ++i)
+	{
+		if (Pattern->Mask[i] == 'x' && i != Anchors.Offset0 && i != Anchors.Offset1)
 		{
-			*Found = (VOID*)Address;
-			Status = EFI_SUCCESS;
+			Pattern->FixedOffsets[NumFixed] = (UINT8)i;
+			Pattern->FixedValues[NumFixed++] = Pattern->Bytes[i];
 		}
 	}
 
-	Print(L"\r\nBest match: %lu/%lu matched at 0x%p\r\n", Max, PatternLength, (VOID*)AddrOfMax);
+	Pattern->NumFixed = NumFixed;
+	Pattern->Compiled = TRUE;
+	return EFI_SUCCESS;
+}
 
-	for (UINT32 i = 0; i < PatternLength && AddrOfMax != NULL; ++i)
+STATIC
+BOOLEAN
+BytePatternMatches(
+	IN CONST BYTE_PATTERN* Pattern,
+	IN CONST UINT8* Address
+	)
+{
+	for (UINT32 i = 0; i < Pattern->NumFixed; ++i)
 	{
-		if (Pattern[i] != Wildcard && (*(AddrOfMax + i) != Pattern[i]))
-			Print(L"[%lu] [X] %02X != %02X\r\n", i, (*(AddrOfMax + i)), Pattern[i]); // Mismatch
-		else if (Pattern[i] == Wildcard)
-			Print(L"[%lu] [ ] %02X\r\n", i, (*(AddrOfMax + i))); // Matched wildcard byte
-		else
-			Print(L"[%lu] [v] %02X\r\n", i, Pattern[i]); // Matched exact byte
+		if (Address[Pattern->FixedOffsets[i]] != Pattern->FixedValues[i])
+			return FALSE;
 	}
-
-	return Status;
+	return TRUE;
 }
 
-#ifndef ZYDIS_DISABLE_FORMATTER
+// Adds the number of bytes a scan of [Start, Start + Size) had to read to find Match (or to not find it) to the boot statistics, and returns Match
+STATIC
+CONST UINT8*
+CountScannedBytes(
+	IN CONST UINT8* Start,
+	IN UINTN Size,
+	IN CONST UINT8* Match OPTIONAL,
+	IN UINTN MatchLength
+	)
+{
+	gBootStatistics.BytesScanned += Match != NULL ? (UINT64)(Match - Start) + MatchLength : Size;
+	return Match;
+}
 
-// Formatter hook to prefix the opcode bytes to the output
+// Returns the first match of a compiled pattern in the specified range, or NULL if there is none
 STATIC
-ZyanStatus
-ZydisInstructionBytesFormatter(
-	IN CONST ZydisFormatter* Formatter,
-	IN OUT ZydisFormatterBuffer* Buffer,
-	IN ZydisFormatterContext* Context
+CONST UINT8*
+ScanForPattern(
+	IN CONST BYTE_PATTERN* Pattern,
+	IN CONST UINT8* Start,
+	IN UINT32 Size
 	)
 {
-	CONST ZyanU8 MaxOpcodeBytes = 12; // Print at most 10 bytes (so 20 characters), with room for ellip.. ses
+	if (Size < Pattern->Length)
+		return NULL;
 
-	ZyanString *String;
-	ZYAN_CHECK(ZydisFormatterBufferGetString(Buffer, &String));
+	PATTERN_ANCHORS Anchors;
+	Anchors.Offset0 = Pattern->FixedOffsets[0];
+	Anchors.Byte0 = Pattern->FixedValues[0];
+	Anchors.Offset1 = Pattern->FixedOffsets[Pattern->NumFixed > 1 ? 1 : 0];
+	Anchors.Byte1 = Pattern->FixedValues[Pattern->NumFixed > 1 ? 1 : 0];
 
-	// We cannot use ZyanStringAppendFormat() because at the moment it may use dynamic memory allocation
-	// to resize the string buffer, with no way to disable this behaviour. Therefore call AsciiSPrint
-	for (ZyanU8 i = 0; i < MaxOpcodeBytes; ++i)
+	CONST UINTN LastOffset = Size - Pattern->Length;
+	for (UINTN Offset = 0; Offset <= LastOffset; ++Offset)
 	{
-		CONST ZyanUSize Length = String->vector.size;
-		UINTN N;
+		Offset = FindAnchorCandidate(&Anchors, Start, Offset, LastOffset);
+		if (Offset > LastOffset)
+			break;
 
-		if (i < Context->instruction->length && i < MaxOpcodeBytes - 2)
+		if (BytePatternMatches(Pattern, Start + Offset))
+			return CountScannedBytes(Start, Size, Start + Offset, Pattern->Length);
+	}
+
+	return CountScannedBytes(Start, Size, NULL, 0);
+}
+
+// Returns the first aligned occurrence of a literal byte sequence in the specified range, or NULL if there is none
+STATIC
+CONST UINT8*
+ScanForBytes(
+	IN CONST UINT8* Bytes,
+	IN UINT32 Length,
+	IN UINT32 Alignment,
+	IN CONST UINT8* Start,
+	IN UINT32 Size
+	)
+{
+	if (Length == 0 || Size < Length)
+		return NULL;
+
+	PATTERN_ANCHORS Anchors;
+	SelectPatternAnchors(Bytes, NULL, Length, &Anchors);
+
+	CONST UINTN LastOffset = Size - Length;
+	for (UINTN Offset = 0; Offset <= LastOffset; ++Offset)
+	{
+		Offset = FindAnchorCandidate(&Anchors, Start, Offset, LastOffset);
+		if (Offset > LastOffset)
+			break;
+		if (Alignment > 1 && (Offset % Alignment) != 0)
+			continue;
+
+		if (CompareMem(Start + Offset, Bytes, Length) == 0)
+			return CountScannedBytes(Start, Size, Start + Offset, Length);
+	}
+
+	return CountScannedBytes(Start, Size, NULL, 0);
+}
+
+EFI_STATUS
+EFIAPI
+FindPattern(
+	IN OUT PBYTE_PATTERN Pattern,
+	IN CONST VOID* Base,
+	IN UINT32 Size,
+	OUT VOID **Found
+	)
+{
+	if (Found == NULL || Pattern == NULL || Base == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	*Found = NULL;
+
+#ifdef EFI_DEBUG
+	// Verify that the pattern is unique. The scan stops at the second match, so this only costs extra if the pattern is in fact unique
+	VOID* Matches[2];
+	UINT32 MatchCount;
+	CONST EFI_STATUS Status = FindPatternAll(Pattern, Base, Size, Matches, ARRAY_SIZE(Matches), &MatchCount);
+	if (Status == EFI_INVALID_PARAMETER)
+		return Status;
+	ASSERT(MatchCount <= 1);
+	*Found = MatchCount > 0 ? Matches[0] : NULL;
+#else
+	CONST EFI_STATUS Status = CompileBytePattern(Pattern);
+	if (EFI_ERROR(Status))
+		return Status;
+	*Found = (VOID*)ScanForPattern(Pattern, (CONST UINT8*)Base, Size);
+#endif
+
+	return *Found != NULL ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+EFI_STATUS
+EFIAPI
+FindPatternAll(
+	IN OUT PBYTE_PATTERN Pattern,
+	IN CONST VOID* Base,
+	IN UINT32 Size,
+	OUT VOID **Matches,
+	IN UINT32 MaxMatches,
+	OUT UINT32 *MatchCount
+	)
+{
+	if (MatchCount == NULL || Matches == NULL || MaxMatches == 0 || Pattern == NULL || Base == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	*MatchCount = 0;
+
+	CONST EFI_STATUS Status = CompileBytePattern(Pattern);
+	if (EFI_ERROR(Status))
+		return Status;
+
+	CONST UINT8* Start = (CONST UINT8*)Base;
+	CONST UINT8* End = Start + Size;
+	CONST UINT8* Match;
+	while (*MatchCount < MaxMatches &&
+		(Match = ScanForPattern(Pattern, Start, (UINT32)(End - Start))) != NULL)
+	{
+		Matches[(*MatchCount)++] = (VOID*)Match;
+		Start = Match + 1;
+	}
+
+	return *MatchCount > 0 ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+EFI_STATUS
+EFIAPI
+FindBytes(
+	IN CONST VOID* Bytes,
+	IN UINT32 Length,
+	IN UINT32 Alignment,
+	IN CONST VOID* Base,
+	IN UINT32 Size,
+	OUT VOID **Found
+	)
+{
+	if (Found == NULL || Bytes == NULL || Base == NULL || Alignment == 0)
+		return EFI_INVALID_PARAMETER;
+
+	*Found = (VOID*)ScanForBytes((CONST UINT8*)Bytes, Length, Alignment, (CONST UINT8*)Base, Size);
+
+	return *Found != NULL ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+// For debugging non-working signatures. Not that I would ever need to do such a thing of course. Ha ha... ha
+EFI_STATUS
+EFIAPI
+FindPatternVerbose(
+	IN OUT PBYTE_PATTERN Pattern,
+	IN CONST VOID* Base,
+	IN UINT32 Size,
+	OUT VOID **Found
+	)
+{
+	if (Found == NULL || Pattern == NULL || Base == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	*Found = NULL;
+
+	// Try the fast path first. The slow best match search below is only needed to diagnose a pattern that does not match
+	VOID* Matches[2];
+	UINT32 MatchCount;
+	EFI_STATUS Status = FindPatternAll(Pattern, Base, Size, Matches, ARRAY_SIZE(Matches), &MatchCount);
+	if (Status == EFI_INVALID_PARAMETER)
+		return Status;
+
+	CONST UINT8* Bytes = Pattern->Bytes;
+	CONST CHAR8* Mask = Pattern->Mask;
+	CONST UINT32 PatternLength = Pattern->Length;
+	UINT32 Max = 0;
+	UINT8 *AddrOfMax = NULL;
+
+	if (MatchCount > 0)
+	{
+		*Found = Matches[0];
+		Max = PatternLength;
+		AddrOfMax = (UINT8*)Matches[0];
+		if (MatchCount > 1)
+			ConsolePrint(VERBOSITY_VERBOSE, L"\r\nWarning: pattern is not unique. Second match at 0x%p\r\n", Matches[1]);
+	}
+	else if (Size >= PatternLength)
+	{
+		CONST UINTN Start = (UINTN)Base;
+		CONST UINTN End = Start + Size - PatternLength;
+
+		for (UINT8 *Address = (UINT8*)Start; Address <= (UINT8*)End; ++Address)
+		{
+			UINT32 i;
+			for (i = 0; i < PatternLength; ++i)
+			{
+				if (Mask[i] == 'x' && (*(Address + i) != Bytes[i]))
+					break;
+			}
+
+			if (i > Max)
+			{
+				Max = i;
+				AddrOfMax = Address;
+			}
+		}
+	}
+
+	ConsolePrint(VERBOSITY_VERBOSE, L"\r\nBest match: %lu/%lu matched at 0x%p\r\n", Max, PatternLength, (VOID*)AddrOfMax);
+
+	for (UINT32 i = 0; i < PatternLength && AddrOfMax != NULL; ++i)
+	{
+		if (Mask[i] == 'x' && (*(AddrOfMax + i) != Bytes[i]))
+			ConsolePrint(VERBOSITY_VERBOSE, L"[%lu] [X] %02X != %02X\r\n", i, (*(AddrOfMax + i)), Bytes[i]); // Mismatch
+		else if (Mask[i] != 'x')
+			ConsolePrint(VERBOSITY_VERBOSE, L"[%lu] [ ] %02X\r\n", i, (*(AddrOfMax + i))); // Matched wildcard byte
+		else
+			ConsolePrint(VERBOSITY_VERBOSE, L"[%lu] [v] %02X\r\n", i, Bytes[i]); // Matched exact byte
+	}
+
+	return Status;
+}
+
+#if defined(MDE_CPU_X64)
+// A pair of anchor bytes shared by one or more FindPatterns() signatures, with the offset of the second anchor relative to the first
+typedef struct _ANCHOR_PAIR
+{
+	__m128i Needle0;
+	__m128i Needle1;
+	INT32 Delta;
+	UINT8 Byte0;
+	UINT8 Byte1;
+	UINT8 Signatures;	// Mask of the signatures with this pair of anchors
+} ANCHOR_PAIR;
+
+// Tests 16 positions at a time, starting at Offset, and returns the first one at which both anchors of any of the pairs match.
+// Blocks are only started below EndOffset, and the caller guarantees that all loads for them stay in bounds. If there is no match,
+// the first position that was not tested is returned
+STATIC
+UINTN
+FindAnchorPairCandidate(
+	IN CONST ANCHOR_PAIR* Pairs,
+	IN UINT32 NumPairs,
+	IN CONST UINT8* Start,
+	IN UINTN Offset,
+	IN UINTN EndOffset
+	)
+{
+	for (; Offset < EndOffset; Offset += sizeof(__m128i))
+	{
+		CONST __m128i Block = _mm_loadu_si128((CONST __m128i*)(Start + Offset));
+		__m128i Hits = _mm_and_si128(_mm_cmpeq_epi8(Block, Pairs[0].Needle0),
+									_mm_cmpeq_epi8(_mm_loadu_si128((CONST __m128i*)(Start + Offset + Pairs[0].Delta)), Pairs[0].Needle1));
+		for (UINT32 i = 1; i < NumPairs; ++i)
+		{
+			Hits = _mm_or_si128(Hits, _mm_and_si128(_mm_cmpeq_epi8(Block, Pairs[i].Needle0),
+													_mm_cmpeq_epi8(_mm_loadu_si128((CONST __m128i*)(Start + Offset + Pairs[i].Delta)), Pairs[i].Needle1)));
+		}
+
+		CONST UINT32 Mask = (UINT32)_mm_movemask_epi8(Hits);
+		if (Mask != 0)
+			return Offset + (UINTN)LowBitSet32(Mask);
+	}
+	return Offset;
+}
+#endif
+
+EFI_STATUS
+EFIAPI
+FindPatterns(
+	IN OUT PPATTERN_SEARCH_ENTRY Entries,
+	IN UINT32 NumEntries,
+	IN CONST VOID* Base,
+	IN UINT32 Size
+	)
+{
+	if (Entries == NULL || Base == NULL || NumEntries == 0 || NumEntries > MAX_PATTERN_SEARCH_ENTRIES)
+		return EFI_INVALID_PARAMETER;
+
+	// Build a dispatch table that maps each byte value to a mask of the signatures whose first anchor byte has that value.
+	// This lets us visit every byte in the range exactly once, no matter how many signatures we are looking for,
+	// and only do a full compare when an anchor byte is hit
+	UINT8 Dispatch[256];
+	ZeroMem(Dispatch, sizeof(Dispatch));
+	UINT8 Remaining = 0;	// Signatures that have not been found yet
+	UINT8 Scanning = 0;		// Signatures that are still being scanned for. In debug builds, this includes those that have only been found once
+#if defined(MDE_CPU_X64)
+	// Distinct pairs of anchors for the SSE2 prefilter. Delta is relative to the first anchor, so it can be negative
+	ANCHOR_PAIR Pairs[MAX_PATTERN_SEARCH_ENTRIES];
+	UINT32 NumPairs = 0;
+	INT32 MinDelta = 0, MaxDelta = 0;
+#endif
+
+	for (UINT32 i = 0; i < NumEntries; ++i)
+	{
+		Entries[i].Found = NULL;
+		if (Entries[i].Pattern == NULL)
+			return EFI_INVALID_PARAMETER;
+
+		CONST EFI_STATUS Status = CompileBytePattern(Entries[i].Pattern);
+		if (EFI_ERROR(Status))
+			return Status;
+
+		CONST BYTE_PATTERN* Pattern = Entries[i].Pattern;
+		Dispatch[Pattern->FixedValues[0]] |= (UINT8)(1 << i);
+		Remaining |= (UINT8)(1 << i);
+
+#if defined(MDE_CPU_X64)
+		CONST UINT32 Second = Pattern->NumFixed > 1 ? 1 : 0;
+		CONST UINT8 Byte1 = Pattern->FixedValues[Second];
+		CONST INT32 Delta = (INT32)Pattern->FixedOffsets[Second] - (INT32)Pattern->FixedOffsets[0];
+		UINT32 Pair;
+		for (Pair = 0; Pair < NumPairs; ++Pair)
+		{
+			if (Pairs[Pair].Byte0 == Pattern->FixedValues[0] && Pairs[Pair].Byte1 == Byte1 && Pairs[Pair].Delta == Delta)
+				break;
+		}
+		if (Pair == NumPairs)
+		{
+			Pairs[NumPairs].Needle0 = _mm_set1_epi8((CHAR8)Pattern->FixedValues[0]);
+			Pairs[NumPairs].Needle1 = _mm_set1_epi8((CHAR8)Byte1);
+			Pairs[NumPairs].Delta = Delta;
+			Pairs[NumPairs].Byte0 = Pattern->FixedValues[0];
+			Pairs[NumPairs].Byte1 = Byte1;
+			Pairs[NumPairs++].Signatures = 0;
+			MinDelta = MIN(MinDelta, Delta);
+			MaxDelta = MAX(MaxDelta, Delta);
+		}
+		Pairs[Pair].Signatures |= (UINT8)(1 << i);
+#endif
+	}
+	Scanning = Remaining;
+
+	CONST UINT8* Start = (CONST UINT8*)Base;
+	CONST UINT8* End = Start + Size;
+	CONST UINT8* Address;
+#if defined(MDE_CPU_X64)
+	// Range of offsets at which a 16 byte block can be prefiltered without any of the anchor loads going out of bounds
+	CONST UINTN SseStartOffset = (UINTN)-MinDelta;
+	CONST UINTN SseEndOffset = Size >= sizeof(__m128i) + (UINTN)MaxDelta ? Size - sizeof(__m128i) - (UINTN)MaxDelta + 1 : 0;
+	UINT8 PairsScanning = Scanning;
+#endif
+
+	for (Address = Start; Address < End && Scanning != 0; ++Address)
+	{
+#if defined(MDE_CPU_X64)
+		// Skip 16 bytes at a time to the next position where both anchors of any signature match. Near the edges of the range,
+		// where the load of a second anchor would go out of bounds, the table lookup below is used on its own
+		if ((UINTN)(Address - Start) >= SseStartOffset && (UINTN)(Address - Start) < SseEndOffset)
+		{
+			if (PairsScanning != Scanning)
+			{
+				// Drop the anchors of signatures that are no longer being scanned for
+				for (UINT32 Pair = 0; Pair < NumPairs; )
+				{
+					if ((Pairs[Pair].Signatures & Scanning) == 0)
+						Pairs[Pair] = Pairs[--NumPairs];
+					else
+						++Pair;
+				}
+				PairsScanning = Scanning;
+			}
+
+			Address = Start + FindAnchorPairCandidate(Pairs, NumPairs, Start, (UINTN)(Address - Start), SseEndOffset);
+			if (Address == End)
+				break;
+		}
+#endif
+
+		UINT32 Candidates = Dispatch[*Address] & Scanning;
+		while (Candidates != 0)
+		{
+			CONST UINT32 i = (UINT32)LowBitSet32(Candidates);
+			Candidates &= Candidates - 1;
+
+			// Because the anchor offset is fixed per signature, the first anchor hit that matches is also the first match overall
+			CONST BYTE_PATTERN* Pattern = Entries[i].Pattern;
+			CONST UINT8* Match = Address - Pattern->FixedOffsets[0];
+			if (Match < Start || (UINTN)(End - Match) < Pattern->Length)
+				continue;
+
+			if (BytePatternMatches(Pattern, Match))
+			{
+#ifdef EFI_DEBUG
+				// Verify that the signature is unique, like FindPattern() does. It is scanned for until its second match or the end of the range
+				if (Entries[i].Found != NULL)
+				{
+					DEBUG((DEBUG_ERROR, "FindPatterns: signature %u matches at both 0x%p and 0x%p\r\n", i, Entries[i].Found, Match));
+					ASSERT(FALSE);
+					Scanning &= (UINT8)~(1 << i);
+					continue;
+				}
+#else
+				Scanning &= (UINT8)~(1 << i);
+#endif
+				Entries[i].Found = (VOID*)Match;
+				Remaining &= (UINT8)~(1 << i);
+			}
+		}
+	}
+	gBootStatistics.BytesScanned += (UINT64)(Address - Start);
+
+	return Remaining == 0 ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+#ifndef ZYDIS_DISABLE_FORMATTER
+
+// Formatter hook to prefix the opcode bytes to the output
+STATIC
+ZyanStatus
+ZydisInstructionBytesFormatter(
+	IN CONST ZydisFormatter* Formatter,
+	IN OUT ZydisFormatterBuffer* Buffer,
+	IN ZydisFormatterContext* Context
+	)
+{
+	CONST ZyanU8 MaxOpcodeBytes = 12; // Print at most 10 bytes (so 20 characters), with room for ellip.. ses
+
+	ZyanString *String;
+	ZYAN_CHECK(ZydisFormatterBufferGetString(Buffer, &String));
+
+	// We cannot use ZyanStringAppendFormat() because at the moment it may use dynamic memory allocation
+	// to resize the string buffer, with no way to disable this behaviour. Therefore call AsciiSPrint
+	for (ZyanU8 i = 0; i < MaxOpcodeBytes; ++i)
+	{
+		CONST ZyanUSize Length = String->vector.size;
+		UINTN N;
+
+		if (i < Context->instruction->length && i < MaxOpcodeBytes - 2)
 		{
 			// Print one byte of the instruction
 			N = AsciiSPrint((CHAR8*)(String->vector.data) + Length - 1,
@@ -499,17 +1394,493 @@ ZydisInit(
 	return ZYAN_STATUS_SUCCESS;
 }
 
-UINT8*
+// Decodes [Start, Start + Length) and dispatches each instruction to the active matchers. NumActive is the number of active matchers,
+// and is decremented for every matcher that completes. Instructions are decoded without operands first. The operands are only decoded
+// once a matcher's prefilter has accepted the instruction
+STATIC
+VOID
+SweepRange(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST UINT8* Start,
+	IN UINTN Length,
+	IN OUT PINSTRUCTION_MATCHER Matchers,
+	IN UINT32 NumMatchers,
+	IN OUT UINT32* NumActive
+	)
+{
+	Context->Length = Length;
+	Context->Offset = 0;
+
+	// Start decode loop. The statistics are updated once at the end, to keep the loop free of global writes
+	ZydisDecoderContext DecoderContext;
+	ZyanStatus Status;
+	UINT64 NumDecoded = 0, NumResyncs = 0;
+	while (*NumActive > 0 &&
+		(Context->InstructionAddress = (ZyanU64)(Start + Context->Offset),
+		Status = ZydisDecoderDecodeInstruction(&Context->Decoder,
+												&DecoderContext,
+												(VOID*)Context->InstructionAddress,
+												Context->Length - Context->Offset,
+												&Context->Instruction)) != ZYDIS_STATUS_NO_MORE_DATA)
+	{
+		if (!ZYAN_SUCCESS(Status))
+		{
+			Context->Offset++;
+			NumResyncs++;
+			continue;
+		}
+		NumDecoded++;
+
+		BOOLEAN OperandsDecoded = FALSE;
+		for (UINT32 i = 0; i < NumMatchers; ++i)
+		{
+			if (!Matchers[i].Active ||
+				(Matchers[i].Prefilter != NULL && !Matchers[i].Prefilter(Context, Matchers[i].PredicateContext)))
+				continue;
+
+			if (!OperandsDecoded)
+			{
+				if (!ZYAN_SUCCESS(ZydisDecoderDecodeOperands(&Context->Decoder,
+															&DecoderContext,
+															&Context->Instruction,
+															Context->Operands,
+															Context->Instruction.operand_count)))
+					break;
+				OperandsDecoded = TRUE;
+			}
+
+			if (!Matchers[i].Predicate(Context, Matchers[i].PredicateContext))
+				continue;
+
+			Matchers[i].Found = (UINT8*)Context->InstructionAddress;
+			if (Matchers[i].Callback == NULL || !Matchers[i].Callback(Context, Matchers[i].CallbackContext))
+			{
+				Matchers[i].Active = FALSE;
+				(*NumActive)--;
+			}
+		}
+
+		Context->Offset += Context->Instruction.length;
+	}
+
+	gBootStatistics.InstructionsDecoded += NumDecoded;
+	gBootStatistics.ResyncEvents += NumResyncs;
+}
+
+// Resets the Found field of all active matchers, and returns the number of active matchers
+STATIC
+UINT32
+ResetActiveMatchers(
+	IN OUT PINSTRUCTION_MATCHER Matchers,
+	IN UINT32 NumMatchers
+	)
+{
+	UINT32 NumActive = 0;
+	for (UINT32 i = 0; i < NumMatchers; ++i)
+	{
+		if (Matchers[i].Active)
+		{
+			Matchers[i].Found = NULL;
+			NumActive++;
+		}
+	}
+	return NumActive;
+}
+
+EFI_STATUS
 EFIAPI
-BacktrackToFunctionStart(
+DisassembleRange(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST UINT8* Start,
+	IN UINTN Length,
+	IN OUT PINSTRUCTION_MATCHER Matchers,
+	IN UINT32 NumMatchers
+	)
+{
+	if (Context == NULL || Start == NULL || (Matchers == NULL && NumMatchers > 0))
+		return EFI_INVALID_PARAMETER;
+
+	UINT32 NumActive = ResetActiveMatchers(Matchers, NumMatchers);
+	SweepRange(Context, Start, Length, Matchers, NumMatchers, &NumActive);
+
+	return NumActive == 0 ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+EFI_STATUS
+EFIAPI
+InitializeFunctionIterator(
 	IN CONST UINT8* ImageBase,
 	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
-	IN CONST UINT8* AddressInFunction
+	IN CONST FUNCTION_FILTER* Filter OPTIONAL,
+	OUT PFUNCTION_ITERATOR Iterator
+	)
+{
+	if (ImageBase == NULL || NtHeaders == NULL || Iterator == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	SetMem(Iterator, sizeof(*Iterator), 0);
+	if (NtHeaders->OptionalHeader.NumberOfRvaAndSizes <= EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION)
+		return EFI_NOT_FOUND;
+
+	CONST UINT32 FunctionTableSize = NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION].Size;
+	if (FunctionTableSize == 0)
+		return EFI_NOT_FOUND;
+
+	Iterator->ImageBase = ImageBase;
+	Iterator->FunctionTable = (CONST IMAGE_RUNTIME_FUNCTION_ENTRY*)(ImageBase + NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION].VirtualAddress);
+	Iterator->NumFunctions = FunctionTableSize / sizeof(IMAGE_RUNTIME_FUNCTION_ENTRY);
+	if (Filter != NULL)
+		Iterator->Filter = *Filter;
+
+	// The function table is sorted by address, so do a binary search for the first function that ends after StartRva
+	UINT32 Low = 0, High = Iterator->NumFunctions;
+	while (Low < High)
+	{
+		CONST UINT32 Middle = (Low + High) >> 1;
+		if (Iterator->FunctionTable[Middle].EndAddress <= Iterator->Filter.StartRva)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+	Iterator->Index = Low;
+
+	return EFI_SUCCESS;
+}
+
+BOOLEAN
+EFIAPI
+GetNextFunction(
+	IN OUT PFUNCTION_ITERATOR Iterator,
+	OUT CONST IMAGE_RUNTIME_FUNCTION_ENTRY** FunctionEntry
+	)
+{
+	CONST FUNCTION_FILTER* Filter = &Iterator->Filter;
+
+	while (Iterator->Index < Iterator->NumFunctions)
+	{
+		CONST IMAGE_RUNTIME_FUNCTION_ENTRY* Entry = &Iterator->FunctionTable[Iterator->Index++];
+		if (Filter->EndRva != 0 && Entry->BeginAddress >= Filter->EndRva)
+		{
+			Iterator->Index = Iterator->NumFunctions;
+			break;
+		}
+
+		CONST UINT32 Size = Entry->EndAddress - Entry->BeginAddress;
+		if (Entry->EndAddress <= Entry->BeginAddress ||
+			(Filter->MinSize != 0 && Size < Filter->MinSize) ||
+			(Filter->MaxSize != 0 && Size > Filter->MaxSize))
+			continue;
+
+		if (Filter->RequiredUnwindFlags != 0 || Filter->ExcludedUnwindFlags != 0)
+		{
+			// If the function entry specifies indirection, the unwind info is that of the primary function entry
+			CONST IMAGE_RUNTIME_FUNCTION_ENTRY* PrimaryEntry = Entry;
+			if ((PrimaryEntry->u.UnwindData & RUNTIME_FUNCTION_INDIRECT) != 0)
+				PrimaryEntry = (CONST IMAGE_RUNTIME_FUNCTION_ENTRY*)(Iterator->ImageBase + PrimaryEntry->u.UnwindData - 1);
+
+			CONST UNWIND_INFO* UnwindInfo = (CONST UNWIND_INFO*)(Iterator->ImageBase + PrimaryEntry->u.UnwindInfoAddress);
+			if ((UnwindInfo->Flags & Filter->RequiredUnwindFlags) != Filter->RequiredUnwindFlags ||
+				(UnwindInfo->Flags & Filter->ExcludedUnwindFlags) != 0)
+				continue;
+		}
+
+		*FunctionEntry = Entry;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+EFI_STATUS
+EFIAPI
+DisassembleFunctions(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN OUT PFUNCTION_ITERATOR Iterator,
+	IN OUT PINSTRUCTION_MATCHER Matchers,
+	IN UINT32 NumMatchers
+	)
+{
+	if (Context == NULL || Iterator == NULL || Iterator->FunctionTable == NULL || (Matchers == NULL && NumMatchers > 0))
+		return EFI_INVALID_PARAMETER;
+
+	UINT32 NumActive = ResetActiveMatchers(Matchers, NumMatchers);
+
+	CONST IMAGE_RUNTIME_FUNCTION_ENTRY* FunctionEntry;
+	while (NumActive > 0 && GetNextFunction(Iterator, &FunctionEntry))
+	{
+		SweepRange(Context,
+					Iterator->ImageBase + FunctionEntry->BeginAddress,
+					FunctionEntry->EndAddress - FunctionEntry->BeginAddress,
+					Matchers,
+					NumMatchers,
+					&NumActive);
+	}
+
+	return NumActive == 0 ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+// State shared by the xref index matcher and its callback
+typedef struct _XREF_INDEX_BUILDER
+{
+	PXREF_INDEX Index;
+	UINT8 TypeMask;
+	UINT8 Type;			// Type of the last matched instruction
+	UINT8 OperandIndex;	// Operand that holds the target of the last matched instruction
+} XREF_INDEX_BUILDER;
+
+// Prefilter for IsXrefInstruction. Data xrefs require a ModRM byte that encodes [rip+disp32]
+STATIC
+BOOLEAN
+EFIAPI
+IsXrefCandidate(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	CONST XREF_INDEX_BUILDER* Builder = (CONST XREF_INDEX_BUILDER*)PredicateContext;
+	if (Context->Instruction.mnemonic == ZYDIS_MNEMONIC_CALL || Context->Instruction.mnemonic == ZYDIS_MNEMONIC_JMP)
+		return (Builder->TypeMask & XREF_TYPE_MASK_BRANCH) != 0;
+
+	return (Builder->TypeMask & XREF_TYPE_MASK_DATA) != 0 &&
+		Context->Instruction.machine_mode == ZYDIS_MACHINE_MODE_LONG_64 &&
+		(Context->Instruction.attributes & ZYDIS_ATTRIB_HAS_MODRM) != 0 &&
+		Context->Instruction.raw.modrm.mod == 0 && Context->Instruction.raw.modrm.rm == 5;
+}
+
+// Classifies the instruction and matches it if its xref type is in the builder's type mask
+STATIC
+BOOLEAN
+EFIAPI
+IsXrefInstruction(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	XREF_INDEX_BUILDER* Builder = (XREF_INDEX_BUILDER*)PredicateContext;
+	CONST BOOLEAN IsCall = Context->Instruction.mnemonic == ZYDIS_MNEMONIC_CALL;
+	CONST ZydisDecodedOperand* Operand = &Context->Operands[0];
+
+	if (IsCall || Context->Instruction.mnemonic == ZYDIS_MNEMONIC_JMP)
+	{
+		if (Operand->type == ZYDIS_OPERAND_TYPE_IMMEDIATE && Operand->imm.is_relative == ZYAN_TRUE && Context->Instruction.raw.imm[0].size == 32)
+			Builder->Type = IsCall ? XREF_CALL_REL32 : XREF_JMP_REL32;
+		else if (Operand->type == ZYDIS_OPERAND_TYPE_MEMORY && Operand->mem.base == ZYDIS_REGISTER_RIP && Operand->mem.index == ZYDIS_REGISTER_NONE)
+			Builder->Type = IsCall ? XREF_CALL_INDIRECT : XREF_JMP_INDIRECT;
+		else
+			return FALSE;
+
+		Builder->OperandIndex = 0;
+		return (Builder->TypeMask & XREF_TYPE_MASK(Builder->Type)) != 0;
+	}
+
+	for (UINT8 i = 0; i < Context->Instruction.operand_count_visible; ++i)
+	{
+		if (Context->Operands[i].type == ZYDIS_OPERAND_TYPE_MEMORY && Context->Operands[i].mem.base == ZYDIS_REGISTER_RIP)
+		{
+			Builder->Type = Context->Instruction.mnemonic == ZYDIS_MNEMONIC_LEA ? XREF_DATA_LEA : XREF_DATA_ACCESS;
+			Builder->OperandIndex = i;
+			return (Builder->TypeMask & XREF_TYPE_MASK(Builder->Type)) != 0;
+		}
+	}
+	return FALSE;
+}
+
+// Appends an xref for the matched instruction to the index. Stops the sweep if the index is full
+STATIC
+BOOLEAN
+EFIAPI
+AppendXref(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* CallbackContext
+	)
+{
+	CONST XREF_INDEX_BUILDER* Builder = (CONST XREF_INDEX_BUILDER*)CallbackContext;
+	PXREF_INDEX Index = Builder->Index;
+	ZyanU64 TargetAddress = 0;
+	if (!ZYAN_SUCCESS(ZydisCalcAbsoluteAddress(&Context->Instruction, &Context->Operands[Builder->OperandIndex], Context->InstructionAddress, &TargetAddress)) ||
+		TargetAddress < (ZyanU64)Index->ImageBase || TargetAddress - (ZyanU64)Index->ImageBase > MAX_UINT32 ||
+		Context->InstructionAddress - (ZyanU64)Index->ImageBase >= XREF_SITE_RVA_LIMIT)
+		return TRUE;
+
+	if (Index->Count == Index->Capacity)
+		return FALSE;
+
+	PXREF_ENTRY Entry = &Index->Entries[Index->Count++];
+	Entry->TargetRva = (UINT32)(TargetAddress - (ZyanU64)Index->ImageBase);
+	Entry->SiteRva = (UINT32)(Context->InstructionAddress - (ZyanU64)Index->ImageBase);
+	Entry->Type = Builder->Type;
+	return TRUE;
+}
+
+#define XREF_LESS(A, B) ((A)->TargetRva < (B)->TargetRva || ((A)->TargetRva == (B)->TargetRva && (A)->SiteRva < (B)->SiteRva))
+
+// Restores the heap property for the subtree at Root of a max-heap of Count entries
+STATIC
+VOID
+SiftDownXref(
+	IN OUT PXREF_ENTRY Entries,
+	IN UINT32 Root,
+	IN UINT32 Count
+	)
+{
+	while (TRUE)
+	{
+		UINT32 Largest = Root;
+		CONST UINT32 Left = 2 * Root + 1, Right = 2 * Root + 2;
+		if (Left < Count && XREF_LESS(&Entries[Largest], &Entries[Left]))
+			Largest = Left;
+		if (Right < Count && XREF_LESS(&Entries[Largest], &Entries[Right]))
+			Largest = Right;
+		if (Largest == Root)
+			return;
+
+		CONST XREF_ENTRY Temp = Entries[Root];
+		Entries[Root] = Entries[Largest];
+		Entries[Largest] = Temp;
+		Root = Largest;
+	}
+}
+
+// In-place heap sort, because there is nothing to allocate a merge buffer from when indexing the kernel
+STATIC
+VOID
+SortXrefs(
+	IN OUT PXREF_ENTRY Entries,
+	IN UINT32 Count
+	)
+{
+	if (Count < 2)
+		return;
+
+	for (UINT32 i = Count / 2; i-- > 0; )
+		SiftDownXref(Entries, i, Count);
+
+	for (UINT32 End = Count - 1; End > 0; --End)
+	{
+		CONST XREF_ENTRY Temp = Entries[0];
+		Entries[0] = Entries[End];
+		Entries[End] = Temp;
+		SiftDownXref(Entries, 0, End);
+	}
+}
+
+EFI_STATUS
+EFIAPI
+BuildXrefIndex(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST UINT8* ImageBase,
+	IN CONST PEFI_IMAGE_SECTION_HEADER* Sections,
+	IN UINT32 NumSections,
+	IN UINT8 TypeMask,
+	IN OUT PXREF_INDEX Index
+	)
+{
+	if (Context == NULL || ImageBase == NULL || Sections == NULL || Index == NULL || Index->Entries == NULL || TypeMask == 0)
+		return EFI_INVALID_PARAMETER;
+
+	// SiteRva is only 29 bits wide, so sites in sections that reach past that would be truncated
+	for (UINT32 i = 0; i < NumSections; ++i)
+	{
+		if ((UINT64)Sections[i]->VirtualAddress + Sections[i]->SizeOfRawData > XREF_SITE_RVA_LIMIT)
+			return EFI_UNSUPPORTED;
+	}
+
+	Index->ImageBase = ImageBase;
+	Index->Count = 0;
+
+	// This matcher never completes by itself. It is only deactivated when the index is full
+	XREF_INDEX_BUILDER Builder = { Index, TypeMask, 0, 0 };
+	INSTRUCTION_MATCHER XrefMatcher = { IsXrefCandidate, IsXrefInstruction, &Builder, AppendXref, &Builder, TRUE, NULL };
+	for (UINT32 i = 0; i < NumSections && XrefMatcher.Active; ++i)
+	{
+		DisassembleRange(Context, ImageBase + Sections[i]->VirtualAddress, Sections[i]->SizeOfRawData, &XrefMatcher, 1);
+	}
+
+	if (!XrefMatcher.Active)
+	{
+		Index->Count = 0;
+		return EFI_BUFFER_TOO_SMALL;
+	}
+
+	SortXrefs(Index->Entries, Index->Count);
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+FindXrefsTo(
+	IN CONST XREF_INDEX* Index,
+	IN CONST VOID* Target,
+	OUT CONST XREF_ENTRY** Xrefs,
+	OUT UINT32* Count
+	)
+{
+	*Xrefs = NULL;
+	*Count = 0;
+	if ((CONST UINT8*)Target < Index->ImageBase || (UINTN)((CONST UINT8*)Target - Index->ImageBase) > MAX_UINT32)
+		return EFI_NOT_FOUND;
+	CONST UINT32 TargetRva = (UINT32)((CONST UINT8*)Target - Index->ImageBase);
+
+	// Binary search for the first xref to the target
+	UINT32 Low = 0, High = Index->Count;
+	while (Low < High)
+	{
+		CONST UINT32 Middle = (Low + High) >> 1;
+		if (Index->Entries[Middle].TargetRva < TargetRva)
+			Low = Middle + 1;
+		else
+			High = Middle;
+	}
+
+	UINT32 End = Low;
+	while (End < Index->Count && Index->Entries[End].TargetRva == TargetRva)
+		End++;
+	if (End == Low)
+		return EFI_NOT_FOUND;
+
+	*Xrefs = &Index->Entries[Low];
+	*Count = End - Low;
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+MatchXrefsTo(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST XREF_INDEX* Index,
+	IN CONST VOID* Target,
+	IN UINT8 TypeMask,
+	IN CONST UINT8* Start,
+	IN UINTN Length,
+	IN OUT PINSTRUCTION_MATCHER Matcher
+	)
+{
+	if (Context == NULL || Index == NULL || Matcher == NULL || !Matcher->Active)
+		return EFI_INVALID_PARAMETER;
+
+	CONST XREF_ENTRY* Xrefs;
+	UINT32 Count;
+	if (EFI_ERROR(FindXrefsTo(Index, Target, &Xrefs, &Count)))
+		return EFI_NOT_FOUND;
+
+	for (UINT32 i = 0; i < Count && Matcher->Active; ++i)
+	{
+		CONST UINT8* Site = Index->ImageBase + Xrefs[i].SiteRva;
+		if ((TypeMask & XREF_TYPE_MASK(Xrefs[i].Type)) != 0 && Site >= Start && Site < Start + Length)
+			DisassembleRange(Context, Site, MIN(ZYDIS_MAX_INSTRUCTION_LENGTH, (UINTN)(Start + Length - Site)), Matcher, 1);
+	}
+	return Matcher->Active ? EFI_NOT_FOUND : EFI_SUCCESS;
+}
+
+// Returns the function table entry that contains the specified RVA, or NULL if there is none. Indirection is not followed
+STATIC
+CONST IMAGE_RUNTIME_FUNCTION_ENTRY*
+LookupFunctionEntry(
+	IN CONST UINT8* ImageBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN UINT32 RelativeAddress
 	)
 {
-	// Test for null. This allows callers to do 'FindPattern(..., &Address); X = Backtrack(Address, ...)' with a single failure branch
-	if (AddressInFunction == NULL)
-		return NULL;
 	if (NtHeaders->OptionalHeader.NumberOfRvaAndSizes <= EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION)
 		return NULL;
 
@@ -519,34 +1890,213 @@ BacktrackToFunctionStart(
 		return NULL;
 
 	// Do a binary search until we find the function that contains our address
-	CONST UINT32 RelativeAddress = (UINT32)(AddressInFunction - ImageBase);
-	PIMAGE_RUNTIME_FUNCTION_ENTRY FunctionEntry = NULL;
 	INT32 Low = 0;
 	INT32 High = (INT32)(FunctionTableSize / sizeof(IMAGE_RUNTIME_FUNCTION_ENTRY)) - 1;
 	
 	while (High >= Low)
 	{
 		CONST INT32 Middle = (Low + High) >> 1;
-		FunctionEntry = &FunctionTable[Middle];
+		CONST PIMAGE_RUNTIME_FUNCTION_ENTRY FunctionEntry = &FunctionTable[Middle];
 
 		if (RelativeAddress < FunctionEntry->BeginAddress)
 			High = Middle - 1;
 		else if (RelativeAddress >= FunctionEntry->EndAddress)
 			Low = Middle + 1;
 		else
+			return FunctionEntry;
+	}
+
+	return NULL;
+}
+
+// Returns the first offset in [Offset, LastOffset] that holds a branch opcode byte (E8, E9 or FF), or LastOffset + 1 if there is none.
+// On x64, 16 positions are tested at a time using SSE2
+STATIC
+UINTN
+FindBranchOpcodeCandidate(
+	IN CONST UINT8* Start,
+	IN UINTN Offset,
+	IN UINTN LastOffset
+	)
+{
+#if defined(MDE_CPU_X64)
+	CONST __m128i CallRel32 = _mm_set1_epi8((CHAR8)0xE8);
+	CONST __m128i JmpRel32 = _mm_set1_epi8((CHAR8)0xE9);
+	CONST __m128i Group5 = _mm_set1_epi8((CHAR8)0xFF);
+	while (Offset + (sizeof(__m128i) - 1) <= LastOffset)
+	{
+		CONST __m128i Block = _mm_loadu_si128((CONST __m128i*)(Start + Offset));
+		CONST UINT32 Mask = (UINT32)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(Block, CallRel32),
+																				_mm_cmpeq_epi8(Block, JmpRel32)),
+																	_mm_cmpeq_epi8(Block, Group5)));
+		if (Mask != 0)
+			return Offset + (UINTN)LowBitSet32(Mask);
+
+		Offset += sizeof(__m128i);
+	}
+#endif
+
+	for (; Offset <= LastOffset; ++Offset)
+	{
+		if (Start[Offset] == 0xE8 || Start[Offset] == 0xE9 || Start[Offset] == 0xFF)
 			break;
 	}
+	return Offset;
+}
 
-	if (High >= Low)
+// Checks whether the candidate branch at Address is a real instruction of the expected length. If the candidate is inside a function
+// with a function table entry, that function (fragment) is decoded from its start to verify that Address is on an instruction boundary.
+// Otherwise only the candidate itself is decoded
+STATIC
+BOOLEAN
+IsConfirmedBranch(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST UINT8* ImageBase OPTIONAL,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders OPTIONAL,
+	IN CONST UINT8* Address,
+	IN UINT8 ExpectedLength
+	)
+{
+	CONST UINT8* DecodeStart = Address;
+	if (ImageBase != NULL && NtHeaders != NULL && Address >= ImageBase)
+	{
+		CONST IMAGE_RUNTIME_FUNCTION_ENTRY* FunctionEntry = LookupFunctionEntry(ImageBase, NtHeaders, (UINT32)(Address - ImageBase));
+		if (FunctionEntry != NULL)
+			DecodeStart = ImageBase + FunctionEntry->BeginAddress;
+	}
+
+	// Only instruction lengths are needed here, so operands are not decoded
+	ZydisDecoderContext DecoderContext;
+	Context->Length = (UINTN)(Address - DecodeStart) + ExpectedLength;
+	Context->Offset = 0;
+	while (Context->Offset < Context->Length)
 	{
-		// If the function entry specifies indirection, get the address of the master function entry
-		if ((FunctionEntry->u.UnwindData & RUNTIME_FUNCTION_INDIRECT) != 0)
+		Context->InstructionAddress = (ZyanU64)(DecodeStart + Context->Offset);
+		if (!ZYAN_SUCCESS(ZydisDecoderDecodeInstruction(&Context->Decoder,
+														&DecoderContext,
+														(VOID*)Context->InstructionAddress,
+														Context->Length - Context->Offset,
+														&Context->Instruction)))
+		{
+			if ((CONST UINT8*)Context->InstructionAddress == Address)
+				return FALSE;
+			Context->Offset++;
+			gBootStatistics.ResyncEvents++;
+			continue;
+		}
+		gBootStatistics.InstructionsDecoded++;
+
+		if ((CONST UINT8*)Context->InstructionAddress == Address)
 		{
-			FunctionEntry = (PIMAGE_RUNTIME_FUNCTION_ENTRY)(FunctionEntry->u.UnwindData + ImageBase - 1);
+			return Context->Instruction.length == ExpectedLength &&
+				(Context->Instruction.mnemonic == ZYDIS_MNEMONIC_CALL || Context->Instruction.mnemonic == ZYDIS_MNEMONIC_JMP);
 		}
-		
-		return (UINT8*)ImageBase + FunctionEntry->BeginAddress;
+		if ((CONST UINT8*)Context->InstructionAddress > Address)
+			return FALSE;
+
+		Context->Offset += Context->Instruction.length;
 	}
+	return FALSE;
+}
 
-	return NULL;
+EFI_STATUS
+EFIAPI
+FindBranchesTo(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST UINT8* ImageBase OPTIONAL,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders OPTIONAL,
+	IN CONST UINT8* Start,
+	IN UINTN Length,
+	IN CONST VOID* Target,
+	IN UINT8 TypeMask,
+	OUT UINT8** Sites,
+	IN UINT32 MaxSites,
+	OUT UINT32* NumSites
+	)
+{
+	if (Context == NULL || Start == NULL || Sites == NULL || MaxSites == 0 || NumSites == NULL)
+		return EFI_INVALID_PARAMETER;
+
+	*NumSites = 0;
+	if (Length < 5) // Size of the shortest instruction we are looking for
+		return EFI_NOT_FOUND;
+
+	// RIP-relative addressing only exists in 64-bit mode
+	CONST BOOLEAN Is64Bit = Context->Decoder.machine_mode == ZYDIS_MACHINE_MODE_LONG_64;
+	CONST UINTN LastOffset = Length - 5;
+	UINTN Offset;
+
+	for (Offset = 0; Offset <= LastOffset && *NumSites < MaxSites; ++Offset)
+	{
+		Offset = FindBranchOpcodeCandidate(Start, Offset, LastOffset);
+		if (Offset > LastOffset)
+			break;
+
+		// Compute the type, site, length and target of the candidate from its raw bytes
+		UINT8 Type;
+		CONST UINT8* Site = Start + Offset;
+		UINT8 InstructionLength;
+		if (Start[Offset] == 0xE8 || Start[Offset] == 0xE9)
+		{
+			Type = Start[Offset] == 0xE8 ? XREF_CALL_REL32 : XREF_JMP_REL32;
+			InstructionLength = 5;
+		}
+		else if (Is64Bit && Offset + 6 <= Length && (Start[Offset + 1] == 0x15 || Start[Offset + 1] == 0x25))
+		{
+			Type = Start[Offset + 1] == 0x15 ? XREF_CALL_INDIRECT : XREF_JMP_INDIRECT;
+			InstructionLength = 6;
+			if (Type == XREF_JMP_INDIRECT && Offset > 0 && Start[Offset - 1] == 0x48)
+			{
+				// 'jmp qword ptr ds:[...]' with a REX.W prefix, as used in ntoskrnl for tail calls through the IAT
+				Site--;
+				InstructionLength++;
+			}
+		}
+		else
+			continue;
+
+		if ((TypeMask & XREF_TYPE_MASK(Type)) == 0)
+			continue;
+
+		// The displacement is relative to the end of the instruction, which is the same with or without a REX prefix
+		CONST INT32 Displacement = *(CONST INT32*)(Start + Offset + (Start[Offset] == 0xFF ? 2 : 1));
+		CONST UINT8* CandidateTarget = Start + Offset + (Start[Offset] == 0xFF ? 6 : 5) + Displacement;
+		if (CandidateTarget != (CONST UINT8*)Target)
+			continue;
+
+		// Only now run the decoder, to rule out byte sequences that are part of other instructions
+		if (IsConfirmedBranch(Context, ImageBase, NtHeaders, Site, InstructionLength) ||
+			(Site != Start + Offset && IsConfirmedBranch(Context, ImageBase, NtHeaders, Start + Offset, InstructionLength - 1)))
+		{
+			Sites[(*NumSites)++] = (UINT8*)(Context->InstructionAddress);
+		}
+	}
+	gBootStatistics.BytesScanned += MIN(Offset + 4, Length); // Each candidate reads up to 5 bytes from its offset
+
+	return *NumSites > 0 ? EFI_SUCCESS : EFI_NOT_FOUND;
+}
+
+UINT8*
+EFIAPI
+BacktrackToFunctionStart(
+	IN CONST UINT8* ImageBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN CONST UINT8* AddressInFunction
+	)
+{
+	// Test for null. This allows callers to do 'FindPattern(..., &Address); X = Backtrack(Address, ...)' with a single failure branch
+	if (AddressInFunction == NULL)
+		return NULL;
+
+	CONST IMAGE_RUNTIME_FUNCTION_ENTRY* FunctionEntry = LookupFunctionEntry(ImageBase, NtHeaders, (UINT32)(AddressInFunction - ImageBase));
+	if (FunctionEntry == NULL)
+		return NULL;
+
+	// If the function entry specifies indirection, get the address of the master function entry
+	if ((FunctionEntry->u.UnwindData & RUNTIME_FUNCTION_INDIRECT) != 0)
+	{
+		FunctionEntry = (PIMAGE_RUNTIME_FUNCTION_ENTRY)(FunctionEntry->u.UnwindData + ImageBase - 1);
+	}
+	
+	return (UINT8*)ImageBase + FunctionEntry->BeginAddress;
 }
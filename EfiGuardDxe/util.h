@@ -47,6 +47,8 @@ PrintLoadedImageInfo(
 // Similar to Print(), but for use during the kernel patching phase.
 // Do not call this unless the message is specifically intended for (delayed) display output only.
 // Instead use the PRINT_KERNEL_PATCH_MSG() macro so the boot debugger receives messages with no delay.
+// The message is not formatted here: its format string and up to KERNEL_PATCH_MESSAGE_MAX_ARGUMENTS arguments are stored
+// in the kernel patch log as is. Format strings and string arguments must therefore remain valid until the log is printed.
 //
 VOID
 EFIAPI
@@ -56,9 +58,8 @@ AppendKernelPatchMessage(
 	);
 
 //
-// Prints the contents of the kernel patch string buffer to the screen using OutputString() calls.
-// This is a separate function because the buffer consists of zero or more null-terminated strings,
-// which are printed sequentially to prevent issues with platforms that have small Print() buffer limits
+// Formats the messages in the kernel patch log and writes them to the console buffer, regardless of the configured verbosity.
+// Each message is formatted separately to prevent issues with platforms that have small Print() buffer limits
 //
 VOID
 EFIAPI
@@ -66,6 +67,55 @@ PrintKernelPatchInfo(
 	VOID
 	);
 
+//
+// Holds the state of a stage between BeginStage() and EndStage() calls.
+//
+typedef struct _STAGE_TIMER
+{
+	EFIGUARD_STAGE Stage;			// EFIGUARD_STAGE_MAX if the timer is not running
+	UINT64 StartTsc;
+	UINT64 BytesScanned;
+	UINT64 InstructionsDecoded;
+	UINT64 ResyncEvents;
+} STAGE_TIMER, *PSTAGE_TIMER;
+
+//
+// Starts timing a stage. The TSC and the scan counters are sampled here, and their deltas are added to the stage by EndStage().
+//
+VOID
+EFIAPI
+BeginStage(
+	OUT PSTAGE_TIMER Timer,
+	IN EFIGUARD_STAGE Stage
+	);
+
+//
+// Stops timing a stage and adds the elapsed ticks and counter deltas to its statistics. Does nothing if the timer is not running.
+//
+VOID
+EFIAPI
+EndStage(
+	IN OUT PSTAGE_TIMER Timer
+	);
+
+//
+// Measures the TSC frequency and clears the boot statistics. Must be called while boot services are available.
+//
+VOID
+EFIAPI
+InitializeBootStatistics(
+	VOID
+	);
+
+//
+// Prints a summary table of the boot statistics, regardless of the configured verbosity.
+//
+VOID
+EFIAPI
+PrintBootStatistics(
+	VOID
+	);
+
 //
 // Disables CET.
 //
@@ -127,6 +177,142 @@ SetWpMem(
 	IN UINT8 Value
 	);
 
+//
+// A patch plan holds a batch of patches that are verified first, and then written in a single window with write protection
+// (and CET) disabled. This avoids the serializing CR0/CR4 writes that CopyWpMem() and SetWpMem() make for every patch.
+// The original bytes of each patch are kept in the plan, so that a failed write can be rolled back without touching memory
+// that was not part of the plan. Plans are meant to be kept in static storage, since they are also used in the kernel phase.
+//
+#define PATCH_PLAN_MAX_ENTRIES		8
+#define PATCH_PLAN_MAX_PATCH_SIZE	24
+
+typedef struct _PATCH_PLAN_ENTRY
+{
+	UINT8* Address;
+	UINT32 Length;
+	BOOLEAN VerifyExpected;
+	UINT8 Expected[PATCH_PLAN_MAX_PATCH_SIZE];
+	UINT8 Patch[PATCH_PLAN_MAX_PATCH_SIZE];
+	UINT8 Original[PATCH_PLAN_MAX_PATCH_SIZE];	// Undo journal, filled in by ApplyPatchPlan()
+} PATCH_PLAN_ENTRY;
+
+typedef struct _PATCH_PLAN
+{
+	EFI_STATUS Status;							// Set if an entry could not be added. ApplyPatchPlan() will then fail without writing anything
+	UINT32 NumEntries;
+	PATCH_PLAN_ENTRY Entries[PATCH_PLAN_MAX_ENTRIES];
+} PATCH_PLAN;
+
+//
+// Empties a patch plan.
+//
+VOID
+EFIAPI
+InitializePatchPlan(
+	OUT PATCH_PLAN *Plan
+	);
+
+//
+// Adds a patch to a plan. If Expected is not NULL, ApplyPatchPlan() verifies that the destination holds these bytes before patching.
+// On failure, the error is also stored in the plan, so that callers may add all of their patches before checking the status once.
+//
+EFI_STATUS
+EFIAPI
+AddPatchPlanEntry(
+	IN OUT PATCH_PLAN *Plan,
+	IN VOID *Destination,
+	IN CONST VOID *Expected OPTIONAL,
+	IN CONST VOID *Patch,
+	IN UINTN Length
+	);
+
+//
+// Adds a patch that fills the destination with a byte value to a plan. Like AddPatchPlanEntry(), but for SetWpMem()-style patches.
+//
+EFI_STATUS
+EFIAPI
+AddPatchPlanFill(
+	IN OUT PATCH_PLAN *Plan,
+	IN VOID *Destination,
+	IN UINTN Length,
+	IN UINT8 Value
+	);
+
+//
+// Verifies and applies all patches in a plan, disabling write protection only once. Nothing is written unless every entry verifies.
+// If a patch does not read back as written, all patches applied so far are rolled back and EFI_DEVICE_ERROR is returned.
+// This does not raise the TPL, because it is also used in the kernel phase. Callers that still have boot services should do so.
+//
+EFI_STATUS
+EFIAPI
+ApplyPatchPlan(
+	IN OUT PATCH_PLAN *Plan
+	);
+
+//
+// A bump allocator over a fixed region of memory. Allocations cannot be freed individually; the whole arena is reset instead.
+// This allows index structures to be built in winload's application context, where firmware allocations are not possible.
+//
+typedef struct _ARENA
+{
+	UINT8* Base;
+	UINTN Size;
+	UINTN Used;
+} ARENA, *PARENA;
+
+//
+// Initializes an arena to allocate from the specified buffer.
+//
+VOID
+EFIAPI
+InitializeArena(
+	OUT PARENA Arena,
+	IN VOID *Buffer,
+	IN UINTN Size
+	);
+
+//
+// Allocates memory from an arena. Alignment must be a power of two. The memory is not zeroed.
+// Returns NULL if the arena does not have enough space left.
+//
+VOID*
+EFIAPI
+ArenaAllocate(
+	IN OUT PARENA Arena,
+	IN UINTN Size,
+	IN UINTN Alignment
+	);
+
+//
+// Frees all allocations of an arena.
+//
+VOID
+EFIAPI
+ResetArena(
+	IN OUT PARENA Arena
+	);
+
+//
+// Largest variable that SetVariableIfChanged() can compare to its current value. Larger variables are always written.
+//
+#define VARIABLE_STATE_MAX_SIZE		2048
+
+//
+// Writes a variable only if its current value or attributes differ. NV writes go to SPI flash, which is slow and wears the part,
+// so all state that the driver persists should be written through this. If the variable exists with different attributes or
+// a different size, it is deleted first. Returns EFI_SUCCESS without writing anything if the variable already matches.
+// Must be called before SetVirtualAddressMap(). Not reentrant, since the current value is read into a static buffer.
+//
+EFI_STATUS
+EFIAPI
+SetVariableIfChanged(
+	IN CONST CHAR16 *VariableName,
+	IN CONST EFI_GUID *VendorGuid,
+	IN UINT32 Attributes,
+	IN UINTN DataSize,
+	IN CONST VOID *Data
+	);
+
 //
 // Returns TRUE if 5-level paging is enabled.
 //
@@ -178,34 +364,129 @@ SetConsoleTextColour(
 	IN BOOLEAN ClearScreen
 	);
 
+//
+// Maximum length of a byte pattern, in bytes.
+//
+#define MAX_BYTE_PATTERN_LENGTH			64
+
+//
+// A byte pattern (signature) with an explicit mask. The mask has one character per pattern byte: 'x' for a byte that must match,
+// and '?' for a wildcard. By convention the pattern bytes at wildcard positions are 0x00, but their value is never used.
+// The remaining fields hold the compiled form of the pattern, which is generated once by the first search that uses it.
+//
+typedef struct _BYTE_PATTERN
+{
+	CONST UINT8* Bytes;
+	CONST CHAR8* Mask;
+	UINT32 Length;
+
+	BOOLEAN Compiled;
+	UINT32 NumFixed;
+	UINT8 FixedOffsets[MAX_BYTE_PATTERN_LENGTH];	// Two rarest bytes (anchors) first, then all other non-wildcard bytes
+	UINT8 FixedValues[MAX_BYTE_PATTERN_LENGTH];
+} BYTE_PATTERN, *PBYTE_PATTERN;
+
+//
+// Initializer for a BYTE_PATTERN from a byte array and a mask string literal.
+// This fails to compile if the mask does not have exactly one character per pattern byte.
+//
+#define BYTE_PATTERN_INIT(Bytes, Mask) \
+	{ (Bytes), (Mask), sizeof(Bytes) + 0 * sizeof(CHAR8[(sizeof(Mask) - 1 == sizeof(Bytes)) ? 1 : -1]), FALSE, 0, { 0 }, { 0 } }
+
+//
+// Compiles a pattern into its list of fixed bytes, with the two rarest bytes (the anchors) first and the remaining fixed
+// bytes in ascending order after them. Wildcard bytes do not appear in the compiled form at all. Does nothing if the pattern is already compiled.
+// The search functions call this on first use. Code that shares patterns between threads (the host tools) must compile them before starting the threads.
+//
+EFI_STATUS
+EFIAPI
+CompileBytePattern(
+	IN OUT PBYTE_PATTERN Pattern
+	);
+
 //
 // Finds a byte pattern starting at the specified address
 //
 EFI_STATUS
 EFIAPI
 FindPattern(
-	IN CONST UINT8* Pattern,
-	IN UINT8 Wildcard,
-	IN UINT32 PatternLength,
+	IN OUT PBYTE_PATTERN Pattern,
 	IN CONST VOID* Base,
 	IN UINT32 Size,
 	OUT VOID **Found
 	);
 
+//
+// Finds up to MaxMatches occurrences of a byte pattern starting at the specified address, in ascending order.
+// The scan stops as soon as MaxMatches matches have been found, so a MaxMatches of 2 is a cheap way to check if a pattern is unique
+//
+EFI_STATUS
+EFIAPI
+FindPatternAll(
+	IN OUT PBYTE_PATTERN Pattern,
+	IN CONST VOID* Base,
+	IN UINT32 Size,
+	OUT VOID **Matches,
+	IN UINT32 MaxMatches,
+	OUT UINT32 *MatchCount
+	);
+
 //
 // Finds a byte pattern starting at the specified address (with lots of debug spew)
 //
 EFI_STATUS
 EFIAPI
 FindPatternVerbose(
-	IN CONST UINT8* Pattern,
-	IN UINT8 Wildcard,
-	IN UINT32 PatternLength,
+	IN OUT PBYTE_PATTERN Pattern,
 	IN CONST VOID* Base,
 	IN UINT32 Size,
 	OUT VOID **Found
 	);
 
+//
+// Finds a literal byte sequence (no wildcards) starting at the specified address.
+// Only addresses that are a multiple of Alignment bytes from Base are considered. Use an alignment of 1 for an unaligned search
+//
+EFI_STATUS
+EFIAPI
+FindBytes(
+	IN CONST VOID* Bytes,
+	IN UINT32 Length,
+	IN UINT32 Alignment,
+	IN CONST VOID* Base,
+	IN UINT32 Size,
+	OUT VOID **Found
+	);
+
+//
+// Maximum number of signatures that can be searched for in a single FindPatterns() call.
+//
+#define MAX_PATTERN_SEARCH_ENTRIES		8
+
+//
+// A signature to search for using FindPatterns(). Found receives the address of the first match, or NULL if there was none.
+//
+typedef struct _PATTERN_SEARCH_ENTRY
+{
+	PBYTE_PATTERN Pattern;
+	VOID* Found;
+} PATTERN_SEARCH_ENTRY, *PPATTERN_SEARCH_ENTRY;
+
+//
+// Finds multiple byte patterns in a single pass over the specified address range. On x64, positions at which the two anchor bytes of no pattern match
+// are skipped 16 at a time using SSE2.
+// Returns EFI_SUCCESS if all patterns were found, and EFI_NOT_FOUND if at least one was not. Check the Found field of each entry for the results.
+// In debug builds, the scan continues past the first match of each pattern, and asserts that none of them matches a second time.
+//
+EFI_STATUS
+EFIAPI
+FindPatterns(
+	IN OUT PPATTERN_SEARCH_ENTRY Entries,
+	IN UINT32 NumEntries,
+	IN CONST VOID* Base,
+	IN UINT32 Size
+	);
+
 //
 // Zydis instruction decoder context.
 //
@@ -235,6 +516,229 @@ ZydisInit(
 	OUT PZYDIS_CONTEXT Context
 	);
 
+//
+// Instruction predicate and callback types for DisassembleRange().
+// Callbacks return TRUE if the matcher should remain active, or FALSE if it has found what it was looking for.
+// Prefilters are predicates that are called before the instruction operands have been decoded, so they may only use Context->Instruction.
+//
+typedef
+BOOLEAN
+(EFIAPI*
+INSTRUCTION_PREDICATE)(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	);
+
+typedef
+BOOLEAN
+(EFIAPI*
+INSTRUCTION_CALLBACK)(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* CallbackContext
+	);
+
+//
+// An instruction matcher for DisassembleRange(). While the matcher is active, Predicate is called for every decoded instruction
+// that passes the prefilter. If it returns TRUE, the instruction address is stored in Found and Callback is called. Without a callback,
+// the matcher is deactivated after its first match. Operands are only decoded for instructions that pass the prefilter of at least one
+// matcher, so a cheap mnemonic or length check in the prefilter avoids most of the decoding work.
+//
+typedef struct _INSTRUCTION_MATCHER
+{
+	INSTRUCTION_PREDICATE Prefilter;	// Optional. Receives PredicateContext
+	INSTRUCTION_PREDICATE Predicate;
+	VOID* PredicateContext;			// Optional
+	INSTRUCTION_CALLBACK Callback;	// Optional
+	VOID* CallbackContext;			// Optional
+	BOOLEAN Active;
+	UINT8* Found;
+} INSTRUCTION_MATCHER, *PINSTRUCTION_MATCHER;
+
+//
+// Disassembles an address range once, and passes each decoded instruction to every matcher that is still active, in array order.
+// Matchers that are not active on entry are skipped (and their Found field is left as is), so callers can enable them conditionally.
+// The sweep ends early once no active matchers remain.
+// Returns EFI_SUCCESS if all matchers have completed, and EFI_NOT_FOUND if at least one matcher was still active at the end of the range.
+//
+EFI_STATUS
+EFIAPI
+DisassembleRange(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST UINT8* Start,
+	IN UINTN Length,
+	IN OUT PINSTRUCTION_MATCHER Matchers,
+	IN UINT32 NumMatchers
+	);
+
+//
+// Selects which functions in the exception directory (.pdata) are returned by a function iterator. Zero fields are ignored.
+// StartRva and EndRva restrict the functions to an RVA range, typically that of a section. Sizes are in bytes.
+// Unwind flags (UNW_FLAG_*) are taken from the primary function entry for entries that specify indirection.
+//
+typedef struct _FUNCTION_FILTER
+{
+	UINT32 StartRva;
+	UINT32 EndRva;
+	UINT32 MinSize;
+	UINT32 MaxSize;
+	UINT8 RequiredUnwindFlags;
+	UINT8 ExcludedUnwindFlags;
+} FUNCTION_FILTER, *PFUNCTION_FILTER;
+
+//
+// Iterator over the function entries of an image, in ascending address order.
+//
+typedef struct _FUNCTION_ITERATOR
+{
+	CONST UINT8* ImageBase;
+	CONST IMAGE_RUNTIME_FUNCTION_ENTRY* FunctionTable;
+	UINT32 NumFunctions;
+	UINT32 Index;
+	FUNCTION_FILTER Filter;
+} FUNCTION_ITERATOR, *PFUNCTION_ITERATOR;
+
+//
+// Initializes a function iterator. Returns EFI_NOT_FOUND if the image has no exception directory.
+//
+EFI_STATUS
+EFIAPI
+InitializeFunctionIterator(
+	IN CONST UINT8* ImageBase,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders,
+	IN CONST FUNCTION_FILTER* Filter OPTIONAL,
+	OUT PFUNCTION_ITERATOR Iterator
+	);
+
+//
+// Gets the next function that passes the iterator's filter. Returns FALSE if there are no more functions.
+//
+BOOLEAN
+EFIAPI
+GetNextFunction(
+	IN OUT PFUNCTION_ITERATOR Iterator,
+	OUT CONST IMAGE_RUNTIME_FUNCTION_ENTRY** FunctionEntry
+	);
+
+//
+// Same as DisassembleRange(), but only disassembles the [BeginAddress, EndAddress) ranges of the functions returned by the iterator,
+// so that padding, jump tables and other data between functions are skipped. Note that leaf functions have no function entries.
+//
+EFI_STATUS
+EFIAPI
+DisassembleFunctions(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN OUT PFUNCTION_ITERATOR Iterator,
+	IN OUT PINSTRUCTION_MATCHER Matchers,
+	IN UINT32 NumMatchers
+	);
+
+//
+// Cross-reference (xref) types. Relative xrefs target the branch destination, all other xrefs target the RIP-relative memory operand
+// (e.g. an IAT entry, a string or a global variable).
+//
+#define XREF_CALL_REL32			0	// E8 rel32
+#define XREF_JMP_REL32			1	// E9 rel32
+#define XREF_CALL_INDIRECT		2	// FF 15 disp32
+#define XREF_JMP_INDIRECT		3	// [48] FF 25 disp32
+#define XREF_DATA_LEA			4	// lea REG, [rip+disp32]
+#define XREF_DATA_ACCESS		5	// Any other instruction with a [rip+disp32] operand
+
+typedef struct _XREF_ENTRY
+{
+	UINT32 TargetRva;
+	UINT32 SiteRva : 29;
+	UINT32 Type : 3;
+} XREF_ENTRY, *PXREF_ENTRY;
+
+// Sites must be below this RVA to fit in XREF_ENTRY.SiteRva
+#define XREF_SITE_RVA_LIMIT		(1U << 29)
+
+#define XREF_TYPE_MASK(Type)	((UINT8)(1 << (Type)))
+
+#define XREF_TYPE_MASK_BRANCH	(XREF_TYPE_MASK(XREF_CALL_REL32) | XREF_TYPE_MASK(XREF_JMP_REL32) | \
+								XREF_TYPE_MASK(XREF_CALL_INDIRECT) | XREF_TYPE_MASK(XREF_JMP_INDIRECT))
+#define XREF_TYPE_MASK_DATA		(XREF_TYPE_MASK(XREF_DATA_LEA) | XREF_TYPE_MASK(XREF_DATA_ACCESS))
+
+//
+// A cross-reference index for an image, sorted by target and then by site. Entries is a caller-provided buffer of Capacity entries.
+//
+typedef struct _XREF_INDEX
+{
+	CONST UINT8* ImageBase;
+	PXREF_ENTRY Entries;
+	UINT32 Capacity;
+	UINT32 Count;
+} XREF_INDEX, *PXREF_INDEX;
+
+//
+// Builds a cross-reference index of the specified sections in a single pass. TypeMask is a combination of XREF_TYPE_MASK() values that selects
+// the kinds of xrefs to record: XREF_TYPE_MASK_BRANCH for all rel32 calls and jumps and all RIP-relative indirect calls and jumps, and
+// XREF_TYPE_MASK_DATA for all other RIP-relative memory operands. Returns EFI_BUFFER_TOO_SMALL if the index is full, in which case it must not be used.
+// Returns EFI_UNSUPPORTED if a section extends past XREF_SITE_RVA_LIMIT.
+//
+EFI_STATUS
+EFIAPI
+BuildXrefIndex(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST UINT8* ImageBase,
+	IN CONST PEFI_IMAGE_SECTION_HEADER* Sections,
+	IN UINT32 NumSections,
+	IN UINT8 TypeMask,
+	IN OUT PXREF_INDEX Index
+	);
+
+//
+// Finds all xrefs to Target in the index. On return, Xrefs points to the first of Count entries, in ascending site order.
+// Returns EFI_NOT_FOUND if there are no xrefs to Target.
+//
+EFI_STATUS
+EFIAPI
+FindXrefsTo(
+	IN CONST XREF_INDEX* Index,
+	IN CONST VOID* Target,
+	OUT CONST XREF_ENTRY** Xrefs,
+	OUT UINT32* Count
+	);
+
+//
+// Runs Matcher on the sites of the xrefs to Target of a type in TypeMask with a site in [Start, Start + Length), in ascending order,
+// until it completes. Instead of the whole range, only ZYDIS_MAX_INSTRUCTION_LENGTH bytes at each site are disassembled.
+// Returns EFI_NOT_FOUND if the matcher did not complete.
+//
+EFI_STATUS
+EFIAPI
+MatchXrefsTo(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST XREF_INDEX* Index,
+	IN CONST VOID* Target,
+	IN UINT8 TypeMask,
+	IN CONST UINT8* Start,
+	IN UINTN Length,
+	IN OUT PINSTRUCTION_MATCHER Matcher
+	);
+
+//
+// Finds calls and jumps to Target in [Start, Start + Length) without disassembling the whole range. TypeMask is a combination of XREF_TYPE_MASK() values.
+// Candidates are found by scanning for E8/E9/FF opcode bytes (16 at a time using SSE2 on x64), and their targets are computed from the raw displacement.
+// Only candidates with a matching target are decoded. If ImageBase and NtHeaders are given, the function containing a candidate is decoded from its start
+// to confirm that the candidate is on an instruction boundary. Sites receives up to MaxSites matches in ascending order.
+// Returns EFI_NOT_FOUND if there were no matches.
+//
+EFI_STATUS
+EFIAPI
+FindBranchesTo(
+	IN OUT PZYDIS_CONTEXT Context,
+	IN CONST UINT8* ImageBase OPTIONAL,
+	IN PEFI_IMAGE_NT_HEADERS NtHeaders OPTIONAL,
+	IN CONST UINT8* Start,
+	IN UINTN Length,
+	IN CONST VOID* Target,
+	IN UINT8 TypeMask,
+	OUT UINT8** Sites,
+	IN UINT32 MaxSites,
+	OUT UINT32* NumSites
+	);
+
 //
 // Finds the start of a function given an address within it.
 // Returns NULL if AddressInFunction is NULL (this simplifies error checking logic in calling functions).
@@ -8,13 +8,20 @@ extern "C" {
 #endif
 
 //
-// EfiGuard Bootkit Protocol GUID
+// EfiGuard Bootkit Protocol GUID. Drivers that install the previous GUID, 51e4785b-b1e4-4fda-af5f-942ec015f107, have no QueryStatistics()
+// and take a configuration without Verbosity, so they are not compatible with this interface.
 //
 #define EFI_EFIGUARD_DRIVER_PROTOCOL_GUID \
 	{ \
-	0x51e4785b, 0xb1e4, 0x4fda, { 0xaf, 0x5f, 0x94, 0x2e, 0xc0, 0x15, 0xf1, 0x7 } \
+	0x7a88ad09, 0xce58, 0x4765, { 0x98, 0xde, 0x87, 0xfe, 0x12, 0xa6, 0xd5, 0xa8 } \
 	}
 
+//
+// Revision of the protocol interface and of the structures passed through it. This is incremented on every change to them,
+// so callers must check that the Revision of the installed protocol is equal to the one they were built with before using it.
+//
+#define EFIGUARD_DRIVER_PROTOCOL_REVISION				2
+
 //
 // Type of Driver Signature Enforcement bypass to use
 //
@@ -43,6 +50,38 @@ typedef enum _EFIGUARD_DSE_BYPASS_TYPE {
 	DSE_DISABLE_SETVARIABLE_HOOK = 2
 } EFIGUARD_DSE_BYPASS_TYPE;
 
+//
+// Amount of console output produced by the driver
+//
+typedef enum _EFIGUARD_VERBOSITY {
+	//
+	// Print nothing unless something fails. Errors and prompts are always printed.
+	//
+	VERBOSITY_QUIET = 0,
+
+	//
+	// Print one line for each image that was patched, and warnings.
+	//
+	VERBOSITY_SUMMARY = 1,
+
+	//
+	// Print the progress of every patch stage, as well as the boot statistics.
+	//
+	// This is the default verbosity setting, unless EFIGUARD_VERBOSITY_VARIABLE_NAME is set.
+	//
+	VERBOSITY_VERBOSE = 2
+} EFIGUARD_VERBOSITY;
+
+//
+// Non-volatile variable that holds the default verbosity, as a UINT32 EFIGUARD_VERBOSITY value. It is read when the driver is loaded,
+// so that it also applies to the driver initialization output, and on systems where Configure() is never called (e.g. headless ones).
+// The loader stores the verbosity chosen during interactive configuration here. To set it from the UEFI shell:
+//     setvar EfiGuardVerbosity -guid 7a88ad09-ce58-4765-98de-87fe12a6d5a8 -nv -bs =00000000
+//
+#define EFIGUARD_VERBOSITY_VARIABLE_NAME					L"EfiGuardVerbosity"
+#define EFIGUARD_VERBOSITY_VARIABLE_GUID					&gEfiGuardDriverProtocolGuid
+#define EFIGUARD_VERBOSITY_VARIABLE_ATTRIBUTES				(EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS)
+
 
 //
 // Kernel read/write backdoor struct, used in combination with DSE bypass type DSE_DISABLE_SETVARIABLE_HOOK.
@@ -103,9 +142,99 @@ typedef struct _EFIGUARD_CONFIGURATION_DATA {
 	// Default: FALSE
 	//
 	BOOLEAN WaitForKeyPress;
+
+	//
+	// Amount of console output to print.
+	// Default: the value of EFIGUARD_VERBOSITY_VARIABLE_NAME if set, otherwise VERBOSITY_VERBOSE
+	//
+	EFIGUARD_VERBOSITY Verbosity;
 } EFIGUARD_CONFIGURATION_DATA;
 
 
+//
+// Boot stages timed by the driver. The kernel stages are the individual locators of the PatchGuard and DSE patch sites,
+// followed by the patching itself. A stage that was skipped (e.g. because its patch sites were found in the patch cache) has a Count of 0.
+//
+typedef enum _EFIGUARD_STAGE {
+	EFIGUARD_STAGE_LOAD_IMAGE,
+	EFIGUARD_STAGE_PATCH_BOOT_MANAGER,
+	EFIGUARD_STAGE_PATCH_WINLOAD,
+	EFIGUARD_STAGE_FIND_OSL_FWP_KERNEL_SETUP_PHASE1,
+	EFIGUARD_STAGE_PATCH_IMGP_VALIDATE_IMAGE_HASH,
+	EFIGUARD_STAGE_PATCH_IMGP_FILTER_VALIDATION_FAILURE,
+	EFIGUARD_STAGE_OSL_FWP_KERNEL_SETUP_PHASE1,
+	EFIGUARD_STAGE_PATCH_NTOSKRNL,
+	EFIGUARD_STAGE_FIND_KE_INIT_AMD64_SPECIFIC_STATE,
+	EFIGUARD_STAGE_FIND_CC_INITIALIZE_BCB_PROFILER,
+	EFIGUARD_STAGE_FIND_KI_MCA_DEFERRED_RECOVERY_SERVICE,
+	EFIGUARD_STAGE_FIND_GLOBAL_PG_CONTEXT,
+	EFIGUARD_STAGE_DISABLE_PATCHGUARD,
+	EFIGUARD_STAGE_FIND_CI_INITIALIZE,
+	EFIGUARD_STAGE_FIND_SEP_INITIALIZE_CODE_INTEGRITY,
+	EFIGUARD_STAGE_FIND_SE_VALIDATE_IMAGE_DATA,
+	EFIGUARD_STAGE_FIND_SE_CODE_INTEGRITY_QUERY_INFORMATION,
+	EFIGUARD_STAGE_DISABLE_DSE,
+	EFIGUARD_STAGE_MAX
+} EFIGUARD_STAGE;
+
+//
+// Display names of the stages, indexed by EFIGUARD_STAGE.
+//
+#define EFIGUARD_STAGE_NAMES \
+	{ \
+	L"LoadImage", \
+	L"PatchBootManager", \
+	L"PatchWinload", \
+	L"  FindOslFwpKernelSetupPhase1", \
+	L"  PatchImgpValidateImageHash", \
+	L"  PatchImgpFilterValidationFailure", \
+	L"OslFwpKernelSetupPhase1", \
+	L"  PatchNtoskrnl", \
+	L"    FindKeInitAmd64SpecificState", \
+	L"    FindCcInitializeBcbProfiler", \
+	L"    FindKiMcaDeferredRecoveryService", \
+	L"    FindGlobalPgContext", \
+	L"    DisablePatchGuard", \
+	L"    FindCiInitialize", \
+	L"    FindSepInitializeCodeIntegrity", \
+	L"    FindSeValidateImageData", \
+	L"    FindSeCodeIntegrityQueryInfo", \
+	L"    DisableDSE" \
+	}
+
+//
+// Timing and scan statistics of a single stage. All values are cumulative over the runs of the stage, and include nested stages.
+//
+typedef struct _EFIGUARD_STAGE_STATISTICS {
+	UINT32 Count;					// Number of times the stage was run
+	UINT64 FirstTsc;				// TSC value at the start of the first run
+	UINT64 LastTsc;					// TSC value at the end of the last run
+	UINT64 Ticks;					// Total TSC ticks spent in the stage
+	UINT64 BytesScanned;			// Bytes read by the pattern and branch scanners
+	UINT64 InstructionsDecoded;
+	UINT64 ResyncEvents;			// Decode failures after which the disassembler skipped one byte to resynchronize
+} EFIGUARD_STAGE_STATISTICS;
+
+//
+// Boot timing and scan statistics collected by the driver.
+//
+typedef struct _EFIGUARD_STATISTICS {
+	//
+	// TSC ticks per second, measured at driver load. May be 0 if the measurement failed.
+	//
+	UINT64 TscFrequency;
+
+	//
+	// Totals over all stages, including work done outside of any stage.
+	//
+	UINT64 BytesScanned;
+	UINT64 InstructionsDecoded;
+	UINT64 ResyncEvents;
+
+	EFIGUARD_STAGE_STATISTICS Stages[EFIGUARD_STAGE_MAX];
+} EFIGUARD_STATISTICS;
+
+
 //
 // Sends configuration data to the driver.
 //
@@ -116,12 +245,25 @@ EFIGUARD_CONFIGURE)(
 	IN CONST EFIGUARD_CONFIGURATION_DATA* ConfigurationData
 	);
 
+//
+// Copies the boot timing and scan statistics collected so far. The kernel stages only run once winload.efi has been started,
+// so on a successful boot they are only visible in the summary the driver prints in its ExitBootServices() callback.
+//
+typedef
+EFI_STATUS
+(EFIAPI*
+EFIGUARD_QUERY_STATISTICS)(
+	OUT EFIGUARD_STATISTICS* Statistics
+	);
+
 
 //
 // The EfiGuard bootkit driver protocol.
 //
 typedef struct _EFIGUARD_DRIVER_PROTOCOL {
+	UINT32 Revision;				// EFIGUARD_DRIVER_PROTOCOL_REVISION
 	EFIGUARD_CONFIGURE Configure;
+	EFIGUARD_QUERY_STATISTICS QueryStatistics;
 } EFIGUARD_DRIVER_PROTOCOL;
 
 
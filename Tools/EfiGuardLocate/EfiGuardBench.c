@@ -0,0 +1,281 @@
+//
+// EfiGuardBench: micro-benchmarks for the scanning, decoding and PE lookup primitives used by the EfiGuardDxe locators.
+//
+// Usage: EfiGuardBench [-v] [-f filter] [-s min size] [-m max size] [-t min time ms] [-n repetitions]
+//                      [-o output.json] [-b baseline.json] [-r max regression %]
+//
+// Results are printed as JSON, one measurement per line. Given a baseline from a previous run, every measurement is compared to it,
+// and the exit code is 1 if a primitive became slower by more than the maximum regression (10% by default), or returned a wrong result.
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "HostBench.h"
+#include "HostLocate.h"
+
+typedef struct _BENCH_RESULT
+{
+	char Name[64];
+	char Position[16];
+	unsigned long long BufferSize;
+	unsigned long long Bytes;
+	unsigned long long Calls;
+	double NsPerCall;
+	double NsPerByte;
+} BENCH_RESULT;
+
+typedef struct _BENCH_RESULTS
+{
+	BENCH_RESULT* Results;
+	size_t Count, Capacity;
+} BENCH_RESULTS;
+
+static BENCH_RESULTS Results;
+static int NumFailed = 0;
+
+
+static
+BENCH_RESULT*
+AddResult(
+	BENCH_RESULTS* List
+	)
+{
+	if (List->Count == List->Capacity)
+	{
+		List->Capacity = List->Capacity == 0 ? 64 : List->Capacity * 2;
+		List->Results = realloc(List->Results, List->Capacity * sizeof(*List->Results));
+		if (List->Results == NULL)
+		{
+			perror("realloc");
+			exit(2);
+		}
+	}
+	memset(&List->Results[List->Count], 0, sizeof(List->Results[List->Count]));
+	return &List->Results[List->Count++];
+}
+
+void
+HostBenchReport(
+	const char* Name,
+	const char* Position,
+	unsigned long long BufferSize,
+	unsigned long long Bytes,
+	unsigned long long Calls,
+	unsigned long long Nanoseconds
+	)
+{
+	BENCH_RESULT* Result = AddResult(&Results);
+	snprintf(Result->Name, sizeof(Result->Name), "%s", Name);
+	snprintf(Result->Position, sizeof(Result->Position), "%s", Position);
+	Result->BufferSize = BufferSize;
+	Result->Bytes = Bytes;
+	Result->Calls = Calls;
+	Result->NsPerCall = (double)Nanoseconds / (double)Calls;
+	Result->NsPerByte = Bytes != 0 ? Result->NsPerCall / (double)Bytes : 0.0;
+
+	fprintf(stderr, "%-28s %-7s %6lluK %14.1f ns/call %10.4f ns/byte\n",
+		Name, Position, BufferSize / 1024, Result->NsPerCall, Result->NsPerByte);
+}
+
+void
+HostBenchFailed(
+	const char* Name,
+	const char* Position,
+	unsigned long long BufferSize
+	)
+{
+	fprintf(stderr, "%-28s %-7s %6lluK FAILED: wrong result\n", Name, Position, BufferSize / 1024);
+	NumFailed++;
+}
+
+static
+unsigned long long
+ParseSize(
+	const char* String
+	)
+{
+	char* End;
+	unsigned long long Size = strtoull(String, &End, 0);
+	if (*End == 'K' || *End == 'k')
+		Size *= 1024;
+	else if (*End == 'M' || *End == 'm')
+		Size *= 1024 * 1024;
+	return Size;
+}
+
+// Reads a previous output file. Only the format written by PrintResults() is supported
+static
+int
+ReadBaseline(
+	const char* Path,
+	BENCH_RESULTS* Baseline
+	)
+{
+	FILE* File = fopen(Path, "r");
+	if (File == NULL)
+	{
+		perror(Path);
+		return -1;
+	}
+
+	char Line[512];
+	while (fgets(Line, sizeof(Line), File) != NULL)
+	{
+		BENCH_RESULT Entry;
+		if (sscanf(Line, " { \"name\": \"%63[^\"]\", \"position\": \"%15[^\"]\", \"size\": %llu, \"bytes\": %llu, \"calls\": %llu, \"nsPerCall\": %lf, \"nsPerByte\": %lf",
+			Entry.Name, Entry.Position, &Entry.BufferSize, &Entry.Bytes, &Entry.Calls, &Entry.NsPerCall, &Entry.NsPerByte) == 7)
+		{
+			*AddResult(Baseline) = Entry;
+		}
+	}
+	fclose(File);
+	return 0;
+}
+
+static
+void
+PrintResults(
+	FILE* Output
+	)
+{
+	fprintf(Output, "[\n");
+	for (size_t i = 0; i < Results.Count; ++i)
+	{
+		const BENCH_RESULT* Result = &Results.Results[i];
+		fprintf(Output, "  { \"name\": \"%s\", \"position\": \"%s\", \"size\": %llu, \"bytes\": %llu, \"calls\": %llu, \"nsPerCall\": %.3f, \"nsPerByte\": %.6g }%s\n",
+			Result->Name, Result->Position, Result->BufferSize, Result->Bytes, Result->Calls, Result->NsPerCall, Result->NsPerByte,
+			i + 1 < Results.Count ? "," : "");
+	}
+	fprintf(Output, "]\n");
+}
+
+// Compares the results to a baseline, and returns the number of regressions
+static
+int
+CompareResults(
+	const BENCH_RESULTS* Baseline,
+	double MaxRegression
+	)
+{
+	int NumRegressions = 0;
+	fprintf(stderr, "\n%-28s %-7s %7s %14s %14s %8s\n", "Primitive", "Pos", "Size", "Baseline ns", "Current ns", "Change");
+	for (size_t i = 0; i < Results.Count; ++i)
+	{
+		const BENCH_RESULT* Result = &Results.Results[i];
+		const BENCH_RESULT* Base = NULL;
+		for (size_t j = 0; j < Baseline->Count && Base == NULL; ++j)
+		{
+			if (strcmp(Baseline->Results[j].Name, Result->Name) == 0 &&
+				strcmp(Baseline->Results[j].Position, Result->Position) == 0 &&
+				Baseline->Results[j].BufferSize == Result->BufferSize)
+			{
+				Base = &Baseline->Results[j];
+			}
+		}
+
+		if (Base == NULL || Base->NsPerCall <= 0.0)
+		{
+			fprintf(stderr, "%-28s %-7s %6lluK %14s %14.1f %8s\n", Result->Name, Result->Position, Result->BufferSize / 1024, "-", Result->NsPerCall, "new");
+			continue;
+		}
+
+		const double Change = (Result->NsPerCall / Base->NsPerCall - 1.0) * 100.0;
+		const int Regressed = Change > MaxRegression;
+		fprintf(stderr, "%-28s %-7s %6lluK %14.1f %14.1f %+7.1f%%%s\n", Result->Name, Result->Position, Result->BufferSize / 1024,
+			Base->NsPerCall, Result->NsPerCall, Change, Regressed ? "  REGRESSION" : "");
+		NumRegressions += Regressed;
+	}
+	return NumRegressions;
+}
+
+static
+void
+Usage(
+	const char* ProgramName
+	)
+{
+	fprintf(stderr, "Usage: %s [-v] [-f filter] [-s min size] [-m max size] [-t min time ms] [-n repetitions]\n"
+		"       [-o output.json] [-b baseline.json] [-r max regression %%]\n", ProgramName);
+	exit(2);
+}
+
+int
+main(
+	int argc,
+	char** argv
+	)
+{
+	HOST_BENCH_OPTIONS Options = { NULL, 0, ~0ULL, 50 * 1000 * 1000, 3 };
+	const char* OutputPath = NULL;
+	const char* BaselinePath = NULL;
+	double MaxRegression = 10.0;
+	int Option;
+	while ((Option = getopt(argc, argv, "vf:s:m:t:n:o:b:r:")) != -1)
+	{
+		switch (Option)
+		{
+			case 'v':
+				HostVerbose = 1;
+				break;
+			case 'f':
+				Options.Filter = optarg;
+				break;
+			case 's':
+				Options.MinBufferSize = ParseSize(optarg);
+				break;
+			case 'm':
+				Options.MaxBufferSize = ParseSize(optarg);
+				break;
+			case 't':
+				Options.MinTimeNs = strtoull(optarg, NULL, 10) * 1000 * 1000;
+				break;
+			case 'n':
+				Options.Repetitions = (unsigned int)strtoul(optarg, NULL, 10);
+				break;
+			case 'o':
+				OutputPath = optarg;
+				break;
+			case 'b':
+				BaselinePath = optarg;
+				break;
+			case 'r':
+				MaxRegression = strtod(optarg, NULL);
+				break;
+			default:
+				Usage(argv[0]);
+		}
+	}
+	if (optind != argc || Options.Repetitions == 0)
+		Usage(argv[0]);
+
+	// Read the baseline first, so that it is not lost if it is also the output file
+	BENCH_RESULTS Baseline = { NULL, 0, 0 };
+	if (BaselinePath != NULL && ReadBaseline(BaselinePath, &Baseline) != 0)
+		return 2;
+
+	HostBenchRun(&Options);
+
+	FILE* Output = OutputPath != NULL ? fopen(OutputPath, "w") : stdout;
+	if (Output == NULL)
+	{
+		perror(OutputPath);
+		return 2;
+	}
+	PrintResults(Output);
+	if (Output != stdout)
+		fclose(Output);
+
+	int NumRegressions = 0;
+	if (BaselinePath != NULL)
+	{
+		NumRegressions = CompareResults(&Baseline, MaxRegression);
+		fprintf(stderr, "\n%d regression(s) of more than %.1f%%\n", NumRegressions, MaxRegression);
+	}
+	if (NumFailed > 0)
+		fprintf(stderr, "%d primitive(s) returned a wrong result\n", NumFailed);
+
+	return NumFailed > 0 || NumRegressions > 0 ? 1 : 0;
+}
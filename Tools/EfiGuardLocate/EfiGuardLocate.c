@@ -0,0 +1,408 @@
+//
+// EfiGuardLocate: runs the EfiGuardDxe locators against boot manager, winload.efi and ntoskrnl.exe images on disk,
+// and prints the patch sites found and the time taken by each locator as JSON.
+//
+// Usage: EfiGuardLocate [-v] [-j threads] [-o output.json] <file or directory>...
+//
+// Directories are searched recursively, and files in them that are not supported images are skipped.
+// Images are processed in parallel by a pool of worker threads, one per CPU by default.
+//
+#define _GNU_SOURCE
+#include <errno.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "HostLocate.h"
+
+typedef struct _LOCATE_JOB
+{
+	char* Path;
+	int Explicit;						// Named on the command line rather than found in a directory
+	int Status;							// Return value of HostLocate(), or -2 if the file could not be read
+	const char* Error;
+	unsigned long long Nanoseconds;		// Including reading and mapping the file
+	HOST_LOCATE_RESULT Result;
+} LOCATE_JOB;
+
+static LOCATE_JOB* Jobs = NULL;
+static size_t NumJobs = 0, JobsCapacity = 0;
+static size_t NextJob = 0;
+
+
+static
+void
+AddJob(
+	const char* Path,
+	int Explicit
+	)
+{
+	if (NumJobs == JobsCapacity)
+	{
+		JobsCapacity = JobsCapacity == 0 ? 64 : JobsCapacity * 2;
+		Jobs = realloc(Jobs, JobsCapacity * sizeof(*Jobs));
+		if (Jobs == NULL)
+		{
+			perror("realloc");
+			exit(2);
+		}
+	}
+	memset(&Jobs[NumJobs], 0, sizeof(Jobs[NumJobs]));
+	Jobs[NumJobs].Path = strdup(Path);
+	Jobs[NumJobs].Explicit = Explicit;
+	NumJobs++;
+}
+
+static
+int
+AddDirectoryEntry(
+	const char* Path,
+	const struct stat* Stat,
+	int Flag,
+	struct FTW* Ftw
+	)
+{
+	(void)Ftw;
+	if (Flag == FTW_F && S_ISREG(Stat->st_mode))
+		AddJob(Path, 0);
+	return 0;
+}
+
+static
+int
+CompareJobs(
+	const void* First,
+	const void* Second
+	)
+{
+	return strcmp(((const LOCATE_JOB*)First)->Path, ((const LOCATE_JOB*)Second)->Path);
+}
+
+static
+unsigned int
+ReadUInt16(
+	const unsigned char* Data
+	)
+{
+	return Data[0] | (Data[1] << 8);
+}
+
+static
+unsigned int
+ReadUInt32(
+	const unsigned char* Data
+	)
+{
+	return Data[0] | (Data[1] << 8) | (Data[2] << 16) | ((unsigned int)Data[3] << 24);
+}
+
+//
+// Lays out a PE file the way the loader would: headers at 0, and each section at its RVA. Relocations are not applied,
+// which does not affect RVAs. Returns NULL if this is not a PE file
+//
+static
+unsigned char*
+MapImage(
+	const unsigned char* File,
+	size_t FileSize,
+	size_t* ImageSize
+	)
+{
+	if (FileSize < 0x40 || File[0] != 'M' || File[1] != 'Z')
+		return NULL;
+	const size_t NtOffset = ReadUInt32(File + 0x3C);
+	if (NtOffset > FileSize - 24 || memcmp(File + NtOffset, "PE\0\0", 4) != 0)
+		return NULL;
+
+	const unsigned char* FileHeader = File + NtOffset + 4;
+	const unsigned int NumberOfSections = ReadUInt16(FileHeader + 2);
+	const unsigned int SizeOfOptionalHeader = ReadUInt16(FileHeader + 16);
+	const unsigned char* OptionalHeader = FileHeader + 20;
+	const size_t SectionsOffset = NtOffset + 24 + SizeOfOptionalHeader;
+	if (SizeOfOptionalHeader < 64 || SectionsOffset + (size_t)NumberOfSections * 40 > FileSize)
+		return NULL;
+
+	const size_t SizeOfImage = ReadUInt32(OptionalHeader + 56);
+	size_t SizeOfHeaders = ReadUInt32(OptionalHeader + 60);
+	if (SizeOfImage == 0 || SizeOfHeaders > SizeOfImage)
+		return NULL;
+	if (SizeOfHeaders > FileSize)
+		SizeOfHeaders = FileSize;
+
+	unsigned char* Image = aligned_alloc(0x1000, (SizeOfImage + 0xFFF) & ~(size_t)0xFFF);
+	if (Image == NULL)
+		return NULL;
+	memset(Image, 0, SizeOfImage);
+	memcpy(Image, File, SizeOfHeaders);
+
+	for (unsigned int i = 0; i < NumberOfSections; ++i)
+	{
+		const unsigned char* Section = File + SectionsOffset + i * 40;
+		const size_t VirtualSize = ReadUInt32(Section + 8);
+		const size_t VirtualAddress = ReadUInt32(Section + 12);
+		size_t SizeOfRawData = ReadUInt32(Section + 16);
+		const size_t PointerToRawData = ReadUInt32(Section + 20);
+		if (VirtualSize != 0 && SizeOfRawData > VirtualSize)
+			SizeOfRawData = VirtualSize;
+		if (PointerToRawData >= FileSize || VirtualAddress >= SizeOfImage)
+			continue;
+		if (SizeOfRawData > FileSize - PointerToRawData)
+			SizeOfRawData = FileSize - PointerToRawData;
+		if (SizeOfRawData > SizeOfImage - VirtualAddress)
+			SizeOfRawData = SizeOfImage - VirtualAddress;
+		memcpy(Image + VirtualAddress, File + PointerToRawData, SizeOfRawData);
+	}
+
+	*ImageSize = SizeOfImage;
+	return Image;
+}
+
+static
+void
+RunJob(
+	LOCATE_JOB* Job
+	)
+{
+	const unsigned long long StartTime = HostGetTimeNs();
+	Job->Status = -2;
+
+	FILE* File = fopen(Job->Path, "rb");
+	if (File == NULL)
+	{
+		Job->Error = strerror(errno);
+		return;
+	}
+
+	unsigned char* Data = NULL;
+	size_t Size = 0;
+	struct stat Stat;
+	if (fstat(fileno(File), &Stat) == 0 && Stat.st_size > 0)
+	{
+		Size = (size_t)Stat.st_size;
+		Data = malloc(Size);
+		if (Data != NULL && fread(Data, 1, Size, File) != Size)
+		{
+			free(Data);
+			Data = NULL;
+		}
+	}
+	fclose(File);
+	if (Data == NULL)
+	{
+		Job->Error = "failed to read file";
+		return;
+	}
+
+	size_t ImageSize;
+	unsigned char* Image = MapImage(Data, Size, &ImageSize);
+	free(Data);
+	if (Image == NULL)
+	{
+		Job->Status = -1;
+		Job->Error = "not a PE image";
+		return;
+	}
+
+	Job->Status = HostLocate(Image, ImageSize, &Job->Result);
+	if (Job->Status < 0)
+		Job->Error = "not a supported boot manager, winload.efi or ntoskrnl.exe image";
+	Job->Nanoseconds = HostGetTimeNs() - StartTime;
+	free(Image);
+}
+
+static
+void*
+WorkerThread(
+	void* Parameter
+	)
+{
+	(void)Parameter;
+	for (;;)
+	{
+		const size_t Index = __atomic_fetch_add(&NextJob, 1, __ATOMIC_RELAXED);
+		if (Index >= NumJobs)
+			break;
+		RunJob(&Jobs[Index]);
+	}
+	return NULL;
+}
+
+static
+void
+PrintJsonString(
+	FILE* Output,
+	const char* String
+	)
+{
+	fputc('"', Output);
+	for (; *String != '\0'; ++String)
+	{
+		const unsigned char Char = (unsigned char)*String;
+		if (Char == '"' || Char == '\\')
+			fprintf(Output, "\\%c", Char);
+		else if (Char < 0x20)
+			fprintf(Output, "\\u%04x", Char);
+		else
+			fputc(Char, Output);
+	}
+	fputc('"', Output);
+}
+
+static
+void
+PrintJob(
+	FILE* Output,
+	const LOCATE_JOB* Job
+	)
+{
+	const HOST_LOCATE_RESULT* Result = &Job->Result;
+
+	fprintf(Output, "  {\n    \"file\": ");
+	PrintJsonString(Output, Job->Path);
+	if (Job->Error != NULL)
+	{
+		fprintf(Output, ",\n    \"status\": \"%s\",\n    \"error\": ", Job->Status == -2 ? "error" : "unsupported");
+		PrintJsonString(Output, Job->Error);
+		fprintf(Output, "\n  }");
+		return;
+	}
+
+	fprintf(Output, ",\n    \"type\": \"%s\",\n", Result->FileType);
+	fprintf(Output, "    \"version\": \"%u.%u.%u.%u\",\n", Result->MajorVersion, Result->MinorVersion, Result->BuildNumber, Result->Revision);
+	fprintf(Output, "    \"timeDateStamp\": %u,\n    \"sizeOfImage\": %u,\n    \"checkSum\": %u,\n",
+		Result->TimeDateStamp, Result->SizeOfImage, Result->CheckSum);
+	fprintf(Output, "    \"status\": \"%s\",\n", Job->Status == 0 ? "ok" : "failed");
+	fprintf(Output, "    \"totalNs\": %llu,\n", Job->Nanoseconds);
+
+	fprintf(Output, "    \"locators\": [");
+	for (unsigned int i = 0; i < Result->NumLocators; ++i)
+	{
+		fprintf(Output, "%s\n      { \"name\": \"%s\", \"status\": \"0x%llx\", \"ns\": %llu }",
+			i == 0 ? "" : ",", Result->Locators[i].Name, Result->Locators[i].Status, Result->Locators[i].Nanoseconds);
+	}
+	fprintf(Output, "\n    ],\n");
+
+	fprintf(Output, "    \"sites\": {");
+	int First = 1;
+	for (unsigned int i = 0; i < HOST_MAX_SITES; ++i)
+	{
+		if ((Result->SiteMask & (1U << i)) == 0)
+			continue;
+		fprintf(Output, "%s\n      \"%s\": { \"rva\": %u, \"bytes\": \"", First ? "" : ",", Result->SiteNames[i], Result->SiteRvas[i]);
+		for (unsigned int j = 0; Result->SiteRvas[i] != 0 && j < HOST_SITE_BYTES; ++j)
+			fprintf(Output, "%02x", Result->SiteBytes[i][j]);
+		fprintf(Output, "\" }");
+		First = 0;
+	}
+	fprintf(Output, "\n    }\n  }");
+}
+
+static
+void
+Usage(
+	const char* ProgramName
+	)
+{
+	fprintf(stderr, "Usage: %s [-v] [-j threads] [-o output.json] <file or directory>...\n", ProgramName);
+	exit(2);
+}
+
+int
+main(
+	int argc,
+	char** argv
+	)
+{
+	long NumThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char* OutputPath = NULL;
+	int Option;
+	while ((Option = getopt(argc, argv, "vj:o:")) != -1)
+	{
+		switch (Option)
+		{
+			case 'v':
+				HostVerbose = 1;
+				break;
+			case 'j':
+				NumThreads = strtol(optarg, NULL, 10);
+				break;
+			case 'o':
+				OutputPath = optarg;
+				break;
+			default:
+				Usage(argv[0]);
+		}
+	}
+	if (optind >= argc || NumThreads <= 0)
+		Usage(argv[0]);
+
+	for (int i = optind; i < argc; ++i)
+	{
+		struct stat Stat;
+		if (stat(argv[i], &Stat) == 0 && S_ISDIR(Stat.st_mode))
+		{
+			const size_t FirstJob = NumJobs;
+			nftw(argv[i], AddDirectoryEntry, 64, FTW_PHYS);
+			qsort(Jobs + FirstJob, NumJobs - FirstJob, sizeof(*Jobs), CompareJobs);
+		}
+		else
+			AddJob(argv[i], 1);
+	}
+
+	if (HostInitialize() != 0)
+	{
+		fprintf(stderr, "Failed to initialize the locators\n");
+		return 2;
+	}
+
+	if ((size_t)NumThreads > NumJobs)
+		NumThreads = NumJobs > 0 ? (long)NumJobs : 1;
+	pthread_t* Threads = calloc((size_t)NumThreads, sizeof(*Threads));
+	if (Threads == NULL)
+	{
+		perror("calloc");
+		return 2;
+	}
+	for (long i = 0; i < NumThreads; ++i)
+	{
+		if (pthread_create(&Threads[i], NULL, WorkerThread, NULL) != 0)
+		{
+			perror("pthread_create");
+			return 2;
+		}
+	}
+	for (long i = 0; i < NumThreads; ++i)
+		pthread_join(Threads[i], NULL);
+	free(Threads);
+
+	FILE* Output = OutputPath != NULL ? fopen(OutputPath, "w") : stdout;
+	if (Output == NULL)
+	{
+		perror(OutputPath);
+		return 2;
+	}
+
+	int ExitCode = 0, First = 1;
+	fprintf(Output, "[");
+	for (size_t i = 0; i < NumJobs; ++i)
+	{
+		const LOCATE_JOB* Job = &Jobs[i];
+		if (Job->Status == -1 && !Job->Explicit)
+			continue; // Not a supported image found in a directory
+
+		fprintf(Output, "%s\n", First ? "" : ",");
+		PrintJob(Output, Job);
+		First = 0;
+		if (Job->Status != 0)
+			ExitCode = 1;
+	}
+	fprintf(Output, "%s]\n", First ? "" : "\n");
+
+	if (Output != stdout)
+		fclose(Output);
+	return ExitCode;
+}
@@ -0,0 +1,971 @@
+//
+// Micro-benchmarks for the scanning, decoding and PE lookup primitives in util.c and pe.c.
+// Each primitive is run on synthetic PE images of increasing size, with the item being searched for planted at the start,
+// in the middle and at the end of the range being searched. The images contain valid x64 code, a function table,
+// export, import and resource directories, all scaled with the image size.
+//
+#include "EfiGuardDxe.h"
+#include "HostBench.h"
+#include "HostLocate.h"
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+#define MIN_BENCH_BUFFER_SIZE			SIZE_64KB
+#define MAX_BENCH_BUFFER_SIZE			SIZE_64MB
+
+#define SYNTHETIC_FUNCTION_SIZE			64
+#define SYNTHETIC_CODE_SIZE				46		// The rest of each function is int3 padding, which is where patterns are planted
+#define SYNTHETIC_NUM_IMPORT_DLLS		16
+#define SYNTHETIC_NUM_RESOURCE_TYPES	16
+#define SYNTHETIC_NAME_LENGTH			32
+
+typedef enum _BENCH_POSITION
+{
+	PositionStart,
+	PositionMiddle,
+	PositionEnd,
+	NumPositions
+} BENCH_POSITION;
+
+STATIC CONST CHAR8* CONST mPositionNames[] = { "start", "middle", "end" };
+
+// push rbx; sub rsp, 20h; mov rax, [rcx+8]; lea rdx, [rip+X]; call X; test eax, eax; jz $+7; mov ecx, 1;
+// mov [rsp+30h], rax; movzx ecx, byte ptr [rbx+10h]; add rsp, 20h; pop rbx; ret
+STATIC CONST UINT8 mFunctionTemplate[SYNTHETIC_CODE_SIZE] = {
+	0x40, 0x53, 0x48, 0x83, 0xEC, 0x20, 0x48, 0x8B, 0x41, 0x08, 0x48, 0x8D, 0x15, 0x00, 0x00, 0x00,
+	0x00, 0xE8, 0x00, 0x00, 0x00, 0x00, 0x85, 0xC0, 0x74, 0x05, 0xB9, 0x01, 0x00, 0x00, 0x00, 0x48,
+	0x89, 0x44, 0x24, 0x30, 0x0F, 0xB6, 0x4B, 0x10, 0x48, 0x83, 0xC4, 0x20, 0x5B, 0xC3
+};
+#define TEMPLATE_LEA_DISP_OFFSET		13
+#define TEMPLATE_CALL_OFFSET			17
+
+// mov rax, [rip+X]; test rax, rax; jz $+9; movzx eax, byte ptr [rax+2Ah]. The last byte is replaced by the position
+STATIC CONST UINT8 mPlantedPattern[] = {
+	0x48, 0x8B, 0x05, 0x11, 0x22, 0x33, 0x44, 0x48, 0x85, 0xC0, 0x74, 0x07, 0x0F, 0xB6, 0x40, 0x2A
+};
+STATIC CONST CHAR8 mPlantedPatternMask[] = "xxx????xxxx?xxxx";
+
+// Identifies bootmgfw.efi to GetInputFileType() if it has no BOOTMGR.XSL resource
+STATIC CONST EFI_GUID mBcdWindowsBootmgrGuid = { 0x9dea862c, 0x5cdd, 0x4e70, { 0xac, 0xc1, 0xf3, 0x2b, 0x34, 0x4d, 0x47, 0x95 } };
+
+typedef struct _SYNTHETIC_IMAGE
+{
+	UINT8* Base;
+	UINT32 Size;
+	UINT32 Used;							// Next free RVA
+	PEFI_IMAGE_NT_HEADERS NtHeaders;
+
+	UINT8* Text;
+	UINT32 TextSize;
+	UINT32 NumFunctions;
+	UINT32 ResourceRva;
+	UINT8* ResourceData;
+	EFI_IMAGE_RESOURCE_DIRECTORY_STRING* ResourceTypeName;	// Name of the named resource type; room for 12 characters
+	UINT32 ImportsSize;						// Size of the import descriptors, thunks and names
+
+	ZYDIS_CONTEXT Context;
+
+	// What to search for at each position, and where it should be found
+	BYTE_PATTERN Patterns[NumPositions];
+	UINT8 PatternBytes[NumPositions][sizeof(mPlantedPattern)];
+	UINT8* PatternAddresses[NumPositions];
+	UINT8* FunctionStarts[NumPositions];
+	CHAR8 ExportNames[NumPositions][SYNTHETIC_NAME_LENGTH];
+	UINT8* ExportAddresses[NumPositions];
+	EXPORT_NAME_TABLE ExportNameTable;
+	CHAR8 ImportDllNames[NumPositions][SYNTHETIC_NAME_LENGTH];
+	CHAR8 ImportNames[NumPositions][SYNTHETIC_NAME_LENGTH];
+	UINT8* ImportIatAddresses[NumPositions];
+	IMPORT_INDEX ImportIndex;
+	UINT16 ResourceTypes[NumPositions];
+	UINT16 ResourceNames[NumPositions];
+} SYNTHETIC_IMAGE, *PSYNTHETIC_IMAGE;
+
+//
+// Runs a primitive once and checks its result. Bytes receives the size of the range the primitive had to search
+//
+typedef
+BOOLEAN
+(*BENCH_FUNCTION)(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	);
+
+typedef struct _BENCHMARK
+{
+	CONST CHAR8* Name;
+	BENCH_FUNCTION Function;
+	BOOLEAN Positional;					// FALSE if the primitive always processes the whole range
+} BENCHMARK;
+
+
+// Reserves space in the image for a table or string, and returns its RVA
+STATIC
+UINT32
+ReserveSpace(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN UINT32 Size,
+	IN UINT32 Alignment
+	)
+{
+	CONST UINT32 Rva = ALIGN_VALUE(Image->Used, Alignment);
+	ASSERT(Rva + Size <= Image->Size);
+	Image->Used = Rva + Size;
+	return Rva;
+}
+
+// Writes Prefix followed by Value as 8 hex digits. Names formatted this way sort in the same order as their values
+STATIC
+VOID
+FormatName(
+	OUT CHAR8* Buffer,
+	IN CONST CHAR8* Prefix,
+	IN UINT32 Value
+	)
+{
+	while (*Prefix != '\0')
+		*Buffer++ = *Prefix++;
+	for (INT32 Shift = 28; Shift >= 0; Shift -= 4)
+		*Buffer++ = "0123456789ABCDEF"[(Value >> Shift) & 0xF];
+	*Buffer = '\0';
+}
+
+STATIC
+UINT32
+NameLength(
+	IN CONST CHAR8* Name
+	)
+{
+	UINT32 Length = 0;
+	while (Name[Length] != '\0')
+		Length++;
+	return Length;
+}
+
+// Returns the index of the item at a position in a table of Count items
+STATIC
+UINT32
+PositionToIndex(
+	IN BENCH_POSITION Position,
+	IN UINT32 Count
+	)
+{
+	return Position == PositionStart ? 0 : (Position == PositionMiddle ? Count / 2 : Count - 1);
+}
+
+STATIC
+VOID
+BuildHeaders(
+	IN OUT PSYNTHETIC_IMAGE Image
+	)
+{
+	CONST PEFI_IMAGE_DOS_HEADER DosHeader = (PEFI_IMAGE_DOS_HEADER)Image->Base;
+	DosHeader->e_magic = EFI_IMAGE_DOS_SIGNATURE;
+	DosHeader->e_lfanew = 0x80;
+
+	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = (PEFI_IMAGE_NT_HEADERS)(Image->Base + DosHeader->e_lfanew);
+	NtHeaders->Signature = EFI_IMAGE_NT_SIGNATURE;
+	NtHeaders->FileHeader.Machine = IMAGE_FILE_MACHINE_X64;
+	NtHeaders->FileHeader.NumberOfSections = 2;
+	NtHeaders->FileHeader.SizeOfOptionalHeader = sizeof(NtHeaders->OptionalHeader);
+	NtHeaders->OptionalHeader.Magic = EFI_IMAGE_NT_OPTIONAL_HDR64_MAGIC;
+	NtHeaders->OptionalHeader.SizeOfImage = Image->Size;
+	NtHeaders->OptionalHeader.SizeOfHeaders = EFI_PAGE_SIZE;
+	NtHeaders->OptionalHeader.Subsystem = EFI_IMAGE_SUBSYSTEM_WINDOWS_BOOT_APPLICATION;
+	NtHeaders->OptionalHeader.NumberOfRvaAndSizes = EFI_IMAGE_NUMBER_OF_DIRECTORY_ENTRIES;
+	Image->NtHeaders = NtHeaders;
+
+	// .text takes up the first half of the image, and .rdata the rest
+	Image->TextSize = Image->Size / 2 - EFI_PAGE_SIZE;
+	Image->Text = Image->Base + EFI_PAGE_SIZE;
+	CONST PEFI_IMAGE_SECTION_HEADER Sections = IMAGE_FIRST_SECTION(NtHeaders);
+	CopyMem(Sections[0].Name, ".text", sizeof(".text"));
+	Sections[0].Misc.VirtualSize = Sections[0].SizeOfRawData = Image->TextSize;
+	Sections[0].VirtualAddress = Sections[0].PointerToRawData = EFI_PAGE_SIZE;
+	Sections[0].Characteristics = EFI_IMAGE_SCN_CNT_CODE | EFI_IMAGE_SCN_MEM_EXECUTE | EFI_IMAGE_SCN_MEM_READ;
+	CopyMem(Sections[1].Name, ".rdata", sizeof(".rdata"));
+	Sections[1].Misc.VirtualSize = Sections[1].SizeOfRawData = Image->Size / 2;
+	Sections[1].VirtualAddress = Sections[1].PointerToRawData = Image->Size / 2;
+	Sections[1].Characteristics = EFI_IMAGE_SCN_CNT_INITIALIZED_DATA | EFI_IMAGE_SCN_MEM_READ;
+	Image->Used = Image->Size / 2;
+}
+
+STATIC
+VOID
+BuildCode(
+	IN OUT PSYNTHETIC_IMAGE Image
+	)
+{
+	Image->NumFunctions = Image->TextSize / SYNTHETIC_FUNCTION_SIZE;
+	CONST UINT32 TextRva = (UINT32)(Image->Text - Image->Base);
+	CONST UINT32 DataSize = Image->Size - Image->Used;
+
+	for (UINT32 i = 0; i < Image->NumFunctions; ++i)
+	{
+		UINT8* Function = Image->Text + i * SYNTHETIC_FUNCTION_SIZE;
+		CopyMem(Function, mFunctionTemplate, sizeof(mFunctionTemplate));
+		SetMem(Function + SYNTHETIC_CODE_SIZE, SYNTHETIC_FUNCTION_SIZE - SYNTHETIC_CODE_SIZE, 0xCC);
+
+		// Vary the displacements so that the code is not a repeating byte sequence
+		CONST UINT32 LeaTarget = Image->Size / 2 + (i * 24) % DataSize;
+		CONST UINT32 CallTarget = TextRva + (UINT32)(((UINT64)i * 7919) % Image->NumFunctions) * SYNTHETIC_FUNCTION_SIZE;
+		CONST UINT32 FunctionRva = TextRva + i * SYNTHETIC_FUNCTION_SIZE;
+		*(INT32*)(Function + TEMPLATE_LEA_DISP_OFFSET) = (INT32)(LeaTarget - (FunctionRva + TEMPLATE_LEA_DISP_OFFSET + sizeof(INT32)));
+		*(INT32*)(Function + TEMPLATE_CALL_OFFSET + 1) = (INT32)(CallTarget - (FunctionRva + TEMPLATE_CALL_OFFSET + 5));
+	}
+
+	for (UINT32 Position = 0; Position < NumPositions; ++Position)
+	{
+		// Skip the first and last function, so that a pattern is never found at the very edge of the range
+		CONST UINT32 Index = Position == PositionStart ? 1 : (Position == PositionMiddle ? Image->NumFunctions / 2 : Image->NumFunctions - 2);
+		UINT8* Function = Image->Text + Index * SYNTHETIC_FUNCTION_SIZE;
+
+		CopyMem(Image->PatternBytes[Position], mPlantedPattern, sizeof(mPlantedPattern));
+		Image->PatternBytes[Position][sizeof(mPlantedPattern) - 1] += (UINT8)Position;
+		CopyMem(Function + SYNTHETIC_CODE_SIZE, Image->PatternBytes[Position], sizeof(mPlantedPattern));
+
+		Image->Patterns[Position].Bytes = Image->PatternBytes[Position];
+		Image->Patterns[Position].Mask = mPlantedPatternMask;
+		Image->Patterns[Position].Length = sizeof(mPlantedPattern);
+		Image->Patterns[Position].Compiled = FALSE;
+		Image->PatternAddresses[Position] = Function + SYNTHETIC_CODE_SIZE;
+		Image->FunctionStarts[Position] = Function;
+	}
+}
+
+STATIC
+VOID
+BuildFunctionTable(
+	IN OUT PSYNTHETIC_IMAGE Image
+	)
+{
+	CONST UINT32 UnwindRva = ReserveSpace(Image, sizeof(UNWIND_INFO), sizeof(UINT32));
+	PUNWIND_INFO UnwindInfo = (PUNWIND_INFO)(Image->Base + UnwindRva);
+	UnwindInfo->Version = 1;
+	UnwindInfo->SizeOfProlog = 6;
+
+	CONST UINT32 TableSize = Image->NumFunctions * sizeof(IMAGE_RUNTIME_FUNCTION_ENTRY);
+	CONST UINT32 TableRva = ReserveSpace(Image, TableSize, sizeof(UINT32));
+	PIMAGE_RUNTIME_FUNCTION_ENTRY FunctionTable = (PIMAGE_RUNTIME_FUNCTION_ENTRY)(Image->Base + TableRva);
+	for (UINT32 i = 0; i < Image->NumFunctions; ++i)
+	{
+		FunctionTable[i].BeginAddress = (UINT32)(Image->Text - Image->Base) + i * SYNTHETIC_FUNCTION_SIZE;
+		FunctionTable[i].EndAddress = FunctionTable[i].BeginAddress + SYNTHETIC_CODE_SIZE;
+		FunctionTable[i].u.UnwindData = UnwindRva;
+	}
+
+	Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION].VirtualAddress = TableRva;
+	Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION].Size = TableSize;
+}
+
+STATIC
+VOID
+BuildExports(
+	IN OUT PSYNTHETIC_IMAGE Image
+	)
+{
+	// Ordinals are 16 bit, which limits the number of exports in the larger images
+	CONST UINT32 NumExports = MIN(Image->Size / 512, MAX_UINT16 + 1);
+	CONST UINT32 DirectoryRva = ReserveSpace(Image, sizeof(EFI_IMAGE_EXPORT_DIRECTORY), sizeof(UINT32));
+	CONST UINT32 FunctionsRva = ReserveSpace(Image, NumExports * sizeof(UINT32), sizeof(UINT32));
+	CONST UINT32 NamesRva = ReserveSpace(Image, NumExports * sizeof(UINT32), sizeof(UINT32));
+	CONST UINT32 OrdinalsRva = ReserveSpace(Image, NumExports * sizeof(UINT16), sizeof(UINT16));
+
+	CONST PEFI_IMAGE_EXPORT_DIRECTORY Directory = (PEFI_IMAGE_EXPORT_DIRECTORY)(Image->Base + DirectoryRva);
+	Directory->Base = 1;
+	Directory->NumberOfFunctions = NumExports;
+	Directory->NumberOfNames = NumExports;
+	Directory->AddressOfFunctions = FunctionsRva;
+	Directory->AddressOfNames = NamesRva;
+	Directory->AddressOfNameOrdinals = OrdinalsRva;
+
+	UINT32* Functions = (UINT32*)(Image->Base + FunctionsRva);
+	UINT32* Names = (UINT32*)(Image->Base + NamesRva);
+	UINT16* Ordinals = (UINT16*)(Image->Base + OrdinalsRva);
+	CHAR8 Name[SYNTHETIC_NAME_LENGTH];
+	for (UINT32 i = 0; i < NumExports; ++i)
+	{
+		FormatName(Name, "BenchExport", i);
+		Names[i] = ReserveSpace(Image, NameLength(Name) + 1, 1);
+		CopyMem(Image->Base + Names[i], Name, NameLength(Name) + 1);
+		Functions[i] = (UINT32)(Image->Text - Image->Base) + (i % Image->NumFunctions) * SYNTHETIC_FUNCTION_SIZE;
+		Ordinals[i] = (UINT16)i;
+	}
+
+	for (UINT32 Position = 0; Position < NumPositions; ++Position)
+	{
+		CONST UINT32 Index = PositionToIndex((BENCH_POSITION)Position, NumExports);
+		FormatName(Image->ExportNames[Position], "BenchExport", Index);
+		Image->ExportAddresses[Position] = Image->Base + Functions[Ordinals[Index]];
+	}
+
+	Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXPORT].VirtualAddress = DirectoryRva;
+	Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXPORT].Size = Image->Used - DirectoryRva;
+
+	// The name hash table has at least twice as many buckets as there are names
+	Image->ExportNameTable.NumBuckets = 1;
+	while (Image->ExportNameTable.NumBuckets < 2 * NumExports)
+		Image->ExportNameTable.NumBuckets <<= 1;
+	Image->ExportNameTable.Buckets = AllocatePool(Image->ExportNameTable.NumBuckets * sizeof(UINT32));
+}
+
+STATIC
+VOID
+BuildImports(
+	IN OUT PSYNTHETIC_IMAGE Image
+	)
+{
+	CONST UINT32 ImportsPerDll = MAX(Image->Size / 512 / SYNTHETIC_NUM_IMPORT_DLLS, 4);
+	CONST UINT32 DescriptorsRva = ReserveSpace(Image, (SYNTHETIC_NUM_IMPORT_DLLS + 1) * sizeof(IMAGE_IMPORT_DESCRIPTOR), sizeof(UINT32));
+	PIMAGE_IMPORT_DESCRIPTOR Descriptors = (PIMAGE_IMPORT_DESCRIPTOR)(Image->Base + DescriptorsRva);
+
+	CHAR8 Name[SYNTHETIC_NAME_LENGTH];
+	for (UINT32 Dll = 0; Dll < SYNTHETIC_NUM_IMPORT_DLLS; ++Dll)
+	{
+		FormatName(Name, "bench", Dll);
+		Descriptors[Dll].Name = ReserveSpace(Image, NameLength(Name) + sizeof(".dll"), 1);
+		CopyMem(Image->Base + Descriptors[Dll].Name, Name, NameLength(Name));
+		CopyMem(Image->Base + Descriptors[Dll].Name + NameLength(Name), ".dll", sizeof(".dll"));
+
+		Descriptors[Dll].u.OriginalFirstThunk = ReserveSpace(Image, (ImportsPerDll + 1) * sizeof(IMAGE_THUNK_DATA64), sizeof(UINT64));
+		Descriptors[Dll].FirstThunk = ReserveSpace(Image, (ImportsPerDll + 1) * sizeof(IMAGE_THUNK_DATA64), sizeof(UINT64));
+		PIMAGE_THUNK_DATA64 OriginalThunks = (PIMAGE_THUNK_DATA64)(Image->Base + Descriptors[Dll].u.OriginalFirstThunk);
+		PIMAGE_THUNK_DATA64 Thunks = (PIMAGE_THUNK_DATA64)(Image->Base + Descriptors[Dll].FirstThunk);
+		for (UINT32 i = 0; i < ImportsPerDll; ++i)
+		{
+			FormatName(Name, "BenchImport", Dll * ImportsPerDll + i);
+			CONST UINT32 ImportByNameRva = ReserveSpace(Image, (UINT32)OFFSET_OF(IMAGE_IMPORT_BY_NAME, Name) + NameLength(Name) + 1, sizeof(UINT16));
+			CopyMem(((PIMAGE_IMPORT_BY_NAME)(Image->Base + ImportByNameRva))->Name, Name, NameLength(Name) + 1);
+			OriginalThunks[i].u1.AddressOfData = Thunks[i].u1.AddressOfData = ImportByNameRva;
+		}
+	}
+
+	for (UINT32 Position = 0; Position < NumPositions; ++Position)
+	{
+		CONST UINT32 Dll = PositionToIndex((BENCH_POSITION)Position, SYNTHETIC_NUM_IMPORT_DLLS);
+		CONST UINT32 Index = PositionToIndex((BENCH_POSITION)Position, ImportsPerDll);
+		FormatName(Image->ImportDllNames[Position], "bench", Dll);
+		CopyMem(Image->ImportDllNames[Position] + NameLength(Image->ImportDllNames[Position]), ".dll", sizeof(".dll"));
+		FormatName(Image->ImportNames[Position], "BenchImport", Dll * ImportsPerDll + Index);
+		Image->ImportIatAddresses[Position] = Image->Base + Descriptors[Dll].FirstThunk + Index * sizeof(IMAGE_THUNK_DATA64);
+	}
+
+	Image->ImportsSize = Image->Used - DescriptorsRva;
+	Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_IMPORT].VirtualAddress = DescriptorsRva;
+	Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_IMPORT].Size = (SYNTHETIC_NUM_IMPORT_DLLS + 1) * sizeof(IMAGE_IMPORT_DESCRIPTOR);
+
+	// The import index has at least twice as many buckets as there are imports
+	Image->ImportIndex.NumBuckets = 1;
+	while (Image->ImportIndex.NumBuckets < 2 * SYNTHETIC_NUM_IMPORT_DLLS * ImportsPerDll)
+		Image->ImportIndex.NumBuckets <<= 1;
+	Image->ImportIndex.Buckets = AllocatePool(Image->ImportIndex.NumBuckets * sizeof(IMPORT_INDEX_ENTRY));
+}
+
+// Builds a Type -> Name -> Language resource tree, with one named type (OSLOADER.XSL, like winload.efi) followed by the ID types.
+// This is done first, so that the fallback scans of GetInputFileType() have to search nearly all of .rdata for the OSLOADER.XSL string
+// and the BCD Bootmgr GUID, which are placed at the very end of the image by BuildImage()
+STATIC
+VOID
+BuildResources(
+	IN OUT PSYNTHETIC_IMAGE Image
+	)
+{
+	CONST UINT32 NamesPerType = MAX(Image->Size / SIZE_64KB, 1);
+	CONST UINT32 RootRva = ReserveSpace(Image,
+										sizeof(EFI_IMAGE_RESOURCE_DIRECTORY) + (1 + SYNTHETIC_NUM_RESOURCE_TYPES) * sizeof(EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY),
+										sizeof(UINT32));
+	UINT8* Root = Image->Base + RootRva;
+	((EFI_IMAGE_RESOURCE_DIRECTORY*)Root)->NumberOfNamedEntries = 1;
+	((EFI_IMAGE_RESOURCE_DIRECTORY*)Root)->NumberOfIdEntries = SYNTHETIC_NUM_RESOURCE_TYPES;
+
+	// All resources share the same data
+	CONST UINT32 DataRva = ReserveSpace(Image, 16, sizeof(UINT32));
+	CONST UINT32 DataEntryRva = ReserveSpace(Image, sizeof(EFI_IMAGE_RESOURCE_DATA_ENTRY), sizeof(UINT32));
+	((EFI_IMAGE_RESOURCE_DATA_ENTRY*)(Image->Base + DataEntryRva))->OffsetToData = DataRva;
+	((EFI_IMAGE_RESOURCE_DATA_ENTRY*)(Image->Base + DataEntryRva))->Size = 16;
+	Image->ResourceData = Image->Base + DataRva;
+
+	// The named type has a single resource with ID 1
+	EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY* NamedTypeEntry = (EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(Root + sizeof(EFI_IMAGE_RESOURCE_DIRECTORY));
+	CONST UINT32 TypeNameRva = ReserveSpace(Image, sizeof(UINT16) + sizeof(L"OSLOADER.XSL"), sizeof(UINT16));
+	CONST UINT32 NamedTypeDirRva = ReserveSpace(Image,
+												2 * (sizeof(EFI_IMAGE_RESOURCE_DIRECTORY) + sizeof(EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY)),
+												sizeof(UINT32));
+	Image->ResourceTypeName = (EFI_IMAGE_RESOURCE_DIRECTORY_STRING*)(Image->Base + TypeNameRva);
+	Image->ResourceTypeName->Length = (UINT16)(sizeof(L"OSLOADER.XSL") / sizeof(CHAR16) - 1);
+	CopyMem(Image->ResourceTypeName->String, L"OSLOADER.XSL", sizeof(L"OSLOADER.XSL") - sizeof(CHAR16));
+	NamedTypeEntry->u1.s.NameOffset = TypeNameRva - RootRva;
+	NamedTypeEntry->u1.s.NameIsString = 1;
+	NamedTypeEntry->u2.s.OffsetToDirectory = NamedTypeDirRva - RootRva;
+	NamedTypeEntry->u2.s.DataIsDirectory = 1;
+	EFI_IMAGE_RESOURCE_DIRECTORY* NamedTypeDir = (EFI_IMAGE_RESOURCE_DIRECTORY*)(Image->Base + NamedTypeDirRva);
+	EFI_IMAGE_RESOURCE_DIRECTORY* NamedTypeLanguageDir = (EFI_IMAGE_RESOURCE_DIRECTORY*)((EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(NamedTypeDir + 1) + 1);
+	NamedTypeDir->NumberOfIdEntries = 1;
+	((EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(NamedTypeDir + 1))->u1.Id = 1;
+	((EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(NamedTypeDir + 1))->u2.s.OffsetToDirectory = (UINT32)((UINT8*)NamedTypeLanguageDir - Root);
+	((EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(NamedTypeDir + 1))->u2.s.DataIsDirectory = 1;
+	NamedTypeLanguageDir->NumberOfIdEntries = 1;
+	((EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(NamedTypeLanguageDir + 1))->u1.Id = 0x409;
+	((EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(NamedTypeLanguageDir + 1))->u2.OffsetToData = DataEntryRva - RootRva;
+
+	for (UINT32 Type = 0; Type < SYNTHETIC_NUM_RESOURCE_TYPES; ++Type)
+	{
+		EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY* TypeEntry = (EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(Root + sizeof(EFI_IMAGE_RESOURCE_DIRECTORY)) + 1 + Type;
+		CONST UINT32 NameDirRva = ReserveSpace(Image,
+												sizeof(EFI_IMAGE_RESOURCE_DIRECTORY) + NamesPerType * sizeof(EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY),
+												sizeof(UINT32));
+		TypeEntry->u1.Id = (UINT16)(Type + 1);
+		TypeEntry->u2.s.OffsetToDirectory = NameDirRva - RootRva;
+		TypeEntry->u2.s.DataIsDirectory = 1;
+		((EFI_IMAGE_RESOURCE_DIRECTORY*)(Image->Base + NameDirRva))->NumberOfIdEntries = (UINT16)NamesPerType;
+
+		for (UINT32 Name = 0; Name < NamesPerType; ++Name)
+		{
+			EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY* NameEntry = (EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(Image->Base + NameDirRva + sizeof(EFI_IMAGE_RESOURCE_DIRECTORY)) + Name;
+			CONST UINT32 LanguageDirRva = ReserveSpace(Image,
+														sizeof(EFI_IMAGE_RESOURCE_DIRECTORY) + sizeof(EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY),
+														sizeof(UINT32));
+			NameEntry->u1.Id = (UINT16)(Name + 1);
+			NameEntry->u2.s.OffsetToDirectory = LanguageDirRva - RootRva;
+			NameEntry->u2.s.DataIsDirectory = 1;
+			((EFI_IMAGE_RESOURCE_DIRECTORY*)(Image->Base + LanguageDirRva))->NumberOfIdEntries = 1;
+
+			EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY* LanguageEntry = (EFI_IMAGE_RESOURCE_DIRECTORY_ENTRY*)(Image->Base + LanguageDirRva + sizeof(EFI_IMAGE_RESOURCE_DIRECTORY));
+			LanguageEntry->u1.Id = 0x409;
+			LanguageEntry->u2.OffsetToData = DataEntryRva - RootRva;
+		}
+	}
+
+	for (UINT32 Position = 0; Position < NumPositions; ++Position)
+	{
+		Image->ResourceTypes[Position] = (UINT16)(PositionToIndex((BENCH_POSITION)Position, SYNTHETIC_NUM_RESOURCE_TYPES) + 1);
+		Image->ResourceNames[Position] = (UINT16)(PositionToIndex((BENCH_POSITION)Position, NamesPerType) + 1);
+	}
+
+	Image->ResourceRva = RootRva;
+	Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_RESOURCE].VirtualAddress = RootRva;
+	Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_RESOURCE].Size = Image->Used - RootRva;
+}
+
+STATIC
+EFI_STATUS
+BuildImage(
+	IN UINT32 Size,
+	OUT PSYNTHETIC_IMAGE Image
+	)
+{
+	ZeroMem(Image, sizeof(*Image));
+	Image->Base = AllocatePool(Size);
+	if (Image->Base == NULL)
+		return EFI_OUT_OF_RESOURCES;
+	ZeroMem(Image->Base, Size);
+	Image->Size = Size;
+
+	BuildHeaders(Image);
+	BuildCode(Image);
+	BuildResources(Image);
+	BuildFunctionTable(Image);
+	BuildExports(Image);
+	BuildImports(Image);
+	if (Image->ExportNameTable.Buckets == NULL || Image->ImportIndex.Buckets == NULL ||
+		EFI_ERROR(BuildExportNameTable((UINTN)Image->Base, Image->NtHeaders, &Image->ExportNameTable)) ||
+		EFI_ERROR(BuildImportIndex(Image->Base, Image->NtHeaders, &Image->ImportIndex)))
+		return EFI_OUT_OF_RESOURCES;
+
+	CopyMem(Image->Base + Size - sizeof(L"OSLOADER.XSL"), L"OSLOADER.XSL", sizeof(L"OSLOADER.XSL"));
+	CopyMem(Image->Base + ALIGN_VALUE(Size - sizeof(L"OSLOADER.XSL") - 2 * sizeof(EFI_GUID), sizeof(VOID*)), &mBcdWindowsBootmgrGuid, sizeof(EFI_GUID));
+
+	return ZYAN_SUCCESS(ZydisInit(Image->NtHeaders, &Image->Context)) ? EFI_SUCCESS : EFI_LOAD_ERROR;
+}
+
+
+STATIC
+BOOLEAN
+BenchFindPattern(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	VOID* Found;
+	CONST EFI_STATUS Status = FindPattern(&Image->Patterns[Position], Image->Text, Image->TextSize, &Found);
+	*Bytes = (UINT64)(Image->PatternAddresses[Position] - Image->Text) + sizeof(mPlantedPattern);
+	return !EFI_ERROR(Status) && Found == Image->PatternAddresses[Position];
+}
+
+// Finds the patterns at all positions in one call
+STATIC
+BOOLEAN
+BenchFindPatterns(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	PATTERN_SEARCH_ENTRY Entries[NumPositions];
+	for (UINT32 i = 0; i < NumPositions; ++i)
+		Entries[i].Pattern = &Image->Patterns[i];
+
+	CONST EFI_STATUS Status = FindPatterns(Entries, NumPositions, Image->Text, Image->TextSize);
+	*Bytes = (UINT64)(Image->PatternAddresses[PositionEnd] - Image->Text) + sizeof(mPlantedPattern);
+
+	BOOLEAN Found = !EFI_ERROR(Status);
+	for (UINT32 i = 0; i < NumPositions; ++i)
+		Found = Found && Entries[i].Found == Image->PatternAddresses[i];
+	return Found;
+}
+
+// Same as BenchFindPatterns(), but with one FindPattern() call per position. Bytes is the same, so that the throughputs can be compared
+STATIC
+BOOLEAN
+BenchFindPatternEach(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	BOOLEAN Found = TRUE;
+	for (UINT32 i = 0; i < NumPositions; ++i)
+	{
+		VOID* Address;
+		Found = !EFI_ERROR(FindPattern(&Image->Patterns[i], Image->Text, Image->TextSize, &Address)) &&
+			Address == Image->PatternAddresses[i] && Found;
+	}
+	*Bytes = (UINT64)(Image->PatternAddresses[PositionEnd] - Image->Text) + sizeof(mPlantedPattern);
+	return Found;
+}
+
+STATIC
+BOOLEAN
+BenchFindPatternVerbose(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	VOID* Found;
+	CONST EFI_STATUS Status = FindPatternVerbose(&Image->Patterns[Position], Image->Text, Image->TextSize, &Found);
+	*Bytes = Image->TextSize;
+	return !EFI_ERROR(Status) && Found == Image->PatternAddresses[Position];
+}
+
+STATIC
+BOOLEAN
+EFIAPI
+RejectInstruction(
+	IN CONST ZYDIS_CONTEXT* Context,
+	IN VOID* PredicateContext
+	)
+{
+	return FALSE;
+}
+
+// Decodes every instruction in .text, but no operands
+STATIC
+BOOLEAN
+BenchDisassembleRange(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	INSTRUCTION_MATCHER Matcher = { RejectInstruction, RejectInstruction, NULL, NULL, NULL, TRUE, NULL };
+	CONST EFI_STATUS Status = DisassembleRange(&Image->Context, Image->Text, Image->TextSize, &Matcher, 1);
+	*Bytes = Image->TextSize;
+	return Status == EFI_NOT_FOUND;
+}
+
+// Decodes every instruction in .text including its operands
+STATIC
+BOOLEAN
+BenchDisassembleRangeOperands(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	INSTRUCTION_MATCHER Matcher = { NULL, RejectInstruction, NULL, NULL, NULL, TRUE, NULL };
+	CONST EFI_STATUS Status = DisassembleRange(&Image->Context, Image->Text, Image->TextSize, &Matcher, 1);
+	*Bytes = Image->TextSize;
+	return Status == EFI_NOT_FOUND;
+}
+
+// Decodes every instruction in .text with ZydisDecoderDecodeFull(), which is how DisassembleRange() decoded before it had prefilters
+STATIC
+BOOLEAN
+BenchDecodeFull(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	PZYDIS_CONTEXT Context = &Image->Context;
+	Context->Length = Image->TextSize;
+	Context->Offset = 0;
+	UINT32 NumDecoded = 0;
+
+	ZyanStatus Status;
+	while ((Context->InstructionAddress = (ZyanU64)(Image->Text + Context->Offset),
+		Status = ZydisDecoderDecodeFull(&Context->Decoder,
+										(VOID*)Context->InstructionAddress,
+										Context->Length - Context->Offset,
+										&Context->Instruction,
+										Context->Operands)) != ZYDIS_STATUS_NO_MORE_DATA)
+	{
+		if (!ZYAN_SUCCESS(Status))
+		{
+			Context->Offset++;
+			continue;
+		}
+
+		NumDecoded++;
+		Context->Offset += Context->Instruction.length;
+	}
+
+	*Bytes = Image->TextSize;
+	return NumDecoded > 0;
+}
+
+STATIC
+BOOLEAN
+BenchBacktrackToFunctionStart(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	CONST UINT8* FunctionStart = BacktrackToFunctionStart(Image->Base, Image->NtHeaders, Image->FunctionStarts[Position] + TEMPLATE_CALL_OFFSET);
+	*Bytes = Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXCEPTION].Size;
+	return FunctionStart == Image->FunctionStarts[Position];
+}
+
+STATIC
+BOOLEAN
+BenchGetProcedureAddress(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	CONST VOID* Address = GetProcedureAddress((UINTN)Image->Base, Image->NtHeaders, Image->ExportNames[Position]);
+	*Bytes = Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXPORT].Size;
+	return Address == Image->ExportAddresses[Position];
+}
+
+// Resolves the exports at all positions in one call
+STATIC
+BOOLEAN
+BenchGetProcedureAddresses(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	EXPORT_LOOKUP Lookups[NumPositions];
+	for (UINT32 i = 0; i < NumPositions; ++i)
+		Lookups[i].Name = Image->ExportNames[i];
+
+	CONST EFI_STATUS Status = GetProcedureAddresses((UINTN)Image->Base, Image->NtHeaders, Lookups, NumPositions);
+	*Bytes = Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXPORT].Size;
+
+	BOOLEAN Found = !EFI_ERROR(Status);
+	for (UINT32 i = 0; i < NumPositions; ++i)
+		Found = Found && Lookups[i].Address == Image->ExportAddresses[i];
+	return Found;
+}
+
+STATIC
+BOOLEAN
+BenchGetProcedureAddressFromTable(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	CONST VOID* Address = GetProcedureAddressFromTable(&Image->ExportNameTable, Image->ExportNames[Position]);
+	*Bytes = Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_EXPORT].Size;
+	return Address == Image->ExportAddresses[Position];
+}
+
+STATIC
+BOOLEAN
+BenchFindIATAddressForImport(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	VOID* IatAddress;
+	CONST EFI_STATUS Status = FindIATAddressForImport(Image->Base,
+													Image->NtHeaders,
+													Image->ImportDllNames[Position],
+													Image->ImportNames[Position],
+													&IatAddress);
+	*Bytes = Image->ImportsSize;
+	return !EFI_ERROR(Status) && IatAddress == Image->ImportIatAddresses[Position];
+}
+
+// Rebuilds the import index, which walks all of the imports
+STATIC
+BOOLEAN
+BenchBuildImportIndex(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	CONST EFI_STATUS Status = BuildImportIndex(Image->Base, Image->NtHeaders, &Image->ImportIndex);
+	*Bytes = Image->ImportsSize;
+	return !EFI_ERROR(Status) && Image->ImportIndex.Count == SYNTHETIC_NUM_IMPORT_DLLS * MAX(Image->Size / 512 / SYNTHETIC_NUM_IMPORT_DLLS, 4);
+}
+
+STATIC
+BOOLEAN
+BenchFindIATAddressInIndex(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	VOID* IatAddress;
+	CONST EFI_STATUS Status = FindIATAddressInIndex(&Image->ImportIndex,
+													Image->ImportDllNames[Position],
+													Image->ImportNames[Position],
+													&IatAddress);
+	*Bytes = Image->ImportsSize;
+	return !EFI_ERROR(Status) && IatAddress == Image->ImportIatAddresses[Position];
+}
+
+// Parses the section table and data directories once, as is done for every image before its locators run
+STATIC
+BOOLEAN
+BenchInitializePeImageView(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	PE_IMAGE_VIEW View;
+	CONST EFI_STATUS Status = InitializePeImageView(Image->Base, Image->NtHeaders, &View);
+	*Bytes = Image->NtHeaders->FileHeader.NumberOfSections * sizeof(EFI_IMAGE_SECTION_HEADER);
+	return !EFI_ERROR(Status) &&
+		PeImageFindSection(&View, ".rdata") == &View.Sections[1] &&
+		PeImageSectionFromRva(&View, Image->ResourceRva) == &View.Sections[1] &&
+		View.Exports.Data != NULL && View.Imports.Data != NULL && View.Exceptions.Data != NULL && View.Resources.Data != NULL;
+}
+
+STATIC
+BOOLEAN
+BenchFindResourceDataById(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	VOID* Data;
+	UINT32 Size;
+	CONST EFI_STATUS Status = FindResourceDataById(Image->Base, Image->ResourceTypes[Position], Image->ResourceNames[Position], 0, &Data, &Size);
+	*Bytes = Image->NtHeaders->OptionalHeader.DataDirectory[EFI_IMAGE_DIRECTORY_ENTRY_RESOURCE].Size;
+	return !EFI_ERROR(Status) && Data == Image->ResourceData;
+}
+
+STATIC
+BOOLEAN
+BenchGetInputFileType(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	CONST INPUT_FILETYPE FileType = GetInputFileType(Image->Base, Image->Size);
+	*Bytes = Image->Size - Image->ResourceRva;
+	return FileType == WinloadEfi;
+}
+
+// Classifies the image as bootmgfw.efi, by its subsystem and BOOTMGR.XSL resource
+STATIC
+BOOLEAN
+BenchGetInputFileTypeBootmgfw(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	Image->NtHeaders->OptionalHeader.Subsystem = EFI_IMAGE_SUBSYSTEM_EFI_APPLICATION;
+	Image->ResourceTypeName->Length = (UINT16)(sizeof(L"BOOTMGR.XSL") / sizeof(CHAR16) - 1);
+	CopyMem(Image->ResourceTypeName->String, L"BOOTMGR.XSL", sizeof(L"BOOTMGR.XSL") - sizeof(CHAR16));
+
+	CONST INPUT_FILETYPE FileType = GetInputFileType(Image->Base, Image->Size);
+
+	Image->NtHeaders->OptionalHeader.Subsystem = EFI_IMAGE_SUBSYSTEM_WINDOWS_BOOT_APPLICATION;
+	Image->ResourceTypeName->Length = (UINT16)(sizeof(L"OSLOADER.XSL") / sizeof(CHAR16) - 1);
+	CopyMem(Image->ResourceTypeName->String, L"OSLOADER.XSL", sizeof(L"OSLOADER.XSL") - sizeof(CHAR16));
+
+	*Bytes = Image->Size;
+	return FileType == BootmgfwEfi;
+}
+
+// Classifies the image as bootmgfw.efi without the BOOTMGR.XSL resource, which falls back to searching the image sections for the GUID
+STATIC
+BOOLEAN
+BenchGetInputFileTypeGuidScan(
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	OUT UINT64* Bytes
+	)
+{
+	Image->NtHeaders->OptionalHeader.Subsystem = EFI_IMAGE_SUBSYSTEM_EFI_APPLICATION;
+	CONST INPUT_FILETYPE FileType = GetInputFileType(Image->Base, Image->Size);
+	Image->NtHeaders->OptionalHeader.Subsystem = EFI_IMAGE_SUBSYSTEM_WINDOWS_BOOT_APPLICATION;
+
+	*Bytes = Image->Size;
+	return FileType == BootmgfwEfi;
+}
+
+STATIC CONST BENCHMARK mBenchmarks[] = {
+	{ "FindPattern", BenchFindPattern, TRUE },
+	{ "FindPatterns", BenchFindPatterns, FALSE },
+	{ "FindPatternEach", BenchFindPatternEach, FALSE },
+	{ "FindPatternVerbose", BenchFindPatternVerbose, TRUE },
+	{ "DisassembleRange", BenchDisassembleRange, FALSE },
+	{ "DisassembleRangeOperands", BenchDisassembleRangeOperands, FALSE },
+	{ "DecodeFull", BenchDecodeFull, FALSE },
+	{ "BacktrackToFunctionStart", BenchBacktrackToFunctionStart, TRUE },
+	{ "GetProcedureAddress", BenchGetProcedureAddress, TRUE },
+	{ "GetProcedureAddresses", BenchGetProcedureAddresses, FALSE },
+	{ "GetProcedureAddressFromTable", BenchGetProcedureAddressFromTable, TRUE },
+	{ "FindIATAddressForImport", BenchFindIATAddressForImport, TRUE },
+	{ "BuildImportIndex", BenchBuildImportIndex, FALSE },
+	{ "FindIATAddressInIndex", BenchFindIATAddressInIndex, TRUE },
+	{ "InitializePeImageView", BenchInitializePeImageView, FALSE },
+	{ "FindResourceDataById", BenchFindResourceDataById, TRUE },
+	{ "GetInputFileType", BenchGetInputFileType, FALSE },
+	{ "GetInputFileTypeBootmgfw", BenchGetInputFileTypeBootmgfw, FALSE },
+	{ "GetInputFileTypeGuidScan", BenchGetInputFileTypeGuidScan, FALSE }
+};
+
+
+STATIC
+BOOLEAN
+NameMatchesFilter(
+	IN CONST CHAR8* Name,
+	IN CONST CHAR8* Filter OPTIONAL
+	)
+{
+	if (Filter == NULL)
+		return TRUE;
+
+	CONST UINT32 FilterLength = NameLength(Filter);
+	for (CONST CHAR8* Start = Name; NameLength(Start) >= FilterLength; ++Start)
+	{
+		if (CompareMem(Start, Filter, FilterLength) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Calls a benchmark function NumCalls times, and returns the elapsed time
+STATIC
+UINT64
+TimeCalls(
+	IN CONST BENCHMARK* Benchmark,
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	IN UINT64 NumCalls,
+	OUT BOOLEAN* Correct
+	)
+{
+	UINT64 Bytes;
+	BOOLEAN AllCorrect = TRUE;
+	CONST UINT64 StartTime = HostGetTimeNs();
+	for (UINT64 i = 0; i < NumCalls; ++i)
+		AllCorrect &= Benchmark->Function(Image, Position, &Bytes);
+	CONST UINT64 EndTime = HostGetTimeNs();
+	*Correct = AllCorrect;
+	return EndTime - StartTime;
+}
+
+STATIC
+BOOLEAN
+RunBenchmark(
+	IN CONST BENCHMARK* Benchmark,
+	IN OUT PSYNTHETIC_IMAGE Image,
+	IN BENCH_POSITION Position,
+	IN CONST HOST_BENCH_OPTIONS* Options
+	)
+{
+	CONST CHAR8* PositionName = Benchmark->Positional ? mPositionNames[Position] : "all";
+
+	// Check the result once. This also compiles the pattern for the pattern scans
+	UINT64 Bytes;
+	if (!Benchmark->Function(Image, Position, &Bytes))
+	{
+		HostBenchFailed(Benchmark->Name, PositionName, Image->Size);
+		return FALSE;
+	}
+
+	// Double the number of calls until a measurement takes at least MinTimeNs, then keep the fastest of the repetitions
+	BOOLEAN Correct;
+	UINT64 NumCalls = 1, Elapsed;
+	while ((Elapsed = TimeCalls(Benchmark, Image, Position, NumCalls, &Correct)) < Options->MinTimeNs && NumCalls < (1ULL << 40))
+		NumCalls *= 2;
+	for (UINT32 i = 1; i < Options->Repetitions && Correct; ++i)
+	{
+		BOOLEAN RepetitionCorrect;
+		CONST UINT64 RepetitionElapsed = TimeCalls(Benchmark, Image, Position, NumCalls, &RepetitionCorrect);
+		Elapsed = MIN(Elapsed, RepetitionElapsed);
+		Correct &= RepetitionCorrect;
+	}
+
+	if (!Correct)
+	{
+		HostBenchFailed(Benchmark->Name, PositionName, Image->Size);
+		return FALSE;
+	}
+
+	HostBenchReport(Benchmark->Name, PositionName, Image->Size, Bytes, NumCalls, Elapsed);
+	return TRUE;
+}
+
+int
+HostBenchRun(
+	const HOST_BENCH_OPTIONS* Options
+	)
+{
+	STATIC SYNTHETIC_IMAGE Image;
+	int Result = 0;
+
+	for (UINT64 Size = MIN_BENCH_BUFFER_SIZE; Size <= MAX_BENCH_BUFFER_SIZE; Size *= 4)
+	{
+		if (Size < Options->MinBufferSize || Size > Options->MaxBufferSize)
+			continue;
+
+		if (EFI_ERROR(BuildImage((UINT32)Size, &Image)))
+		{
+			HostBenchFailed("BuildImage", "all", Size);
+			return 1;
+		}
+
+		for (UINT32 i = 0; i < ARRAY_SIZE(mBenchmarks); ++i)
+		{
+			if (!NameMatchesFilter(mBenchmarks[i].Name, Options->Filter))
+				continue;
+
+			CONST UINT32 NumBenchPositions = mBenchmarks[i].Positional ? NumPositions : 1;
+			for (UINT32 Position = 0; Position < NumBenchPositions; ++Position)
+			{
+				if (!RunBenchmark(&mBenchmarks[i], &Image, (BENCH_POSITION)Position, Options))
+					Result = 1;
+			}
+		}
+
+		FreePool(Image.ImportIndex.Buckets);
+		FreePool(Image.ExportNameTable.Buckets);
+		FreePool(Image.Base);
+	}
+
+	return Result;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+//
+// Interface between the host side of EfiGuardBench (EfiGuardBench.c) and the benchmarks in HostBench.c. See HostLocate.h
+//
+
+typedef struct _HOST_BENCH_OPTIONS
+{
+	const char* Filter;						// Optional. Only run benchmarks whose name contains this string
+	unsigned long long MinBufferSize;		// Buffer sizes are powers of 4 from 64 KB to 64 MB, limited to this range
+	unsigned long long MaxBufferSize;
+	unsigned long long MinTimeNs;			// Minimum duration of a measurement. The number of calls is doubled until it is reached
+	unsigned int Repetitions;				// Number of measurements. The fastest is reported
+} HOST_BENCH_OPTIONS;
+
+//
+// Implemented by the UEFI side
+//
+
+// Runs the benchmarks on synthetic images, and reports each measurement with HostBenchReport().
+// Returns 0 on success, or 1 if a primitive returned the wrong result (which is also reported)
+int
+HostBenchRun(
+	const HOST_BENCH_OPTIONS* Options
+	);
+
+//
+// Implemented by the host side
+//
+
+// Receives a measurement. Position is where the match was planted ("start", "middle" or "end"), or "all" for primitives that
+// process the whole buffer. Bytes is the size of the range the primitive had to search to find the match
+void
+HostBenchReport(
+	const char* Name,
+	const char* Position,
+	unsigned long long BufferSize,
+	unsigned long long Bytes,
+	unsigned long long Calls,
+	unsigned long long Nanoseconds
+	);
+
+// Reports a primitive that returned the wrong result
+void
+HostBenchFailed(
+	const char* Name,
+	const char* Position,
+	unsigned long long BufferSize
+	);
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "EfiGuardDxe.h"
+#include "HostLocate.h"
+
+//
+// Records the status and duration of a locator that was started at StartTime (from HostGetTimeNs())
+//
+VOID
+EFIAPI
+HostRecordLocator(
+	IN OUT HOST_LOCATE_RESULT* Result,
+	IN CONST CHAR8* Name,
+	IN EFI_STATUS Status,
+	IN UINT64 StartTime
+	);
+
+//
+// Records the address of a patch site. Address may be NULL if the site does not exist in the image
+//
+VOID
+EFIAPI
+HostRecordSite(
+	IN OUT HOST_LOCATE_RESULT* Result,
+	IN CONST UINT8* ImageBase,
+	IN PATCH_SITE Site,
+	IN CONST UINT8* Address OPTIONAL
+	);
+
+//
+// Compile the STATIC signatures of each Patch*.c file. The locators compile them on first use, which is not thread-safe
+//
+EFI_STATUS
+EFIAPI
+HostCompileBootManagerPatterns(
+	VOID
+	);
+
+EFI_STATUS
+EFIAPI
+HostCompileWinloadPatterns(
+	VOID
+	);
+
+EFI_STATUS
+EFIAPI
+HostCompileNtoskrnlPatterns(
+	VOID
+	);
+
+//
+// Locators for each image type. These are built together with the corresponding Patch*.c file, so that its STATIC locators are accessible
+//
+EFI_STATUS
+EFIAPI
+HostLocateBootManager(
+	IN INPUT_FILETYPE FileType,
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN UINT16 BuildNumber,
+	IN OUT HOST_LOCATE_RESULT* Result
+	);
+
+EFI_STATUS
+EFIAPI
+HostLocateWinload(
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN UINT16 BuildNumber,
+	IN OUT HOST_LOCATE_RESULT* Result
+	);
+
+//
+// Locates ImgpValidateImageHash and ImgpFilterValidationFailure, which exist in both the boot manager and winload.efi
+//
+EFI_STATUS
+EFIAPI
+HostLocateImgpSites(
+	IN INPUT_FILETYPE FileType,
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN CONST XREF_INDEX* XrefIndex OPTIONAL,
+	IN UINT16 BuildNumber,
+	IN OUT HOST_LOCATE_RESULT* Result
+	);
+
+EFI_STATUS
+EFIAPI
+HostLocateNtoskrnl(
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN UINT16 BuildNumber,
+	IN OUT HOST_LOCATE_RESULT* Result
+	);
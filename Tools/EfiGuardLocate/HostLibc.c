@@ -0,0 +1,57 @@
+//
+// Host side implementations of the functions declared in HostLocate.h, shared by EfiGuardLocate and EfiGuardBench
+//
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "HostLocate.h"
+
+int HostVerbose = 0;
+
+void*
+HostAllocate(
+	unsigned long long Size
+	)
+{
+	return malloc(Size);
+}
+
+void
+HostFree(
+	void* Buffer
+	)
+{
+	free(Buffer);
+}
+
+void
+HostWriteOutput(
+	const char* String
+	)
+{
+	if (HostVerbose)
+		fputs(String, stdout);
+}
+
+void
+HostAssertFailed(
+	const char* FileName,
+	unsigned long long LineNumber,
+	const char* Description
+	)
+{
+	fprintf(stderr, "ASSERT %s(%llu): %s\n", FileName, LineNumber, Description);
+	abort();
+}
+
+unsigned long long
+HostGetTimeNs(
+	void
+	)
+{
+	struct timespec Time;
+	clock_gettime(CLOCK_MONOTONIC, &Time);
+	return (unsigned long long)Time.tv_sec * 1000000000ULL + (unsigned long long)Time.tv_nsec;
+}
@@ -0,0 +1,129 @@
+#include "HostInternal.h"
+
+#include <Library/BaseMemoryLib.h>
+
+// Names of the PATCH_SITE values. These are also the names used by KnownBuilds.h
+STATIC CONST CHAR8* CONST mPatchSiteNames[] = {
+	"PatchSiteImgArchStartBootApplication",
+	"PatchSiteImgpValidateImageHash",
+	"PatchSiteImgpFilterValidationFailure",
+	"PatchSiteOslFwpKernelSetupPhase1",
+	"PatchSiteKeInitAmd64SpecificState",
+	"PatchSiteCcInitializeBcbProfiler",
+	"PatchSiteExpLicenseWatchInitWorker",
+	"PatchSiteKiVerifyScopesExecute",
+	"PatchSiteKiMcaDeferredRecoveryServiceCaller0",
+	"PatchSiteKiMcaDeferredRecoveryServiceCaller1",
+	"PatchSiteGlobalPgContext",
+	"PatchSiteKiSwInterrupt",
+	"PatchSiteSepInitializeCodeIntegrity",
+	"PatchSiteSeValidateImageDataMovEax",
+	"PatchSiteSeValidateImageDataJz",
+	"PatchSiteSeCodeIntegrityQueryInformation"
+};
+
+STATIC_ASSERT(ARRAY_SIZE(mPatchSiteNames) == PatchSiteMax, "mPatchSiteNames does not match PATCH_SITE");
+STATIC_ASSERT(PatchSiteMax <= HOST_MAX_SITES, "HOST_MAX_SITES is too small");
+
+VOID
+EFIAPI
+HostRecordLocator(
+	IN OUT HOST_LOCATE_RESULT* Result,
+	IN CONST CHAR8* Name,
+	IN EFI_STATUS Status,
+	IN UINT64 StartTime
+	)
+{
+	CONST UINT64 EndTime = HostGetTimeNs();
+	if (Result->NumLocators >= HOST_MAX_LOCATORS)
+		return;
+
+	HOST_LOCATOR_TIMING* Timing = &Result->Locators[Result->NumLocators++];
+	Timing->Name = Name;
+	Timing->Status = Status;
+	Timing->Nanoseconds = EndTime - StartTime;
+}
+
+VOID
+EFIAPI
+HostRecordSite(
+	IN OUT HOST_LOCATE_RESULT* Result,
+	IN CONST UINT8* ImageBase,
+	IN PATCH_SITE Site,
+	IN CONST UINT8* Address OPTIONAL
+	)
+{
+	Result->SiteMask |= 1U << Site;
+	Result->SiteNames[Site] = mPatchSiteNames[Site];
+	if (Address != NULL && (UINTN)(Address - ImageBase) <= Result->SizeOfImage - HOST_SITE_BYTES)
+	{
+		Result->SiteRvas[Site] = (UINT32)(Address - ImageBase);
+		CopyMem(Result->SiteBytes[Site], Address, HOST_SITE_BYTES);
+	}
+}
+
+int
+HostInitialize(
+	void
+	)
+{
+	// The signatures are shared by all threads, and are written when they are compiled
+	EFI_STATUS Status = HostCompileBootManagerPatterns();
+	if (!EFI_ERROR(Status))
+		Status = HostCompileWinloadPatterns();
+	if (!EFI_ERROR(Status))
+		Status = HostCompileNtoskrnlPatterns();
+	return EFI_ERROR(Status) ? -1 : 0;
+}
+
+int
+HostLocate(
+	void* ImageBase,
+	unsigned long long ImageSize,
+	HOST_LOCATE_RESULT* Result
+	)
+{
+	ZeroMem(Result, sizeof(*Result));
+
+	CONST PEFI_IMAGE_NT_HEADERS NtHeaders = RtlpImageNtHeaderEx(ImageBase, ImageSize);
+	PE_IMAGE_VIEW Image;
+	if (NtHeaders == NULL || EFI_ERROR(InitializePeImageView(ImageBase, NtHeaders, &Image)))
+		return -1;
+
+	Result->TimeDateStamp = NtHeaders->FileHeader.TimeDateStamp;
+	Result->SizeOfImage = HEADER_FIELD(NtHeaders, SizeOfImage);
+	Result->CheckSum = HEADER_FIELD(NtHeaders, CheckSum);
+
+	CONST INPUT_FILETYPE FileType = GetInputFileType(ImageBase, ImageSize);
+	switch (FileType)
+	{
+		case BootmgfwEfi:
+			Result->FileType = "BootmgfwEfi";
+			break;
+		case BootmgrEfi:
+			Result->FileType = "BootmgrEfi";
+			break;
+		case WinloadEfi:
+			Result->FileType = "WinloadEfi";
+			break;
+		case Ntoskrnl:
+			Result->FileType = "Ntoskrnl";
+			break;
+		default:
+			return -1;
+	}
+
+	UINT16 BuildNumber = 0;
+	GetPeFileVersionInfo(ImageBase, &Result->MajorVersion, &Result->MinorVersion, &BuildNumber, &Result->Revision, NULL);
+	Result->BuildNumber = BuildNumber;
+
+	EFI_STATUS Status;
+	if (FileType == BootmgfwEfi || FileType == BootmgrEfi)
+		Status = HostLocateBootManager(FileType, &Image, BuildNumber, Result);
+	else if (FileType == WinloadEfi)
+		Status = HostLocateWinload(&Image, BuildNumber, Result);
+	else
+		Status = HostLocateNtoskrnl(&Image, BuildNumber, Result);
+
+	return EFI_ERROR(Status) ? 1 : 0;
+}
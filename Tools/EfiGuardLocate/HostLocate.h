@@ -0,0 +1,90 @@
+#pragma once
+
+//
+// Interface between the host side of EfiGuardLocate (EfiGuardLocate.c, built against the C library) and the UEFI side
+// (the driver sources and HostUefi.c, built against the EDK2 headers). The two cannot share headers, so only standard C types are used here.
+//
+
+#define HOST_MAX_SITES					32
+#define HOST_MAX_LOCATORS				16
+#define HOST_SITE_BYTES					8
+
+typedef struct _HOST_LOCATOR_TIMING
+{
+	const char* Name;
+	unsigned long long Status;				// EFI_STATUS returned by the locator
+	unsigned long long Nanoseconds;
+} HOST_LOCATOR_TIMING;
+
+typedef struct _HOST_LOCATE_RESULT
+{
+	const char* FileType;					// NULL if the image is not a supported boot manager, winload.efi or ntoskrnl.exe
+	unsigned short MajorVersion, MinorVersion, BuildNumber, Revision;
+	unsigned int TimeDateStamp;
+	unsigned int SizeOfImage;
+	unsigned int CheckSum;
+
+	// Bit N is set if the locators searched for site N. A site with an RVA of 0 does not exist in this image
+	unsigned int SiteMask;
+	const char* SiteNames[HOST_MAX_SITES];
+	unsigned int SiteRvas[HOST_MAX_SITES];
+	unsigned char SiteBytes[HOST_MAX_SITES][HOST_SITE_BYTES];
+
+	HOST_LOCATOR_TIMING Locators[HOST_MAX_LOCATORS];
+	unsigned int NumLocators;
+} HOST_LOCATE_RESULT;
+
+//
+// Implemented by the UEFI side
+//
+
+// Prepares the locators for use by several threads at once. Must be called before the first HostLocate() call and before
+// any threads are started. Returns 0 on success
+int
+HostInitialize(
+	void
+	);
+
+// Runs the locators for the image type on a section-aligned image. Returns 0 if all required sites were found,
+// 1 if a locator failed, and -1 if the image is not a supported boot manager, winload.efi or ntoskrnl.exe
+int
+HostLocate(
+	void* ImageBase,
+	unsigned long long ImageSize,
+	HOST_LOCATE_RESULT* Result
+	);
+
+//
+// Implemented by the host side
+//
+
+void*
+HostAllocate(
+	unsigned long long Size
+	);
+
+void
+HostFree(
+	void* Buffer
+	);
+
+// Set by the -v command line option
+extern int HostVerbose;
+
+// Receives the output of Print() and PRINT_KERNEL_PATCH_MSG. Discarded unless HostVerbose is set
+void
+HostWriteOutput(
+	const char* String
+	);
+
+void
+HostAssertFailed(
+	const char* FileName,
+	unsigned long long LineNumber,
+	const char* Description
+	);
+
+unsigned long long
+HostGetTimeNs(
+	void
+	);
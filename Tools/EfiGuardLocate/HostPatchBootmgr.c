@@ -0,0 +1,43 @@
+//
+// Builds PatchBootmgr.c for the host, and exposes its locators
+//
+#include "HostInternal.h"
+
+#include "PatchBootmgr.c"
+
+EFI_STATUS
+EFIAPI
+HostCompileBootManagerPatterns(
+	VOID
+	)
+{
+	return CompileBytePattern(&SigImgArchStartBootApplicationPattern);
+}
+
+EFI_STATUS
+EFIAPI
+HostLocateBootManager(
+	IN INPUT_FILETYPE FileType,
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN UINT16 BuildNumber,
+	IN OUT HOST_LOCATE_RESULT* Result
+	)
+{
+	CONST CHAR16* ShortFileName = FileType == BootmgrEfi ? L"bootmgr" : L"bootmgfw";
+	CONST CHAR16* FunctionName = BuildNumber >= 17134 ? L"ImgArchStartBootApplication" : L"ImgArchEfiStartBootApplication";
+
+	UINT8* ImgArchStartBootApplication = NULL;
+	CONST UINT64 StartTime = HostGetTimeNs();
+	CONST EFI_STATUS Status = FindImgArchStartBootApplication(Image,
+															ShortFileName,
+															FunctionName,
+															&ImgArchStartBootApplication);
+	HostRecordLocator(Result, "FindImgArchStartBootApplication", Status, StartTime);
+	if (!EFI_ERROR(Status))
+		HostRecordSite(Result, Image->ImageBase, PatchSiteImgArchStartBootApplication, ImgArchStartBootApplication);
+
+	// The remaining sites are optional, as in PatchBootManager()
+	HostLocateImgpSites(FileType, Image, NULL, BuildNumber, Result);
+
+	return Status;
+}
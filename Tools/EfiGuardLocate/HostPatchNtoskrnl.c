@@ -0,0 +1,96 @@
+//
+// Builds PatchNtoskrnl.c for the host, and exposes its locators
+//
+#include "HostInternal.h"
+
+// Print kernel patch messages directly. The delayed message log in gKernelPatchInfo is shared by all images, and would wrap around
+#undef PRINT_KERNEL_PATCH_MSG
+#define PRINT_KERNEL_PATCH_MSG(Fmt, ...) Print(Fmt, ##__VA_ARGS__)
+
+#include "PatchNtoskrnl.c"
+
+EFI_STATUS
+EFIAPI
+HostCompileNtoskrnlPatterns(
+	VOID
+	)
+{
+	PBYTE_PATTERN CONST Patterns[] = {
+		&SigKeInitAmd64SpecificStatePattern,
+		&SigKiVerifyScopesExecutePattern,
+		&SigKiMcaDeferredRecoveryServicePattern,
+		&SigKiSwInterruptPattern,
+		&SigSeCodeIntegrityQueryInformationPattern
+	};
+	for (UINTN i = 0; i < ARRAY_SIZE(Patterns); ++i)
+	{
+		CONST EFI_STATUS Status = CompileBytePattern(Patterns[i]);
+		if (EFI_ERROR(Status))
+			return Status;
+	}
+	return EFI_SUCCESS;
+}
+
+EFI_STATUS
+EFIAPI
+HostLocateNtoskrnl(
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN UINT16 BuildNumber,
+	IN OUT HOST_LOCATE_RESULT* Result
+	)
+{
+	UINT8* ImageBase = Image->ImageBase;
+
+	// Find the INIT, .text and PAGE sections
+	CONST PEFI_IMAGE_SECTION_HEADER InitSection = PeImageFindSection(Image, "INIT");
+	CONST PEFI_IMAGE_SECTION_HEADER TextSection = PeImageFindSection(Image, ".text");
+	CONST PEFI_IMAGE_SECTION_HEADER PageSection = PeImageFindSection(Image, "PAGE");
+	if (InitSection == NULL || TextSection == NULL || PageSection == NULL)
+		return EFI_NOT_FOUND;
+
+	PATCHGUARD_SITES PgSites;
+	ZeroMem(&PgSites, sizeof(PgSites));
+	UINT64 StartTime = HostGetTimeNs();
+	STAGE_TIMER Timer;
+	CONST EFI_STATUS Status = FindPatchGuardSites(Image, InitSection, TextSection, BuildNumber, &Timer, &PgSites);
+	EndStage(&Timer);
+	HostRecordLocator(Result, "FindPatchGuardSites", Status, StartTime);
+	if (!EFI_ERROR(Status))
+	{
+		HostRecordSite(Result, ImageBase, PatchSiteKeInitAmd64SpecificState, PgSites.KeInitAmd64SpecificState);
+		HostRecordSite(Result, ImageBase, PatchSiteCcInitializeBcbProfiler, PgSites.CcInitializeBcbProfiler);
+		HostRecordSite(Result, ImageBase, PatchSiteExpLicenseWatchInitWorker, PgSites.ExpLicenseWatchInitWorker);
+		HostRecordSite(Result, ImageBase, PatchSiteKiVerifyScopesExecute, PgSites.KiVerifyScopesExecute);
+		HostRecordSite(Result, ImageBase, PatchSiteKiMcaDeferredRecoveryServiceCaller0, PgSites.KiMcaDeferredRecoveryServiceCallers[0]);
+		HostRecordSite(Result, ImageBase, PatchSiteKiMcaDeferredRecoveryServiceCaller1, PgSites.KiMcaDeferredRecoveryServiceCallers[1]);
+		HostRecordSite(Result, ImageBase, PatchSiteGlobalPgContext, PgSites.GlobalPgContext);
+		HostRecordSite(Result, ImageBase, PatchSiteKiSwInterrupt, PgSites.KiSwInterrupt);
+	}
+
+	// Index the imports the same way PatchNtoskrnl() does
+	PIMPORT_INDEX_ENTRY ImportBuckets = AllocatePool(KERNEL_IMPORT_INDEX_CAPACITY * sizeof(IMPORT_INDEX_ENTRY));
+	PE_IMAGE_VIEW DseImage;
+	IMPORT_INDEX ImportIndex;
+	AttachKernelImportIndex(Image, ImportBuckets, &ImportIndex, &DseImage);
+
+	// Use DSE_DISABLE_AT_BOOT, which needs the most sites
+	DSE_SITES DseSites;
+	ZeroMem(&DseSites, sizeof(DseSites));
+	StartTime = HostGetTimeNs();
+	CONST EFI_STATUS DseStatus = FindDseSites(&DseImage, PageSection, DSE_DISABLE_AT_BOOT, BuildNumber, &Timer, &DseSites);
+	EndStage(&Timer);
+	HostRecordLocator(Result, "FindDseSites", DseStatus, StartTime);
+	if (!EFI_ERROR(DseStatus))
+	{
+		HostRecordSite(Result, ImageBase, PatchSiteSepInitializeCodeIntegrity, DseSites.SepInitializeCodeIntegrityMovEcx);
+		HostRecordSite(Result, ImageBase, PatchSiteSeValidateImageDataMovEax, DseSites.SeValidateImageDataMovEax);
+		HostRecordSite(Result, ImageBase, PatchSiteSeValidateImageDataJz, DseSites.SeValidateImageDataJz);
+		if (BuildNumber >= 16299)
+			HostRecordSite(Result, ImageBase, PatchSiteSeCodeIntegrityQueryInformation, DseSites.SeCodeIntegrityQueryInformation);
+	}
+
+	if (ImportBuckets != NULL)
+		FreePool(ImportBuckets);
+
+	return EFI_ERROR(Status) ? Status : DseStatus;
+}
@@ -0,0 +1,102 @@
+//
+// Builds PatchWinload.c for the host, and exposes its locators
+//
+#include "HostInternal.h"
+
+#include "PatchWinload.c"
+
+EFI_STATUS
+EFIAPI
+HostCompileWinloadPatterns(
+	VOID
+	)
+{
+	EFI_STATUS Status = CompileBytePattern(&SigOslFwpKernelSetupPhase1Pattern);
+	if (!EFI_ERROR(Status))
+		Status = CompileBytePattern(&SigBlStatusPrintPattern);
+	return Status;
+}
+
+EFI_STATUS
+EFIAPI
+HostLocateImgpSites(
+	IN INPUT_FILETYPE FileType,
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN CONST XREF_INDEX* XrefIndex OPTIONAL,
+	IN UINT16 BuildNumber,
+	IN OUT HOST_LOCATE_RESULT* Result
+	)
+{
+	CONST CHAR16* ShortName = FileType == BootmgfwEfi ? L"bootmgfw" : (FileType == BootmgrEfi ? L"bootmgr" : L"winload");
+
+	UINT8* ImgpValidateImageHash = NULL;
+	UINT64 StartTime = HostGetTimeNs();
+	EFI_STATUS Status = FindImgpValidateImageHash(Image, ShortName, &ImgpValidateImageHash);
+	HostRecordLocator(Result, "FindImgpValidateImageHash", Status, StartTime);
+	if (!EFI_ERROR(Status))
+		HostRecordSite(Result, Image->ImageBase, PatchSiteImgpValidateImageHash, ImgpValidateImageHash);
+
+	// ImgpFilterValidationFailure only exists on Windows 7 and higher
+	if (BuildNumber >= 7600)
+	{
+		UINT8* ImgpFilterValidationFailure = NULL;
+		StartTime = HostGetTimeNs();
+		Status = FindImgpFilterValidationFailure(FileType, Image, XrefIndex, ShortName, &ImgpFilterValidationFailure);
+		HostRecordLocator(Result, "FindImgpFilterValidationFailure", Status, StartTime);
+		if (!EFI_ERROR(Status))
+			HostRecordSite(Result, Image->ImageBase, PatchSiteImgpFilterValidationFailure, ImgpFilterValidationFailure);
+	}
+
+	return Status;
+}
+
+EFI_STATUS
+EFIAPI
+HostLocateWinload(
+	IN CONST PE_IMAGE_VIEW* Image,
+	IN UINT16 BuildNumber,
+	IN OUT HOST_LOCATE_RESULT* Result
+	)
+{
+	// Find the .text and .rdata sections
+	PEFI_IMAGE_SECTION_HEADER CodeSection = PeImageFindSection(Image, ".text");
+	CONST PEFI_IMAGE_SECTION_HEADER PatternSection = PeImageFindSection(Image, ".rdata");
+	if (CodeSection == NULL || PatternSection == NULL)
+		return EFI_NOT_FOUND;
+
+	// Build the data xref index only for the builds PatchWinload() builds it for
+	XREF_INDEX XrefIndex;
+	PXREF_ENTRY XrefEntries = NULL;
+	CONST XREF_INDEX* DataXrefIndex = NULL;
+	UINT64 StartTime;
+	EFI_STATUS Status;
+	if (WINLOAD_NEEDS_DATA_XREF_INDEX(BuildNumber))
+	{
+		XrefEntries = AllocatePool(WINLOAD_DATA_XREF_INDEX_CAPACITY(CodeSection) * sizeof(XREF_ENTRY));
+		StartTime = HostGetTimeNs();
+		Status = BuildWinloadDataXrefIndex(Image, CodeSection, XrefEntries, &XrefIndex);
+		HostRecordLocator(Result, "BuildXrefIndex", Status, StartTime);
+		if (!EFI_ERROR(Status))
+			DataXrefIndex = &XrefIndex;
+	}
+
+	UINT8* OslFwpKernelSetupPhase1 = NULL;
+	StartTime = HostGetTimeNs();
+	Status = FindOslFwpKernelSetupPhase1(Image,
+										CodeSection,
+										PatternSection,
+										DataXrefIndex,
+										BuildNumber,
+										&OslFwpKernelSetupPhase1);
+	HostRecordLocator(Result, "FindOslFwpKernelSetupPhase1", Status, StartTime);
+	if (!EFI_ERROR(Status))
+		HostRecordSite(Result, Image->ImageBase, PatchSiteOslFwpKernelSetupPhase1, OslFwpKernelSetupPhase1);
+
+	// These are optional, as in PatchWinload()
+	HostLocateImgpSites(WinloadEfi, Image, DataXrefIndex, BuildNumber, Result);
+
+	if (XrefEntries != NULL)
+		FreePool(XrefEntries);
+
+	return Status;
+}
@@ -0,0 +1,747 @@
+//
+// Minimal UEFI environment for running the driver's locators on the host.
+// This provides the library functions and globals referenced by pe.c, util.c and the Patch*.c files. Boot and runtime services
+// are never called by the locators, so gBS, gRT and gST point to empty tables. CopyWpMem() and SetWpMem() still work, because
+// the control register accessors below are no-ops and the image being written to is a private copy.
+//
+#include "EfiGuardDxe.h"
+#include "HostLocate.h"
+
+#include <Guid/Acpi.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/DevicePathLib.h>
+#include <Library/PrintLib.h>
+
+STATIC EFI_BOOT_SERVICES mBootServices;
+STATIC EFI_RUNTIME_SERVICES mRuntimeServices;
+STATIC EFI_SYSTEM_TABLE mSystemTable = { .RuntimeServices = &mRuntimeServices, .BootServices = &mBootServices };
+
+EFI_HANDLE gImageHandle = NULL;
+EFI_SYSTEM_TABLE* gST = &mSystemTable;
+EFI_BOOT_SERVICES* gBS = &mBootServices;
+EFI_RUNTIME_SERVICES* gRT = &mRuntimeServices;
+
+EFI_GUID gEfiAcpi20TableGuid = EFI_ACPI_20_TABLE_GUID;
+EFI_GUID gEfiGuardDriverProtocolGuid = EFI_EFIGUARD_DRIVER_PROTOCOL_GUID;
+
+// Defined in EfiGuardDxe.c, which is not part of the host build. Use the DSE bypass method that needs the most patch sites
+EFIGUARD_CONFIGURATION_DATA gDriverConfig = { DSE_DISABLE_AT_BOOT, FALSE, VERBOSITY_VERBOSE };
+EFI_HANDLE gBootmgfwHandle = NULL;
+EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL* gTextInputEx = NULL;
+
+
+//
+// MemoryAllocationLib
+//
+
+VOID*
+EFIAPI
+AllocatePool(
+	IN UINTN AllocationSize
+	)
+{
+	return HostAllocate(AllocationSize);
+}
+
+VOID*
+EFIAPI
+AllocateZeroPool(
+	IN UINTN AllocationSize
+	)
+{
+	VOID* Buffer = HostAllocate(AllocationSize);
+	if (Buffer != NULL)
+		ZeroMem(Buffer, AllocationSize);
+	return Buffer;
+}
+
+VOID
+EFIAPI
+FreePool(
+	IN VOID* Buffer
+	)
+{
+	HostFree(Buffer);
+}
+
+
+//
+// BaseMemoryLib
+//
+
+VOID*
+EFIAPI
+CopyMem(
+	OUT VOID* DestinationBuffer,
+	IN CONST VOID* SourceBuffer,
+	IN UINTN Length
+	)
+{
+	UINT8* Destination = (UINT8*)DestinationBuffer;
+	CONST UINT8* Source = (CONST UINT8*)SourceBuffer;
+	if (Destination < Source)
+	{
+		for (UINTN i = 0; i < Length; ++i)
+			Destination[i] = Source[i];
+	}
+	else
+	{
+		for (UINTN i = Length; i > 0; --i)
+			Destination[i - 1] = Source[i - 1];
+	}
+	return DestinationBuffer;
+}
+
+VOID*
+EFIAPI
+SetMem(
+	OUT VOID* Buffer,
+	IN UINTN Length,
+	IN UINT8 Value
+	)
+{
+	UINT8* Destination = (UINT8*)Buffer;
+	for (UINTN i = 0; i < Length; ++i)
+		Destination[i] = Value;
+	return Buffer;
+}
+
+VOID*
+EFIAPI
+ZeroMem(
+	OUT VOID* Buffer,
+	IN UINTN Length
+	)
+{
+	return SetMem(Buffer, Length, 0);
+}
+
+INTN
+EFIAPI
+CompareMem(
+	IN CONST VOID* DestinationBuffer,
+	IN CONST VOID* SourceBuffer,
+	IN UINTN Length
+	)
+{
+	CONST UINT8* Destination = (CONST UINT8*)DestinationBuffer;
+	CONST UINT8* Source = (CONST UINT8*)SourceBuffer;
+	for (UINTN i = 0; i < Length; ++i)
+	{
+		if (Destination[i] != Source[i])
+			return (INTN)Destination[i] - (INTN)Source[i];
+	}
+	return 0;
+}
+
+
+//
+// BaseLib
+//
+
+UINTN
+EFIAPI
+StrLen(
+	IN CONST CHAR16* String
+	)
+{
+	UINTN Length = 0;
+	while (String[Length] != CHAR_NULL)
+		++Length;
+	return Length;
+}
+
+INTN
+EFIAPI
+StrnCmp(
+	IN CONST CHAR16* FirstString,
+	IN CONST CHAR16* SecondString,
+	IN UINTN Length
+	)
+{
+	for (UINTN i = 0; i < Length; ++i)
+	{
+		if (FirstString[i] != SecondString[i] || FirstString[i] == CHAR_NULL)
+			return (INTN)FirstString[i] - (INTN)SecondString[i];
+	}
+	return 0;
+}
+
+CHAR16
+EFIAPI
+CharToUpper(
+	IN CHAR16 Char
+	)
+{
+	return Char >= L'a' && Char <= L'z' ? (CHAR16)(Char - (L'a' - L'A')) : Char;
+}
+
+INTN
+EFIAPI
+AsciiStrCmp(
+	IN CONST CHAR8* FirstString,
+	IN CONST CHAR8* SecondString
+	)
+{
+	while (*FirstString != '\0' && *FirstString == *SecondString)
+	{
+		FirstString++;
+		SecondString++;
+	}
+	return (INTN)(UINT8)*FirstString - (INTN)(UINT8)*SecondString;
+}
+
+INTN
+EFIAPI
+AsciiStriCmp(
+	IN CONST CHAR8* FirstString,
+	IN CONST CHAR8* SecondString
+	)
+{
+	CHAR8 First, Second;
+	do
+	{
+		First = *FirstString >= 'a' && *FirstString <= 'z' ? *FirstString - ('a' - 'A') : *FirstString;
+		Second = *SecondString >= 'a' && *SecondString <= 'z' ? *SecondString - ('a' - 'A') : *SecondString;
+		FirstString++;
+		SecondString++;
+	} while (First != '\0' && First == Second);
+	return (INTN)(UINT8)First - (INTN)(UINT8)Second;
+}
+
+INTN
+EFIAPI
+LowBitSet32(
+	IN UINT32 Operand
+	)
+{
+	if (Operand == 0)
+		return -1;
+
+	INTN BitIndex = 0;
+	while ((Operand & 1) == 0)
+	{
+		Operand >>= 1;
+		BitIndex++;
+	}
+	return BitIndex;
+}
+
+UINT64
+EFIAPI
+MultU64x32(
+	IN UINT64 Multiplicand,
+	IN UINT32 Multiplier
+	)
+{
+	return Multiplicand * Multiplier;
+}
+
+UINT64
+EFIAPI
+DivU64x64Remainder(
+	IN UINT64 Dividend,
+	IN UINT64 Divisor,
+	OUT UINT64 *Remainder OPTIONAL
+	)
+{
+	if (Remainder != NULL)
+		*Remainder = Dividend % Divisor;
+	return Dividend / Divisor;
+}
+
+UINT64
+EFIAPI
+AsmReadTsc(
+	VOID
+	)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+UINTN
+EFIAPI
+AsmReadCr0(
+	VOID
+	)
+{
+	return 0;
+}
+
+UINTN
+EFIAPI
+AsmWriteCr0(
+	IN UINTN Cr0
+	)
+{
+	return Cr0;
+}
+
+UINTN
+EFIAPI
+AsmReadCr4(
+	VOID
+	)
+{
+	return 0;
+}
+
+UINT64
+EFIAPI
+AsmReadMsr64(
+	IN UINT32 Index
+	)
+{
+	return 0;
+}
+
+VOID
+EFIAPI
+AsmDisableCet(
+	VOID
+	)
+{
+}
+
+VOID
+EFIAPI
+AsmEnableCet(
+	VOID
+	)
+{
+}
+
+
+//
+// UefiLib, DevicePathLib and DebugLib
+//
+
+EFI_TPL
+EFIAPI
+EfiGetCurrentTpl(
+	VOID
+	)
+{
+	return TPL_APPLICATION;
+}
+
+CHAR16*
+EFIAPI
+ConvertDevicePathToText(
+	IN CONST EFI_DEVICE_PATH_PROTOCOL* DevicePath,
+	IN BOOLEAN DisplayOnly,
+	IN BOOLEAN AllowShortcuts
+	)
+{
+	return NULL;
+}
+
+BOOLEAN
+EFIAPI
+DebugAssertEnabled(
+	VOID
+	)
+{
+	return TRUE;
+}
+
+BOOLEAN
+EFIAPI
+DebugPrintEnabled(
+	VOID
+	)
+{
+	return TRUE;
+}
+
+BOOLEAN
+EFIAPI
+DebugPrintLevelEnabled(
+	IN CONST UINTN ErrorLevel
+	)
+{
+	return TRUE;
+}
+
+BOOLEAN
+EFIAPI
+DebugCodeEnabled(
+	VOID
+	)
+{
+	return TRUE;
+}
+
+BOOLEAN
+EFIAPI
+DebugClearMemoryEnabled(
+	VOID
+	)
+{
+	return FALSE;
+}
+
+VOID
+EFIAPI
+DebugAssert(
+	IN CONST CHAR8* FileName,
+	IN UINTN LineNumber,
+	IN CONST CHAR8* Description
+	)
+{
+	HostAssertFailed(FileName, LineNumber, Description);
+}
+
+
+//
+// PrintLib. Supports the subset of the EDK2 format syntax that is used by the driver
+//
+
+typedef struct _HOST_PRINT_BUFFER
+{
+	CHAR16* Buffer;
+	UINTN MaxLength;	// Including the terminator
+	UINTN Length;
+} HOST_PRINT_BUFFER;
+
+STATIC
+VOID
+PutChar(
+	IN OUT HOST_PRINT_BUFFER* Out,
+	IN CHAR16 Char
+	)
+{
+	if (Out->Length + 1 < Out->MaxLength)
+		Out->Buffer[Out->Length++] = Char;
+}
+
+STATIC
+VOID
+PutPadding(
+	IN OUT HOST_PRINT_BUFFER* Out,
+	IN CHAR16 Char,
+	IN UINTN Count
+	)
+{
+	for (UINTN i = 0; i < Count; ++i)
+		PutChar(Out, Char);
+}
+
+// Formats Value in the given base into Digits, which must hold at least 20 characters. Returns the number of digits
+STATIC
+UINTN
+FormatNumber(
+	OUT CHAR16* Digits,
+	IN UINT64 Value,
+	IN UINT32 Base,
+	IN BOOLEAN UpperCase
+	)
+{
+	CONST CHAR8* DigitChars = UpperCase ? "0123456789ABCDEF" : "0123456789abcdef";
+	CHAR16 Reversed[20];
+	UINTN Count = 0;
+	do
+	{
+		Reversed[Count++] = (CHAR16)DigitChars[Value % Base];
+		Value /= Base;
+	} while (Value != 0);
+
+	for (UINTN i = 0; i < Count; ++i)
+		Digits[i] = Reversed[Count - 1 - i];
+	return Count;
+}
+
+STATIC
+VOID
+PutHex(
+	IN OUT HOST_PRINT_BUFFER* Out,
+	IN UINT64 Value,
+	IN UINTN Width
+	)
+{
+	CHAR16 Digits[20];
+	CONST UINTN Count = FormatNumber(Digits, Value, 16, TRUE);
+	PutPadding(Out, L'0', Width > Count ? Width - Count : 0);
+	for (UINTN i = 0; i < Count; ++i)
+		PutChar(Out, Digits[i]);
+}
+
+STATIC
+UINTN
+EFIAPI
+HostVSPrint(
+	OUT CHAR16* StartOfBuffer,
+	IN UINTN BufferSize,
+	IN CONST CHAR16* UnicodeFormat OPTIONAL,
+	IN CONST CHAR8* AsciiFormat OPTIONAL,
+	IN VA_LIST Marker
+	)
+{
+	HOST_PRINT_BUFFER Out = { StartOfBuffer, BufferSize / sizeof(CHAR16), 0 };
+	if (Out.MaxLength == 0)
+		return 0;
+
+	// In Unicode format strings %s is a CHAR16 string, in ASCII format strings it is a CHAR8 string
+	CONST BOOLEAN IsAscii = AsciiFormat != NULL;
+	for (UINTN i = 0; ; ++i)
+	{
+		CHAR16 Char = IsAscii ? (CHAR16)(UINT8)AsciiFormat[i] : UnicodeFormat[i];
+		if (Char == CHAR_NULL)
+			break;
+		if (Char != L'%')
+		{
+			PutChar(&Out, Char);
+			continue;
+		}
+
+#define NEXT_CHAR() (++i, Char = IsAscii ? (CHAR16)(UINT8)AsciiFormat[i] : UnicodeFormat[i])
+
+		// Flags, width, precision and size
+		BOOLEAN LeftJustify = FALSE, ZeroPad = FALSE, Is64 = FALSE;
+		UINTN Width = 0, Precision = MAX_UINTN;
+		for (NEXT_CHAR(); Char == L'-' || Char == L'0' || Char == L' ' || Char == L'+' || Char == L','; NEXT_CHAR())
+		{
+			if (Char == L'-')
+				LeftJustify = TRUE;
+			else if (Char == L'0')
+				ZeroPad = TRUE;
+		}
+		if (Char == L'*')
+		{
+			Width = VA_ARG(Marker, UINTN);
+			NEXT_CHAR();
+		}
+		for (; Char >= L'0' && Char <= L'9'; NEXT_CHAR())
+			Width = Width * 10 + (Char - L'0');
+		if (Char == L'.')
+		{
+			Precision = 0;
+			NEXT_CHAR();
+			if (Char == L'*')
+			{
+				Precision = VA_ARG(Marker, UINTN);
+				NEXT_CHAR();
+			}
+			for (; Char >= L'0' && Char <= L'9'; NEXT_CHAR())
+				Precision = Precision * 10 + (Char - L'0');
+		}
+		for (; Char == L'l' || Char == L'L'; NEXT_CHAR())
+			Is64 = TRUE;
+
+#undef NEXT_CHAR
+
+		CHAR16 Digits[20];
+		CONST CHAR16* UnicodeString = NULL;
+		CONST CHAR8* AsciiString = NULL;
+		UINTN Length = 0;
+		BOOLEAN IsNumber = TRUE, IsNegative = FALSE;
+		switch (Char)
+		{
+			case L'd':
+			case L'i':
+			{
+				CONST INT64 Value = Is64 ? VA_ARG(Marker, INT64) : VA_ARG(Marker, INT32);
+				IsNegative = Value < 0;
+				Length = FormatNumber(Digits, IsNegative ? (UINT64)-Value : (UINT64)Value, 10, FALSE);
+				break;
+			}
+			case L'u':
+			case L'x':
+			case L'X':
+			{
+				CONST UINT64 Value = Is64 ? VA_ARG(Marker, UINT64) : VA_ARG(Marker, UINT32);
+				Length = FormatNumber(Digits, Value, Char == L'u' ? 10 : 16, Char == L'X');
+				break;
+			}
+			case L'p':
+				Length = FormatNumber(Digits, (UINTN)VA_ARG(Marker, VOID*), 16, TRUE);
+				Width = MAX(Width, 2 * sizeof(VOID*));
+				ZeroPad = TRUE;
+				break;
+			case L'r':
+				Length = FormatNumber(Digits, VA_ARG(Marker, RETURN_STATUS), 16, TRUE);
+				break;
+			case L'c':
+				Digits[0] = (CHAR16)VA_ARG(Marker, UINTN);
+				Length = 1;
+				IsNumber = FALSE;
+				break;
+			case L's':
+			case L'S':
+			case L'a':
+				if (Char == L'a' || (Char == L's' && IsAscii))
+					AsciiString = VA_ARG(Marker, CONST CHAR8*);
+				else
+					UnicodeString = VA_ARG(Marker, CONST CHAR16*);
+				if (AsciiString == NULL && UnicodeString == NULL)
+					AsciiString = "<null string>";
+				while (Length < Precision && (AsciiString != NULL ? AsciiString[Length] != '\0' : UnicodeString[Length] != CHAR_NULL))
+					++Length;
+				IsNumber = FALSE;
+				break;
+			case L'g':
+			{
+				CONST GUID* Guid = VA_ARG(Marker, CONST GUID*);
+				PutHex(&Out, Guid->Data1, 8);
+				PutChar(&Out, L'-');
+				PutHex(&Out, Guid->Data2, 4);
+				PutChar(&Out, L'-');
+				PutHex(&Out, Guid->Data3, 4);
+				PutChar(&Out, L'-');
+				for (UINTN j = 0; j < ARRAY_SIZE(Guid->Data4); ++j)
+				{
+					if (j == 2)
+						PutChar(&Out, L'-');
+					PutHex(&Out, Guid->Data4[j], 2);
+				}
+				continue;
+			}
+			case CHAR_NULL:
+				i--;
+				continue;
+			default:
+				PutChar(&Out, Char);
+				continue;
+		}
+
+		CONST UINTN TotalLength = Length + (IsNegative ? 1 : 0);
+		CONST UINTN Padding = Width > TotalLength ? Width - TotalLength : 0;
+		if (!LeftJustify && !(IsNumber && ZeroPad))
+			PutPadding(&Out, L' ', Padding);
+		if (IsNegative)
+			PutChar(&Out, L'-');
+		if (!LeftJustify && IsNumber && ZeroPad)
+			PutPadding(&Out, L'0', Padding);
+		for (UINTN j = 0; j < Length; ++j)
+			PutChar(&Out, AsciiString != NULL ? (CHAR16)(UINT8)AsciiString[j] : (UnicodeString != NULL ? UnicodeString[j] : Digits[j]));
+		if (LeftJustify)
+			PutPadding(&Out, L' ', Padding);
+	}
+
+	Out.Buffer[Out.Length] = CHAR_NULL;
+	return Out.Length;
+}
+
+UINTN
+EFIAPI
+UnicodeVSPrint(
+	OUT CHAR16* StartOfBuffer,
+	IN UINTN BufferSize,
+	IN CONST CHAR16* FormatString,
+	IN VA_LIST Marker
+	)
+{
+	return HostVSPrint(StartOfBuffer, BufferSize, FormatString, NULL, Marker);
+}
+
+// On X64 a BASE_LIST has the same layout as an MS ABI VA_LIST: every argument occupies one 8-byte slot
+UINTN
+EFIAPI
+UnicodeBSPrint(
+	OUT CHAR16* StartOfBuffer,
+	IN UINTN BufferSize,
+	IN CONST CHAR16* FormatString,
+	IN BASE_LIST Marker
+	)
+{
+	return HostVSPrint(StartOfBuffer, BufferSize, FormatString, NULL, (VA_LIST)(CHAR8*)Marker);
+}
+
+// Converts the output to ASCII and passes it to the host
+STATIC
+VOID
+WriteOutput(
+	IN CONST CHAR16* String,
+	IN UINTN Length
+	)
+{
+	CHAR8 AsciiString[1024];
+	UINTN AsciiLength = 0;
+	for (UINTN i = 0; i < Length && AsciiLength < ARRAY_SIZE(AsciiString) - 1; ++i)
+	{
+		if (String[i] != L'\r')
+			AsciiString[AsciiLength++] = String[i] < 0x80 ? (CHAR8)String[i] : '?';
+	}
+	AsciiString[AsciiLength] = '\0';
+	HostWriteOutput(AsciiString);
+}
+
+UINTN
+EFIAPI
+Print(
+	IN CONST CHAR16* Format,
+	...
+	)
+{
+	CHAR16 Buffer[1024];
+	VA_LIST Marker;
+	VA_START(Marker, Format);
+	CONST UINTN Length = HostVSPrint(Buffer, sizeof(Buffer), Format, NULL, Marker);
+	VA_END(Marker);
+
+	WriteOutput(Buffer, Length);
+	return Length;
+}
+
+//
+// Console.c. Not part of the host build, because its buffer is shared and the locators may run on several threads at once.
+// Output is written straight to the host instead
+//
+VOID
+EFIAPI
+ConsolePrint(
+	IN EFIGUARD_VERBOSITY Level,
+	IN CONST CHAR16* Format,
+	...
+	)
+{
+	if (Level > gDriverConfig.Verbosity)
+		return;
+
+	CHAR16 Buffer[1024];
+	VA_LIST Marker;
+	VA_START(Marker, Format);
+	CONST UINTN Length = HostVSPrint(Buffer, sizeof(Buffer), Format, NULL, Marker);
+	VA_END(Marker);
+
+	WriteOutput(Buffer, Length);
+}
+
+VOID
+EFIAPI
+ConsoleWrite(
+	IN CONST CHAR16* String
+	)
+{
+	WriteOutput(String, StrLen(String));
+}
+
+VOID
+EFIAPI
+ConsoleFlush(
+	VOID
+	)
+{
+}
+
+VOID
+EFIAPI
+DebugPrint(
+	IN UINTN ErrorLevel,
+	IN CONST CHAR8* Format,
+	...
+	)
+{
+	CHAR16 Buffer[1024];
+	VA_LIST Marker;
+	VA_START(Marker, Format);
+	CONST UINTN Length = HostVSPrint(Buffer, sizeof(Buffer), NULL, Format, Marker);
+	VA_END(Marker);
+
+	WriteOutput(Buffer, Length);
+}